@@ -20,6 +20,11 @@ newoption {
 	 description = "Do not validate shaders at application/tool compilation."
 }
 
+newoption {
+	 trigger     = "raycaster_stats",
+	 description = "Count the nodes, boxes and primitives tested by each raycaster query."
+}
+
 newoption {
 	 trigger     = "skip_internal",
 	 description = "Do not generate any existing internal projects."
@@ -45,6 +50,9 @@ workspace("Rendu")
 		defines({ "DEBUG" })
 		symbols("On")
 
+	filter("options:raycaster_stats")
+		defines({ "RAYCASTER_STATS" })
+
 	filter({})
 	startproject("ALL")
 
@@ -151,6 +159,12 @@ project("Engine")
 	   [""] = { "*.*" },
 	-- ["Scenes/*"] = {"resources/**.scene"},
 	})
+	-- The AVX raycaster kernel is only used if supported by the CPU at runtime.
+	filter({"files:src/engine/raycaster/RaycasterAVX.cpp", "toolset:not msc*"})
+		buildoptions({ "-mavx" })
+	filter({"files:src/engine/raycaster/RaycasterAVX.cpp", "toolset:msc*"})
+		buildoptions({ "/arch:AVX" })
+	filter({})
 
 
 group("Apps")
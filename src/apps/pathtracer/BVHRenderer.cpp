@@ -17,6 +17,19 @@ BVHRenderer::BVHRenderer() : Renderer("BVH renderer") {
 void BVHRenderer::setScene(const std::shared_ptr<Scene> & scene, const Raycaster & raycaster) {
 	_scene = scene;
 	_visuHelper = std::unique_ptr<RaycasterVisualisation>(new RaycasterVisualisation(raycaster));
+	updateLevels();
+	_bvhRange = glm::vec2(0, 0);
+}
+
+void BVHRenderer::updateHierarchy() {
+	// Regenerating the meshes is expensive, wait until they are displayed.
+	_levelsOutdated = true;
+}
+
+void BVHRenderer::updateLevels() {
+	for(Mesh & level : _bvhLevels) {
+		level.clean();
+	}
 	// Build the BVH mesh.
 	_visuHelper->getAllLevels(_bvhLevels);
 	for(Mesh & level : _bvhLevels) {
@@ -24,7 +37,10 @@ void BVHRenderer::setScene(const std::shared_ptr<Scene> & scene, const Raycaster
 		level.upload();
 		level.clearGeometry();
 	}
-	_bvhRange = glm::vec2(0, 0);
+	// The hierarchy depth might have changed.
+	_bvhRange.y = glm::clamp(_bvhRange.y, 0, std::max(maxLevel(), 0));
+	_bvhRange.x = glm::clamp(_bvhRange.x, 0, _bvhRange.y);
+	_levelsOutdated = false;
 	checkGLError();
 }
 
@@ -69,6 +85,9 @@ void BVHRenderer::draw(const Camera & camera, Framebuffer & framebuffer, size_t
 			}
 		}
 	} else if(_showBVH) {
+		if(_levelsOutdated) {
+			updateLevels();
+		}
 		for(int lid = _bvhRange.x; lid <= _bvhRange.y; ++lid) {
 			GLUtilities::drawMesh(_bvhLevels[lid]);
 		}
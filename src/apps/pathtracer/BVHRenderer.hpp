@@ -27,6 +27,9 @@ public:
 	 */
 	void setScene(const std::shared_ptr<Scene> & scene, const Raycaster & raycaster);
 
+	/** Notify that the raycaster hierarchy has been refitted or rebuilt, the displayed levels will be regenerated when next shown. */
+	void updateHierarchy();
+
 	/** \copydoc Renderer::draw */
 	void draw(const Camera & camera, Framebuffer & framebuffer, size_t layer = 0) override;
 
@@ -59,6 +62,9 @@ public:
 	
 private:
 
+	/** Regenerate and upload the meshes of all levels of the hierarchy. */
+	void updateLevels();
+
 	const Program * _objectProgram; ///< Basic object program.
 	const Program * _bvhProgram;	///< BVH visualisation program.
 	std::vector<Mesh> _bvhLevels;   ///< The BVH visualisation mesh.
@@ -70,4 +76,5 @@ private:
 
 	glm::ivec2 _bvhRange = glm::ivec2(0, 1); ///< The subset of the BVH to display.
 	bool _showBVH		 = true;			 ///< Show the raytracer BVH.
+	bool _levelsOutdated = false;			 ///< Should the level meshes be regenerated before display.
 };
@@ -0,0 +1,296 @@
+#include "LightSampler.hpp"
+#include "scene/lights/PointLight.hpp"
+#include "scene/lights/SpotLight.hpp"
+#include "generation/Random.hpp"
+
+#include <numeric>
+
+/** Luminance of a linear color.
+ \param color the color
+ \return the luminance
+ */
+static float luminance(const glm::vec3 & color) {
+	return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+LightSampler::LightSampler(const Scene & scene) {
+
+	// Analytic lights have no physical extent, estimate their power from the region they illuminate.
+	const BoundingBox & bbox  = scene.boundingBox();
+	const float sceneRadius	  = bbox.minis.x <= bbox.maxis.x ? 0.5f * glm::length(bbox.getSize()) : 1.0f;
+	for(const auto & light : scene.lights) {
+		Emitter emitter;
+		emitter.light	  = light.get();
+		float lightRadius = sceneRadius;
+		float coneRatio	  = 1.0f;
+		if(const PointLight * point = dynamic_cast<const PointLight *>(light.get())) {
+			lightRadius = point->radius();
+		} else if(const SpotLight * spot = dynamic_cast<const SpotLight *>(light.get())) {
+			lightRadius = spot->radius();
+			coneRatio	= 0.5f * (1.0f - std::cos(spot->angles().y));
+		}
+		emitter.power = luminance(light->intensity()) * glm::pi<float>() * lightRadius * lightRadius * coneRatio;
+		_emitters.push_back(emitter);
+	}
+
+	// Emissive objects are split in area lights, weighted by their mean radiance.
+	_objectEmitters.assign(scene.objects.size(), -1);
+	for(size_t oid = 0; oid < scene.objects.size(); ++oid) {
+		const Object & obj = scene.objects[oid];
+		if(obj.type() != Object::Type::Emissive) {
+			continue;
+		}
+		glm::vec3 meanEmission = emission(obj, glm::vec2(0.5f));
+		if(obj.useTexCoords()) {
+			const Image & image = obj.textures()[0]->images[0];
+			const size_t pixelCount = size_t(image.width) * size_t(image.height);
+			const size_t channels	= std::min(image.components, 3u);
+			meanEmission			= glm::vec3(0.0f);
+			for(size_t pid = 0; pid < pixelCount; ++pid) {
+				for(size_t cid = 0; cid < channels; ++cid) {
+					meanEmission[int(cid)] += image.pixels[pid * image.components + cid];
+				}
+			}
+			meanEmission /= float(std::max(pixelCount, size_t(1)));
+		}
+		_objectEmitters[oid] = long(_emitters.size());
+
+		Emitter emitter;
+		emitter.object	 = &obj;
+		emitter.radiance = std::max(luminance(meanEmission), 0.0f);
+		// Meshes are split in one emitter per triangle.
+		const size_t indexCount = obj.shape() == Object::Shape::Mesh ? obj.mesh()->indices.size() : 3;
+		for(size_t iid = 0; iid + 2 < indexCount; iid += 3) {
+			emitter.firstIndex = iid;
+			place(emitter);
+			_emitters.push_back(emitter);
+		}
+	}
+
+	if(!buildAliasTable()) {
+		// Nothing emits light.
+		_emitters.clear();
+		_objectEmitters.assign(scene.objects.size(), -1);
+	}
+}
+
+void LightSampler::update(const Scene & scene) {
+	bool moved = false;
+	for(size_t oid = 0; oid < scene.objects.size() && oid < _objectEmitters.size(); ++oid) {
+		if(_objectEmitters[oid] < 0 || !scene.objects[oid].animated()) {
+			continue;
+		}
+		// The emitters of an object are contiguous.
+		for(size_t eid = size_t(_objectEmitters[oid]); eid < _emitters.size() && _emitters[eid].object == &scene.objects[oid]; ++eid) {
+			place(_emitters[eid]);
+		}
+		moved = true;
+	}
+	// Areas might have changed.
+	if(moved) {
+		buildAliasTable();
+	}
+}
+
+void LightSampler::place(Emitter & emitter) {
+	const Object & obj	 = *emitter.object;
+	emitter.model		 = obj.model();
+	const glm::mat3 frame = glm::mat3(obj.model());
+	emitter.normalMatrix = glm::inverse(glm::transpose(frame));
+	if(obj.shape() == Object::Shape::Mesh) {
+		const Mesh & mesh = *obj.mesh();
+		for(size_t vid = 0; vid < 3; ++vid) {
+			emitter.vertices[vid] = glm::vec3(emitter.model * glm::vec4(mesh.positions[mesh.indices[emitter.firstIndex + vid]], 1.0f));
+		}
+		const glm::vec3 cross = glm::cross(emitter.vertices[1] - emitter.vertices[0], emitter.vertices[2] - emitter.vertices[0]);
+		const float crossLength = glm::length(cross);
+		emitter.area	= 0.5f * crossLength;
+		emitter.normal	= crossLength > 0.0f ? cross / crossLength : glm::vec3(0.0f, 0.0f, 1.0f);
+		emitter.power	= glm::pi<float>() * emitter.radiance * emitter.area;
+		return;
+	}
+	// Analytic shapes are defined in model space, see Object::Shape.
+	const float crossLength = glm::length(glm::cross(frame[0], frame[1]));
+	emitter.normal			= glm::normalize(emitter.normalMatrix * glm::vec3(0.0f, 0.0f, 1.0f));
+	if(obj.shape() == Object::Shape::Quad) {
+		emitter.area = 4.0f * crossLength;
+	} else if(obj.shape() == Object::Shape::Disk) {
+		emitter.area = glm::pi<float>() * crossLength;
+	} else {
+		// Approximate area of the ellipsoid, only used for picking.
+		emitter.area = 4.0f * glm::pi<float>() * std::pow(std::abs(glm::determinant(frame)), 2.0f / 3.0f);
+	}
+	emitter.power = glm::pi<float>() * emitter.radiance * emitter.area;
+}
+
+bool LightSampler::buildAliasTable() {
+	const size_t count = _emitters.size();
+	float total		   = 0.0f;
+	for(const Emitter & emitter : _emitters) {
+		total += emitter.power;
+	}
+	if(count == 0 || !(total > 0.0f)) {
+		// No emitter can be picked.
+		_pdfs.assign(count, 0.0f);
+		_thresholds.assign(count, 1.0f);
+		_aliases.resize(count);
+		std::iota(_aliases.begin(), _aliases.end(), size_t(0));
+		return false;
+	}
+
+	// Build the alias table (Vose, 1991): each bin keeps its own emitter with some probability, and else picks an alias.
+	_pdfs.resize(count);
+	_thresholds.assign(count, 1.0f);
+	_aliases.resize(count);
+	std::vector<size_t> smalls, larges;
+	for(size_t eid = 0; eid < count; ++eid) {
+		_pdfs[eid]		 = _emitters[eid].power / total;
+		_thresholds[eid] = _pdfs[eid] * float(count);
+		_aliases[eid]	 = eid;
+		(_thresholds[eid] < 1.0f ? smalls : larges).push_back(eid);
+	}
+	while(!smalls.empty() && !larges.empty()) {
+		const size_t small = smalls.back();
+		const size_t large = larges.back();
+		smalls.pop_back();
+		larges.pop_back();
+		_aliases[small] = large;
+		_thresholds[large] += _thresholds[small] - 1.0f;
+		(_thresholds[large] < 1.0f ? smalls : larges).push_back(large);
+	}
+	// Remaining bins are full, up to numerical errors.
+	for(const size_t eid : smalls) {
+		_thresholds[eid] = 1.0f;
+	}
+	for(const size_t eid : larges) {
+		_thresholds[eid] = 1.0f;
+	}
+	return true;
+}
+
+bool LightSampler::sample(const glm::vec3 & position, float lightSample, const glm::vec2 & pointSample, LightSampler::Sample & sample) const {
+	if(_emitters.empty()) {
+		return false;
+	}
+	// Pick a bin, and reuse the remainder of the value to pick between its emitter and the alias.
+	const float scaled = lightSample * float(_emitters.size());
+	const size_t bin   = std::min(size_t(scaled), _emitters.size() - 1);
+	const size_t eid   = (scaled - float(bin)) < _thresholds[bin] ? bin : _aliases[bin];
+	const Emitter & emitter = _emitters[eid];
+	const float pickPdf		= _pdfs[eid];
+	// Bins can be left with empty emitters by rounding errors.
+	if(!(pickPdf > 0.0f)) {
+		return false;
+	}
+
+	if(emitter.light) {
+		float falloff	   = 0.0f;
+		sample.direction   = emitter.light->sample(position, sample.dist, falloff);
+		sample.radiance	   = falloff * emitter.light->intensity() / pickPdf;
+		sample.pdf		   = 0.0f;
+		sample.castsShadow = emitter.light->castsShadow();
+		return falloff > 0.0f;
+	}
+
+	glm::vec3 point, normal;
+	glm::vec2 uv;
+	const float areaPdf = samplePoint(emitter, pointSample, point, normal, uv);
+	glm::vec3 direction = point - position;
+	const float dist2	= glm::dot(direction, direction);
+	if(!(dist2 > 0.0f)) {
+		return false;
+	}
+	const float dist = std::sqrt(dist2);
+	direction /= dist;
+	// All objects are double sided.
+	const float cosLight = std::abs(glm::dot(normal, direction));
+	if(cosLight < 1e-6f) {
+		return false;
+	}
+	// Convert from area to solid angle measure.
+	sample.direction   = direction;
+	sample.pdf		   = pickPdf * areaPdf * dist2 / cosLight;
+	sample.radiance	   = emission(*emitter.object, uv) / sample.pdf;
+	// Stop before the light surface itself.
+	sample.dist		   = 0.999f * dist;
+	sample.castsShadow = true;
+	return true;
+}
+
+float LightSampler::pdf(const Raycaster::Hit & hit, const glm::vec3 & rayDir) const {
+	if(hit.meshId >= _objectEmitters.size() || _objectEmitters[hit.meshId] < 0) {
+		return 0.0f;
+	}
+	const Object & obj = *_emitters[size_t(_objectEmitters[hit.meshId])].object;
+	const size_t eid   = size_t(_objectEmitters[hit.meshId]) + (obj.shape() == Object::Shape::Mesh ? size_t(hit.localId) / 3 : 0);
+	const Emitter & emitter = _emitters[eid];
+	glm::vec3 normal = emitter.normal;
+	float areaPdf	 = emitter.area > 0.0f ? 1.0f / emitter.area : 0.0f;
+	if(emitter.object->shape() == Object::Shape::Sphere) {
+		// Recover the point on the unit sphere from its parametric coordinates.
+		const float phi	  = (hit.u - 0.5f) * glm::two_pi<float>();
+		const float theta = hit.v * glm::pi<float>();
+		const glm::vec3 dir(std::sin(theta) * std::sin(phi), std::cos(theta), std::sin(theta) * std::cos(phi));
+		areaPdf = spherePdf(emitter, dir, normal);
+	}
+	const float cosLight = std::abs(glm::dot(normal, rayDir));
+	if(cosLight < 1e-6f) {
+		return 0.0f;
+	}
+	return _pdfs[eid] * areaPdf * hit.dist * hit.dist / cosLight;
+}
+
+float LightSampler::samplePoint(const Emitter & emitter, const glm::vec2 & u, glm::vec3 & point, glm::vec3 & normal, glm::vec2 & uv) {
+	const Object & obj = *emitter.object;
+	normal			   = emitter.normal;
+	uv				   = glm::vec2(0.5f);
+	if(obj.shape() == Object::Shape::Mesh) {
+		// Uniform barycentric coordinates.
+		const float su = std::sqrt(u.x);
+		const float b1 = u.y * su;
+		const float b0 = 1.0f - su;
+		const float b2 = 1.0f - b0 - b1;
+		point		   = b0 * emitter.vertices[0] + b1 * emitter.vertices[1] + b2 * emitter.vertices[2];
+		if(obj.useTexCoords()) {
+			const Mesh & mesh = *obj.mesh();
+			const size_t iid  = emitter.firstIndex;
+			uv = b0 * mesh.texcoords[mesh.indices[iid]] + b1 * mesh.texcoords[mesh.indices[iid + 1]] + b2 * mesh.texcoords[mesh.indices[iid + 2]];
+		}
+		return 1.0f / emitter.area;
+	}
+
+	glm::vec3 local;
+	float areaPdf = 1.0f / emitter.area;
+	if(obj.shape() == Object::Shape::Quad) {
+		local = glm::vec3(2.0f * u - 1.0f, 0.0f);
+	} else if(obj.shape() == Object::Shape::Disk) {
+		local = glm::vec3(Random::sampleDisk(u), 0.0f);
+	} else {
+		local	= Random::sampleSphere(u);
+		areaPdf = spherePdf(emitter, local, normal);
+	}
+	point = glm::vec3(emitter.model * glm::vec4(local, 1.0f));
+	if(obj.useTexCoords()) {
+		// Same parametrization as the raycaster.
+		if(obj.shape() == Object::Shape::Sphere) {
+			uv.x = std::atan2(local.x, local.z) / glm::two_pi<float>() + 0.5f;
+			uv.y = std::acos(glm::clamp(local.y, -1.0f, 1.0f)) / glm::pi<float>();
+		} else {
+			uv = 0.5f * glm::vec2(local) + 0.5f;
+		}
+	}
+	return areaPdf;
+}
+
+float LightSampler::spherePdf(const Emitter & emitter, const glm::vec3 & dir, glm::vec3 & normal) {
+	// Points are uniform on the unit sphere, scale by the local area change of the model transformation.
+	const glm::vec3 transformedNormal = emitter.normalMatrix * dir;
+	const float transformedLength	  = glm::length(transformedNormal);
+	normal = transformedNormal / transformedLength;
+	const float jacobian = std::abs(glm::determinant(glm::mat3(emitter.model))) * transformedLength;
+	return 1.0f / (4.0f * glm::pi<float>() * jacobian);
+}
+
+glm::vec3 LightSampler::emission(const Object & obj, const glm::vec2 & uv) {
+	return glm::vec3(obj.textures()[0]->images[0].rgbal(uv.x, uv.y));
+}
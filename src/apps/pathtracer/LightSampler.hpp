@@ -0,0 +1,114 @@
+#pragma once
+#include "raycaster/Raycaster.hpp"
+#include "scene/Scene.hpp"
+#include "Common.hpp"
+
+/**
+ \brief Picks a light to sample from a surface point, among the scene analytic lights and the surfaces of emissive objects, split in area lights (one per triangle or analytic shape).
+ Lights are picked proportionally to an estimate of their emitted power, using an alias table built once for the scene.
+ \ingroup PathtracerDemo
+ */
+class LightSampler {
+public:
+
+	/** \brief A light sample, as seen from a surface point. */
+	struct Sample {
+		glm::vec3 direction = glm::vec3(0.0f); ///< Normalized direction from the surface point towards the light.
+		glm::vec3 radiance	= glm::vec3(0.0f); ///< Received light, divided by the probability of the sample.
+		float dist			= 0.0f; ///< Distance up to which occluders should be searched along the direction.
+		float pdf			= 0.0f; ///< Probability of the direction with respect to solid angle, zero for analytic lights that rays can't hit.
+		bool castsShadow	= true; ///< Should the light visibility be tested.
+	};
+
+	/** Empty constructor. */
+	LightSampler() = default;
+
+	/** Constructor. Estimate the power of all lights and emissive surfaces in the scene and build the alias table.
+	 \param scene the scene to sample lights from
+	 */
+	explicit LightSampler(const Scene & scene);
+
+	/** Update the emissive surfaces of animated objects and the alias table, after the scene objects have been animated.
+	 \param scene the scene the sampler was created from
+	 */
+	void update(const Scene & scene);
+
+	/** \return true if there is no light to sample */
+	bool empty() const { return _emitters.empty(); }
+
+	/** \return the number of analytic lights and emissive surfaces that can be sampled */
+	size_t count() const { return _emitters.size(); }
+
+	/** Pick a light and a point on it.
+	 \param position the surface point receiving light
+	 \param lightSample a value in [0,1) used to pick the light
+	 \param pointSample two values in [0,1) used to pick a point on emissive surfaces
+	 \param sample will contain the light sample
+	 \return false if the light can't contribute to the surface point
+	 */
+	bool sample(const glm::vec3 & position, float lightSample, const glm::vec2 & pointSample, LightSampler::Sample & sample) const;
+
+	/** Evaluate the probability of having sampled a point on an emissive surface hit by a ray.
+	 \param hit the intersection record, on an emissive object
+	 \param rayDir the normalized direction of the ray that intersected
+	 \return the probability of the ray direction with respect to solid angle
+	 */
+	float pdf(const Raycaster::Hit & hit, const glm::vec3 & rayDir) const;
+
+private:
+
+	/** \brief An analytic light, an emissive triangle or an emissive analytic shape. */
+	struct Emitter {
+		const Light * light	 = nullptr; ///< The analytic light, or null for emissive surfaces.
+		const Object * object = nullptr; ///< The emissive object.
+		size_t firstIndex	 = 0; ///< Position of the triangle first vertex in the mesh index buffer.
+		glm::vec3 vertices[3]; ///< World space triangle vertices.
+		glm::mat4 model		 = glm::mat4(1.0f); ///< Shape model matrix.
+		glm::mat3 normalMatrix = glm::mat3(1.0f); ///< Shape normal matrix.
+		glm::vec3 normal	 = glm::vec3(0.0f, 0.0f, 1.0f); ///< World space geometric normal of planar surfaces.
+		float area			 = 0.0f; ///< Surface area in world space (estimated for ellipsoids).
+		float radiance		 = 0.0f; ///< Luminance of the mean emitted radiance, for emissive surfaces.
+		float power			 = 0.0f; ///< Estimated emitted power.
+	};
+
+	/** Place an emissive surface in world space using its object transformation, and estimate its power.
+	 \param emitter the emissive surface, its object, first index and radiance should be set
+	 */
+	static void place(Emitter & emitter);
+
+	/** Build the alias table from the power of the emitters.
+	 \return false if no emitter has a positive power, nothing will be sampled
+	 */
+	bool buildAliasTable();
+
+	/** Sample a point uniformly on the parametric domain of an emissive surface.
+	 \param emitter the emissive surface
+	 \param u two values in [0,1)
+	 \param point will contain the world space point
+	 \param normal will contain the world space geometric normal
+	 \param uv will contain the texture coordinates at the point
+	 \return the probability of the point with respect to area
+	 */
+	static float samplePoint(const Emitter & emitter, const glm::vec2 & u, glm::vec3 & point, glm::vec3 & normal, glm::vec2 & uv);
+
+	/** Probability of sampling a point of a sphere with respect to area, given its parametric direction.
+	 \param emitter the emissive sphere
+	 \param dir the point on the unit sphere, in model space
+	 \param normal will contain the world space normal at the point
+	 \return the probability of the point with respect to area
+	 */
+	static float spherePdf(const Emitter & emitter, const glm::vec3 & dir, glm::vec3 & normal);
+
+	/** Fetch the emitted radiance of an emissive object.
+	 \param obj the emissive object
+	 \param uv the texture coordinates
+	 \return the emitted radiance
+	 */
+	static glm::vec3 emission(const Object & obj, const glm::vec2 & uv);
+
+	std::vector<Emitter> _emitters;	  ///< All analytic lights and emissive surfaces.
+	std::vector<float> _pdfs;		  ///< Probability of picking each emitter.
+	std::vector<float> _thresholds;	  ///< Probability of keeping each alias table bin own emitter.
+	std::vector<size_t> _aliases;	  ///< Emitter picked in each bin of the alias table otherwise.
+	std::vector<long> _objectEmitters; ///< First emitter of each scene object, -1 for non-emissive objects.
+};
@@ -27,6 +27,10 @@ float MaterialGGX::alphaFromRoughness(float roughness){
 	return alpha;
 }
 
+float MaterialGGX::specularProbability(const glm::vec3 & baseColor, float metallic){
+	return glm::mix(1.0f / (glm::dot(baseColor, glm::vec3(1.0f)) / 3.0f + 1.0f), 1.0f,  metallic);
+}
+
 glm::vec3 MaterialGGX::GGX(const glm::vec3 & wo, const glm::vec3 & baseColor, float alpha, float metallic, const glm::vec3 & wi, float * pdf){
 
 	const glm::vec3 h = glm::normalize(wi + wo);
@@ -51,18 +55,18 @@ glm::vec3 MaterialGGX::GGX(const glm::vec3 & wo, const glm::vec3 & baseColor, fl
 	return brdf;
 }
 
-glm::vec3 MaterialGGX::sampleAndEval(const glm::vec3 & wo, const glm::vec3 & baseColor, float roughness, float metallic, glm::vec3 & wi){
+glm::vec3 MaterialGGX::sampleAndEval(const glm::vec3 & wo, const glm::vec3 & baseColor, float roughness, float metallic, float lobeSample, const glm::vec2 & directionSample, glm::vec3 & wi){
 
-	const float probaSpecular = glm::mix(1.0f / (glm::dot(baseColor, glm::vec3(1.0f)) / 3.0f + 1.0f), 1.0f,  metallic);
+	const float probaSpecular = specularProbability(baseColor, metallic);
 	const float alpha = alphaFromRoughness(roughness);
 
-	if(Random::Float() < probaSpecular){
+	if(lobeSample < probaSpecular){
 		// Sample specular lobe.
 		const float a2 = alpha * alpha;
-		const float x = Random::Float();
+		const float x = directionSample.x;
 		// for dielectrics, Walter et al. have a roughness rescaling hack.
 		// alpha * (1.2f - 0.2f * std::sqrt(std::abs(wi.z)));
-		const float phiH = Random::Float() * glm::two_pi<float>();
+		const float phiH = directionSample.y * glm::two_pi<float>();
 		const float cosThetaHSqr = std::min((1.0f - x) / ((a2 - 1.0f) * x + 1.0f), 1.0f);
 		const float cosThetaH = std::sqrt(cosThetaHSqr);
 		const float sinThetaH = std::sqrt(1.0f - cosThetaHSqr);
@@ -71,7 +75,7 @@ glm::vec3 MaterialGGX::sampleAndEval(const glm::vec3 & wo, const glm::vec3 & bas
 		wi = 2.0f * glm::dot(wo, lh) * lh - wo;
 	} else {
 		// Else sample diffuse lobe.
-		wi = Random::sampleCosineHemisphere();
+		wi = Random::sampleCosineHemisphere(directionSample);
 		if(wo.z < 0.0f){
 			wi.z *= -1.0f;
 		}
@@ -99,3 +103,16 @@ glm::vec3 MaterialGGX::eval(const glm::vec3 & wo, const glm::vec3 & baseColor, f
 	const glm::vec3 brdf = GGX(wo, baseColor, alpha, metallic, wi, nullptr);
 	return brdf;
 }
+
+float MaterialGGX::pdf(const glm::vec3 & wo, const glm::vec3 & baseColor, float roughness, float metallic, const glm::vec3 & wi){
+	if(wi.z < 0.0f){
+		return 0.0f;
+	}
+	// Same lobes mix as in sampleAndEval.
+	const float alpha = alphaFromRoughness(roughness);
+	const glm::vec3 h = glm::normalize(wi + wo);
+	const float NdotH = std::max(h.z, 0.0f);
+	const float VdotH = std::max(glm::dot(wi,h), 0.0f);
+	const float pdfSpec = D(NdotH, alpha) * NdotH / (4.0f * std::max(0.0001f, VdotH));
+	return glm::mix(glm::one_over_pi<float>() * wi.z, pdfSpec, specularProbability(baseColor, metallic));
+}
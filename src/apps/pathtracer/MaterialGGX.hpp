@@ -18,10 +18,12 @@ public:
 	 \param baseColor the surface albedo (for dieletrics) or specular tint (for conductors)
 	 \param roughness the linear roughness of the surface
 	 \param metallic the metallicness of the surface (usually 0 or 1).
+	 \param lobeSample a value in [0,1) used to pick the diffuse or specular lobe
+	 \param directionSample two values in [0,1) used to sample a direction in the chosen lobe
 	 \param wi will contain the sampled incoming ray direction (usually direction towards a light/surface)
 	 \return the BRDF evaluated for the sampled direction, weighted by its PDF
 	 */
-	static glm::vec3 sampleAndEval(const glm::vec3 & wo, const glm::vec3 & baseColor, float roughness, float metallic, glm::vec3 & wi);
+	static glm::vec3 sampleAndEval(const glm::vec3 & wo, const glm::vec3 & baseColor, float roughness, float metallic, float lobeSample, const glm::vec2 & directionSample, glm::vec3 & wi);
 
 	/** Evaluate the BRDF value for a given set of directions and parameters. Both directions are expressed in the local frame and have the surface point as origin.
 	\param wo the outgoing ray direction (usually direction towards the camera)
@@ -33,6 +35,16 @@ public:
 	*/
 	static glm::vec3 eval(const glm::vec3 & wo, const glm::vec3 & baseColor, float roughness, float metallic, const glm::vec3 & wi);
 
+	/** Evaluate the probability of sampling a direction with sampleAndEval. Both directions are expressed in the local frame and have the surface point as origin.
+	\param wo the outgoing ray direction (usually direction towards the camera)
+	\param baseColor the surface albedo (for dieletrics) or specular tint (for conductors)
+	\param roughness the linear roughness of the surface
+	\param metallic the metallicness of the surface (usually 0 or 1)
+	\param wi the incoming ray direction (usually direction towards a light/surface)
+	\return the PDF of the incoming direction, with respect to solid angle
+	*/
+	static float pdf(const glm::vec3 & wo, const glm::vec3 & baseColor, float roughness, float metallic, const glm::vec3 & wi);
+
 private:
 
 	/** Schlick-Fresnel approximation.
@@ -63,6 +75,13 @@ private:
 	 */
 	static float alphaFromRoughness(float roughness);
 
+	/** Probability of sampling the specular lobe rather than the diffuse one.
+	 \param baseColor the surface albedo (for dieletrics) or specular tint (for conductors)
+	 \param metallic the metallicness of the surface (usually 0 or 1)
+	 \return the specular lobe probability
+	 */
+	static float specularProbability(const glm::vec3 & baseColor, float metallic);
+
 	/** Evaluate the specular GGX lobe BRDF.
 	 \param wo the outgoing ray direction (usually direction towards the camera)
 	 \param baseColor the surface albedo (for dieletrics) or specular tint (for conductors)
@@ -8,16 +8,75 @@
 #include "generation/Random.hpp"
 #include "system/Query.hpp"
 
-PathTracer::PathTracer(const std::shared_ptr<Scene> & scene) {
+#include <mutex>
+#include <numeric>
+
+PathTracer::PathTracer(const std::shared_ptr<Scene> & scene, const std::string & cachePath) {
+	// Favor traversal performance over construction time.
+	_raycaster.settings().split = Raycaster::Split::SAH;
 	// Add all scene objects to the raycaster.
 	for(const auto & obj : scene->objects) {
+		// Analytic shapes are intersected directly, their frames are computed from the hit.
+		if(obj.shape() != Object::Shape::Mesh) {
+			_raycaster.addShape(Raycaster::Shape(int(obj.shape())), obj.model());
+			continue;
+		}
 		if(obj.mesh()->tangents.empty()){
 			Log::Error() << "The path tracer requires local tangent frames for all meshes." << std::endl;
 		}
 		_raycaster.addMesh(*obj.mesh(), obj.model());
 	}
-	_raycaster.updateHierarchy();
+	if(cachePath.empty()) {
+		_raycaster.updateHierarchy();
+	} else {
+		_raycaster.updateHierarchy(cachePath);
+	}
 	_scene = scene;
+	_sampler = Sampler::create(Sampler::Type::SOBOL, Random::getSeed());
+	_lights = LightSampler(*scene);
+	Log::Info() << "[PathTracer] Sampling " << _lights.count() << " lights and emissive surfaces." << std::endl;
+
+	// Alpha-test masked objects during traversal, if there are any.
+	const bool masked = std::any_of(scene->objects.begin(), scene->objects.end(), [](const Object & obj) {
+		return obj.masked() && obj.useTexCoords();
+	});
+	if(masked) {
+		_alphaTest = [scene](const Raycaster::Hit & hit) {
+			const Object & obj = scene->objects[hit.meshId];
+			// If the object has no mask or no uvs, the hit is always valid.
+			if(!obj.masked() || !obj.useTexCoords()) {
+				return true;
+			}
+			// Else, we have to sample the object alpha mask.
+			const glm::vec2 uv = texCoords(obj, hit);
+			return obj.textures()[0]->images[0].rgbal(uv.x, uv.y).a >= 0.01f;
+		};
+	}
+}
+
+void PathTracer::sampler(Sampler::Type type) {
+	sampler(type, Random::getSeed());
+}
+
+void PathTracer::sampler(Sampler::Type type, uint32_t seed) {
+	_sampler = Sampler::create(type, seed);
+}
+
+void PathTracer::rouletteDepth(size_t depth) {
+	_rouletteDepth = depth;
+}
+
+void PathTracer::updateScene() {
+	// Objects have been added to the raycaster in order.
+	for(size_t oid = 0; oid < _scene->objects.size(); ++oid) {
+		const Object & obj = _scene->objects[oid];
+		if(obj.animated()) {
+			_raycaster.updateInstance(oid, obj.model());
+		}
+	}
+	_raycaster.refit();
+	// Emissive surfaces might have moved.
+	_lights.update(*_scene);
 }
 
 glm::vec3 PathTracer::evalBackground(const glm::vec3 & rayDir, const glm::vec3 & rayPos, const glm::vec2 & ndcPos, bool directHit) const {
@@ -52,49 +111,37 @@ glm::vec3 PathTracer::evalBackground(const glm::vec3 & rayDir, const glm::vec3 &
 	return color;
 }
 
-glm::ivec2 PathTracer::getSampleGrid(size_t samples) {
-	// Prepare the stratified grid.
-	// We know that we have 2^k samples.
-	const int k = int(std::floor(std::log2(samples)));
-	// If even, just use k samples on each side.
-	glm::ivec2 stratesCount(int(std::pow(2, k / 2)));
-	if(k % 2 == 1) {
-		//  Else dispatch the extraneous factor of 2 on the horizontal axis.
-		stratesCount[0] = int(std::pow(2, (k + 1) / 2));
-		stratesCount[1] = int(std::pow(2, (k - 1) / 2));
-	}
-	return stratesCount;
-}
-
-glm::vec2 PathTracer::getSamplePosition(size_t sid, const glm::ivec2 & cellCount, const glm::vec2 & cellSize) {
-	// Find the grid location.
-	const int sidy = int(sid) / cellCount.x;
-	const int sidx = int(sid) % cellCount.x;
-
-	// Draw random shift in [0.0,1.0f) for jittering.
-	const float jx = Random::Float();
-	const float jy = Random::Float();
-	// Compute position in the stratification grid.
-	const glm::vec2 gridPos = glm::vec2(float(sidx) + jx, float(sidy) + jy);
-	// Position in screen space.
-	const glm::vec2 localPos = gridPos * cellSize;
-	return localPos;
+glm::vec2 PathTracer::texCoords(const Object & obj, const Raycaster::Hit & hit){
+	// Analytic shapes provide their parametric coordinates.
+	if(obj.shape() != Object::Shape::Mesh){
+		return glm::vec2(hit.u, hit.v);
+	}
+	const Mesh & mesh = *obj.mesh();
+	return Raycaster::interpolateAttribute(hit, mesh, mesh.texcoords);
 }
 
 glm::mat3 PathTracer::buildLocalFrame(const Object & obj, const Raycaster::Hit & hit, const glm::vec3 & rayDir, const glm::vec2 & uv){
-	const auto & mesh = *obj.mesh();
-	const glm::vec3 n = glm::normalize(Raycaster::interpolateAttribute(hit, mesh, mesh.normals));
-	glm::vec3 t = glm::normalize(Raycaster::interpolateAttribute(hit, mesh, mesh.tangents));
-	// Ensure that the resulting frame is orthogonal.
-	const glm::vec3 b = glm::normalize(glm::cross(n, t));
-	t = glm::normalize(glm::cross(b, n));
-	// Convert to world frame.
-	const glm::mat3 invtp = glm::inverse(glm::transpose(glm::mat3(obj.model())));
-	// From tangent space to world space.
 	glm::mat3 tbn;
-	tbn[0] = glm::normalize(glm::vec3(invtp * glm::vec4(t, 0.0f)));
-	tbn[1] = glm::normalize(glm::vec3(invtp * glm::vec4(b, 0.0f)));
-	tbn[2] = glm::normalize(glm::vec3(invtp * glm::vec4(n, 0.0f)));
+	if(obj.shape() != Object::Shape::Mesh){
+		// The hit frame is already in world space, ensure that it is orthogonal.
+		const glm::vec3 b = glm::normalize(glm::cross(hit.normal, hit.tangent));
+		tbn[0] = glm::normalize(glm::cross(b, hit.normal));
+		tbn[1] = b;
+		tbn[2] = hit.normal;
+	} else {
+		const auto & mesh = *obj.mesh();
+		const glm::vec3 n = glm::normalize(Raycaster::interpolateAttribute(hit, mesh, mesh.normals));
+		glm::vec3 t = glm::normalize(Raycaster::interpolateAttribute(hit, mesh, mesh.tangents));
+		// Ensure that the resulting frame is orthogonal.
+		const glm::vec3 b = glm::normalize(glm::cross(n, t));
+		t = glm::normalize(glm::cross(b, n));
+		// Convert to world frame.
+		const glm::mat3 invtp = glm::inverse(glm::transpose(glm::mat3(obj.model())));
+		// From tangent space to world space.
+		tbn[0] = glm::normalize(glm::vec3(invtp * glm::vec4(t, 0.0f)));
+		tbn[1] = glm::normalize(glm::vec3(invtp * glm::vec4(b, 0.0f)));
+		tbn[2] = glm::normalize(glm::vec3(invtp * glm::vec4(n, 0.0f)));
+	}
 
 	// Flip normal if needed (all objects are double sided).
 	const bool frontFacing = glm::dot(tbn[2], rayDir) < 0.0f;
@@ -115,113 +162,374 @@ glm::mat3 PathTracer::buildLocalFrame(const Object & obj, const Raycaster::Hit &
 	return tbn;
 }
 
-bool PathTracer::checkVisibility(const glm::vec3 & startPos, const glm::vec3 & rayDir, float maxDist) const {
-	glm::vec3 lpos = startPos;
-	// Walk along the ray, checking at each intersection if there is occlusion.
-	while(maxDist > 0.0f){
-		const Raycaster::Hit lhit = _raycaster.intersects(lpos, rayDir, 0.001f, maxDist);
-		// No hit, we are visible, exit.
-		if(!lhit.hit){
-			return true;
+/** Weight a sampling strategy against another one with the power heuristic (Veach, 1997).
+ \param pdf the probability of the sample with the strategy to weight
+ \param otherPdf the probability of the same sample with the other strategy
+ \return the multiple importance sampling weight
+ */
+static float powerHeuristic(float pdf, float otherPdf) {
+	const float pdf2 = pdf * pdf;
+	const float sum	 = pdf2 + otherPdf * otherPdf;
+	return sum > 0.0f ? pdf2 / sum : 0.0f;
+}
+
+/** Compute the position of a tile along a Morton curve, by interleaving the bits of its coordinates.
+ \param x the horizontal tile index
+ \param y the vertical tile index
+ \return the Morton code
+ */
+static uint32_t mortonCode(uint32_t x, uint32_t y) {
+	uint32_t code = 0;
+	for(uint32_t bit = 0; bit < 16; ++bit) {
+		code |= ((x >> bit) & 1u) << (2u * bit);
+		code |= ((y >> bit) & 1u) << (2u * bit + 1u);
+	}
+	return code;
+}
+
+/** Number of buckets of the traversal counters histograms: exact values below 64, then 8 buckets per power of two. */
+static const size_t statsBucketCount = 64 + (64 - 6) * 8;
+
+/** Find the histogram bucket of a traversal counter value.
+ \param value the counter value
+ \return the bucket index
+ */
+static size_t statsBucket(uint64_t value) {
+	if(value < 64) {
+		return size_t(value);
+	}
+	int exponent = 63;
+	while(((value >> exponent) & 1) == 0) {
+		--exponent;
+	}
+	return size_t(64 + (exponent - 6) * 8) + size_t((value >> (exponent - 3)) & 7);
+}
+
+/** Smallest traversal counter value in a histogram bucket.
+ \param bucket the bucket index
+ \return the lower bound of the bucket
+ */
+static uint64_t statsBucketValue(size_t bucket) {
+	if(bucket < 64) {
+		return uint64_t(bucket);
+	}
+	const size_t exponent = (bucket - 64) / 8 + 6;
+	return uint64_t(8 + (bucket - 64) % 8) << (exponent - 3);
+}
+
+void PathTracer::TraversalStats::add(const Raycaster::Stats & stats) {
+	if(histograms[0].empty()) {
+		for(auto & histogram : histograms) {
+			histogram.assign(statsBucketCount, 0);
 		}
-		// If we hit, two cases.
-		const auto & lobj = _scene->objects[lhit.meshId];
-		if(!lobj.masked() || !lobj.useTexCoords()){
-			// If the object has no mask or no uvs, geometric occlusion is always valid.
-			return false;
-		} else {
-			// We have to sample the object alpha mask.
-			// For this we compute the UVs and check the texture.
-			const auto & lmesh = *lobj.mesh();
-			const glm::vec2 luv = Raycaster::interpolateAttribute(lhit, lmesh, lmesh.texcoords);
-			const float alpha = lobj.textures()[0]->images[0].rgbal(luv.x, luv.y).a;
-			if(alpha < 0.01f){
-				// Transparent: shift, update the distance and keep casting.
-				maxDist = maxDist - lhit.dist;
-				lpos = lpos + lhit.dist * rayDir;
-			} else {
-				// Occlusion.
-				return false;
-				break;
+	}
+	total += stats;
+	++count;
+	++histograms[0][statsBucket(stats.nodes)];
+	++histograms[1][statsBucket(stats.boxes)];
+	++histograms[2][statsBucket(stats.primitives)];
+	++histograms[3][statsBucket(stats.hits)];
+}
+
+void PathTracer::TraversalStats::merge(const TraversalStats & other) {
+	if(other.count == 0) {
+		return;
+	}
+	if(count == 0) {
+		*this = other;
+		return;
+	}
+	total += other.total;
+	count += other.count;
+	for(size_t hid = 0; hid < 4; ++hid) {
+		for(size_t bid = 0; bid < statsBucketCount; ++bid) {
+			histograms[hid][bid] += other.histograms[hid][bid];
+		}
+	}
+}
+
+void PathTracer::TraversalStats::log(const std::string & name) const {
+	if(count == 0) {
+		return;
+	}
+	const char * names[]	= {"nodes", "boxes", "primitives", "hits"};
+	const uint64_t totals[] = {total.nodes, total.boxes, total.primitives, total.hits};
+	const float percentiles[] = {0.5f, 0.9f, 0.99f};
+	Log::Info() << "[PathTracer] " << name << " rays: " << count << ", per ray";
+	for(size_t hid = 0; hid < 4; ++hid) {
+		Log::Info() << (hid == 0 ? " " : ", ") << names[hid] << " " << double(totals[hid]) / double(count) << " (";
+		// Percentiles are given by the lower bound of their histogram bucket.
+		uint64_t cumulated = 0;
+		size_t bid		   = 0;
+		for(size_t pid = 0; pid < 3; ++pid) {
+			const uint64_t threshold = uint64_t(std::ceil(percentiles[pid] * float(count)));
+			while(bid < statsBucketCount && cumulated + histograms[hid][bid] < threshold) {
+				cumulated += histograms[hid][bid];
+				++bid;
 			}
+			Log::Info() << (pid == 0 ? "p50 " : (pid == 1 ? ", p90 " : ", p99 ")) << statsBucketValue(std::min(bid, statsBucketCount - 1));
 		}
+		Log::Info() << ")";
 	}
-	return true;
+	Log::Info() << "." << std::endl;
 }
 
-void PathTracer::render(const Camera & camera, size_t samples, size_t depth, Image & render) {
+void PathTracer::render(const Camera & camera, size_t samples, size_t depth, Image & render, Image * heatmap) {
+	const size_t samplesOld = samples;
+	samples					= size_t(std::pow(2, std::round(std::log2(float(samplesOld)))));
+	if(samplesOld != samples) {
+		Log::Warning() << "[PathTracer] Non power-of-2 samples count. Using " << samples << " instead." << std::endl;
+	}
+	Image statistics(render.width, render.height, 3);
+	// Counters are summed by accumulate, start from zero.
+	const bool validHeatmap = heatmap && heatmap->width == render.width && heatmap->height == render.height && heatmap->components == 3;
+	if(validHeatmap) {
+		std::fill(heatmap->pixels.begin(), heatmap->pixels.end(), 0.0f);
+	}
+	accumulate(camera, samples, depth, render, statistics, 0.0f, heatmap);
+	resolve(render, statistics, render);
+	if(validHeatmap && Raycaster::statsEnabled) {
+		resolveHeatmap(*heatmap, statistics);
+	}
+}
+
+void PathTracer::resolve(const Image & accumulation, const Image & statistics, Image & render) {
+	if(&render != &accumulation) {
+		render = Image(accumulation.width, accumulation.height, 3);
+	}
+	// Normalize by the samples count of each pixel and gamma correction.
+	System::forParallel(0, size_t(accumulation.height), [&accumulation, &statistics, &render](size_t y) {
+		for(size_t x = 0; x < accumulation.width; ++x) {
+			const float count		  = statistics.rgb(int(x), int(y))[0];
+			const glm::vec3 color	  = count > 0.0f ? accumulation.rgb(int(x), int(y)) / count : glm::vec3(0.0f);
+			render.rgb(int(x), int(y)) = glm::pow(color, glm::vec3(1.0f / 2.2f));
+		}
+	});
+}
+
+void PathTracer::resolveHeatmap(Image & heatmap, const Image & statistics, const Image * initialStatistics) {
+	// Only the samples rendered since the heatmap was created have been counted.
+	System::forParallel(0, size_t(heatmap.height), [&heatmap, &statistics, initialStatistics](size_t y) {
+		for(size_t x = 0; x < heatmap.width; ++x) {
+			float count = statistics.rgb(int(x), int(y))[0];
+			if(initialStatistics) {
+				count -= initialStatistics->rgb(int(x), int(y))[0];
+			}
+			glm::vec3 & counters = heatmap.rgb(int(x), int(y));
+			counters			 = count > 0.0f ? counters / count : glm::vec3(0.0f);
+		}
+	});
+}
+
+bool PathTracer::converged(const glm::vec3 & statistics, float targetError) {
+	const float count = statistics[0];
+	if(targetError <= 0.0f || count < float(adaptiveMinSamples)) {
+		return false;
+	}
+	// Standard error of the mean, relative to the mean luminance (bounded to avoid stalling on black pixels).
+	const float variance = statistics[2] / (count - 1.0f);
+	const float error	 = std::sqrt(variance / count);
+	return error <= targetError * std::max(statistics[1], 0.001f);
+}
+
+size_t PathTracer::accumulate(const Camera & camera, size_t samples, size_t depth, Image & render, Image & statistics, float targetError, Image * heatmap) {
 
 	// Safety checks.
 	if(!_scene) {
 		Log::Error() << "[PathTracer] No scene available." << std::endl;
-		return;
+		return 0;
 	}
 	if(render.components != 3) {
 		Log::Warning() << "[PathTracer] Expected a RGB image." << std::endl;
 	}
-	const size_t samplesOld = samples;
-	samples					= size_t(std::pow(2, std::round(std::log2(float(samplesOld)))));
-	if(samplesOld != samples) {
-		Log::Warning() << "[PathTracer] Non power-of-2 samples count. Using " << samples << " instead." << std::endl;
+	if(statistics.width != render.width || statistics.height != render.height || statistics.components != 3) {
+		Log::Error() << "[PathTracer] Expected a RGB statistics image of the same size as the render." << std::endl;
+		return 0;
+	}
+	if(samples == 0) {
+		return 0;
+	}
+	if(heatmap && !Raycaster::statsEnabled) {
+		Log::Warning() << "[PathTracer] Raycaster traversal counters are disabled, no heatmap will be generated." << std::endl;
+		heatmap = nullptr;
 	}
+	if(heatmap && (heatmap->width != render.width || heatmap->height != render.height || heatmap->components != 3)) {
+		Log::Warning() << "[PathTracer] Expected a RGB heatmap image of the same size as the render." << std::endl;
+		heatmap = nullptr;
+	}
+	// Traversal statistics of primary, bounce and shadow rays.
+	TraversalStats stats[3];
+	std::mutex statsMutex;
 
 	// Compute incremental pixel shifts.
 	glm::vec3 corner, dx, dy;
 	camera.pixelShifts(corner, dx, dy);
-	const glm::ivec2 cellCount = getSampleGrid(samples);
-	const glm::vec2 cellSize = 1.0f / glm::vec2(cellCount);
+
+	// Pixels keep receiving samples until they and their neighbors have converged, as a single pixel estimate is unreliable when rare paths haven't been sampled yet.
+	// The mask is computed before rendering as the statistics will be updated concurrently.
+	std::vector<char> activePixels(render.width * render.height, 1);
+	if(targetError > 0.0f) {
+		const int w = int(render.width);
+		const int h = int(render.height);
+		System::forParallel(0, size_t(h), [&activePixels, &statistics, targetError, w, h](size_t yy) {
+			const int y = int(yy);
+			for(int x = 0; x < w; ++x) {
+				bool active = false;
+				for(int ny = std::max(y - 1, 0); ny <= std::min(y + 1, h - 1) && !active; ++ny) {
+					for(int nx = std::max(x - 1, 0); nx <= std::min(x + 1, w - 1) && !active; ++nx) {
+						active = !converged(statistics.rgb(nx, ny), targetError);
+					}
+				}
+				activePixels[size_t(y) * size_t(w) + size_t(x)] = active ? 1 : 0;
+			}
+		});
+	}
+
+	// Split the image in tiles, visited along a Morton curve so that consecutive tiles are close on screen.
+	const glm::uvec2 tileCount = (glm::uvec2(render.width, render.height) + uint(tileSize) - 1u) / uint(tileSize);
+	std::vector<std::pair<uint32_t, glm::uvec2>> tiles;
+	tiles.reserve(tileCount.x * tileCount.y);
+	for(uint ty = 0; ty < tileCount.y; ++ty) {
+		for(uint tx = 0; tx < tileCount.x; ++tx) {
+			// Skip tiles where all pixels have converged.
+			const glm::uvec2 tileMin = glm::uvec2(tx, ty) * uint(tileSize);
+			const glm::uvec2 tileMax = glm::min(tileMin + uint(tileSize), glm::uvec2(render.width, render.height));
+			bool tileConverged		 = true;
+			for(uint y = tileMin.y; y < tileMax.y && tileConverged; ++y) {
+				for(uint x = tileMin.x; x < tileMax.x && tileConverged; ++x) {
+					tileConverged = activePixels[y * render.width + x] == 0;
+				}
+			}
+			if(!tileConverged) {
+				tiles.emplace_back(mortonCode(tx, ty), tileMin);
+			}
+		}
+	}
+	std::sort(tiles.begin(), tiles.end(), [](const std::pair<uint32_t, glm::uvec2> & a, const std::pair<uint32_t, glm::uvec2> & b) {
+		return a.first < b.first;
+	});
+	// Time spent and tiles rendered by each thread.
+	std::vector<uint64_t> threadTimes(System::threadCount(), 0);
+	std::vector<size_t> threadTiles(System::threadCount(), 0);
+	std::vector<size_t> threadSamples(System::threadCount(), 0);
+	std::vector<size_t> threadSegments(System::threadCount(), 0);
 
 	// Start chrono.
 	Query timer;
 	timer.begin();
 
-	// Parallelize on each row of the image.
-	System::forParallel(0, size_t(render.height), [&render, samples, &cellCount, &cellSize, &corner, &dx, &dy, &camera, depth, this](size_t y) {
-		for(size_t x = 0; x < size_t(render.width); ++x) {
-			for(size_t sid = 0; sid < samples; ++sid) {
+	// Threads pick the next tile as soon as they are done, tiles covering the background being much faster to render.
+	System::forParallelDynamic(0, tiles.size(), [&tiles, &activePixels, &threadTimes, &threadTiles, &threadSamples, &threadSegments, &render, &statistics, heatmap, &stats, &statsMutex, samples, &corner, &dx, &dy, &camera, depth, this](size_t tileId, size_t threadId) {
+		Query tileTimer;
+		tileTimer.begin();
+		// Primary rays of a tile are coherent, cast them together.
+		const glm::uvec2 tileMin = tiles[tileId].second;
+		const glm::uvec2 tileMax = glm::min(tileMin + uint(tileSize), glm::uvec2(render.width, render.height));
+		// Only render pixels that haven't converged.
+		std::vector<glm::ivec2> pixels;
+		for(uint y = tileMin.y; y < tileMax.y; ++y) {
+			for(uint x = tileMin.x; x < tileMax.x; ++x) {
+				if(activePixels[y * render.width + x] != 0) {
+					pixels.emplace_back(int(x), int(y));
+				}
+			}
+		}
+		const size_t width = pixels.size();
+		const std::vector<glm::vec3> rayOrigins(width, camera.position());
+		std::vector<glm::vec3> rayDirs(width);
+		std::vector<glm::vec2> ndcPoses(width);
+		std::vector<Raycaster::Hit> primaryHits;
+		// Paths of a tile advance together, one bounce at a time, so that their shadow rays are tested in one call.
+		std::vector<glm::vec3> rayPoses(width);
+		std::vector<glm::vec3> sampleColors(width);
+		std::vector<glm::vec3> attenuations(width);
+		// Probability of the last bounce direction, to weight emissive surfaces hit against light sampling.
+		std::vector<float> bouncePdfs(width);
+		std::vector<Sampler::Sequence> sequences(width);
+		std::vector<size_t> paths;
+		std::vector<glm::vec3> shadowOrigins, shadowDirs, shadowContribs;
+		std::vector<float> shadowMaxis;
+		std::vector<size_t> shadowPixels;
+		std::vector<bool> shadowOccluded;
+		// Traversal counters of the tile, accumulated per pixel for the heatmap.
+		TraversalStats tileStats[3];
+		std::vector<Raycaster::Stats> primaryStats, shadowStats;
+		std::vector<glm::vec3> pixelStats(Raycaster::statsEnabled ? width : 0, glm::vec3(0.0f));
+		auto recordStats = [&tileStats, &pixelStats](size_t type, size_t x, const Raycaster::Stats & rayStats) {
+			tileStats[type].add(rayStats);
+			pixelStats[x] += glm::vec3(rayStats.nodes, rayStats.boxes, rayStats.primitives);
+		};
 
+		for(size_t sid = 0; sid < samples; ++sid) {
+			paths.clear();
+			for(size_t x = 0; x < width; ++x) {
+				// The sample index in the pixel is given by the samples already accumulated.
+				const glm::ivec2 & pos = pixels[x];
+				sequences[x]		   = Sampler::Sequence(*_sampler, glm::uvec2(pos), uint32_t(statistics.rgb(pos.x, pos.y)[0]));
 				// Get the position of the sample in screenspace.
-				const glm::vec2 screenPos = glm::vec2(x, y) + getSamplePosition(sid, cellCount, cellSize);
+				const glm::vec2 screenPos = glm::vec2(pos) + sequences[x].next2D();
 				// Derive a position on the image plane from the pixel.
-				const glm::vec2 ndcPos = screenPos / glm::vec2(render.width, render.height);
+				ndcPoses[x] = screenPos / glm::vec2(render.width, render.height);
 				// Place the point on the near plane in clip space.
-				const glm::vec3 worldPos = corner + ndcPos.x * dx + ndcPos.y * dy;
+				const glm::vec3 worldPos = corner + ndcPoses[x].x * dx + ndcPoses[x].y * dy;
+				rayDirs[x] = glm::normalize(worldPos - camera.position());
 				// Initial ray setup.
-				glm::vec3 rayPos = camera.position();
-				glm::vec3 rayDir = glm::normalize(worldPos - camera.position());
-				glm::vec3 sampleColor(0.0f);
-				glm::vec3 attenuation(1.0f);
-
-				for(size_t did = 0; did < depth; ++did) {
-					// Query closest intersection.
-					const Raycaster::Hit hit = _raycaster.intersects(rayPos, rayDir);
+				rayPoses[x]		= camera.position();
+				sampleColors[x] = glm::vec3(0.0f);
+				attenuations[x] = glm::vec3(1.0f);
+				paths.push_back(x);
+			}
+			_raycaster.intersects(rayOrigins, rayDirs, primaryHits, 0.0001f, 1e8f, _alphaTest, Raycaster::statsEnabled ? &primaryStats : nullptr);
+			if(Raycaster::statsEnabled) {
+				for(size_t x = 0; x < width; ++x) {
+					recordStats(0, x, primaryStats[x]);
+				}
+			}
+
+			for(size_t did = 0; did < depth && !paths.empty(); ++did) {
+				threadSegments[threadId] += paths.size();
+				shadowOrigins.clear();
+				shadowDirs.clear();
+				shadowMaxis.clear();
+				shadowContribs.clear();
+				shadowPixels.clear();
+				size_t pathCount = 0;
+
+				for(const size_t x : paths) {
+					const glm::vec2 & ndcPos = ndcPoses[x];
+					glm::vec3 & rayPos		 = rayPoses[x];
+					glm::vec3 & rayDir		 = rayDirs[x];
+					glm::vec3 & sampleColor	 = sampleColors[x];
+					glm::vec3 & attenuation	 = attenuations[x];
+
+					// Query closest intersection, primary hits are already known.
+					const Raycaster::Stats statsBefore = Raycaster::threadStats();
+					const Raycaster::Hit hit = did == 0 ? primaryHits[x] : _raycaster.intersects(rayPos, rayDir, 0.0001f, 1e8f, _alphaTest);
+					if(Raycaster::statsEnabled && did != 0) {
+						recordStats(1, x, Raycaster::threadStats() - statsBefore);
+					}
 					// If no hit, background.
 					if(!hit.hit) {
 						sampleColor += attenuation * evalBackground(rayDir, rayPos, ndcPos, did == 0);
-						break;
+						continue;
 					}
 
 					// Fetch geometry infos...
 					const Object & obj = _scene->objects[hit.meshId];
-					const Mesh & mesh  = *obj.mesh();
 					const glm::vec3 p  = rayPos + hit.dist * rayDir;
 					// Fetch material texel information.
 					const bool noUVs = !obj.useTexCoords();
-					const glm::vec2 uv = noUVs ? glm::vec2(0.5f, 0.5f) :  Raycaster::interpolateAttribute(hit, mesh, mesh.texcoords);
+					const glm::vec2 uv = noUVs ? glm::vec2(0.5f, 0.5f) : texCoords(obj, hit);
 					const Image & image  = obj.textures()[0]->images[0];
 					const glm::vec4 bCol = image.rgbal(uv.x, uv.y);
-					// In case of alpha cut-out, just update the position to the intersection and keep casting.
-					// The 'mini' margin will ensures that we don't reintersect the same surface.
-					if(obj.masked() && bCol.a < 0.01f) {
-						rayPos = p;
-						continue;
-					}
 					// For emissive we don't apply any BRDF or re-cast rays, we just receive emitted light.
 					if(obj.type() == Object::Type::Emissive){
+						// After a bounce, the surface could also have been reached by light sampling.
+						const float weight = did == 0 ? 1.0f : powerHeuristic(bouncePdfs[x], _lights.pdf(hit, rayDir));
 						// Should we gamma-correct emissive textures?
-						sampleColor += attenuation * glm::vec3(bCol);
+						sampleColor += weight * attenuation * glm::vec3(bCol);
 						// No need to continue further.
-						break;
+						continue;
 					}
 
 					// Compute local tangent frame.
@@ -235,60 +543,124 @@ void PathTracer::render(const Camera & camera, size_t samples, size_t depth, Ima
 					const glm::vec4 rmao = imageRMAO.rgbal(uv.x, uv.y);
 
 					// Direct light sampling.
-					if(!_scene->lights.empty()){
-						// Take a light at random.
-						const unsigned int lid = Random::Int(0, int(_scene->lights.size()-1));
-						const auto & light = _scene->lights[lid];
+					if(!_lights.empty()){
+						// Pick a light based on its power, and a point on it for emissive surfaces.
+						const float lightSample = sequences[x].next1D();
+						const glm::vec2 pointSample = sequences[x].next2D();
 						// Shift slightly to avoid grazing angle self-intersections.
 						const glm::vec3 pShift = p+0.001f*tbn[2];
 						// Sample a ray going from the surface of the object to the light.
-						float maxDist, falloff;
-						const glm::vec3 direction = light->sample(pShift, maxDist, falloff);
-						// Test visibility of needed..
-						bool visible = falloff > 0.0f;
-						if(visible && light->castsShadow()){
-							visible = checkVisibility(pShift, direction, maxDist);
-						}
-
-						// If visible, add contribution weighted by the surface BRDF.
-						if(visible){
-							const glm::vec3 lwi = glm::normalize(itbn * direction);
+						LightSampler::Sample lightSampled;
+						// If the light can be reached, compute its contribution weighted by the surface BRDF.
+						if(_lights.sample(pShift, lightSample, pointSample, lightSampled)){
+							const glm::vec3 lwi = glm::normalize(itbn * lightSampled.direction);
 							const glm::vec3 evalLight = MaterialGGX::eval(wo, baseColor, rmao.r, rmao.g, lwi);
-							const float lightPdf = 1.0f / float(_scene->lights.size());
-							const glm::vec3 illumination = falloff * evalLight * light->intensity() / lightPdf;
-							// Because we only sample analytical lights, we can't hit an emitter via the raycaster, so no double-hit case to consider for now.
-							sampleColor += attenuation * illumination;
+							// Emissive surfaces can also be hit by the next bounce, weight both strategies. Analytic lights can only be sampled.
+							const float weight = lightSampled.pdf > 0.0f ? powerHeuristic(lightSampled.pdf, MaterialGGX::pdf(wo, baseColor, rmao.r, rmao.g, lwi)) : 1.0f;
+							const glm::vec3 illumination = weight * evalLight * lightSampled.radiance;
+							if(lightSampled.castsShadow){
+								// Visibility will be tested for all paths at once.
+								shadowOrigins.push_back(pShift);
+								shadowDirs.push_back(lightSampled.direction);
+								shadowMaxis.push_back(lightSampled.dist);
+								shadowContribs.push_back(attenuation * illumination);
+								shadowPixels.push_back(x);
+							} else {
+								sampleColor += attenuation * illumination;
+							}
 						}
 					}
 
 					// Pick next direction based on the BRDF.
 					glm::vec3 wi;
-					glm::vec3 eval = MaterialGGX::sampleAndEval(wo, baseColor, rmao.r, rmao.g, wi);
+					const float lobeSample = sequences[x].next1D();
+					const glm::vec2 directionSample = sequences[x].next2D();
+					glm::vec3 eval = MaterialGGX::sampleAndEval(wo, baseColor, rmao.r, rmao.g, lobeSample, directionSample, wi);
+					bouncePdfs[x] = MaterialGGX::pdf(wo, baseColor, rmao.r, rmao.g, wi);
 					const glm::vec3 nextRayDir = glm::normalize(tbn * wi);
 					// Bounce decay.
 					attenuation *= eval;
+					// Paths with no throughput left can't contribute anymore.
+					const float throughput = std::max(attenuation.x, std::max(attenuation.y, attenuation.z));
+					if(throughput <= 0.0f) {
+						continue;
+					}
+					// Past the minimum depth, randomly terminate paths with a low throughput, compensating for the survivors.
+					if(did + 1 >= _rouletteDepth) {
+						const float survival = std::min(throughput, 1.0f);
+						if(sequences[x].next1D() >= survival) {
+							continue;
+						}
+						attenuation /= survival;
+					}
+
+					// Update position and ray direction, the path continues.
+					rayPos = p;
+					rayDir = glm::normalize(nextRayDir);
+					paths[pathCount++] = x;
+				}
+				paths.resize(pathCount);
 
-					// Update position and ray direction.
-					if(did < depth - 1) {
-						rayPos = p;
-						rayDir = glm::normalize(nextRayDir);
+				// Resolve the shadow rays of all paths, adding the contribution of visible lights.
+				_raycaster.intersectsAny(shadowOrigins, shadowDirs, shadowMaxis, shadowOccluded, 0.001f, _alphaTest, Raycaster::statsEnabled ? &shadowStats : nullptr);
+				if(Raycaster::statsEnabled) {
+					for(size_t rid = 0; rid < shadowPixels.size(); ++rid) {
+						recordStats(2, shadowPixels[rid], shadowStats[rid]);
+					}
+				}
+				for(size_t rid = 0; rid < shadowPixels.size(); ++rid) {
+					if(!shadowOccluded[rid]) {
+						sampleColors[shadowPixels[rid]] += shadowContribs[rid];
 					}
 				}
+			}
+
+			for(size_t x = 0; x < width; ++x) {
 				// Clamp and store.
-				render.rgb(int(x), int(y)) += glm::min(sampleColor, 5.0f);
+				const glm::ivec2 pos	= pixels[x];
+				const glm::vec3 color	= glm::min(sampleColors[x], 5.0f);
+				render.rgb(pos.x, pos.y) += color;
+				// Update the running mean and variance of the pixel luminance (Welford).
+				glm::vec3 & stats	  = statistics.rgb(pos.x, pos.y);
+				const float luminance = glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+				stats[0] += 1.0f;
+				const float delta = luminance - stats[1];
+				stats[1] += delta / stats[0];
+				stats[2] += delta * (luminance - stats[1]);
 			}
 		}
-	});
 
-	// Normalize and gamma correction.
-	System::forParallel(0, size_t(render.height), [&render, &samples](size_t y) {
-		for(size_t x = 0; x < (render.width); ++x) {
-			const glm::vec3 color	  = render.rgb(int(x), int(y)) / float(samples);
-			render.rgb(int(x), int(y)) = glm::pow(color, glm::vec3(1.0f / 2.2f));
+		if(Raycaster::statsEnabled) {
+			if(heatmap) {
+				for(size_t x = 0; x < width; ++x) {
+					const glm::ivec2 pos = pixels[x];
+					heatmap->rgb(pos.x, pos.y) += pixelStats[x];
+				}
+			}
+			std::lock_guard<std::mutex> lock(statsMutex);
+			for(size_t type = 0; type < 3; ++type) {
+				stats[type].merge(tileStats[type]);
+			}
 		}
+		tileTimer.end();
+		threadTimes[threadId] += tileTimer.value();
+		++threadTiles[threadId];
+		threadSamples[threadId] += width * samples;
 	});
 
 	// Display duration.
 	timer.end();
-	Log::Info() << "[PathTracer] Rendering took " << float(timer.value()) / 1000000000.0f << "s at " << render.width << "x" << render.height << "." << std::endl;
+	const size_t sampleCount = std::accumulate(threadSamples.begin(), threadSamples.end(), size_t(0));
+	const uint64_t duration = timer.value();
+	Log::Info() << "[PathTracer] Rendering took " << float(duration) / 1000000000.0f << "s at " << render.width << "x" << render.height << ", " << tiles.size() << " tiles, " << sampleCount << " samples." << std::endl;
+	const size_t segmentCount = std::accumulate(threadSegments.begin(), threadSegments.end(), size_t(0));
+	Log::Info() << "[PathTracer] Average path length: " << (sampleCount == 0 ? 0.0f : float(segmentCount) / float(sampleCount)) << " segments, maximum depth " << depth << ", Russian roulette from depth " << _rouletteDepth << "." << std::endl;
+	// Threads that were idle for a large part of the rendering reveal an unbalanced load.
+	for(size_t threadId = 0; threadId < threadTimes.size(); ++threadId) {
+		Log::Info() << "[PathTracer] Thread " << threadId << ": " << threadTiles[threadId] << " tiles, busy " << float(threadTimes[threadId]) / 1000000000.0f << "s (" << (duration == 0 ? 100.0f : 100.0f * float(threadTimes[threadId]) / float(duration)) << "%)." << std::endl;
+	}
+	stats[0].log("Primary");
+	stats[1].log("Bounce");
+	stats[2].log("Shadow");
+	return sampleCount;
 }
@@ -1,4 +1,6 @@
 #pragma once
+#include "LightSampler.hpp"
+#include "Sampler.hpp"
 #include "raycaster/Raycaster.hpp"
 #include "scene/Scene.hpp"
 #include "Common.hpp"
@@ -14,36 +16,113 @@ public:
 
 	/** Constructor. Initializes the internal raycaster with the scene data.
 	 \param scene the scene to path trace against
+	 \param cachePath optional path to a file caching the raycaster hierarchy between runs
 	 */
-	explicit PathTracer(const std::shared_ptr<Scene> & scene);
+	explicit PathTracer(const std::shared_ptr<Scene> & scene, const std::string & cachePath = "");
 
 	/** Performs a rendering of the scene.
 	 \param camera the viewpoint to use
 	 \param samples the number of samples per-pixel
 	 \param depth the maximum number of bounces for each path
 	 \param render the image, will be filled with the (gamma-corrected) result
+	 \param heatmap optional RGB image, will be filled with the number of nodes visited, boxes tested and primitives tested per sample by all rays of each pixel
+	 \note The heatmap and the traversal statistics summary are only available if the raycaster traversal counters are enabled.
 	 */
-	void render(const Camera & camera, size_t samples, size_t depth, Image & render);
+	void render(const Camera & camera, size_t samples, size_t depth, Image & render, Image * heatmap = nullptr);
+
+	/** Performs a pass of progressive rendering, adding new samples to the previous ones.
+	 The running mean and variance of the luminance of each pixel are tracked, and pixels that have reached the target relative error along with their neighbors receive no new samples. Tiles where all pixels have converged are skipped.
+	 \param camera the viewpoint to use
+	 \param samples the number of new samples per-pixel
+	 \param depth the maximum number of bounces for each path
+	 \param render the RGB image the linear radiance of the new samples will be summed into
+	 \param statistics the RGB image storing the samples count, the mean luminance and the sum of squared deviations of each pixel, will be updated
+	 \param targetError the relative standard error of the mean under which a pixel is considered converged, or 0 to render all pixels
+	 \param heatmap optional RGB image, the number of nodes visited, boxes tested and primitives tested by all rays of each pixel rendered during the pass will be summed into it
+	 \return the total number of samples rendered during the pass
+	 \note The result can be converted to a displayable image with resolve, and the heatmap normalized with resolveHeatmap.
+	 */
+	size_t accumulate(const Camera & camera, size_t samples, size_t depth, Image & render, Image & statistics, float targetError = 0.0f, Image * heatmap = nullptr);
+
+	/** Convert accumulated radiance to a displayable image, by normalizing and gamma-correcting it.
+	 \param accumulation the sum of the radiance of all samples
+	 \param statistics the samples statistics of each pixel, as updated by accumulate
+	 \param render the image, will be filled with the (gamma-corrected) result, can be the accumulation itself
+	 */
+	static void resolve(const Image & accumulation, const Image & statistics, Image & render);
+
+	/** Convert traversal counters summed over passes to counters per sample, by normalizing them by the samples count of each pixel.
+	 \param heatmap the counters, as summed by accumulate, will contain the counters per sample
+	 \param statistics the samples statistics of each pixel, as updated by accumulate
+	 \param initialStatistics optional samples statistics before the first pass that contributed to the heatmap, if resuming a render
+	 */
+	static void resolveHeatmap(Image & heatmap, const Image & statistics, const Image * initialStatistics = nullptr);
+
+	/** Check if a pixel has reached a target relative error.
+	 \param statistics the samples count, mean luminance and sum of squared deviations of the pixel
+	 \param targetError the relative standard error of the mean to reach
+	 \return true if enough samples have been rendered and the estimated error is below the target
+	 */
+	static bool converged(const glm::vec3 & statistics, float targetError);
+
+	/** Update the internal raycaster and light sampler after the scene objects have been animated.
+	 \note The acceleration structure is refitted, which is much cheaper than building it again.
+	 */
+	void updateScene();
 
 	/** \return the internal raycaster. */
 	const Raycaster & raycaster() const { return _raycaster; }
 
-private:
+	/** Set the sampler generating the values consumed by paths (pixel position, light selection, BSDF sampling).
+	 \param type the type of sampler to use
+	 */
+	void sampler(Sampler::Type type);
 
-	/** Compute the dimensions of a grid that contains a given number of samples.
-	 \param samples the number of samples to place on a regular grid
-	 \return the number of samples on each axis
+	/** Set the sampler generating the values consumed by paths, with a given scrambling seed, for instance to continue the sequences of a previous render.
+	 \param type the type of sampler to use
+	 \param seed the seed used to scramble the sequences
 	 */
-	static glm::ivec2 getSampleGrid(size_t samples);
-
-	/** Get the local location of a sample in a pixel.
-	 \param sid the sample ID for the pixel
-	 \param cellCount the number of samples on each grid axis
-	 \param cellSize the spacing between two samples on an axis
-	 \return the local sample location in [0,1]
-	 \note The sample will be randomly jittered.
+	void sampler(Sampler::Type type, uint32_t seed);
+
+	/** Set the depth from which paths are randomly terminated based on their throughput (Russian roulette). Surviving paths are reweighted so that the result stays unbiased.
+	 \param depth the number of bounces always performed before the roulette, if the path hasn't stopped otherwise
 	 */
-	static glm::vec2 getSamplePosition(size_t sid, const glm::ivec2 & cellCount, const glm::vec2 & cellSize);
+	void rouletteDepth(size_t depth);
+
+private:
+
+	static const size_t tileSize = 16; ///< Size in pixels of the square tiles rendered by each thread.
+	static const size_t adaptiveMinSamples = 32; ///< Minimum number of samples per pixel before estimating convergence.
+
+	/** \brief Distribution of the traversal counters of one type of rays. */
+	struct TraversalStats {
+
+		/** Record the counters of a ray.
+		 \param stats the ray counters
+		 */
+		void add(const Raycaster::Stats & stats);
+
+		/** Merge the rays recorded in another distribution.
+		 \param other the distribution to merge
+		 */
+		void merge(const TraversalStats & other);
+
+		/** Log the mean and percentiles of each counter.
+		 \param name the type of rays
+		 */
+		void log(const std::string & name) const;
+
+		Raycaster::Stats total;					///< Sum of the counters of all rays.
+		size_t count = 0;						///< Number of rays recorded.
+		std::vector<uint64_t> histograms[4];	///< Logarithmic histogram of the nodes, boxes, primitives and hits counts.
+	};
+
+	/** Fetch the texture coordinates at an intersection on an object surface.
+	 \param obj the intersected object
+	 \param hit the intersection record
+	 \return the interpolated texture coordinates, or the parametric coordinates on analytic shapes
+	 */
+	static glm::vec2 texCoords(const Object & obj, const Raycaster::Hit & hit);
 
 	/** Build the local frame at an intersection on an object surface.
 	 \param obj the intersected object
@@ -54,14 +133,6 @@ private:
 	 \*/
 	static glm::mat3 buildLocalFrame(const Object & obj, const Raycaster::Hit & hit, const glm::vec3 & rayDir, const glm::vec2 & uv);
 
-	/** Check visibility from a point along a ray in the scene, taking into account object opacity masks.
-	 \param startPos the point to test visibility for
-	 \param rayDir the ray direction to follow
-	 \param maxDist the maximum distance to travel along the ray
-	 \return true if the point has clear visibility along the ray
-	 */
-	bool checkVisibility(const glm::vec3 & startPos, const glm::vec3 & rayDir, float maxDist) const;
-
 	/** Evalutation the contribution from the scene background.
 	 \param rayDir the direction of the ray that intersected
 	 \param rayPos the ray world space position
@@ -71,6 +142,10 @@ private:
 	 */
 	glm::vec3 evalBackground(const glm::vec3 & rayDir, const glm::vec3 & rayPos, const glm::vec2 & ndcPos, bool directHit) const;
 
-	Raycaster _raycaster;		   ///< The internal raycaster.
-	std::shared_ptr<Scene> _scene; ///< The scene.
+	Raycaster _raycaster;			///< The internal raycaster.
+	std::shared_ptr<Scene> _scene;	///< The scene.
+	Raycaster::Filter _alphaTest;	///< Rejects hits on transparent parts of masked objects, empty if there are none.
+	std::unique_ptr<Sampler> _sampler; ///< Generates the values consumed by paths.
+	LightSampler _lights;			///< Picks the analytic lights and emissive surfaces sampled at each bounce.
+	size_t _rouletteDepth = 3; ///< Number of bounces before Russian roulette starts terminating paths.
 };
@@ -5,7 +5,7 @@
 #include "graphics/ScreenQuad.hpp"
 #include "resources/Texture.hpp"
 
-PathTracerApp::PathTracerApp(RenderingConfig & config, const std::shared_ptr<Scene> & scene) :
+PathTracerApp::PathTracerApp(RenderingConfig & config, const std::shared_ptr<Scene> & scene, const std::string & cachePath) :
 	CameraApp(config), _renderTex ("render") {
 
 	_bvhRenderer.reset(new BVHRenderer());
@@ -35,7 +35,7 @@ PathTracerApp::PathTracerApp(RenderingConfig & config, const std::shared_ptr<Sce
 	_userCamera.ratio(config.screenResolution[0] / config.screenResolution[1]);
 	
 	// Create the path tracer and raycaster.
-	_pathTracer.reset(new PathTracer(_scene));
+	_pathTracer.reset(new PathTracer(_scene, cachePath));
 	// Setup the renderer data.
 	_bvhRenderer->setScene(_scene, _pathTracer->raycaster());
 	
@@ -95,6 +95,13 @@ void PathTracerApp::update() {
 		return;
 	}
 
+	// Keep the raycaster and the hierarchy display in sync with the animated scene.
+	if(_sceneMoved) {
+		_pathTracer->updateScene();
+		_bvhRenderer->updateHierarchy();
+		_sceneMoved = false;
+	}
+
 	if(ImGui::Begin("Path tracer")) {
 
 		ImGui::Text("Rendering size: %d x %d", _renderTex.width, _renderTex.height);
@@ -136,6 +143,10 @@ void PathTracerApp::update() {
 		
 		ImGui::Checkbox("Show render", &_showRender); ImGui::SameLine();
 		ImGui::Checkbox("Live render", &_liveRender);
+		if(_scene->animated()) {
+			ImGui::SameLine();
+			ImGui::Checkbox("Animate", &_animate);
+		}
 		if(!_showRender) {
 			// Mesh and BVH display.
 			ImGui::Separator();
@@ -191,11 +202,16 @@ void PathTracerApp::update() {
 	
 }
 
-void PathTracerApp::physics(double, double) {
+void PathTracerApp::physics(double fullTime, double frameTime) {
 	// If there is any interaction, exit the 'show render' mode except if we are live rendering.
 	if(Input::manager().interacted() && !_liveRender) {
 		_showRender = false;
 	}
+	// Animate the scene, the raycaster is synchronized once per frame in update.
+	if(_scene && _animate) {
+		_scene->update(fullTime, frameTime);
+		_sceneMoved = true;
+	}
 }
 
 PathTracerApp::~PathTracerApp() {
@@ -20,8 +20,9 @@ public:
 	/** Constructor.
 	 \param config the configuration to apply
 	 \param scene the scene to render
+	 \param cachePath optional path to a file caching the raycaster hierarchy between runs
 	 */
-	explicit PathTracerApp(RenderingConfig & config, const std::shared_ptr<Scene> & scene);
+	explicit PathTracerApp(RenderingConfig & config, const std::shared_ptr<Scene> & scene, const std::string & cachePath = "");
 
 	/** \copydoc CameraApp::draw */
 	void draw() override;
@@ -56,4 +57,6 @@ private:
 	bool _showRender	 = false;	///< Should the result be displayed.
 	bool _lockLevel		 = true;	///< Lock the range of the BVH visualisation.
 	bool _liveRender	 = false;	///< Display the result in real-time.
+	bool _animate		 = false;	///< Play the scene animations.
+	bool _sceneMoved	 = false;	///< Have the scene objects been animated since the raycaster was updated.
 };
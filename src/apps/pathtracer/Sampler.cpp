@@ -0,0 +1,252 @@
+#include "Sampler.hpp"
+#include "generation/Random.hpp"
+
+#include <random>
+
+/** Hash an integer (Wellons' lowbias32).
+ \param x the value to hash
+ \return the hashed value
+ */
+static uint32_t hash(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+/** Combine a seed with a value. The result should be hashed before use.
+ \param seed the current seed
+ \param value the value to combine
+ \return the new seed
+ */
+static uint32_t hashCombine(uint32_t seed, uint32_t value) {
+	return seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+/** Reverse the order of the bits of an integer.
+ \param x the value to reverse
+ \return the reversed value
+ */
+static uint32_t reverseBits(uint32_t x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+/** Laine-Karras permutation, flipping each bit of an integer based on a hash of the lower bits. Applied on reversed bits, it performs an Owen scrambling in base 2 (Burley, 2020).
+ \param x the value to permute
+ \param seed the permutation seed
+ \return the permuted value
+ */
+static uint32_t laineKarras(uint32_t x, uint32_t seed) {
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+/** Build the lookup tables of the second dimension of the Sobol sequence, with reversed bits.
+ \return for each of the four bytes of a point index, the (reversed) contribution of each byte value
+ */
+static std::vector<uint32_t> sobolTables() {
+	// Direction numbers of the primitive polynomial x+1.
+	uint32_t directions[32];
+	directions[0] = 1u << 31;
+	for(uint32_t bit = 1; bit < 32; ++bit) {
+		directions[bit] = directions[bit - 1] ^ (directions[bit - 1] >> 1);
+	}
+	std::vector<uint32_t> tables(4 * 256, 0);
+	for(uint32_t byte = 0; byte < 4; ++byte) {
+		for(uint32_t value = 0; value < 256; ++value) {
+			uint32_t & entry = tables[byte * 256 + value];
+			for(uint32_t bit = 0; bit < 8; ++bit) {
+				if((value >> bit) & 1u) {
+					entry ^= reverseBits(directions[8 * byte + bit]);
+				}
+			}
+		}
+	}
+	return tables;
+}
+
+/** Generate a shuffled and scrambled point of the first two dimensions of the Sobol sequence.
+ \param index the index of the point
+ \param seed the scrambling seed
+ \return the point, in [0,1)^2
+ */
+static glm::vec2 scrambledSobol(uint32_t index, uint32_t seed) {
+	static const std::vector<uint32_t> tables = sobolTables();
+	// Shuffle the order of the points by scrambling the index.
+	const uint32_t shuffled = reverseBits(laineKarras(reverseBits(index), seed));
+	// The first dimension is the Van der Corput sequence, the bit-reversed index.
+	// The second one is computed with reversed bits, as needed by the scrambling.
+	const uint32_t y = tables[shuffled & 0xffu] ^ tables[256 + ((shuffled >> 8) & 0xffu)] ^ tables[512 + ((shuffled >> 16) & 0xffu)] ^ tables[768 + (shuffled >> 24)];
+	// Scramble each coordinate independently.
+	const uint32_t sx = reverseBits(laineKarras(shuffled, hash(seed + 0x68bc21ebu)));
+	const uint32_t sy = reverseBits(laineKarras(y, hash(seed + 0x02e5be93u)));
+	// Keep 24 bits to get floats strictly below 1.
+	return glm::vec2(float(sx >> 8), float(sy >> 8)) / 16777216.0f;
+}
+
+std::unique_ptr<Sampler> Sampler::create(Type type, uint32_t seed) {
+	switch(type) {
+		case Type::RANDOM:
+			return std::unique_ptr<Sampler>(new RandomSampler());
+		case Type::BLUE_NOISE:
+			return std::unique_ptr<Sampler>(new BlueNoiseSampler(seed));
+		case Type::SOBOL:
+		default:
+			break;
+	}
+	return std::unique_ptr<Sampler>(new SobolSampler(seed));
+}
+
+Sampler::Sequence::Sequence(const Sampler & sampler, const glm::uvec2 & pixel, uint32_t index) :
+	_sampler(&sampler), _pixel(pixel), _index(index) {
+}
+
+float Sampler::Sequence::next1D() {
+	return _sampler->sample(_pixel, _index, _dimension++).x;
+}
+
+glm::vec2 Sampler::Sequence::next2D() {
+	return _sampler->sample(_pixel, _index, _dimension++);
+}
+
+glm::vec2 RandomSampler::sample(const glm::uvec2 &, uint32_t, uint32_t) const {
+	const float x = Random::Float();
+	const float y = Random::Float();
+	return glm::vec2(x, y);
+}
+
+SobolSampler::SobolSampler(uint32_t seed) :
+	_seed(hash(seed)) {
+}
+
+glm::vec2 SobolSampler::sample(const glm::uvec2 & pixel, uint32_t index, uint32_t dimension) const {
+	const uint32_t seed = hash(hashCombine(hashCombine(hashCombine(_seed, pixel.x), pixel.y), dimension));
+	return scrambledSobol(index, seed);
+}
+
+BlueNoiseSampler::BlueNoiseSampler(uint32_t seed) :
+	_mask([]() -> const std::vector<float> & {
+		// Generated once and shared by all samplers.
+		static const std::vector<float> mask = generateMask();
+		return mask;
+	}()),
+	_seed(hash(seed)) {
+}
+
+glm::vec2 BlueNoiseSampler::sample(const glm::uvec2 & pixel, uint32_t index, uint32_t dimension) const {
+	// All pixels share the same points for a given dimension.
+	const uint32_t seed	  = hash(hashCombine(_seed, dimension));
+	const glm::vec2 point = scrambledSobol(index, seed);
+	// Each coordinate of each dimension uses the mask with a different offset, to avoid correlations.
+	const uint32_t offsetX = hash(seed + 0x9e3779b9u);
+	const uint32_t offsetY = hash(seed + 0x3c6ef372u);
+	const uint32_t mx	   = (pixel.x + offsetX) % maskSize;
+	const uint32_t my	   = (pixel.y + (offsetX >> 16)) % maskSize;
+	const uint32_t nx	   = (pixel.x + offsetY) % maskSize;
+	const uint32_t ny	   = (pixel.y + (offsetY >> 16)) % maskSize;
+	const glm::vec2 shift(_mask[my * maskSize + mx], _mask[ny * maskSize + nx]);
+	// Toroidal shift, ensuring that we stay below 1.
+	return glm::min(glm::fract(point + shift), glm::vec2(0.99999994f));
+}
+
+std::vector<float> BlueNoiseSampler::generateMask() {
+	const int size	= int(maskSize);
+	const int count = size * size;
+	// Gaussian energy of each pixel on the wrapping mask.
+	const float sigma = 1.5f;
+	std::vector<float> kernel(count);
+	for(int y = 0; y < size; ++y) {
+		for(int x = 0; x < size; ++x) {
+			const float dx		  = float(std::min(x, size - x));
+			const float dy		  = float(std::min(y, size - y));
+			kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+		}
+	}
+	std::vector<char> pattern(count, 0);
+	std::vector<float> energy(count, 0.0f);
+	auto toggle = [&kernel, size](std::vector<char> & bits, std::vector<float> & energies, int pid) {
+		bits[pid]			= bits[pid] == 0 ? 1 : 0;
+		const float sign	= bits[pid] != 0 ? 1.0f : -1.0f;
+		const int px		= pid % size;
+		const int py		= pid / size;
+		for(int y = 0; y < size; ++y) {
+			for(int x = 0; x < size; ++x) {
+				energies[y * size + x] += sign * kernel[((y - py + size) % size) * size + (x - px + size) % size];
+			}
+		}
+	};
+	// The tightest cluster is the set pixel with the highest energy, the largest void the empty pixel with the lowest.
+	auto tightestCluster = [count](const std::vector<char> & bits, const std::vector<float> & energies) {
+		int best = -1;
+		for(int pid = 0; pid < count; ++pid) {
+			if(bits[pid] != 0 && (best < 0 || energies[pid] > energies[best])) {
+				best = pid;
+			}
+		}
+		return best;
+	};
+	auto largestVoid = [count](const std::vector<char> & bits, const std::vector<float> & energies) {
+		int best = -1;
+		for(int pid = 0; pid < count; ++pid) {
+			if(bits[pid] == 0 && (best < 0 || energies[pid] < energies[best])) {
+				best = pid;
+			}
+		}
+		return best;
+	};
+
+	// Initial random pattern, with a fixed seed so that the mask is always the same.
+	std::mt19937 generator(0);
+	const int initialCount = count / 10;
+	for(int placed = 0; placed < initialCount;) {
+		const int pid = int(generator() % uint32_t(count));
+		if(pattern[pid] == 0) {
+			toggle(pattern, energy, pid);
+			++placed;
+		}
+	}
+	// Move pixels from the tightest cluster to the largest void until the pattern is stable.
+	while(true) {
+		const int cluster = tightestCluster(pattern, energy);
+		toggle(pattern, energy, cluster);
+		const int hole = largestVoid(pattern, energy);
+		toggle(pattern, energy, hole);
+		if(hole == cluster) {
+			break;
+		}
+	}
+
+	std::vector<int> ranks(count, 0);
+	// Rank the pixels of the initial pattern, removing the tightest clusters first.
+	{
+		std::vector<char> bits		 = pattern;
+		std::vector<float> energies = energy;
+		for(int rank = initialCount - 1; rank >= 0; --rank) {
+			const int cluster = tightestCluster(bits, energies);
+			toggle(bits, energies, cluster);
+			ranks[cluster] = rank;
+		}
+	}
+	// Rank the remaining pixels, filling the largest voids first.
+	for(int rank = initialCount; rank < count; ++rank) {
+		const int hole = largestVoid(pattern, energy);
+		toggle(pattern, energy, hole);
+		ranks[hole] = rank;
+	}
+
+	std::vector<float> mask(count);
+	for(int pid = 0; pid < count; ++pid) {
+		mask[pid] = (float(ranks[pid]) + 0.5f) / float(count);
+	}
+	return mask;
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include "Common.hpp"
+
+/**
+ \brief Generates the values consumed by a path, one dimension after the other (pixel position, light selection, BSDF lobe and direction...).
+ A sample is identified by its pixel and its index in the pixel, so that samples can be generated in any order and on any thread.
+ \ingroup PathtracerDemo
+ */
+class Sampler {
+public:
+
+	/** \brief Available samplers. */
+	enum class Type : int {
+		RANDOM = 0, ///< Independent uniform random values.
+		SOBOL,		///< Owen-scrambled Sobol points, decorrelated between pixels and dimensions.
+		BLUE_NOISE	///< Owen-scrambled Sobol points shared by all pixels and shifted by a blue noise mask, distributing the error as blue noise on screen.
+	};
+
+	/** Create a sampler.
+	 \param type the type of sampler
+	 \param seed the seed used to scramble the sequences
+	 \return the new sampler
+	 */
+	static std::unique_ptr<Sampler> create(Type type, uint32_t seed);
+
+	/** Generate the values of one dimension of a sample.
+	 \param pixel the pixel the sample belongs to
+	 \param index the index of the sample in the pixel
+	 \param dimension the dimension to generate
+	 \return two values in [0,1)
+	 */
+	virtual glm::vec2 sample(const glm::uvec2 & pixel, uint32_t index, uint32_t dimension) const = 0;
+
+	/** Destructor. */
+	virtual ~Sampler() = default;
+
+	/**
+	 \brief Successive dimensions of a sample, consumed by a path as it progresses.
+	 */
+	class Sequence {
+	public:
+
+		/** Default constructor. */
+		Sequence() = default;
+
+		/** Constructor.
+		 \param sampler the sampler generating the values
+		 \param pixel the pixel the sample belongs to
+		 \param index the index of the sample in the pixel
+		 */
+		Sequence(const Sampler & sampler, const glm::uvec2 & pixel, uint32_t index);
+
+		/** \return a value in [0,1) from the next dimension */
+		float next1D();
+
+		/** \return two values in [0,1) from the next dimension */
+		glm::vec2 next2D();
+
+	private:
+		const Sampler * _sampler = nullptr; ///< The sampler.
+		glm::uvec2 _pixel		 = glm::uvec2(0); ///< The pixel.
+		uint32_t _index			 = 0; ///< The sample index.
+		uint32_t _dimension		 = 0; ///< The next dimension.
+	};
+
+};
+
+/**
+ \brief Independent uniform random values, drawn from the per-thread random generator.
+ \ingroup PathtracerDemo
+ */
+class RandomSampler final : public Sampler {
+public:
+
+	/** \copydoc Sampler::sample */
+	glm::vec2 sample(const glm::uvec2 & pixel, uint32_t index, uint32_t dimension) const override;
+};
+
+/**
+ \brief Two-dimensional Sobol points with hash-based Owen scrambling and shuffling (Burley, 2020). Each dimension of each pixel uses a different scrambling, so that dimensions are padded with independent well-stratified sequences.
+ \ingroup PathtracerDemo
+ */
+class SobolSampler final : public Sampler {
+public:
+
+	/** Constructor.
+	 \param seed the seed used to scramble the sequences
+	 */
+	explicit SobolSampler(uint32_t seed);
+
+	/** \copydoc Sampler::sample */
+	glm::vec2 sample(const glm::uvec2 & pixel, uint32_t index, uint32_t dimension) const override;
+
+private:
+	uint32_t _seed; ///< The scrambling seed.
+};
+
+/**
+ \brief Two-dimensional Owen-scrambled Sobol points shared by all pixels, toroidally shifted by the rank of each pixel in a void-and-cluster blue noise mask. Neighboring pixels get dissimilar shifts, distributing the error as a blue noise at low sample counts.
+ \ingroup PathtracerDemo
+ */
+class BlueNoiseSampler final : public Sampler {
+public:
+
+	/** Constructor.
+	 \param seed the seed used to scramble the sequences and offset the mask
+	 */
+	explicit BlueNoiseSampler(uint32_t seed);
+
+	/** \copydoc Sampler::sample */
+	glm::vec2 sample(const glm::uvec2 & pixel, uint32_t index, uint32_t dimension) const override;
+
+private:
+
+	/** Generate a blue noise mask with the void-and-cluster method (Ulichney, 1993).
+	 \return the normalized rank of each pixel of the mask, in [0,1)
+	 */
+	static std::vector<float> generateMask();
+
+	static const uint32_t maskSize = 64; ///< Width and height of the blue noise mask.
+
+	const std::vector<float> & _mask; ///< The blue noise mask, shared by all samplers.
+	uint32_t _seed; ///< The scrambling seed.
+};
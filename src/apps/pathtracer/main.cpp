@@ -5,9 +5,13 @@
 #include "system/System.hpp"
 #include "system/Window.hpp"
 #include "system/Config.hpp"
+#include "system/Query.hpp"
 #include "input/Input.hpp"
 #include "Common.hpp"
 
+#include <cstdio>
+#include <limits>
+
 /**
  \defgroup PathtracerDemo Path tracer
  \brief A basic diffuse path tracing demo, with an interactive viewer to place the camera.
@@ -42,6 +46,36 @@ public:
 				size[1] = std::stoi(values[1]);
 			} else if(key == "render") {
 				directRender = true;
+			} else if(key == "cache" && !values.empty()) {
+				cachePath = values[0];
+			} else if(key == "heatmap" && !values.empty()) {
+				heatmapPath = values[0];
+			} else if(key == "pass-samples" && !values.empty()) {
+				passSamples = size_t(std::max(1, std::stoi(values[0])));
+			} else if(key == "checkpoint" && !values.empty()) {
+				checkpointPath = values[0];
+			} else if(key == "checkpoint-interval" && !values.empty()) {
+				checkpointInterval = std::max(0.0f, std::stof(values[0]));
+			} else if(key == "preview" && !values.empty()) {
+				previewPath = values[0];
+			} else if(key == "resume") {
+				resume = true;
+			} else if(key == "target-error" && !values.empty()) {
+				targetError = std::max(0.0f, std::stof(values[0]));
+			} else if(key == "sample-count" && !values.empty()) {
+				sampleCountPath = values[0];
+			} else if(key == "roulette-depth" && !values.empty()) {
+				rouletteDepth = size_t(std::max(0, std::stoi(values[0])));
+			} else if(key == "sampler" && !values.empty()) {
+				if(values[0] == "random") {
+					sampler = Sampler::Type::RANDOM;
+				} else if(values[0] == "sobol") {
+					sampler = Sampler::Type::SOBOL;
+				} else if(values[0] == "bluenoise") {
+					sampler = Sampler::Type::BLUE_NOISE;
+				} else {
+					Log::Warning() << "Unknown sampler " << values[0] << ", using sobol." << std::endl;
+				}
 			}
 		}
 
@@ -66,6 +100,17 @@ public:
 		registerArgument("scene", "", "Name of the scene to load.", "string");
 		registerArgument("output", "", "Path for the output image.", "path");
 		registerArgument("render", "", "Disable the GUI and run a render immediatly.");
+		registerArgument("cache", "", "Directory where the raycaster hierarchy of each scene is cached between runs.", "path");
+		registerArgument("heatmap", "", "Path for an EXR image of the nodes, boxes and primitives tested per sample, if the raycaster traversal counters are enabled.", "path");
+		registerArgument("pass-samples", "", "Number of samples per pixel rendered by each progressive pass.", "int");
+		registerArgument("checkpoint", "", "Path for an EXR checkpoint of the progressive render, saved periodically.", "path");
+		registerArgument("checkpoint-interval", "", "Minimum duration between two checkpoints and previews.", "seconds");
+		registerArgument("preview", "", "Path for intermediate previews of the progressive render, saved periodically.", "path");
+		registerArgument("resume", "", "Continue the render from the checkpoint.");
+		registerArgument("target-error", "", "Relative error under which pixels stop receiving samples, the remaining budget going to other pixels (0 to disable).", "float");
+		registerArgument("sample-count", "", "Path for an EXR image of the number of samples rendered for each pixel.", "path");
+		registerArgument("roulette-depth", "", "Number of bounces before paths with a low throughput are randomly terminated.", "int");
+		registerArgument("sampler", "", "Sampler generating the path values: random, sobol (Owen-scrambled) or bluenoise (Owen-scrambled, blue noise error distribution).", "name");
 	}
 
 	glm::ivec2 size		   = glm::ivec2(1024); ///< Image size.
@@ -74,38 +119,306 @@ public:
 	std::string outputPath = "";			   ///< Output image path.
 	std::string scene	  = "";			   	   ///< Scene name.
 	bool directRender	  = false;			   ///< Disable the GUI and run a render immediatly.
+	std::string cachePath  = "";			   ///< Directory for the raycaster hierarchy caches, disabled if empty.
+	std::string heatmapPath = "";			   ///< Output traversal heatmap path, disabled if empty.
+	size_t passSamples	   = 8;				   ///< Number of samples per pixel for each progressive pass.
+	std::string checkpointPath = "";		   ///< Progressive render checkpoint path, disabled if empty.
+	float checkpointInterval = 60.0f;		   ///< Minimum duration in seconds between two checkpoints.
+	std::string previewPath = "";			   ///< Intermediate preview path, disabled if empty.
+	bool resume			   = false;			   ///< Continue the render from the checkpoint.
+	float targetError	   = 0.0f;			   ///< Relative error at which a pixel has converged, adaptive sampling is disabled if zero.
+	std::string sampleCountPath = "";		   ///< Output samples count image path, disabled if empty.
+	Sampler::Type sampler  = Sampler::Type::SOBOL; ///< Sampler used by the path tracer.
+	size_t rouletteDepth   = 3;				   ///< Number of bounces before Russian roulette.
+
+	/** \return the path to the raycaster hierarchy cache file of the scene, or an empty string if caching is disabled. */
+	std::string sceneCachePath() const {
+		return cachePath.empty() ? "" : (cachePath + "/" + scene + ".bvh");
+	}
 };
 
+/** \return the path an image is written to before replacing its destination
+ \param path the destination path, should have the "exr" extension
+ \ingroup PathtracerDemo
+ */
+std::string partialPath(const std::string & path) {
+	return path.substr(0, path.size() - 4) + "_partial.exr";
+}
+
+/** Save an image with integer attributes, by first writing it next to its destination and then moving it over, so that an interruption can't corrupt a previous version.
+ \param image the image to save
+ \param path the destination path, should have the "exr" extension
+ \param attributes the integer attributes to store
+ \return true if the image was saved
+ \note On Windows the destination has to be removed before moving, an interruption at this point leaves only the partial file, see loadReplaced.
+ \ingroup PathtracerDemo
+ */
+bool saveReplacing(Image & image, const std::string & path, const Image::Attributes & attributes) {
+	const std::string tempPath = partialPath(path);
+	if(image.saveWithAttributes(tempPath, false, attributes) != 0) {
+		Log::Error() << "[PathTracer] Unable to save " << tempPath << "." << std::endl;
+		return false;
+	}
+#ifdef _WIN32
+	std::remove(path.c_str());
+#endif
+	// Replaces the destination atomically on POSIX systems.
+	if(std::rename(tempPath.c_str(), path.c_str()) != 0) {
+		Log::Error() << "[PathTracer] Unable to move " << tempPath << " to " << path << "." << std::endl;
+		return false;
+	}
+	return true;
+}
+
+/** Load an image saved with saveReplacing, falling back to the partial file if the save was interrupted after removing the destination.
+ \param image will contain the image
+ \param path the destination path
+ \param attributes will contain the integer attributes
+ \return true if the image was loaded
+ \ingroup PathtracerDemo
+ */
+bool loadReplaced(Image & image, const std::string & path, Image::Attributes & attributes) {
+	if(image.loadWithAttributes(path, 3, false, true, attributes) == 0) {
+		return true;
+	}
+	const std::string tempPath = partialPath(path);
+	if(image.loadWithAttributes(tempPath, 3, false, true, attributes) != 0) {
+		return false;
+	}
+	Log::Warning() << "[PathTracer] Using interrupted save " << tempPath << "." << std::endl;
+	return true;
+}
+
+/** \return the path of the samples statistics stored alongside a checkpoint
+ \param path the checkpoint path
+ \ingroup PathtracerDemo
+ */
+std::string checkpointStatisticsPath(const std::string & path) {
+	return path.substr(0, path.size() - 4) + "_statistics.exr";
+}
+
+/** Save the state of a progressive render as an EXR image of the current mean radiance, with the average samples count and the sampler settings in its header. The samples statistics of each pixel are saved in a second EXR image, both headers share an identifier of the save.
+ \param accumulation the sum of the radiance of all samples
+ \param statistics the samples statistics of each pixel
+ \param depth the maximum path depth used
+ \param sampler the type of sampler used
+ \param samplerSeed the seed used to scramble the sampler sequences
+ \param path the checkpoint path
+ \return true if the checkpoint was saved
+ \ingroup PathtracerDemo
+ */
+bool saveCheckpoint(const Image & accumulation, Image & statistics, size_t depth, Sampler::Type sampler, uint32_t samplerSeed, const std::string & path) {
+	Image mean(accumulation.width, accumulation.height, 3);
+	double samples = 0.0;
+	for(size_t pid = 0; pid < mean.pixels.size(); pid += 3) {
+		const float count = statistics.pixels[pid];
+		samples += double(count);
+		for(size_t cid = 0; cid < 3; ++cid) {
+			mean.pixels[pid + cid] = count > 0.0f ? accumulation.pixels[pid + cid] / count : 0.0f;
+		}
+	}
+	samples /= double(statistics.width * statistics.height);
+	// Identify the save, so that images from different saves can't be mixed when loading.
+	// The sampler seed is stored as its bit pattern.
+	const Image::Attributes attributes = {{"samples", int(samples)}, {"depth", int(depth)}, {"sampler", int(sampler)}, {"seed", int(samplerSeed)}, {"checkpoint", Random::Int(0, std::numeric_limits<int>::max() - 1)}};
+	return saveReplacing(statistics, checkpointStatisticsPath(path), attributes) && saveReplacing(mean, path, attributes);
+}
+
+/** Restore the state of a progressive render from a checkpoint.
+ \param path the checkpoint path
+ \param config the run configuration
+ \param accumulation will contain the sum of the radiance of all samples
+ \param statistics will contain the samples statistics of each pixel
+ \param samplerSeed will contain the seed used to scramble the sampler sequences, if stored in the checkpoint
+ \return true if the checkpoint was loaded
+ \ingroup PathtracerDemo
+ */
+bool loadCheckpoint(const std::string & path, const PathTracerConfig & config, Image & accumulation, Image & statistics, uint32_t & samplerSeed) {
+	Image mean;
+	Image::Attributes attributes;
+	if(!loadReplaced(mean, path, attributes)) {
+		Log::Error() << "[PathTracer] Unable to load checkpoint from " << path << "." << std::endl;
+		return false;
+	}
+	const std::string statisticsPath = checkpointStatisticsPath(path);
+	Image::Attributes statisticsAttributes;
+	if(!loadReplaced(statistics, statisticsPath, statisticsAttributes)) {
+		Log::Error() << "[PathTracer] Unable to load checkpoint statistics from " << statisticsPath << "." << std::endl;
+		return false;
+	}
+	if(attributes != statisticsAttributes) {
+		Log::Error() << "[PathTracer] Checkpoint " << path << " and its statistics " << statisticsPath << " come from different saves." << std::endl;
+		return false;
+	}
+	if(int(mean.width) != config.size.x || int(mean.height) != config.size.y || statistics.width != mean.width || statistics.height != mean.height) {
+		Log::Error() << "[PathTracer] Checkpoint size " << mean.width << "x" << mean.height << " doesn't match the render size." << std::endl;
+		return false;
+	}
+	if(attributes.count("depth") != 0 && size_t(attributes["depth"]) != config.depth) {
+		Log::Warning() << "[PathTracer] Checkpoint rendered with depth " << attributes["depth"] << ", continuing with depth " << config.depth << "." << std::endl;
+	}
+	// Sample indices continue from the per-pixel counts, the sequences should be the same to preserve their stratification.
+	if(attributes.count("sampler") != 0 && Sampler::Type(attributes["sampler"]) != config.sampler) {
+		Log::Error() << "[PathTracer] Checkpoint rendered with a different sampler, use the same one to resume." << std::endl;
+		return false;
+	}
+	if(attributes.count("seed") != 0) {
+		samplerSeed = uint32_t(attributes["seed"]);
+	} else {
+		Log::Warning() << "[PathTracer] Checkpoint has no sampler seed, new samples won't be stratified with the previous ones." << std::endl;
+	}
+	accumulation = Image(mean.width, mean.height, 3);
+	for(size_t pid = 0; pid < mean.pixels.size(); ++pid) {
+		accumulation.pixels[pid] = mean.pixels[pid] * statistics.pixels[pid - pid % 3];
+	}
+	return true;
+}
+
 /** Load a scene and performs a path tracer rendering using the settings in the configuration.
  The camera used will be the scene reference viewpoint defined in the scene file.
+ The image is rendered progressively: passes of samples are accumulated, and the current state is periodically saved as a checkpoint and a preview if requested. The render can be resumed from the checkpoint.
  The output will be saved to the path specified in the configuration.
  \param config the run configuration
  \ingroup PathtracerDemo
  */
 void renderOneShot(const PathTracerConfig & config) {
 
+	const bool useCheckpoint = !config.checkpointPath.empty();
+	if(useCheckpoint && !Image::isFloat(config.checkpointPath)) {
+		Log::Error() << "[PathTracer] The checkpoint should be an EXR image." << std::endl;
+		return;
+	}
+	if(config.resume && !useCheckpoint) {
+		Log::Error() << "[PathTracer] No checkpoint to resume from." << std::endl;
+		return;
+	}
+
 	// Load geometry and create raycaster.
 	std::shared_ptr<Scene> scene(new Scene(config.scene));
 	// For offline renders we only need the CPU data.
 	if(!scene->init(Storage::CPU | Storage::FORCE_FRAME)) {
-		return;
+		return;
 	}
 
-	// Create the result image.
-	Image render(config.size.x, config.size.y, 3);
+	// Create the accumulation and statistics images, or restore them from the checkpoint.
+	Image accumulation(config.size.x, config.size.y, 3);
+	Image statistics(config.size.x, config.size.y, 3);
+	const size_t pixelCount = size_t(config.size.x) * size_t(config.size.y);
+	size_t samplesDone		= 0;
+	uint32_t samplerSeed	= Random::getSeed();
+	if(config.resume) {
+		if(!loadCheckpoint(config.checkpointPath, config, accumulation, statistics, samplerSeed)) {
+			return;
+		}
+		for(size_t pid = 0; pid < statistics.pixels.size(); pid += 3) {
+			samplesDone += size_t(statistics.pixels[pid]);
+		}
+		Log::Info() << "[PathTracer] Resuming from " << config.checkpointPath << " with " << (samplesDone / pixelCount) << " samples per pixel." << std::endl;
+	}
 	// Setup camera at the proper ratio.
 	Camera camera	 = scene->viewpoint();
 	const float ratio = float(config.size.x) / float(config.size.y);
 	camera.ratio(ratio);
 
-	PathTracer tracer(scene);
+	PathTracer tracer(scene, config.sceneCachePath());
+	tracer.sampler(config.sampler, samplerSeed);
+	tracer.rouletteDepth(config.rouletteDepth);
+
+	// Traversal heatmap, if requested. Counters are summed over all passes of this run.
+	const bool saveHeatmap = !config.heatmapPath.empty() && Raycaster::statsEnabled;
+	Image heatmap(saveHeatmap ? config.size.x : 0, saveHeatmap ? config.size.y : 0, 3);
+	// Samples restored from the checkpoint were not counted.
+	Image initialStatistics;
+	if(saveHeatmap && config.resume) {
+		initialStatistics = Image(statistics.width, statistics.height, statistics.components);
+		initialStatistics.pixels = statistics.pixels;
+	}
 
-	Log::Info() << "[PathTracer] Rendering..." << std::endl;
-	tracer.render(camera, config.samples, config.depth, render);
+	if(!config.heatmapPath.empty() && !saveHeatmap) {
+		Log::Warning() << "[PathTracer] Raycaster traversal counters are disabled, no heatmap will be generated." << std::endl;
+	}
+
+	// Render passes until the samples budget is spent or all pixels have converged.
+	const size_t samplesBudget = config.samples * pixelCount;
+	const uint64_t interval	   = uint64_t(double(config.checkpointInterval) * 1000000000.0);
+	uint64_t sinceCheckpoint   = 0;
+	size_t activePixels		   = pixelCount;
+	Image render;
+	while(samplesDone < samplesBudget) {
+		// Spread the remaining budget over the pixels that were rendered by the previous pass.
+		const size_t samplesLeft = samplesBudget - samplesDone;
+		const size_t passSamples = std::min(config.passSamples, (samplesLeft + activePixels - 1) / activePixels);
+		Log::Info() << "[PathTracer] Rendering " << passSamples << " samples per pixel, " << (100 * samplesDone / samplesBudget) << "% of the budget spent..." << std::endl;
+		Query passTimer;
+		passTimer.begin();
+		const size_t samplesPass = tracer.accumulate(camera, passSamples, config.depth, accumulation, statistics, config.targetError, saveHeatmap ? &heatmap : nullptr);
+		passTimer.end();
+		if(samplesPass == 0) {
+			Log::Info() << "[PathTracer] All pixels have converged." << std::endl;
+			break;
+		}
+		samplesDone += samplesPass;
+		activePixels = samplesPass / passSamples;
+		sinceCheckpoint += passTimer.value();
+
+		// Periodically save the current state, except after the last pass.
+		if(sinceCheckpoint < interval || samplesDone >= samplesBudget) {
+			continue;
+		}
+		sinceCheckpoint = 0;
+		if(useCheckpoint && saveCheckpoint(accumulation, statistics, config.depth, config.sampler, samplerSeed, config.checkpointPath)) {
+			Log::Info() << "[PathTracer] Checkpoint saved to " << config.checkpointPath << "." << std::endl;
+		}
+		if(!config.previewPath.empty()) {
+			PathTracer::resolve(accumulation, statistics, render);
+			render.save(config.previewPath, false);
+			Log::Info() << "[PathTracer] Preview saved to " << config.previewPath << "." << std::endl;
+		}
+	}
+
+	// The final checkpoint allows to add samples later on.
+	if(useCheckpoint && saveCheckpoint(accumulation, statistics, config.depth, config.sampler, samplerSeed, config.checkpointPath)) {
+		Log::Info() << "[PathTracer] Checkpoint saved to " << config.checkpointPath << "." << std::endl;
+	}
+
+	// Samples distribution.
+	Image sampleCount(config.size.x, config.size.y, 3);
+	size_t convergedPixels = 0;
+	float minCount		   = std::numeric_limits<float>::max();
+	float maxCount		   = 0.0f;
+	for(int y = 0; y < config.size.y; ++y) {
+		for(int x = 0; x < config.size.x; ++x) {
+			const glm::vec3 & stats = statistics.rgb(x, y);
+			sampleCount.rgb(x, y)	= glm::vec3(stats[0]);
+			minCount				= std::min(minCount, stats[0]);
+			maxCount				= std::max(maxCount, stats[0]);
+			convergedPixels += PathTracer::converged(stats, config.targetError) ? 1 : 0;
+		}
+	}
+	Log::Info() << "[PathTracer] Samples per pixel: " << minCount << " min, " << (float(samplesDone) / float(pixelCount)) << " average, " << maxCount << " max";
+	if(config.targetError > 0.0f) {
+		Log::Info() << ", " << convergedPixels << " pixels converged (" << (100.0f * float(convergedPixels) / float(pixelCount)) << "%)";
+	}
+	Log::Info() << "." << std::endl;
 
 	// Save image.
+	PathTracer::resolve(accumulation, statistics, render);
 	Log::Info() << "[PathTracer] Saving to " << config.outputPath << "." << std::endl;
 	render.save(config.outputPath, false);
+	if(saveHeatmap) {
+		Log::Info() << "[PathTracer] Saving heatmap to " << config.heatmapPath << "." << std::endl;
+		PathTracer::resolveHeatmap(heatmap, statistics, config.resume ? &initialStatistics : nullptr);
+		heatmap.save(config.heatmapPath, false);
+	}
+	if(!config.sampleCountPath.empty()) {
+		Log::Info() << "[PathTracer] Saving samples count to " << config.sampleCountPath << "." << std::endl;
+		// Store exact counts in HDR images.
+		if(Image::isFloat(config.sampleCountPath)) {
+			sampleCount.saveWithAttributes(config.sampleCountPath, false, {});
+		} else {
+			sampleCount.save(config.sampleCountPath, false);
+		}
+	}
 
 	System::ping();
 }
@@ -151,7 +464,7 @@ int main(int argc, char ** argv) {
 	// We need the CPU data for the path tracer, the GPU data for the preview.
 	scene->init(Storage::BOTH | Storage::FORCE_FRAME);
 
-	PathTracerApp app(config, scene);
+	PathTracerApp app(config, scene, config.sceneCachePath());
 
 	// Start the display/interaction loop.
 	while(window.nextFrame()) {
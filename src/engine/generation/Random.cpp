@@ -39,8 +39,14 @@ glm::vec3 Random::Color(){
 }
 
 glm::vec2 Random::sampleDisk(){
-	const float x = 2.0f * Random::Float() - 1.0f;
-	const float y = 2.0f * Random::Float() - 1.0f;
+	const float x = Random::Float();
+	const float y = Random::Float();
+	return sampleDisk(glm::vec2(x, y));
+}
+
+glm::vec2 Random::sampleDisk(const glm::vec2 & u){
+	const float x = 2.0f * u.x - 1.0f;
+	const float y = 2.0f * u.y - 1.0f;
 	if(x == 0.0f && y == 0.0f){
 		return glm::vec2(0.0f,0.0f);
 	}
@@ -56,15 +62,27 @@ glm::vec2 Random::sampleDisk(){
 }
 
 glm::vec3 Random::sampleSphere() {
-	const float thetaCos = 2.0f * Random::Float() - 1.0f;
-	const float phi		 = glm::two_pi<float>() * Random::Float();
-	const float thetaSin = std::sqrt(1.0f - thetaCos * thetaCos);
+	const float x = Random::Float();
+	const float y = Random::Float();
+	return sampleSphere(glm::vec2(x, y));
+}
+
+glm::vec3 Random::sampleSphere(const glm::vec2 & u) {
+	const float thetaCos = 1.0f - 2.0f * u.x;
+	const float phi		 = glm::two_pi<float>() * u.y;
+	const float thetaSin = std::sqrt(std::max(0.0f, 1.0f - thetaCos * thetaCos));
 	return glm::vec3(thetaSin * std::cos(phi), thetaSin * std::sin(phi), thetaCos);
 }
 
 glm::vec3 Random::sampleCosineHemisphere(){
+	const float x = Random::Float();
+	const float y = Random::Float();
+	return sampleCosineHemisphere(glm::vec2(x, y));
+}
+
+glm::vec3 Random::sampleCosineHemisphere(const glm::vec2 & u){
 	// Sample the disk and project onto the hemisphere.
-	const glm::vec2 xy = Random::sampleDisk();
+	const glm::vec2 xy = Random::sampleDisk(u);
 	const float z = std::sqrt(std::max(0.0f, 1.0f - xy.x * xy.x - xy.y * xy.y));
 	return glm::vec3(xy.x, xy.y, z);
 }
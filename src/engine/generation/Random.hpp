@@ -60,16 +60,34 @@ public:
 	*/
 	static glm::vec2 sampleDisk();
 
+	/** Map a point of the unit square to the unit disk, preserving areas.
+	 \param u a point in [0,1)^2
+	 \return a 2D point on the unit disk
+	 */
+	static glm::vec2 sampleDisk(const glm::vec2 & u);
+
 	/** Sample point uniformly on a sphere.
 	 \return a 3D point on the unit sphere
 	 */
 	static glm::vec3 sampleSphere();
 
+	/** Map a point of the unit square to the unit sphere, preserving areas.
+	 \param u a point in [0,1)^2
+	 \return a 3D point on the unit sphere
+	 */
+	static glm::vec3 sampleSphere(const glm::vec2 & u);
+
 	/** Sample point from the hemisphere, following a cosine lobe
 	 \return a 3D point on the unit z-positive hemisphere
 	*/
 	static glm::vec3 sampleCosineHemisphere();
 
+	/** Map a point of the unit square to the hemisphere, following a cosine lobe
+	 \param u a point in [0,1)^2
+	 \return a 3D point on the unit z-positive hemisphere
+	 */
+	static glm::vec3 sampleCosineHemisphere(const glm::vec2 & u);
+
 	/** Shuffle elements of a vector randomly, in-place.
 	 \param items the items to shuffle
 	 */
@@ -1,262 +1,3551 @@
 #include "raycaster/Raycaster.hpp"
+#include "raycaster/RaycasterPacket.hpp"
+#include "resources/Texture.hpp"
 #include "generation/Random.hpp"
+#include "system/System.hpp"
+#include "system/Query.hpp"
+#include <cstring>
+#include <fstream>
 #include <queue>
 #include <stack>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+const size_t Raycaster::packetSize;
+const size_t Raycaster::blockSize;
+const uint32_t Raycaster::noTriangle;
+const size_t Raycaster::maxDepth;
+const uint32_t Raycaster::packetMiss;
+const bool Raycaster::statsEnabled;
+
+#ifdef RAYCASTER_STATS
+/** Traversal counters of the queries run on each thread. */
+static thread_local Raycaster::Stats threadCounters;
+#define RAYCASTER_COUNT(counter, value) (threadCounters.counter += (value))
+#else
+#define RAYCASTER_COUNT(counter, value)
+#endif
+
 Raycaster::Hit::Hit() :
-	hit(false), dist(std::numeric_limits<float>::max()), u(0.0f), v(0.0f), w(0.0f), localId(0), meshId(0), internalId(0) {
+	hit(false), dist(std::numeric_limits<float>::max()), u(0.0f), v(0.0f), w(0.0f), localId(0), meshId(0), normal(0.0f), tangent(0.0f), internalId(0) {
 }
 
 Raycaster::Hit::Hit(float distance, float uu, float vv, unsigned long lid, unsigned long mid) :
-	hit(true), dist(distance), u(uu), v(vv), w(1.0f - uu - vv), localId(lid), meshId(mid), internalId(0) {
+	hit(true), dist(distance), u(uu), v(vv), w(1.0f - uu - vv), localId(lid), meshId(mid), normal(0.0f), tangent(0.0f), internalId(0) {
+}
+
+Raycaster::Stats & Raycaster::Stats::operator+=(const Stats & other) {
+	rays += other.rays;
+	nodes += other.nodes;
+	boxes += other.boxes;
+	primitives += other.primitives;
+	hits += other.hits;
+	return *this;
+}
+
+Raycaster::Stats Raycaster::Stats::operator-(const Stats & other) const {
+	Stats diff;
+	diff.rays		= rays - other.rays;
+	diff.nodes		= nodes - other.nodes;
+	diff.boxes		= boxes - other.boxes;
+	diff.primitives = primitives - other.primitives;
+	diff.hits		= hits - other.hits;
+	return diff;
+}
+
+Raycaster::Raycaster(const Settings & settings) :
+	_settings(settings) {
+}
+
+Raycaster::Stats Raycaster::threadStats() {
+#ifdef RAYCASTER_STATS
+	return threadCounters;
+#else
+	return Stats();
+#endif
+}
+
+/** Update a FNV-1a hash with a range of bytes.
+ \param data the bytes to hash
+ \param size the number of bytes
+ \param hash the current hash value
+ \return the updated hash
+ */
+static uint64_t hashBytes(const void * data, size_t size, uint64_t hash = 14695981039346656037ull) {
+	const unsigned char * bytes = static_cast<const unsigned char *>(data);
+	for(size_t bid = 0; bid < size; ++bid) {
+		hash = (hash ^ uint64_t(bytes[bid])) * 1099511628211ull;
+	}
+	return hash;
+}
+
+/** Update a hash with the hierarchy construction settings.
+ \param settings the settings
+ \param hash the current hash value
+ \return the updated hash
+ */
+static uint64_t hashSettings(const Raycaster::Settings & settings, uint64_t hash) {
+	const int split = int(settings.split);
+	hash = hashBytes(&split, sizeof(split), hash);
+	hash = hashBytes(&settings.bins, sizeof(settings.bins), hash);
+	hash = hashBytes(&settings.maxLeafSize, sizeof(settings.maxLeafSize), hash);
+	hash = hashBytes(&settings.traversalCost, sizeof(settings.traversalCost), hash);
+	hash = hashBytes(&settings.leafCost, sizeof(settings.leafCost), hash);
+	hash = hashBytes(&settings.width, sizeof(settings.width), hash);
+	hash = hashBytes(&settings.splitBudget, sizeof(settings.splitBudget), hash);
+	hash = hashBytes(&settings.splitOverlap, sizeof(settings.splitOverlap), hash);
+	hash = hashBytes(&settings.mortonBits, sizeof(settings.mortonBits), hash);
+	hash = hashBytes(&settings.treeletPasses, sizeof(settings.treeletPasses), hash);
+	hash = hashBytes(&settings.quantization, sizeof(settings.quantization), hash);
+	return hash;
 }
 
 void Raycaster::addMesh(const Mesh & mesh, const glm::mat4 & model) {
-	const unsigned long indexOffset = static_cast<unsigned long>(_vertices.size());
+	const unsigned long meshId = static_cast<unsigned long>(_instances.size());
 
-	// Start by copying all vertices.
-	const size_t startIndex = _vertices.size();
-	_vertices.insert(_vertices.end(), mesh.positions.begin(), mesh.positions.end());
-	const size_t endIndex = _vertices.size();
+	_instances.emplace_back();
+	Instance & instance = _instances.back();
+	setTransform(instance, model);
 
-	if(model != glm::mat4(1.0f)) {
-		for(size_t vid = startIndex; vid < endIndex; ++vid) {
-			_vertices[vid] = glm::vec3(model * glm::vec4(_vertices[vid], 1.0f));
-		}
+	// If the mesh has already been added, share its geometry.
+	const auto existing = _geometryIds.find(&mesh);
+	if(existing != _geometryIds.end()) {
+		instance.geometry = existing->second;
+		++_geometries[instance.geometry].instanceCount;
+		Log::Info() << "[Raycaster]"
+					<< " Mesh " << meshId << " added, instance of geometry " << instance.geometry << "." << std::endl;
+		return;
 	}
 
-	const size_t startTriangle  = _triangles.size();
+	instance.geometry	 = static_cast<unsigned int>(_geometries.size());
+	_geometryIds[&mesh] = instance.geometry;
+	_geometries.emplace_back();
+	Geometry & geometry		= _geometries.back();
+	geometry.instanceCount = 1;
+
+	// Store all triangles in mesh space, they will be reordered when building the hierarchy.
 	const size_t trianglesCount = mesh.indices.size() / 3;
+	const size_t blocksCount	= (trianglesCount + blockSize - 1) / blockSize;
+	geometry.triangles.resize(blocksCount);
+	geometry.localIds.resize(blocksCount * blockSize, noTriangle);
 	for(size_t tid = 0; tid < trianglesCount; ++tid) {
 		const size_t localId = 3 * tid;
-		TriangleInfos triInfos;
-		triInfos.v0		 = indexOffset + mesh.indices[localId + 0];
-		triInfos.v1		 = indexOffset + mesh.indices[localId + 1];
-		triInfos.v2		 = indexOffset + mesh.indices[localId + 2];
-		triInfos.localId = static_cast<unsigned long>(localId);
-		triInfos.meshId  = _meshCount;
-		triInfos.box	 = BoundingBox(_vertices[triInfos.v0], _vertices[triInfos.v1], _vertices[triInfos.v2]);
-		_triangles.push_back(triInfos);
-	}
-
-	// Add initial node to the hierarchy.
-	_hierarchy.emplace_back();
-	Node & node = _hierarchy.back();
-	node.left   = startTriangle;
-	node.right  = trianglesCount;
+		const glm::vec3 & v0 = mesh.positions[mesh.indices[localId + 0]];
+		const glm::vec3 v01	 = mesh.positions[mesh.indices[localId + 1]] - v0;
+		const glm::vec3 v02	 = mesh.positions[mesh.indices[localId + 2]] - v0;
+		TriangleBlock & block = geometry.triangles[tid / blockSize];
+		const size_t bid	  = tid % blockSize;
+		for(int i = 0; i < 3; ++i) {
+			block.v0[i][bid] = v0[i];
+			block.e1[i][bid] = v01[i];
+			block.e2[i][bid] = v02[i];
+		}
+		geometry.localIds[tid] = uint32_t(localId);
+	}
+	// Unused triangles are degenerate.
+	for(size_t tid = trianglesCount; tid < geometry.localIds.size(); ++tid) {
+		TriangleBlock & block = geometry.triangles[tid / blockSize];
+		for(int i = 0; i < 3; ++i) {
+			block.v0[i][tid % blockSize] = block.e1[i][tid % blockSize] = block.e2[i][tid % blockSize] = 0.0f;
+		}
+	}
+
+	geometry.hash = hashBytes(geometry.triangles.data(), geometry.triangles.size() * sizeof(TriangleBlock));
+	geometry.hash = hashBytes(geometry.localIds.data(), geometry.localIds.size() * sizeof(uint32_t), geometry.hash);
 
 	Log::Info() << "[Raycaster]"
-				<< " Mesh " << _meshCount << " added, " << trianglesCount << " triangles, " << _vertices.size() - indexOffset << " vertices." << std::endl;
+				<< " Mesh " << meshId << " added, " << trianglesCount << " triangles, " << mesh.positions.size() << " vertices." << std::endl;
+}
 
-	++_meshCount;
+void Raycaster::addShape(Shape shape, const glm::mat4 & model) {
+	if(shape == Shape::Mesh) {
+		Log::Error() << "[Raycaster] Meshes should be added with their triangles." << std::endl;
+		return;
+	}
+	const unsigned long meshId = static_cast<unsigned long>(_instances.size());
+
+	_instances.emplace_back();
+	Instance & instance = _instances.back();
+	setTransform(instance, model);
+
+	// All instances of a shape share the same geometry, placed in the shape frame.
+	const auto existing = std::find_if(_geometries.begin(), _geometries.end(), [shape](const Geometry & geometry) {
+		return geometry.shape == shape;
+	});
+	if(existing != _geometries.end()) {
+		instance.geometry = static_cast<unsigned int>(existing - _geometries.begin());
+		++existing->instanceCount;
+	} else {
+		instance.geometry = static_cast<unsigned int>(_geometries.size());
+		_geometries.emplace_back();
+		Geometry & geometry		= _geometries.back();
+		geometry.instanceCount = 1;
+		geometry.shape		   = shape;
+		geometry.hash		   = hashBytes(&shape, sizeof(Shape));
+	}
+	Log::Info() << "[Raycaster]"
+				<< " Mesh " << meshId << " added, analytic shape " << int(shape) << "." << std::endl;
 }
 
-void Raycaster::updateHierarchy() {
+void Raycaster::removeMesh(size_t meshId) {
+	if(meshId >= _instances.size() || _instances[meshId].removed) {
+		Log::Error() << "[Raycaster] Mesh " << meshId << " doesn't exist." << std::endl;
+		return;
+	}
+	// Keep the instance in place so that mesh indices don't change, it is skipped when building the top level.
+	Instance & instance = _instances[meshId];
+	instance.removed	= true;
+	Geometry & geometry = _geometries[instance.geometry];
+	--geometry.instanceCount;
+	if(geometry.instanceCount != 0) {
+		return;
+	}
+	// The geometry is still used by the current hierarchy, it will be released at the next update.
+	// Forget the mesh so that adding it again doesn't share the stale geometry.
+	for(auto it = _geometryIds.begin(); it != _geometryIds.end(); ++it) {
+		if(it->second == instance.geometry) {
+			_geometryIds.erase(it);
+			break;
+		}
+	}
+}
+
+void Raycaster::releaseGeometries() {
+	std::vector<unsigned int> newIds(_geometries.size(), 0);
+	size_t count = 0;
+	for(size_t gid = 0; gid < _geometries.size(); ++gid) {
+		if(_geometries[gid].instanceCount == 0) {
+			continue;
+		}
+		newIds[gid] = static_cast<unsigned int>(count);
+		if(count != gid) {
+			_geometries[count] = std::move(_geometries[gid]);
+		}
+		++count;
+	}
+	if(count == _geometries.size()) {
+		return;
+	}
+	Log::Info() << "[Raycaster] Released " << _geometries.size() - count << " unused meshes." << std::endl;
+	_geometries.resize(count);
+	for(Instance & instance : _instances) {
+		instance.geometry = instance.removed ? 0 : newIds[instance.geometry];
+	}
+	for(auto & geometryId : _geometryIds) {
+		geometryId.second = newIds[geometryId.second];
+	}
+}
 
-	Log::Info() << "[Raycaster] Building hierarchy for " << _triangles.size() << " triangles... " << std::flush;
+/** Number of elements processed by each task of a reduction. */
+static const size_t reductionChunkSize = 16384;
 
-	struct SetInfos {
-		size_t id;
-		size_t begin;
-		size_t count;
+/** Reduce a range of elements, optionally using multiple threads. Partial results are computed on fixed-size chunks and merged in order, so that the result doesn't depend on the number of threads used.
+ \param begin the index of the first element
+ \param count the number of elements
+ \param init the initial value of the accumulator
+ \param parallel should chunks be processed by multiple threads
+ \param accumulate the function adding an element to an accumulator, signature: void(Acc & acc, size_t i)
+ \param merge the function merging two accumulators into the first one, signature: void(Acc & acc, const Acc & other)
+ \return the reduction result
+ */
+template<typename Acc, typename Accumulate, typename Merge>
+static Acc reduceRange(size_t begin, size_t count, const Acc & init, bool parallel, Accumulate accumulate, Merge merge) {
+	const size_t chunkCount = (count + reductionChunkSize - 1) / reductionChunkSize;
+	if(chunkCount == 0) {
+		return init;
+	}
+	std::vector<Acc> partials(chunkCount, init);
+	auto processChunk = [&partials, &accumulate, begin, count](size_t cid) {
+		const size_t chunkBegin = begin + cid * reductionChunkSize;
+		const size_t chunkEnd	= std::min(chunkBegin + reductionChunkSize, begin + count);
+		for(size_t i = chunkBegin; i < chunkEnd; ++i) {
+			accumulate(partials[cid], i);
+		}
 	};
+	if(parallel && chunkCount > 1) {
+		System::forParallel(0, chunkCount, processChunk);
+	} else {
+		for(size_t cid = 0; cid < chunkCount; ++cid) {
+			processChunk(cid);
+		}
+	}
+	for(size_t cid = 1; cid < chunkCount; ++cid) {
+		merge(partials[0], partials[cid]);
+	}
+	return partials[0];
+}
 
-	std::stack<SetInfos> remainingSets;
-	// One root node per mesh.
-	for(size_t nid = 0; nid < _meshCount; ++nid) {
-		const Node & node = _hierarchy[nid];
-		remainingSets.push({nid, node.left, node.right});
+/** Run independent tasks, using multiple threads if there is more than one.
+ \param count the number of tasks
+ \param task the function running a task, signature: void(size_t i)
+ */
+template<typename Task>
+static void forTasks(size_t count, Task task) {
+	if(count > 1) {
+		System::forParallel(0, count, task);
+	} else if(count == 1) {
+		task(0);
 	}
+}
 
-	while(!remainingSets.empty()) {
-		// Get the next node to process on the stack.
-		const SetInfos current(remainingSets.top());
-		remainingSets.pop();
-		const size_t begin = current.begin;
-		const size_t count = current.count;
+/** Process a range of elements in fixed-size chunks, using multiple threads if there is more than one chunk.
+ \param count the number of elements
+ \param process the function processing a chunk, signature: void(size_t cid, size_t begin, size_t end)
+ */
+template<typename Process>
+static void forChunks(size_t count, Process process) {
+	const size_t chunkCount = (count + reductionChunkSize - 1) / reductionChunkSize;
+	forTasks(chunkCount, [&process, count](size_t cid) {
+		const size_t begin = cid * reductionChunkSize;
+		process(cid, begin, std::min(begin + reductionChunkSize, count));
+	});
+}
+
+/** Spread the lowest 21 bits of an integer so that two zero bits separate each of them.
+ \param x the integer
+ \return the spread bits
+ */
+static uint64_t spreadBits(uint64_t x) {
+	x &= 0x1FFFFF;
+	x = (x | (x << 32)) & 0x1F00000000FFFF;
+	x = (x | (x << 16)) & 0x1F0000FF0000FF;
+	x = (x | (x << 8)) & 0x100F00F00F00F00F;
+	x = (x | (x << 4)) & 0x10C30C30C30C30C3;
+	x = (x | (x << 2)) & 0x1249249249249249;
+	return x;
+}
+
+/** Compute the Morton code of a point, interleaving the bits of its quantized coordinates.
+ \param p the point, in [0,1]
+ \param bits the number of bits for each coordinate, at most 21
+ \return the Morton code, using 3 * bits bits
+ */
+static uint64_t mortonCode(const glm::vec3 & p, uint bits) {
+	const float cells  = float(uint64_t(1) << bits);
+	const glm::uvec3 q = glm::uvec3(glm::clamp(p * cells, 0.0f, cells - 1.0f));
+	return (spreadBits(q.x) << 2) | (spreadBits(q.y) << 1) | spreadBits(q.z);
+}
+
+/** Count the leading zero bits of an integer.
+ \param x the integer
+ \return the number of zero bits before the most significant set bit, 64 if x is zero
+ */
+static int leadingZeros(uint64_t x) {
+	if(x == 0) {
+		return 64;
+	}
+#if defined(__GNUC__)
+	return __builtin_clzll(x);
+#elif defined(_M_X64)
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return 63 - int(index);
+#else
+	int count = 0;
+	for(int shift = 32; shift > 0; shift /= 2) {
+		if((x >> (64 - shift)) == 0) {
+			count += shift;
+			x <<= shift;
+		}
+	}
+	return count;
+#endif
+}
 
-		// Compute the global bounding box.
-		BoundingBox global(_triangles[begin].box);
-		for(size_t tid = 1; tid < count; ++tid) {
-			global.merge(_triangles[begin + tid].box);
+/** Sort keys and their associated values, using a least significant digit radix sort. Each pass counts the digits of fixed-size chunks and scatters them in parallel, the sort is stable.
+ \param keys the keys to sort
+ \param values the values, reordered along with their keys
+ \param bits the number of significant bits in the keys
+ */
+static void radixSort(std::vector<uint64_t> & keys, std::vector<uint32_t> & values, uint bits) {
+	const size_t count = keys.size();
+	std::vector<uint64_t> sortedKeys(count);
+	std::vector<uint32_t> sortedValues(count);
+	std::vector<size_t> offsets;
+	for(uint shift = 0; shift < bits; shift += 8) {
+		// Histogram of the current digit in each chunk.
+		const size_t chunkCount = (count + reductionChunkSize - 1) / reductionChunkSize;
+		offsets.assign(chunkCount * 256, 0);
+		forChunks(count, [&keys, &offsets, shift](size_t cid, size_t begin, size_t end) {
+			size_t * histogram = &offsets[cid * 256];
+			for(size_t i = begin; i < end; ++i) {
+				++histogram[(keys[i] >> shift) & 0xFF];
+			}
+		});
+		// Elements are placed by digit, then by chunk.
+		size_t total = 0;
+		for(size_t digit = 0; digit < 256; ++digit) {
+			for(size_t cid = 0; cid < chunkCount; ++cid) {
+				const size_t digitCount		 = offsets[cid * 256 + digit];
+				offsets[cid * 256 + digit] = total;
+				total += digitCount;
+			}
 		}
+		forChunks(count, [&keys, &values, &sortedKeys, &sortedValues, &offsets, shift](size_t cid, size_t begin, size_t end) {
+			size_t * destinations = &offsets[cid * 256];
+			for(size_t i = begin; i < end; ++i) {
+				const size_t dst  = destinations[(keys[i] >> shift) & 0xFF]++;
+				sortedKeys[dst]	  = keys[i];
+				sortedValues[dst] = values[i];
+			}
+		});
+		std::swap(keys, sortedKeys);
+		std::swap(values, sortedValues);
+	}
+}
 
-		Node & node = _hierarchy[current.id];
-		node.box	= global;
+void Raycaster::updateHierarchy() {
 
-		// If the triangles count is low enough, we have a leaf.
-		if(count < 3) {
-			node.leaf  = true;
-			node.left  = begin;
-			node.right = count;
+	_width = _settings.width;
+	if(_width != 2 && _width != 4 && _width != 8) {
+		Log::Warning() << "[Raycaster] Unsupported node width " << _width << ", using 4 instead." << std::endl;
+		_width = 4;
+	}
+	_quantization = _settings.quantization;
+	if(_quantization != 0 && _quantization != 8 && _quantization != 16) {
+		Log::Warning() << "[Raycaster] Unsupported node quantization " << _quantization << " bits, using full precision instead." << std::endl;
+		_quantization = 0;
+	}
 
-		} else {
-			node.leaf		  = false;
-			size_t splitCount = 0;
-			// Pick the dimension along which the global bounding box is the largest.
-			const glm::vec3 boxSize = global.getSize();
-			const int axis			= (boxSize.x >= boxSize.y && boxSize.x >= boxSize.z) ? 0 : (boxSize.y >= boxSize.z ? 1 : 2);
-
-			if(count >= 5) {
-
-				// Compute the midpoint of all triangles centroids along the picked axis.
-				float abscisse = 0.0f;
-				for(size_t tid = 0; tid < count; ++tid) {
-					abscisse += _triangles[begin + tid].box.getCentroid()[axis];
-				}
-				abscisse /= float(count);
+	Query totalTimer, topLevelTimer;
+	totalTimer.begin();
+	BuildStats stats;
+	releaseGeometries();
 
-				// Split in two subnodes.
-				// Main criterion: split at the midpoint along the chosen axis.
-				const auto split = std::partition(_triangles.begin() + begin, _triangles.begin() + begin + count, [abscisse, axis](const TriangleInfos & t0) {
-					return t0.box.getCentroid()[axis] < abscisse;
-				});
-				splitCount		 = std::distance(_triangles.begin() + begin, split);
+	// Bottom level: one hierarchy per geometry, in mesh space. Only new geometries, or those built with other settings, are processed.
+	std::vector<size_t> geometryIds;
+	for(size_t gid = 0; gid < _geometries.size(); ++gid) {
+		Geometry & geometry = _geometries[gid];
+		if(geometry.builtHash == geometryHash(geometry)) {
+			continue;
+		}
+		if(geometry.shape == Shape::Mesh) {
+			geometryIds.push_back(gid);
+			continue;
+		}
+		// Analytic shapes are tested directly, a single leaf gives their bounds in the shape frame.
+		const float thickness = geometry.shape == Shape::Sphere ? 1.0f : 0.0f;
+		geometry.hierarchy.assign(1, Node());
+		geometry.hierarchy[0].box = BoundingBox(glm::vec3(-1.0f, -1.0f, -thickness), glm::vec3(1.0f, 1.0f, thickness));
+		geometry.cost	   = _settings.leafCost;
+		geometry.depth	   = 0;
+		geometry.builtHash = geometryHash(geometry);
+	}
+	size_t trianglesCount = 0;
+	std::vector<Build> builds(geometryIds.size());
+	for(size_t bid = 0; bid < builds.size(); ++bid) {
+		const Geometry & geometry = _geometries[geometryIds[bid]];
+		std::vector<Reference> & refs = builds[bid].refs;
+		refs.reserve(geometry.localIds.size());
+		// Triangles can have been duplicated by spatial splits in a previous construction, only add them once.
+		std::vector<bool> added(geometry.localIds.size(), false);
+		for(size_t tid = 0; tid < geometry.localIds.size(); ++tid) {
+			const uint32_t localId = geometry.localIds[tid];
+			if(localId == noTriangle || added[localId / 3]) {
+				continue;
 			}
+			added[localId / 3] = true;
+			glm::vec3 v0, v1, v2;
+			getTriangle(geometry, tid, v0, v1, v2);
+			refs.push_back({BoundingBox(v0, v1, v2), tid});
+		}
+		if(_settings.split == Split::SBVH) {
+			builds[bid].geometry = &geometry;
+		}
+		trianglesCount += refs.size();
+	}
+	const size_t instancesCount = size_t(std::count_if(_instances.begin(), _instances.end(), [](const Instance & instance) {
+		return !instance.removed;
+	}));
+	Log::Info() << "[Raycaster] Building hierarchy for " << trianglesCount << " triangles in " << builds.size() << " meshes (" << _geometries.size() - builds.size() << " kept), " << instancesCount << " instances... " << std::flush;
+	buildHierarchies(builds, stats);
 
-			// Fallback criterion: split in two equal size subsets.
-			// This can happen in case the primitive boxes overlap a lot,
-			// or in case of equal coordinates along the chosen axis.
-			if(splitCount == 0 || splitCount == count || count < 5) {
-				splitCount = count / 2;
-				std::nth_element(_triangles.begin() + begin, _triangles.begin() + begin + splitCount, _triangles.begin() + begin + count, [axis](const TriangleInfos & t0, const TriangleInfos & t1) {
-					return t0.box.getCentroid()[axis] < t1.box.getCentroid()[axis];
-				});
+	// Reorder triangles to match the leaves, in wide node order if the nodes are quantized.
+	size_t nodesCount = 0;
+	size_t refsCount  = 0;
+	for(size_t bid = 0; bid < builds.size(); ++bid) {
+		Geometry & geometry = _geometries[geometryIds[bid]];
+		const std::vector<Reference> & refs = builds[bid].refs;
+		refsCount += refs.size();
+		std::vector<uint32_t> order;
+		collapse(builds[bid].nodes, geometry.wide, order);
+		const size_t blocksCount = (refs.size() + blockSize - 1) / blockSize;
+		std::vector<TriangleBlock> triangles(blocksCount);
+		std::vector<uint32_t> localIds(blocksCount * blockSize, noTriangle);
+		for(size_t dstId = 0; dstId < localIds.size(); ++dstId) {
+			TriangleBlock & dst = triangles[dstId / blockSize];
+			const size_t dstBid = dstId % blockSize;
+			// Unused triangles are degenerate.
+			if(dstId >= refs.size()) {
+				for(int i = 0; i < 3; ++i) {
+					dst.v0[i][dstBid] = dst.e1[i][dstBid] = dst.e2[i][dstBid] = 0.0f;
+				}
+				continue;
+			}
+			const size_t srcId		  = refs[order.empty() ? dstId : order[dstId]].id;
+			const size_t srcBid		  = srcId % blockSize;
+			const TriangleBlock & src = geometry.triangles[srcId / blockSize];
+			for(int i = 0; i < 3; ++i) {
+				dst.v0[i][dstBid] = src.v0[i][srcBid];
+				dst.e1[i][dstBid] = src.e1[i][srcBid];
+				dst.e2[i][dstBid] = src.e2[i][srcBid];
 			}
+			localIds[dstId] = geometry.localIds[srcId];
+		}
+		std::swap(geometry.triangles, triangles);
+		std::swap(geometry.localIds, localIds);
+		std::swap(geometry.hierarchy, builds[bid].nodes);
+		nodesCount += geometry.hierarchy.size();
+		geometry.cost = cost(geometry.hierarchy, [this](const Node & leaf) {
+			return _settings.leafCost * float(leaf.right);
+		});
+		geometry.depth	   = depth(geometry.hierarchy);
+		geometry.builtHash = geometryHash(geometry);
+	}
+
+	// Top level: one hierarchy over all instances, in world space.
+	topLevelTimer.begin();
+	updateInstanceBoxes();
+	buildTopLevel();
+	updatePackets();
+	topLevelTimer.end();
+	totalTimer.end();
+
+	// Memory used by the triangles and hierarchies.
+	size_t wideMemory = _topLevelWide.size();
+	size_t memory	  = _topLevel.size() * sizeof(Node) + _instances.size() * sizeof(Instance);
+	for(const Geometry & geometry : _geometries) {
+		memory += geometry.triangles.size() * sizeof(TriangleBlock) + geometry.localIds.size() * sizeof(uint32_t);
+		memory += geometry.hierarchy.size() * sizeof(Node);
+		wideMemory += geometry.wide.size();
+	}
+	memory += wideMemory;
+
+	Log::Info() << "Done: " << nodesCount + _topLevel.size() << " nodes created, cost " << cost() << ", " << float(memory) / (1024.0f * 1024.0f) << "MB";
+	if(_settings.split == Split::SBVH) {
+		Log::Info() << ", " << refsCount - trianglesCount << " triangle references added by spatial splits";
+	}
+	Log::Info() << "." << std::endl;
+	if(_quantization != 0) {
+		// Compare to the same nodes stored with full precision boxes.
+		const size_t fullSize  = _width == 2 ? sizeof(WideNode<2>) : (_width == 8 ? sizeof(WideNode<8>) : sizeof(WideNode<4>));
+		const size_t size8	   = _width == 2 ? sizeof(QuantizedNode<2, uint8_t>) : (_width == 8 ? sizeof(QuantizedNode<8, uint8_t>) : sizeof(QuantizedNode<4, uint8_t>));
+		const size_t size16	   = _width == 2 ? sizeof(QuantizedNode<2, uint16_t>) : (_width == 8 ? sizeof(QuantizedNode<8, uint16_t>) : sizeof(QuantizedNode<4, uint16_t>));
+		const size_t nodeSize  = _quantization == 8 ? size8 : size16;
+		const float fullMemory = float(wideMemory / nodeSize * fullSize);
+		Log::Info() << "[Raycaster] Wide nodes quantized to " << _quantization << " bits: " << float(wideMemory) / (1024.0f * 1024.0f) << "MB instead of "
+					<< fullMemory / (1024.0f * 1024.0f) << "MB (" << nodeSize << " bytes per node instead of " << fullSize << ")." << std::endl;
+	}
+	Log::Info() << "[Raycaster] Build took " << float(totalTimer.value()) / 1000000000.0f << "s: "
+				<< "top levels " << float(stats.topLevels) / 1000000000.0f << "s (" << stats.topNodes << " nodes), "
+				<< "subtrees " << float(stats.subtrees) / 1000000000.0f << "s (" << stats.subtreeCount << " subtrees on " << stats.threads << " threads), "
+				<< "instances " << float(topLevelTimer.value()) / 1000000000.0f << "s." << std::endl;
+}
+
+/** Version of the hierarchy cache format, to increment when the stored data changes. */
+static const uint32_t cacheVersion = 2;
 
-			// Create the left and right sub-nodes.
-			// Can't use the currentNode reference anymore because of emplace_back.
-			// Left:
-			_hierarchy.emplace_back();
-			const size_t leftPos		= _hierarchy.size() - 1;
-			_hierarchy[current.id].left = leftPos;
-			remainingSets.push({leftPos, begin, splitCount});
-			// Right:
-			_hierarchy.emplace_back();
-			const size_t rightPos		 = _hierarchy.size() - 1;
-			_hierarchy[current.id].right = rightPos;
-			remainingSets.push({rightPos, begin + splitCount, count - splitCount});
+/** Identifier at the start of hierarchy cache files. */
+static const char cacheMagic[8] = {'R', 'D', 'B', 'V', 'H', 'C', 'H', 'E'};
+
+/** \brief Header of a hierarchy cache file, followed by the payload. */
+struct CacheHeader {
+	char magic[8];		   ///< File identifier.
+	uint32_t version;	   ///< Format version.
+	uint32_t width;		   ///< Width of the wide hierarchies.
+	uint32_t quantization; ///< Number of bits of the wide hierarchies children boxes, or zero if stored as floats.
+	uint32_t padding;	   ///< Unused.
+	uint64_t contentHash;  ///< Hash of the geometries, instances and settings the hierarchy was built from.
+	uint64_t payloadHash;  ///< Hash of the payload, to detect corrupted files.
+	uint64_t payloadSize;  ///< Size of the payload in bytes.
+};
+
+/** Append a value to a cache payload.
+ \param payload the payload
+ \param value the value to append
+ */
+template<typename T>
+static void writeCache(std::vector<char> & payload, const T & value) {
+	const char * bytes = reinterpret_cast<const char *>(&value);
+	payload.insert(payload.end(), bytes, bytes + sizeof(T));
+}
+
+/** Append an array of values to a cache payload, preceded by its size.
+ \param payload the payload
+ \param values the values to append
+ */
+template<typename T>
+static void writeCache(std::vector<char> & payload, const std::vector<T> & values) {
+	writeCache(payload, uint64_t(values.size()));
+	const char * bytes = reinterpret_cast<const char *>(values.data());
+	payload.insert(payload.end(), bytes, bytes + values.size() * sizeof(T));
+}
+
+/** \brief Sequential reader over a cache payload, checking that reads stay in bounds. */
+struct CacheReader {
+	const char * data; ///< The payload.
+	size_t size;	   ///< The payload size in bytes.
+	size_t offset;	   ///< Current position in the payload.
+
+	/** Read a value.
+	 \param value will contain the value
+	 \return true if the payload was large enough
+	 */
+	template<typename T>
+	bool read(T & value) {
+		if(size - offset < sizeof(T)) {
+			return false;
+		}
+		std::memcpy(&value, data + offset, sizeof(T));
+		offset += sizeof(T);
+		return true;
+	}
+
+	/** Read an array of values, preceded by its size.
+	 \param values will contain the values
+	 \return true if the payload was large enough
+	 */
+	template<typename T>
+	bool read(std::vector<T> & values) {
+		uint64_t count = 0;
+		if(!read(count) || count > (size - offset) / sizeof(T)) {
+			return false;
 		}
+		values.resize(size_t(count));
+		std::memcpy(values.data(), data + offset, size_t(count) * sizeof(T));
+		offset += size_t(count) * sizeof(T);
+		return true;
+	}
+};
+
+bool Raycaster::updateHierarchy(const std::string & cachePath) {
+	releaseGeometries();
+	const uint64_t hash = contentHash();
+	Query timer;
+	timer.begin();
+	if(loadHierarchy(cachePath, hash)) {
+		timer.end();
+		Log::Info() << "[Raycaster] Hierarchy loaded from \"" << cachePath << "\" in " << float(timer.value()) / 1000000000.0f << "s, cost " << cost() << "." << std::endl;
+		return true;
 	}
-	Log::Info() << "Done: " << _hierarchy.size() << " nodes created." << std::endl;
+	updateHierarchy();
+	saveHierarchy(cachePath, hash);
+	return false;
 }
 
-Raycaster::Hit Raycaster::intersects(const glm::vec3 & origin, const glm::vec3 & direction, float mini, float maxi) const {
-	const Ray ray(origin, direction);
+uint64_t Raycaster::contentHash() const {
+	// Layout of the stored data.
+	const uint64_t sizes[] = {sizeof(size_t), sizeof(TriangleBlock), sizeof(Node), sizeof(WideNode<2>), sizeof(WideNode<4>), sizeof(WideNode<8>), sizeof(QuantizedNode<4, uint8_t>), sizeof(QuantizedNode<4, uint16_t>), maxDepth};
+	uint64_t hash = hashBytes(&cacheVersion, sizeof(cacheVersion));
+	hash = hashBytes(sizes, sizeof(sizes), hash);
+	hash = hashSettings(_settings, hash);
+	// Geometries and instances.
+	for(const Geometry & geometry : _geometries) {
+		hash = hashBytes(&geometry.hash, sizeof(geometry.hash), hash);
+	}
+	for(const Instance & instance : _instances) {
+		hash = hashBytes(&instance.removed, sizeof(instance.removed), hash);
+		if(instance.removed) {
+			continue;
+		}
+		hash = hashBytes(&instance.geometry, sizeof(instance.geometry), hash);
+		hash = hashBytes(&instance.model[0][0], sizeof(glm::mat4), hash);
+	}
+	return hash;
+}
+
+uint64_t Raycaster::geometryHash(const Geometry & geometry) const {
+	return hashSettings(_settings, geometry.hash);
+}
+
+bool Raycaster::loadHierarchy(const std::string & path, uint64_t hash) {
+	size_t size		  = 0;
+	const char * file = System::mapFile(path, size);
+	if(file == nullptr) {
+		return false;
+	}
+
+	CacheHeader header;
+	bool valid = size >= sizeof(CacheHeader);
+	if(valid) {
+		std::memcpy(&header, file, sizeof(CacheHeader));
+		valid = std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) == 0 && header.version == cacheVersion;
+	}
+	if(!valid) {
+		Log::Warning() << "[Raycaster] Cache \"" << path << "\" is not a valid hierarchy cache, rebuilding." << std::endl;
+		System::unmapFile(file, size);
+		return false;
+	}
+	if(header.contentHash != hash) {
+		Log::Info() << "[Raycaster] Cache \"" << path << "\" is outdated, rebuilding." << std::endl;
+		System::unmapFile(file, size);
+		return false;
+	}
+
+	CacheReader reader = {file + sizeof(CacheHeader), size - sizeof(CacheHeader), 0};
+	valid = header.payloadSize == reader.size && hashBytes(reader.data, reader.size) == header.payloadHash;
+
+	// Read everything in temporary storage first, so that a failure leaves the raycaster untouched.
+	std::vector<Geometry> geometries(_geometries.size());
+	std::vector<Node> topLevel;
+	WideHierarchy topLevelWide;
+	std::vector<size_t> instanceIds;
+	float builtCost		 = 0.0f;
+	uint64_t topDepth	 = 0;
+	uint64_t geometryCount = 0;
+	auto readWide = [&reader](WideHierarchy & wide) {
+		return reader.read(wide.nodes2) && reader.read(wide.nodes4) && reader.read(wide.nodes8)
+			   && reader.read(wide.nodes2q8) && reader.read(wide.nodes4q8) && reader.read(wide.nodes8q8)
+			   && reader.read(wide.nodes2q16) && reader.read(wide.nodes4q16) && reader.read(wide.nodes8q16);
+	};
+	valid = valid && reader.read(geometryCount) && geometryCount == geometries.size();
+	for(size_t gid = 0; valid && gid < geometries.size(); ++gid) {
+		Geometry & geometry = geometries[gid];
+		uint64_t depth		= 0;
+		valid = reader.read(geometry.triangles) && reader.read(geometry.localIds) && reader.read(geometry.hierarchy);
+		valid = valid && readWide(geometry.wide);
+		valid = valid && reader.read(geometry.cost) && reader.read(depth) && !geometry.hierarchy.empty();
+		geometry.depth		   = size_t(depth);
+		geometry.hash		   = _geometries[gid].hash;
+		geometry.shape		   = _geometries[gid].shape;
+		geometry.builtHash	   = geometryHash(geometry);
+		geometry.instanceCount = _geometries[gid].instanceCount;
+	}
+	valid = valid && reader.read(topLevel) && readWide(topLevelWide);
+	valid = valid && reader.read(instanceIds) && reader.read(builtCost) && reader.read(topDepth);
+	const size_t instanceCount = size_t(std::count_if(_instances.begin(), _instances.end(), [](const Instance & instance) {
+		return !instance.removed;
+	}));
+	valid = valid && reader.offset == reader.size && instanceIds.size() == instanceCount;
+	System::unmapFile(file, size);
+
+	if(!valid) {
+		Log::Warning() << "[Raycaster] Cache \"" << path << "\" is corrupted, rebuilding." << std::endl;
+		return false;
+	}
+
+	std::swap(_geometries, geometries);
+	std::swap(_topLevel, topLevel);
+	std::swap(_topLevelWide, topLevelWide);
+	std::swap(_instanceIds, instanceIds);
+	_builtCost	   = builtCost;
+	_topLevelDepth = size_t(topDepth);
+	_width		   = header.width;
+	_quantization  = header.quantization;
+	updateInstanceBoxes();
+	updatePackets();
+	return true;
+}
+
+void Raycaster::saveHierarchy(const std::string & path, uint64_t hash) const {
+	std::vector<char> payload;
+	auto writeWide = [&payload](const WideHierarchy & wide) {
+		writeCache(payload, wide.nodes2);
+		writeCache(payload, wide.nodes4);
+		writeCache(payload, wide.nodes8);
+		writeCache(payload, wide.nodes2q8);
+		writeCache(payload, wide.nodes4q8);
+		writeCache(payload, wide.nodes8q8);
+		writeCache(payload, wide.nodes2q16);
+		writeCache(payload, wide.nodes4q16);
+		writeCache(payload, wide.nodes8q16);
+	};
+	writeCache(payload, uint64_t(_geometries.size()));
+	for(const Geometry & geometry : _geometries) {
+		writeCache(payload, geometry.triangles);
+		writeCache(payload, geometry.localIds);
+		writeCache(payload, geometry.hierarchy);
+		writeWide(geometry.wide);
+		writeCache(payload, geometry.cost);
+		writeCache(payload, uint64_t(geometry.depth));
+	}
+	writeCache(payload, _topLevel);
+	writeWide(_topLevelWide);
+	writeCache(payload, _instanceIds);
+	writeCache(payload, _builtCost);
+	writeCache(payload, uint64_t(_topLevelDepth));
+
+	CacheHeader header;
+	std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+	header.version		= cacheVersion;
+	header.width		= _width;
+	header.quantization = _quantization;
+	header.padding		= 0;
+	header.contentHash	= hash;
+	header.payloadHash	= hashBytes(payload.data(), payload.size());
+	header.payloadSize	= payload.size();
+
+	std::ofstream file(System::widen(path), std::ios::binary);
+	if(!file.is_open()) {
+		Log::Error() << "[Raycaster] Unable to save hierarchy cache to \"" << path << "\"." << std::endl;
+		return;
+	}
+	file.write(reinterpret_cast<const char *>(&header), sizeof(CacheHeader));
+	file.write(payload.data(), payload.size());
+	file.close();
+	Log::Info() << "[Raycaster] Hierarchy saved to \"" << path << "\", " << float(sizeof(CacheHeader) + payload.size()) / (1024.0f * 1024.0f) << "MB." << std::endl;
+}
 
-	std::stack<size_t> nodesToTest;
-	// Start by testing each object.
-	for(size_t nid = 0; nid < _meshCount; ++nid) {
-		// If the ray doesn't intersect the bounding box, move to the next node.
-		if(!Intersection::box(ray, _hierarchy[nid].box, mini, maxi)) {
+void Raycaster::updateInstanceBoxes() {
+	for(Instance & instance : _instances) {
+		// Removed instances and geometries not built yet are not part of the top level.
+		if(instance.removed || _geometries[instance.geometry].hierarchy.empty()) {
+			instance.box = BoundingBox();
 			continue;
 		}
-		nodesToTest.push(nid);
+		const BoundingBox & meshBox = _geometries[instance.geometry].hierarchy[0].box;
+		instance.box = (instance.identity || meshBox.empty()) ? meshBox : meshBox.transformed(instance.model);
 	}
+}
 
-	Hit bestHit;
-	while(!nodesToTest.empty()) {
-		const Node & node = _hierarchy[nodesToTest.top()];
-		nodesToTest.pop();
+void Raycaster::buildTopLevel() {
+	std::vector<Build> topBuild(1);
+	std::vector<Reference> & instanceRefs = topBuild[0].refs;
+	instanceRefs.reserve(_instances.size());
+	for(size_t iid = 0; iid < _instances.size(); ++iid) {
+		if(!_instances[iid].removed) {
+			instanceRefs.push_back({_instances[iid].box, iid});
+		}
+	}
+	BuildStats topStats;
+	buildHierarchies(topBuild, topStats);
+	_instanceIds.resize(instanceRefs.size());
+	for(size_t iid = 0; iid < instanceRefs.size(); ++iid) {
+		_instanceIds[iid] = instanceRefs[iid].id;
+	}
+	std::swap(_topLevel, topBuild[0].nodes);
+	_topLevelDepth = depth(_topLevel);
+	collapseTopLevel();
+	_builtCost = cost();
+}
 
-		// If the node is a leaf, test all included triangles.
+void Raycaster::collapseTopLevel() {
+	std::vector<uint32_t> order;
+	collapse(_topLevel, _topLevelWide, order);
+	if(order.empty()) {
+		return;
+	}
+	std::vector<size_t> instanceIds(order.size());
+	for(size_t iid = 0; iid < order.size(); ++iid) {
+		instanceIds[iid] = _instanceIds[order[iid]];
+	}
+	std::swap(_instanceIds, instanceIds);
+}
+
+size_t Raycaster::depth(const std::vector<Node> & nodes) {
+	// Children are always stored after their parent.
+	std::vector<size_t> depths(nodes.size(), 0);
+	size_t maxDepth = 0;
+	for(size_t nid = 0; nid < nodes.size(); ++nid) {
+		const Node & node = nodes[nid];
 		if(node.leaf) {
-			for(size_t tid = 0; tid < node.right; ++tid) {
-				const auto & tri = _triangles[node.left + tid];
-				const Hit hit = intersects(ray, tri, mini, maxi);
-				// We found a valid hit.
-				if(hit.hit && hit.dist < bestHit.dist) {
-					bestHit = hit;
-					maxi	= bestHit.dist;
+			maxDepth = std::max(maxDepth, depths[nid]);
+		} else {
+			depths[node.left]  = depths[nid] + 1;
+			depths[node.right] = depths[nid] + 1;
+		}
+	}
+	return maxDepth;
+}
+
+template<size_t W>
+void Raycaster::collapse(const std::vector<Node> & nodes, std::vector<WideNode<W>> & wide) {
+	wide.clear();
+	if(nodes.empty()) {
+		return;
+	}
+	// Each wide node is associated to a binary node whose descendants will become its children.
+	std::stack<std::pair<size_t, size_t>> nodesToCollapse;
+	wide.emplace_back();
+	nodesToCollapse.push(std::make_pair(size_t(0), size_t(0)));
+
+	while(!nodesToCollapse.empty()) {
+		const size_t nodeId = nodesToCollapse.top().first;
+		const size_t wideId = nodesToCollapse.top().second;
+		nodesToCollapse.pop();
+
+		// Open the internal child with the largest area until we reach the maximum number of children.
+		std::vector<size_t> children;
+		if(nodes[nodeId].leaf) {
+			children.push_back(nodeId);
+		} else {
+			children = {nodes[nodeId].left, nodes[nodeId].right};
+		}
+		while(children.size() < W) {
+			size_t bestChild = children.size();
+			float bestArea	 = -1.0f;
+			for(size_t cid = 0; cid < children.size(); ++cid) {
+				const Node & child = nodes[children[cid]];
+				const float area = child.box.getSurfaceArea();
+				if(!child.leaf && area > bestArea) {
+					bestChild = cid;
+					bestArea  = area;
 				}
 			}
-			// Move to the next node.
-			continue;
+			if(bestChild == children.size()) {
+				break;
+			}
+			const Node & opened	 = nodes[children[bestChild]];
+			children[bestChild] = opened.left;
+			children.push_back(opened.right);
 		}
-		// Else, intersect both child nodes.
-		if(Intersection::box(ray, _hierarchy[node.left].box, mini, maxi)) {
-			nodesToTest.push(node.left);
+
+		// Fill the wide node, creating new nodes for internal children.
+		uint32_t count = 0;
+		for(const size_t childId : children) {
+			const Node & child = nodes[childId];
+			// Skip empty leaves.
+			if(child.leaf && child.right == 0) {
+				continue;
+			}
+			uint32_t childIndex = uint32_t(child.left);
+			if(!child.leaf) {
+				childIndex = uint32_t(wide.size());
+				wide.emplace_back();
+				nodesToCollapse.push(std::make_pair(childId, wide.size() - 1));
+			}
+			WideNode<W> & node = wide[wideId];
+			for(int i = 0; i < 3; ++i) {
+				node.minis[i][count] = child.box.minis[i];
+				node.maxis[i][count] = child.box.maxis[i];
+			}
+			node.children[count] = childIndex;
+			node.counts[count]	 = child.leaf ? uint32_t(child.right) : 0u;
+			++count;
 		}
-		if(Intersection::box(ray, _hierarchy[node.right].box, mini, maxi)) {
-			nodesToTest.push(node.right);
+		// Unused children are ignored during traversal.
+		WideNode<W> & node = wide[wideId];
+		for(uint32_t cid = count; cid < W; ++cid) {
+			for(int i = 0; i < 3; ++i) {
+				node.minis[i][cid] = 0.0f;
+				node.maxis[i][cid] = 0.0f;
+			}
+			node.children[cid] = 0;
+			node.counts[cid]   = 0;
 		}
+		node.count = count;
 	}
-	return bestHit;
+	wide.shrink_to_fit();
 }
 
-bool Raycaster::intersectsAny(const glm::vec3 & origin, const glm::vec3 & direction, float mini, float maxi) const {
-	const Ray ray(origin, direction);
+/** Compute the size of a quantization grid cell from its exponent, without rounding.
+ \param exponent the power of two of the size, between -126 and 127
+ \return the cell size
+ */
+static inline float cellSize(int exponent) {
+	const uint32_t bits = uint32_t(exponent + 127) << 23;
+	float size;
+	std::memcpy(&size, &bits, sizeof(float));
+	return size;
+}
 
-	std::stack<size_t> nodesToTest;
-	// Start by testing each object.
-	for(size_t nid = 0; nid < _meshCount; ++nid) {
-		// If the ray doesn't intersect the bounding box, move to the next node.
-		if(!Intersection::box(ray, _hierarchy[nid].box, mini, maxi)) {
-			continue;
+#if defined(__SSE2__) || defined(_M_X64)
+/** Load four 8 bits grid coordinates as floats.
+ \param coords the coordinates
+ \return the converted coordinates
+ */
+static inline __m128 loadCoords(const uint8_t * coords) {
+	int32_t bytes;
+	std::memcpy(&bytes, coords, sizeof(int32_t));
+	const __m128i zero = _mm_setzero_si128();
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero));
+}
+
+/** Load four 16 bits grid coordinates as floats.
+ \param coords the coordinates
+ \return the converted coordinates
+ */
+static inline __m128 loadCoords(const uint16_t * coords) {
+	const __m128i shorts = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(coords));
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(shorts, _mm_setzero_si128()));
+}
+#endif
+
+size_t Raycaster::WideHierarchy::size() const {
+	size_t size = nodes2.size() * sizeof(WideNode<2>) + nodes4.size() * sizeof(WideNode<4>) + nodes8.size() * sizeof(WideNode<8>);
+	size += nodes2q8.size() * sizeof(QuantizedNode<2, uint8_t>) + nodes4q8.size() * sizeof(QuantizedNode<4, uint8_t>) + nodes8q8.size() * sizeof(QuantizedNode<8, uint8_t>);
+	size += nodes2q16.size() * sizeof(QuantizedNode<2, uint16_t>) + nodes4q16.size() * sizeof(QuantizedNode<4, uint16_t>) + nodes8q16.size() * sizeof(QuantizedNode<8, uint16_t>);
+	return size;
+}
+
+template<size_t W, typename T>
+void Raycaster::quantize(const std::vector<WideNode<W>> & wide, std::vector<QuantizedNode<W, T>> & quantized, std::vector<uint32_t> & order) {
+	quantized.clear();
+	order.clear();
+	if(wide.empty()) {
+		return;
+	}
+	const uint32_t maxCoord = std::numeric_limits<T>::max();
+	const uint32_t maxCount = std::numeric_limits<uint8_t>::max();
+
+	// Each quantized node is created from a wide node, or from a leaf with too many primitives to be stored in a single child.
+	// Nodes are created in the order they are listed, internal children of a node being listed together.
+	const uint32_t splitLeaf = std::numeric_limits<uint32_t>::max();
+	struct Source {
+		uint32_t node;	 ///< Index of the wide node, or splitLeaf.
+		uint32_t first;	 ///< Index of the first primitive of the split leaf, in the new order.
+		uint32_t count;	 ///< Number of primitives of the split leaf.
+		BoundingBox box; ///< Bounding box of the split leaf.
+	};
+	std::vector<Source> sources;
+	sources.push_back({0, 0, 0, BoundingBox()});
+
+	for(size_t qid = 0; qid < sources.size(); ++qid) {
+		const Source source = sources[qid];
+		// Gather the children boxes, their kind and the primitives of leaves.
+		BoundingBox boxes[W];
+		uint32_t firsts[W];
+		uint32_t counts[W];
+		bool internals[W];
+		uint32_t count = 0;
+		if(source.node != splitLeaf) {
+			const WideNode<W> & node = wide[source.node];
+			count					 = node.count;
+			// Allocate the primitives of leaves stored in the node first, so that they are consecutive.
+			for(int pass = 0; pass < 2; ++pass) {
+				for(uint32_t cid = 0; cid < count; ++cid) {
+					const bool large = node.counts[cid] > maxCount;
+					if(node.counts[cid] == 0 || large != (pass == 1)) {
+						continue;
+					}
+					firsts[cid] = uint32_t(order.size());
+					for(uint32_t pid = 0; pid < node.counts[cid]; ++pid) {
+						order.push_back(node.children[cid] + pid);
+					}
+				}
+			}
+			for(uint32_t cid = 0; cid < count; ++cid) {
+				boxes[cid]	   = BoundingBox(glm::vec3(node.minis[0][cid], node.minis[1][cid], node.minis[2][cid]), glm::vec3(node.maxis[0][cid], node.maxis[1][cid], node.maxis[2][cid]));
+				counts[cid]	   = node.counts[cid];
+				internals[cid] = node.counts[cid] == 0 || node.counts[cid] > maxCount;
+				if(node.counts[cid] == 0) {
+					firsts[cid] = node.children[cid];
+				}
+			}
+		} else {
+			// Split the leaf in children of the maximum size, the remaining primitives are stored in another split leaf if needed.
+			const bool fits = source.count <= W * maxCount;
+			uint32_t first	= source.first;
+			for(; count < W && first < source.first + source.count; ++count) {
+				const bool last = !fits && count == W - 1;
+				boxes[count]	 = source.box;
+				firsts[count]	 = first;
+				counts[count]	 = last ? source.first + source.count - first : std::min(maxCount, source.first + source.count - first);
+				internals[count] = last;
+				first += counts[count];
+			}
+		}
+
+		// Quantize on a grid covering the node box, with power of two cells so that decoding only rounds once.
+		QuantizedNode<W, T> node;
+		std::memset(&node, 0, sizeof(QuantizedNode<W, T>));
+		BoundingBox nodeBox;
+		for(uint32_t cid = 0; cid < count; ++cid) {
+			nodeBox.merge(boxes[cid]);
+		}
+		for(int i = 0; i < 3; ++i) {
+			const float origin = nodeBox.minis[i];
+			const float extent = nodeBox.maxis[i] - origin;
+			int exponent	   = -126;
+			if(extent > 0.0f) {
+				std::frexp(extent / float(maxCoord), &exponent);
+				exponent = std::max(exponent, -126);
+			}
+			while(exponent < 127 && origin + float(maxCoord) * cellSize(exponent) < nodeBox.maxis[i]) {
+				++exponent;
+			}
+			const float size  = cellSize(exponent);
+			node.origin[i]	  = origin;
+			node.exponents[i] = int8_t(exponent);
+			// Round outwards, checking the decoded values.
+			for(uint32_t cid = 0; cid < count; ++cid) {
+				const float mini = boxes[cid].minis[i];
+				const float maxi = boxes[cid].maxis[i];
+				uint32_t qmin	 = uint32_t(glm::clamp(std::floor((mini - origin) / size), 0.0f, float(maxCoord)));
+				uint32_t qmax	 = uint32_t(glm::clamp(std::ceil((maxi - origin) / size), 0.0f, float(maxCoord)));
+				while(qmin > 0 && origin + float(qmin) * size > mini) {
+					--qmin;
+				}
+				while(qmax < maxCoord && origin + float(qmax) * size < maxi) {
+					++qmax;
+				}
+				node.minis[i][cid] = T(qmin);
+				node.maxis[i][cid] = T(qmax);
+			}
+		}
+
+		// Internal children are created together, leaf primitives have been allocated above.
+		node.count		= uint8_t(count);
+		node.children	= uint32_t(sources.size());
+		node.primitives = 0;
+		bool firstLeaf	= true;
+		for(uint32_t cid = 0; cid < count; ++cid) {
+			if(internals[cid]) {
+				const bool split = source.node == splitLeaf || counts[cid] != 0;
+				sources.push_back({split ? splitLeaf : firsts[cid], firsts[cid], counts[cid], boxes[cid]});
+				continue;
+			}
+			node.counts[cid] = uint8_t(counts[cid]);
+			if(firstLeaf) {
+				node.primitives = firsts[cid];
+				firstLeaf		= false;
+			}
 		}
-		nodesToTest.push(nid);
+		quantized.push_back(node);
+	}
+	quantized.shrink_to_fit();
+}
+
+void Raycaster::quantize(const WideHierarchy & wide, WideHierarchy & quantized, std::vector<uint32_t> & order) const {
+	if(_width == 2) {
+		_quantization == 8 ? quantize(wide.nodes2, quantized.nodes2q8, order) : quantize(wide.nodes2, quantized.nodes2q16, order);
+	} else if(_width == 8) {
+		_quantization == 8 ? quantize(wide.nodes8, quantized.nodes8q8, order) : quantize(wide.nodes8, quantized.nodes8q16, order);
+	} else {
+		_quantization == 8 ? quantize(wide.nodes4, quantized.nodes4q8, order) : quantize(wide.nodes4, quantized.nodes4q16, order);
 	}
+}
 
-	while(!nodesToTest.empty()) {
-		const Node & node = _hierarchy[nodesToTest.top()];
-		nodesToTest.pop();
+void Raycaster::collapse(std::vector<Node> & nodes, WideHierarchy & wide, std::vector<uint32_t> & order) const {
+	wide = WideHierarchy();
+	order.clear();
+	WideHierarchy collapsed;
+	WideHierarchy & target = _quantization == 0 ? wide : collapsed;
+	if(_width == 2) {
+		collapse(nodes, target.nodes2);
+	} else if(_width == 8) {
+		collapse(nodes, target.nodes8);
+	} else {
+		collapse(nodes, target.nodes4);
+	}
+	if(_quantization == 0) {
+		return;
+	}
+	quantize(collapsed, wide, order);
 
-		// If the node is a leaf, test all included triangles.
+	// Update the binary leaves, their primitives are still consecutive.
+	std::vector<uint32_t> positions(order.size() + 1, 0);
+	for(size_t pid = 0; pid < order.size(); ++pid) {
+		positions[order[pid]] = uint32_t(pid);
+	}
+	for(Node & node : nodes) {
 		if(node.leaf) {
-			for(size_t tid = 0; tid < node.right; ++tid) {
-				const auto & tri = _triangles[node.left + tid];
-				if(intersects(ray, tri, mini, maxi).hit) {
-					return true;
-				}
+			node.left = node.right == 0 ? 0 : positions[node.left];
+		}
+	}
+}
+
+template<size_t W>
+int Raycaster::intersectsBoxes(const Ray & ray, const float minis[3][W], const float maxis[3][W], uint32_t count, float mini, float maxi, float nears[W]) {
+	int mask = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+	// Test four children at once.
+	if(W % 4 == 0) {
+		const __m128 pos[3]	   = {_mm_set1_ps(ray.pos[0]), _mm_set1_ps(ray.pos[1]), _mm_set1_ps(ray.pos[2])};
+		const __m128 invdir[3] = {_mm_set1_ps(ray.invdir[0]), _mm_set1_ps(ray.invdir[1]), _mm_set1_ps(ray.invdir[2])};
+		for(size_t cid = 0; cid < W; cid += 4) {
+			__m128 closest	= _mm_set1_ps(mini);
+			__m128 furthest = _mm_set1_ps(maxi);
+			for(int i = 0; i < 3; ++i) {
+				const __m128 minRatio = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(minis[i] + cid), pos[i]), invdir[i]);
+				const __m128 maxRatio = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(maxis[i] + cid), pos[i]), invdir[i]);
+				closest	 = _mm_max_ps(closest, _mm_min_ps(minRatio, maxRatio));
+				furthest = _mm_min_ps(furthest, _mm_max_ps(minRatio, maxRatio));
+			}
+			_mm_storeu_ps(nears + cid, closest);
+			mask |= _mm_movemask_ps(_mm_cmple_ps(closest, furthest)) << cid;
+		}
+		return mask & ((1 << count) - 1);
+	}
+#endif
+	for(size_t cid = 0; cid < count; ++cid) {
+		float closest  = mini;
+		float furthest = maxi;
+		for(int i = 0; i < 3; ++i) {
+			const float minRatio = (minis[i][cid] - ray.pos[i]) * ray.invdir[i];
+			const float maxRatio = (maxis[i][cid] - ray.pos[i]) * ray.invdir[i];
+			closest	 = std::max(closest, std::min(minRatio, maxRatio));
+			furthest = std::min(furthest, std::max(minRatio, maxRatio));
+		}
+		nears[cid] = closest;
+		mask |= (closest <= furthest ? 1 : 0) << cid;
+	}
+	return mask;
+}
+
+template<size_t W>
+int Raycaster::intersectsChildren(const Ray & ray, const WideNode<W> & node, float mini, float maxi, float nears[W], const Inflation * inflation) {
+	if(inflation == nullptr) {
+		return intersectsBoxes<W>(ray, node.minis, node.maxis, node.count, mini, maxi, nears);
+	}
+	alignas(16) float minis[3][W];
+	alignas(16) float maxis[3][W];
+	for(int i = 0; i < 3; ++i) {
+		for(size_t cid = 0; cid < W; ++cid) {
+			minis[i][cid] = node.minis[i][cid] - inflation->lower[i];
+			maxis[i][cid] = node.maxis[i][cid] + inflation->upper[i];
+		}
+	}
+	return intersectsBoxes<W>(ray, minis, maxis, node.count, mini, maxi, nears);
+}
+
+template<size_t W, typename T>
+void Raycaster::decodeChildren(const QuantizedNode<W, T> & node, float minis[3][W], float maxis[3][W]) {
+	// Decode the same way the boxes were checked to be conservative.
+	for(int i = 0; i < 3; ++i) {
+		const float size = cellSize(node.exponents[i]);
+#if defined(__SSE2__) || defined(_M_X64)
+		// Decode four children at once.
+		if(W % 4 == 0) {
+			const __m128 origin = _mm_set1_ps(node.origin[i]);
+			const __m128 sizes	= _mm_set1_ps(size);
+			for(size_t cid = 0; cid < W; cid += 4) {
+				_mm_store_ps(minis[i] + cid, _mm_add_ps(origin, _mm_mul_ps(loadCoords(node.minis[i] + cid), sizes)));
+				_mm_store_ps(maxis[i] + cid, _mm_add_ps(origin, _mm_mul_ps(loadCoords(node.maxis[i] + cid), sizes)));
 			}
-			// No intersection move to the next node.
 			continue;
 		}
-		// Check if any of the children is hit.
-		if(Intersection::box(ray, _hierarchy[node.left].box, mini, maxi)) {
-			nodesToTest.push(node.left);
+#endif
+		for(size_t cid = 0; cid < W; ++cid) {
+			minis[i][cid] = node.origin[i] + float(node.minis[i][cid]) * size;
+			maxis[i][cid] = node.origin[i] + float(node.maxis[i][cid]) * size;
+		}
+	}
+}
+
+template<size_t W, typename T>
+int Raycaster::intersectsChildren(const Ray & ray, const QuantizedNode<W, T> & node, float mini, float maxi, float nears[W], const Inflation * inflation) {
+	alignas(16) float minis[3][W];
+	alignas(16) float maxis[3][W];
+	decodeChildren(node, minis, maxis);
+	if(inflation != nullptr) {
+		for(int i = 0; i < 3; ++i) {
+			for(size_t cid = 0; cid < W; ++cid) {
+				minis[i][cid] -= inflation->lower[i];
+				maxis[i][cid] += inflation->upper[i];
+			}
+		}
+	}
+	return intersectsBoxes<W>(ray, minis, maxis, node.count, mini, maxi, nears);
+}
+
+template<size_t W>
+int Raycaster::distanceBoxes(const glm::vec3 & point, const float minis[3][W], const float maxis[3][W], uint32_t count, float maxi, float dists[W]) {
+	int mask = 0;
+	const float maxi2 = maxi * maxi;
+#if defined(__SSE2__) || defined(_M_X64)
+	// Test four children at once.
+	if(W % 4 == 0) {
+		const __m128 pos[3] = {_mm_set1_ps(point[0]), _mm_set1_ps(point[1]), _mm_set1_ps(point[2])};
+		const __m128 zero	= _mm_setzero_ps();
+		for(size_t cid = 0; cid < W; cid += 4) {
+			__m128 dist2 = zero;
+			for(int i = 0; i < 3; ++i) {
+				const __m128 below = _mm_sub_ps(_mm_load_ps(minis[i] + cid), pos[i]);
+				const __m128 above = _mm_sub_ps(pos[i], _mm_load_ps(maxis[i] + cid));
+				const __m128 delta = _mm_max_ps(_mm_max_ps(below, above), zero);
+				dist2 = _mm_add_ps(dist2, _mm_mul_ps(delta, delta));
+			}
+			_mm_storeu_ps(dists + cid, dist2);
+			mask |= _mm_movemask_ps(_mm_cmple_ps(dist2, _mm_set1_ps(maxi2))) << cid;
 		}
-		if(Intersection::box(ray, _hierarchy[node.right].box, mini, maxi)) {
-			nodesToTest.push(node.right);
+		return mask & ((1 << count) - 1);
+	}
+#endif
+	for(size_t cid = 0; cid < count; ++cid) {
+		float dist2 = 0.0f;
+		for(int i = 0; i < 3; ++i) {
+			const float delta = std::max(std::max(minis[i][cid] - point[i], point[i] - maxis[i][cid]), 0.0f);
+			dist2 += delta * delta;
 		}
+		dists[cid] = dist2;
+		mask |= (dist2 <= maxi2 ? 1 : 0) << cid;
 	}
-	return false;
+	return mask;
 }
 
-bool Raycaster::visible(const glm::vec3 & p0, const glm::vec3 & p1) const {
-	const glm::vec3 direction = p1 - p0;
-	const float maxi		  = glm::length(direction);
-	return !intersectsAny(p0, direction, 0.0001f, maxi);
+template<size_t W>
+int Raycaster::distanceChildren(const glm::vec3 & point, const WideNode<W> & node, float maxi, float dists[W]) {
+	return distanceBoxes<W>(point, node.minis, node.maxis, node.count, maxi, dists);
 }
 
-Raycaster::Hit Raycaster::intersects(const Ray & ray, const TriangleInfos & tri, float mini, float maxi) const {
-	// Implement Moller-Trumbore intersection test.
-	const glm::vec3 & v0 = _vertices[tri.v0];
-	const glm::vec3 v01  = _vertices[tri.v1] - v0;
-	const glm::vec3 v02  = _vertices[tri.v2] - v0;
-	const glm::vec3 p	= glm::cross(ray.dir, v02);
-	const float det		 = glm::dot(v01, p);
+template<size_t W, typename T>
+int Raycaster::distanceChildren(const glm::vec3 & point, const QuantizedNode<W, T> & node, float maxi, float dists[W]) {
+	alignas(16) float minis[3][W];
+	alignas(16) float maxis[3][W];
+	decodeChildren(node, minis, maxis);
+	return distanceBoxes<W>(point, minis, maxis, node.count, maxi, dists);
+}
+
+template<size_t W>
+uint32_t Raycaster::childIndex(const WideNode<W> & node, uint32_t cid) {
+	return node.children[cid];
+}
 
-	if(std::abs(det) < std::numeric_limits<float>::epsilon()) {
-		return {};
+template<size_t W, typename T>
+uint32_t Raycaster::childIndex(const QuantizedNode<W, T> & node, uint32_t cid) {
+	// Skip the internal children or leaf primitives stored before this child.
+	const bool leaf = node.counts[cid] != 0;
+	uint32_t index	= leaf ? node.primitives : node.children;
+	for(uint32_t pid = 0; pid < cid; ++pid) {
+		index += leaf ? node.counts[pid] : (node.counts[pid] == 0 ? 1 : 0);
 	}
+	return index;
+}
 
-	const float invDet = 1.0f / det;
-	const glm::vec3 q  = ray.pos - v0;
-	const float u	  = invDet * glm::dot(q, p);
-	if(u < 0.0f || u > 1.0f) {
-		return {};
+template<typename N, typename VisitLeaf>
+bool Raycaster::traverse(const std::vector<N> & nodes, const Ray & ray, float mini, float maxi, VisitLeaf visitLeaf, const Inflation * inflation) {
+	if(nodes.empty()) {
+		return false;
 	}
+	const size_t W = N::width;
+	// Each visited node adds at most W-1 entries to the stack, and collapsed hierarchies are not deeper than binary ones.
+	struct Entry {
+		uint32_t node; ///< Index of the node.
+		float near;	   ///< Entry distance of the ray in the node.
+	};
+	Entry nodesToTest[maxDepth * (W - 1) + 1];
+	size_t stackSize = 0;
+	nodesToTest[stackSize++] = {0, mini};
+
+	float nears[W];
+	uint32_t order[W];
+	while(stackSize > 0) {
+		const Entry entry = nodesToTest[--stackSize];
+		// Skip nodes entered after the closest hit found since they were pushed.
+		if(entry.near > maxi) {
+			continue;
+		}
+		const N & node = nodes[entry.node];
+		RAYCASTER_COUNT(nodes, 1);
+		RAYCASTER_COUNT(boxes, node.count);
 
-	const glm::vec3 r = glm::cross(q, v01);
-	const float v	 = invDet * glm::dot(ray.dir, r);
-	if(v < 0.0f || (u + v) > 1.0f) {
-		return {};
+		// Sort intersected children from near to far.
+		const int mask = intersectsChildren(ray, node, mini, maxi, nears, inflation);
+		uint32_t hitCount = 0;
+		for(uint32_t cid = 0; cid < node.count; ++cid) {
+			if((mask & (1 << cid)) == 0) {
+				continue;
+			}
+			uint32_t pos = hitCount++;
+			for(; pos > 0 && nears[order[pos - 1]] > nears[cid]; --pos) {
+				order[pos] = order[pos - 1];
+			}
+			order[pos] = cid;
+		}
+		// Test leaves first, in order, as they can reduce the maximum distance.
+		for(uint32_t hid = 0; hid < hitCount; ++hid) {
+			const uint32_t cid = order[hid];
+			if(node.counts[cid] != 0 && nears[cid] <= maxi && visitLeaf(childIndex(node, cid), node.counts[cid], maxi)) {
+				return true;
+			}
+		}
+		// Push internal children from far to near, so that the nearest one is visited first.
+		for(uint32_t hid = hitCount; hid > 0; --hid) {
+			const uint32_t cid = order[hid - 1];
+			if(node.counts[cid] == 0 && nears[cid] <= maxi) {
+				nodesToTest[stackSize++] = {childIndex(node, cid), nears[cid]};
+			}
+		}
 	}
+	return false;
+}
 
-	const float t = invDet * glm::dot(v02, r);
-	if(t > mini && t < maxi) {
-		return {t, u, v, tri.localId, tri.meshId};
+template<typename VisitLeaf>
+bool Raycaster::traverse(const WideHierarchy & hierarchy, const Ray & ray, float mini, float maxi, VisitLeaf visitLeaf, const Inflation * inflation) const {
+	if(_quantization == 8) {
+		if(_width == 2) {
+			return traverse(hierarchy.nodes2q8, ray, mini, maxi, visitLeaf, inflation);
+		} else if(_width == 8) {
+			return traverse(hierarchy.nodes8q8, ray, mini, maxi, visitLeaf, inflation);
+		}
+		return traverse(hierarchy.nodes4q8, ray, mini, maxi, visitLeaf, inflation);
+	} else if(_quantization == 16) {
+		if(_width == 2) {
+			return traverse(hierarchy.nodes2q16, ray, mini, maxi, visitLeaf, inflation);
+		} else if(_width == 8) {
+			return traverse(hierarchy.nodes8q16, ray, mini, maxi, visitLeaf, inflation);
+		}
+		return traverse(hierarchy.nodes4q16, ray, mini, maxi, visitLeaf, inflation);
+	}
+	if(_width == 2) {
+		return traverse(hierarchy.nodes2, ray, mini, maxi, visitLeaf, inflation);
+	} else if(_width == 8) {
+		return traverse(hierarchy.nodes8, ray, mini, maxi, visitLeaf, inflation);
+	}
+	return traverse(hierarchy.nodes4, ray, mini, maxi, visitLeaf, inflation);
+}
+
+template<typename N, typename VisitLeaf>
+void Raycaster::traverseClosest(const std::vector<N> & nodes, const glm::vec3 & point, float maxi, VisitLeaf visitLeaf) {
+	if(nodes.empty()) {
+		return;
+	}
+	const size_t W = N::width;
+	struct Entry {
+		uint32_t node; ///< Index of the node.
+		float dist2;   ///< Squared distance from the point to the node.
+	};
+	Entry nodesToTest[maxDepth * (W - 1) + 1];
+	size_t stackSize = 0;
+	nodesToTest[stackSize++] = {0, 0.0f};
+
+	float dists[W];
+	uint32_t order[W];
+	while(stackSize > 0) {
+		const Entry entry = nodesToTest[--stackSize];
+		// Skip nodes further than the closest point found since they were pushed.
+		if(entry.dist2 > maxi * maxi) {
+			continue;
+		}
+		const N & node = nodes[entry.node];
+		RAYCASTER_COUNT(nodes, 1);
+		RAYCASTER_COUNT(boxes, node.count);
+
+		// Sort close enough children from near to far.
+		const int mask = distanceChildren(point, node, maxi, dists);
+		uint32_t closeCount = 0;
+		for(uint32_t cid = 0; cid < node.count; ++cid) {
+			if((mask & (1 << cid)) == 0) {
+				continue;
+			}
+			uint32_t pos = closeCount++;
+			for(; pos > 0 && dists[order[pos - 1]] > dists[cid]; --pos) {
+				order[pos] = order[pos - 1];
+			}
+			order[pos] = cid;
+		}
+		// Test leaves first, in order, as they can reduce the maximum distance.
+		for(uint32_t hid = 0; hid < closeCount; ++hid) {
+			const uint32_t cid = order[hid];
+			if(node.counts[cid] != 0 && dists[cid] <= maxi * maxi) {
+				visitLeaf(childIndex(node, cid), node.counts[cid], maxi);
+			}
+		}
+		// Push internal children from far to near, so that the nearest one is visited first.
+		for(uint32_t hid = closeCount; hid > 0; --hid) {
+			const uint32_t cid = order[hid - 1];
+			if(node.counts[cid] == 0 && dists[cid] <= maxi * maxi) {
+				nodesToTest[stackSize++] = {childIndex(node, cid), dists[cid]};
+			}
+		}
+	}
+}
+
+template<typename VisitLeaf>
+void Raycaster::traverseClosest(const WideHierarchy & hierarchy, const glm::vec3 & point, float maxi, VisitLeaf visitLeaf) const {
+	if(_quantization == 8) {
+		if(_width == 2) {
+			traverseClosest(hierarchy.nodes2q8, point, maxi, visitLeaf);
+		} else if(_width == 8) {
+			traverseClosest(hierarchy.nodes8q8, point, maxi, visitLeaf);
+		} else {
+			traverseClosest(hierarchy.nodes4q8, point, maxi, visitLeaf);
+		}
+	} else if(_quantization == 16) {
+		if(_width == 2) {
+			traverseClosest(hierarchy.nodes2q16, point, maxi, visitLeaf);
+		} else if(_width == 8) {
+			traverseClosest(hierarchy.nodes8q16, point, maxi, visitLeaf);
+		} else {
+			traverseClosest(hierarchy.nodes4q16, point, maxi, visitLeaf);
+		}
+	} else if(_width == 2) {
+		traverseClosest(hierarchy.nodes2, point, maxi, visitLeaf);
+	} else if(_width == 8) {
+		traverseClosest(hierarchy.nodes8, point, maxi, visitLeaf);
+	} else {
+		traverseClosest(hierarchy.nodes4, point, maxi, visitLeaf);
+	}
+}
+
+void Raycaster::updateInstance(size_t meshId, const glm::mat4 & model) {
+	if(meshId >= _instances.size() || _instances[meshId].removed) {
+		Log::Error() << "[Raycaster] Mesh " << meshId << " doesn't exist." << std::endl;
+		return;
+	}
+	setTransform(_instances[meshId], model);
+	updatePacketInstance(meshId);
+}
+
+void Raycaster::setTransform(Instance & instance, const glm::mat4 & model) {
+	instance.model	  = model;
+	instance.invModel = glm::inverse(model);
+	instance.identity = model == glm::mat4(1.0f);
+	// The largest stretch of the world to mesh transformation is bounded by the square root of the largest row sum of its Gram matrix (exact for similarities).
+	const glm::mat3 toLocal = glm::mat3(instance.invModel);
+	const glm::mat3 gram	= glm::transpose(toLocal) * toLocal;
+	float maxSum = 0.0f;
+	for(int i = 0; i < 3; ++i) {
+		maxSum = std::max(maxSum, std::abs(gram[0][i]) + std::abs(gram[1][i]) + std::abs(gram[2][i]));
+	}
+	instance.minScale = maxSum > 0.0f ? 1.0f / std::sqrt(maxSum) : 1.0f;
+}
+
+bool Raycaster::refit() {
+	if(_topLevel.empty()) {
+		return false;
+	}
+	updateInstanceBoxes();
+
+	// Children are always stored after their parent, visit nodes in reverse order to update them before it.
+	for(size_t nid = _topLevel.size(); nid > 0; --nid) {
+		Node & node = _topLevel[nid - 1];
+		node.box	= BoundingBox();
+		if(node.leaf) {
+			for(size_t iid = 0; iid < node.right; ++iid) {
+				node.box.merge(_instances[_instanceIds[node.left + iid]].box);
+			}
+		} else {
+			node.box.merge(_topLevel[node.left].box);
+			node.box.merge(_topLevel[node.right].box);
+		}
+	}
+
+	collapseTopLevel();
+
+	// If the hierarchy quality has degraded too much, rebuild the top level.
+	// Mesh hierarchies are expressed in mesh space and are not affected.
+	const float refitCost = cost();
+	if(_settings.rebuildRatio <= 0.0f || refitCost <= _settings.rebuildRatio * _builtCost) {
+		return false;
+	}
+	Query timer;
+	timer.begin();
+	buildTopLevel();
+	timer.end();
+	Log::Verbose() << "[Raycaster] Top level rebuilt after refit (cost " << refitCost << " -> " << _builtCost << ") in " << float(timer.value()) / 1000000000.0f << "s." << std::endl;
+	return true;
+}
+
+void Raycaster::buildHierarchies(std::vector<Build> & builds, BuildStats & stats) {
+
+	Query topTimer, subtreesTimer;
+	const size_t threadCount = System::threadCount();
+
+	// Linear hierarchies are built one at a time, each step using multiple threads.
+	if(_settings.split == Split::LBVH) {
+		subtreesTimer.begin();
+		for(Build & build : builds) {
+			buildLBVH(build);
+		}
+		subtreesTimer.end();
+		stats.subtrees += subtreesTimer.value();
+		stats.subtreeCount += builds.size();
+		stats.threads = std::max(stats.threads, threadCount);
+		return;
+	}
+
+	size_t refsCount = 0;
+	for(const Build & build : builds) {
+		refsCount += build.refs.size();
+	}
+	// Large sets are split one at a time, with reductions over their primitives performed in parallel.
+	// Once small enough, they are distributed to worker threads that build the corresponding subtrees.
+	const size_t subtreeSize = std::max(reductionChunkSize, refsCount / (4 * threadCount));
+
+	std::stack<SetInfos> remainingSets;
+	for(Build & build : builds) {
+		// Leave room for references duplicated by spatial splits.
+		const size_t count = build.refs.size();
+		if(build.geometry) {
+			build.refs.resize(count + size_t(std::max(_settings.splitBudget, 0.0f) * float(count)));
+		}
+		// Each split creates two non-empty children, so a hierarchy over n primitives contains at most 2n-1 nodes.
+		// Allocate them upfront so that threads can claim nodes concurrently.
+		const size_t capacity = build.refs.size();
+		build.nodes.resize(capacity == 0 ? 1 : (2 * capacity - 1));
+		build.nodeCount = 1;
+		remainingSets.push({&build, 0, 0, count, capacity, 0});
+	}
+
+	// Top levels.
+	topTimer.begin();
+	std::vector<SetInfos> subtrees;
+	size_t topCount = 0;
+	while(!remainingSets.empty()) {
+		// Get the next node to process on the stack.
+		const SetInfos current(remainingSets.top());
+		remainingSets.pop();
+		if(current.count <= subtreeSize) {
+			subtrees.push_back(current);
+			continue;
+		}
+		SetInfos children[2];
+		if(splitNode(current, true, children)) {
+			remainingSets.push(children[0]);
+			remainingSets.push(children[1]);
+		}
+		++topCount;
+	}
+	topTimer.end();
+
+	// Subtrees, largest first to balance the load.
+	subtreesTimer.begin();
+	std::sort(subtrees.begin(), subtrees.end(), [](const SetInfos & s0, const SetInfos & s1) {
+		return s0.count > s1.count;
+	});
+	std::atomic<size_t> nextSubtree(0);
+	auto buildSubtrees = [this, &subtrees, &nextSubtree]() {
+		std::vector<SetInfos> localSets;
+		size_t sid;
+		while((sid = nextSubtree++) < subtrees.size()) {
+			localSets.push_back(subtrees[sid]);
+			while(!localSets.empty()) {
+				const SetInfos current(localSets.back());
+				localSets.pop_back();
+				SetInfos children[2];
+				if(splitNode(current, false, children)) {
+					localSets.push_back(children[0]);
+					localSets.push_back(children[1]);
+				}
+			}
+		}
+	};
+	const size_t workerCount = std::max(std::min(threadCount, subtrees.size()), size_t(1));
+	std::vector<std::thread> workers;
+	for(size_t wid = 1; wid < workerCount; ++wid) {
+		workers.emplace_back(buildSubtrees);
+	}
+	// The current thread also participates.
+	buildSubtrees();
+	for(std::thread & worker : workers) {
+		worker.join();
+	}
+	subtreesTimer.end();
+
+	// Release unused nodes.
+	for(Build & build : builds) {
+		build.nodes.resize(build.nodeCount);
+		build.nodes.shrink_to_fit();
+		if(!build.geometry) {
+			continue;
+		}
+		// Remove the unused room left between leaves.
+		std::vector<Reference> refs;
+		for(Node & node : build.nodes) {
+			if(node.leaf) {
+				const size_t first = refs.size();
+				refs.insert(refs.end(), build.refs.begin() + node.left, build.refs.begin() + node.left + node.right);
+				node.left = first;
+			}
+		}
+		std::swap(build.refs, refs);
+	}
+
+	stats.topLevels += topTimer.value();
+	stats.subtrees += subtreesTimer.value();
+	stats.topNodes += topCount;
+	stats.subtreeCount += subtrees.size();
+	stats.threads = std::max(stats.threads, workerCount);
+}
+
+bool Raycaster::splitNode(const SetInfos & set, bool parallel, SetInfos children[2]) {
+	Build & build				  = *set.build;
+	std::vector<Reference> & refs = build.refs;
+	const size_t begin			  = set.begin;
+	const size_t count			  = set.count;
+
+	// Compute the global bounding box.
+	const BoundingBox global = reduceRange(begin, count, BoundingBox(), parallel, [&refs](BoundingBox & box, size_t rid) {
+		box.merge(refs[rid].box);
+	}, [](BoundingBox & box, const BoundingBox & other) {
+		box.merge(other);
+	});
+
+	Node & node = build.nodes[set.id];
+	node.box	= global;
+
+	// If the primitives count is low enough, we have a leaf.
+	// Past the maximum depth, all remaining primitives are placed in a leaf, to bound the traversal stack size.
+	bool split = false;
+	if(count >= 3 && set.depth + 1 < maxDepth) {
+		if(_settings.split == Split::SBVH && build.geometry) {
+			split = splitSBVH(set, global, parallel, children);
+		} else {
+			const size_t splitCount = _settings.split == Split::Midpoint ? splitMidpoint(refs, begin, count, global, parallel) : splitSAH(refs, begin, count, global, parallel);
+			split		= splitCount != 0;
+			children[0] = {set.build, 0, begin, splitCount, begin + splitCount, set.depth + 1};
+			children[1] = {set.build, 0, begin + splitCount, count - splitCount, set.end, set.depth + 1};
+		}
+	}
+
+	if(!split) {
+		node.leaf  = true;
+		node.left  = begin;
+		node.right = count;
+		return false;
+	}
+
+	// Create the left and right sub-nodes.
+	const size_t leftPos = build.nodeCount.fetch_add(2);
+	node.leaf			 = false;
+	node.left			 = leftPos;
+	node.right			 = leftPos + 1;
+	children[0].id		 = leftPos;
+	children[1].id		 = leftPos + 1;
+	return true;
+}
+
+size_t Raycaster::splitMidpoint(std::vector<Reference> & refs, size_t begin, size_t count, const BoundingBox & box, bool parallel) {
+	size_t splitCount = 0;
+	// Pick the dimension along which the global bounding box is the largest.
+	const glm::vec3 boxSize = box.getSize();
+	const int axis			= (boxSize.x >= boxSize.y && boxSize.x >= boxSize.z) ? 0 : (boxSize.y >= boxSize.z ? 1 : 2);
+
+	if(count >= 5) {
+
+		// Compute the midpoint of all primitives centroids along the picked axis.
+		float abscisse = reduceRange(begin, count, 0.0f, parallel, [&refs, axis](float & sum, size_t rid) {
+			sum += refs[rid].box.getCentroid()[axis];
+		}, [](float & sum, float other) {
+			sum += other;
+		});
+		abscisse /= float(count);
+
+		// Split in two subnodes.
+		// Main criterion: split at the midpoint along the chosen axis.
+		const auto split = std::partition(refs.begin() + begin, refs.begin() + begin + count, [abscisse, axis](const Reference & r0) {
+			return r0.box.getCentroid()[axis] < abscisse;
+		});
+		splitCount		 = std::distance(refs.begin() + begin, split);
+	}
+
+	// Fallback criterion: split in two equal size subsets.
+	// This can happen in case the primitive boxes overlap a lot,
+	// or in case of equal coordinates along the chosen axis.
+	if(splitCount == 0 || splitCount == count || count < 5) {
+		splitCount = count / 2;
+		std::nth_element(refs.begin() + begin, refs.begin() + begin + splitCount, refs.begin() + begin + count, [axis](const Reference & r0, const Reference & r1) {
+			return r0.box.getCentroid()[axis] < r1.box.getCentroid()[axis];
+		});
+	}
+	return splitCount;
+}
+
+void Raycaster::findObjectSplit(const std::vector<Reference> & refs, size_t begin, size_t count, const BoundingBox & box, bool parallel, ObjectSplit & split) const {
+
+	struct Bin {
+		BoundingBox box;
+		size_t count = 0;
+	};
+
+	// Bins are placed along the extent of the primitives centroids.
+	const BoundingBox centroids = reduceRange(begin, count, BoundingBox(), parallel, [&refs](BoundingBox & bounds, size_t rid) {
+		bounds.merge(refs[rid].box.getCentroid());
+	}, [](BoundingBox & bounds, const BoundingBox & other) {
+		bounds.merge(other);
+	});
+	const glm::vec3 extent = centroids.getSize();
+	const uint binCount	   = std::max(_settings.bins, 2u);
+	// Guard against flat geometry.
+	const float invArea	= 1.0f / std::max(box.getSurfaceArea(), std::numeric_limits<float>::min());
+
+	std::vector<BoundingBox> rightBoxes(binCount);
+	split = ObjectSplit();
+
+	for(int axis = 0; axis < 3; ++axis) {
+		// All centroids are at the same coordinate, no split possible along this axis.
+		if(extent[axis] <= 0.0f) {
+			continue;
+		}
+		const float scale	 = float(binCount) / extent[axis];
+		const float minCoord = centroids.minis[axis];
+		const std::vector<Bin> bins = reduceRange(begin, count, std::vector<Bin>(binCount), parallel, [&refs, binCount, scale, minCoord, axis](std::vector<Bin> & accum, size_t rid) {
+			const BoundingBox & refBox = refs[rid].box;
+			const uint bid = std::min(binCount - 1, uint((refBox.getCentroid()[axis] - minCoord) * scale));
+			accum[bid].box.merge(refBox);
+			++accum[bid].count;
+		}, [binCount](std::vector<Bin> & accum, const std::vector<Bin> & other) {
+			for(uint bid = 0; bid < binCount; ++bid) {
+				accum[bid].box.merge(other[bid].box);
+				accum[bid].count += other[bid].count;
+			}
+		});
+		// Sweep from the right to get the bounds of all right subsets.
+		BoundingBox right;
+		for(uint bid = binCount - 1; bid > 0; --bid) {
+			right.merge(bins[bid].box);
+			rightBoxes[bid] = right;
+		}
+		// Sweep from the left to evaluate each split position, after bin bid.
+		BoundingBox left;
+		size_t leftCount = 0;
+		for(uint bid = 0; bid < binCount - 1; ++bid) {
+			left.merge(bins[bid].box);
+			leftCount += bins[bid].count;
+			const size_t rightCount = count - leftCount;
+			// Skip splits leaving a side empty.
+			if(leftCount == 0 || rightCount == 0) {
+				continue;
+			}
+			const float leftArea  = left.getSurfaceArea() * float(leftCount);
+			const float rightArea = rightBoxes[bid + 1].getSurfaceArea() * float(rightCount);
+			const float splitCost = _settings.traversalCost + _settings.leafCost * (leftArea + rightArea) * invArea;
+			if(splitCost < split.cost) {
+				split.cost	   = splitCost;
+				split.axis	   = axis;
+				split.bin	   = bid;
+				split.minCoord = minCoord;
+				split.scale	   = scale;
+				split.left	   = left;
+				split.right	   = rightBoxes[bid + 1];
+			}
+		}
+	}
+}
+
+size_t Raycaster::partition(std::vector<Reference> & refs, size_t begin, size_t count, const ObjectSplit & split) {
+	const auto middle = std::partition(refs.begin() + begin, refs.begin() + begin + count, [&split](const Reference & r0) {
+		return uint((r0.box.getCentroid()[split.axis] - split.minCoord) * split.scale) <= split.bin;
+	});
+	return size_t(std::distance(refs.begin() + begin, middle));
+}
+
+size_t Raycaster::splitSAH(std::vector<Reference> & refs, size_t begin, size_t count, const BoundingBox & box, bool parallel) {
+	ObjectSplit split;
+	findObjectSplit(refs, begin, count, box, parallel, split);
+
+	// All centroids are identical, split in two halves if the leaf would be too large.
+	if(split.axis < 0) {
+		return count > _settings.maxLeafSize ? count / 2 : 0;
+	}
+	// Stop if intersecting all primitives is cheaper than splitting.
+	const float leafCost = _settings.leafCost * float(count);
+	if(count <= _settings.maxLeafSize && leafCost <= split.cost) {
+		return 0;
+	}
+	return partition(refs, begin, count, split);
+}
+
+/** Compute the intersection of two bounding boxes.
+ \param box0 the first box
+ \param box1 the second box
+ \return the intersection, empty if the boxes don't overlap
+ */
+static BoundingBox intersection(const BoundingBox & box0, const BoundingBox & box1) {
+	BoundingBox box;
+	box.minis = glm::max(box0.minis, box1.minis);
+	box.maxis = glm::min(box0.maxis, box1.maxis);
+	return glm::all(glm::lessThanEqual(box.minis, box.maxis)) ? box : BoundingBox();
+}
+
+BoundingBox Raycaster::clip(const Geometry & geometry, const Reference & ref, int axis, float mini, float maxi) {
+	glm::vec3 vs[3];
+	getTriangle(geometry, ref.id, vs[0], vs[1], vs[2]);
+	BoundingBox clipped;
+	for(int i = 0; i < 3; ++i) {
+		const glm::vec3 & a = vs[i];
+		const glm::vec3 & b = vs[(i + 1) % 3];
+		// Keep vertices between the planes.
+		if(a[axis] >= mini && a[axis] <= maxi) {
+			clipped.merge(a);
+		}
+		// Add the intersections of the edge with the planes.
+		for(const float plane : {mini, maxi}) {
+			if((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)) {
+				glm::vec3 point = glm::mix(a, b, (plane - a[axis]) / (b[axis] - a[axis]));
+				point[axis]		= plane;
+				clipped.merge(point);
+			}
+		}
+	}
+	// The reference can already have been clipped by previous splits.
+	return clipped.empty() ? clipped : intersection(clipped, ref.box);
+}
+
+void Raycaster::findSpatialSplit(const Build & build, size_t begin, size_t count, const BoundingBox & box, bool parallel, SpatialSplit & split) const {
+
+	struct Bin {
+		BoundingBox box;
+		size_t entries = 0; ///< Number of references starting in the bin.
+		size_t exits   = 0; ///< Number of references ending in the bin.
+	};
+
+	const std::vector<Reference> & refs = build.refs;
+	const Geometry & geometry			= *build.geometry;
+	// Bins are placed along the extent of the references boxes.
+	const glm::vec3 extent = box.getSize();
+	const uint binCount	   = std::max(_settings.bins, 2u);
+	const float invArea	   = 1.0f / std::max(box.getSurfaceArea(), std::numeric_limits<float>::min());
+
+	std::vector<BoundingBox> rightBoxes(binCount);
+	std::vector<size_t> rightCounts(binCount);
+	split = SpatialSplit();
+
+	for(int axis = 0; axis < 3; ++axis) {
+		if(extent[axis] <= 0.0f) {
+			continue;
+		}
+		const float binSize	 = extent[axis] / float(binCount);
+		const float minCoord = box.minis[axis];
+		const std::vector<Bin> bins = reduceRange(begin, count, std::vector<Bin>(binCount), parallel, [&refs, &geometry, binCount, binSize, minCoord, axis](std::vector<Bin> & accum, size_t rid) {
+			const Reference & ref = refs[rid];
+			const uint first = std::min(binCount - 1, uint(std::max(ref.box.minis[axis] - minCoord, 0.0f) / binSize));
+			const uint last	 = std::min(binCount - 1, uint(std::max(ref.box.maxis[axis] - minCoord, 0.0f) / binSize));
+			if(first == last) {
+				accum[first].box.merge(ref.box);
+			} else {
+				// Add the part of the triangle in each bin it overlaps.
+				for(uint bid = first; bid <= last; ++bid) {
+					const float binMin = minCoord + float(bid) * binSize;
+					const BoundingBox clipped = clip(geometry, ref, axis, bid == first ? ref.box.minis[axis] : binMin, bid == last ? ref.box.maxis[axis] : binMin + binSize);
+					if(!clipped.empty()) {
+						accum[bid].box.merge(clipped);
+					}
+				}
+			}
+			++accum[first].entries;
+			++accum[last].exits;
+		}, [binCount](std::vector<Bin> & accum, const std::vector<Bin> & other) {
+			for(uint bid = 0; bid < binCount; ++bid) {
+				accum[bid].box.merge(other[bid].box);
+				accum[bid].entries += other[bid].entries;
+				accum[bid].exits += other[bid].exits;
+			}
+		});
+		// Sweep from the right to get the bounds of all right subsets.
+		BoundingBox right;
+		size_t rightCount = 0;
+		for(uint bid = binCount - 1; bid > 0; --bid) {
+			right.merge(bins[bid].box);
+			rightCount += bins[bid].exits;
+			rightBoxes[bid]	 = right;
+			rightCounts[bid] = rightCount;
+		}
+		// Sweep from the left to evaluate each plane position, after bin bid. References crossing the plane are counted on both sides.
+		BoundingBox left;
+		size_t leftCount = 0;
+		for(uint bid = 0; bid < binCount - 1; ++bid) {
+			left.merge(bins[bid].box);
+			leftCount += bins[bid].entries;
+			if(leftCount == 0 || rightCounts[bid + 1] == 0) {
+				continue;
+			}
+			const float leftArea  = left.getSurfaceArea() * float(leftCount);
+			const float rightArea = rightBoxes[bid + 1].getSurfaceArea() * float(rightCounts[bid + 1]);
+			const float splitCost = _settings.traversalCost + _settings.leafCost * (leftArea + rightArea) * invArea;
+			if(splitCost < split.cost) {
+				split.cost		 = splitCost;
+				split.axis		 = axis;
+				split.position	 = minCoord + float(bid + 1) * binSize;
+				split.leftCount	 = leftCount;
+				split.rightCount = rightCounts[bid + 1];
+				split.left		 = left;
+				split.right		 = rightBoxes[bid + 1];
+			}
+		}
+	}
+}
+
+bool Raycaster::splitSBVH(const SetInfos & set, const BoundingBox & box, bool parallel, SetInfos children[2]) {
+	Build & build				  = *set.build;
+	std::vector<Reference> & refs = build.refs;
+	const size_t begin			  = set.begin;
+	const size_t count			  = set.count;
+	const size_t room			  = set.end - begin - count;
+
+	ObjectSplit objectSplit;
+	findObjectSplit(refs, begin, count, box, parallel, objectSplit);
+
+	// Only look for a spatial split if the object split children overlap significantly, and if references can be duplicated.
+	SpatialSplit spatialSplit;
+	if(room > 0) {
+		const float overlap	 = objectSplit.axis < 0 ? box.getSurfaceArea() : intersection(objectSplit.left, objectSplit.right).getSurfaceArea();
+		const float rootArea = build.nodes[0].box.getSurfaceArea();
+		if(overlap > _settings.splitOverlap * rootArea) {
+			findSpatialSplit(build, begin, count, box, parallel, spatialSplit);
+		}
+	}
+
+	// Stop if intersecting all primitives is cheaper than splitting.
+	const float leafCost = _settings.leafCost * float(count);
+	if(count <= _settings.maxLeafSize && leafCost <= std::min(objectSplit.cost, spatialSplit.cost)) {
+		return false;
+	}
+
+	size_t leftCount  = 0;
+	size_t rightCount = 0;
+	if(spatialSplit.axis >= 0 && spatialSplit.cost < objectSplit.cost && spatialSplit.leftCount + spatialSplit.rightCount - count <= room) {
+		// Distribute the references on each side of the plane, splitting the ones crossing it.
+		const int axis		 = spatialSplit.axis;
+		const float position = spatialSplit.position;
+		const float leftArea  = spatialSplit.left.getSurfaceArea();
+		const float rightArea = spatialSplit.right.getSurfaceArea();
+		const float leftTotal  = float(spatialSplit.leftCount);
+		const float rightTotal = float(spatialSplit.rightCount);
+		std::vector<Reference> lefts;
+		std::vector<Reference> rights;
+		lefts.reserve(spatialSplit.leftCount);
+		rights.reserve(spatialSplit.rightCount);
+		for(size_t rid = begin; rid < begin + count; ++rid) {
+			const Reference & ref = refs[rid];
+			if(ref.box.maxis[axis] <= position) {
+				lefts.push_back(ref);
+				continue;
+			}
+			if(ref.box.minis[axis] >= position) {
+				rights.push_back(ref);
+				continue;
+			}
+			const Reference leftRef	 = {clip(*build.geometry, ref, axis, ref.box.minis[axis], position), ref.id};
+			const Reference rightRef = {clip(*build.geometry, ref, axis, position, ref.box.maxis[axis]), ref.id};
+			if(leftRef.box.empty() || rightRef.box.empty()) {
+				(leftRef.box.empty() ? rights : lefts).push_back(ref);
+				continue;
+			}
+			// Keep the whole reference on one side if this is cheaper than splitting it.
+			BoundingBox leftMerged = spatialSplit.left;
+			BoundingBox rightMerged = spatialSplit.right;
+			leftMerged.merge(ref.box);
+			rightMerged.merge(ref.box);
+			const float splitCost = leftArea * leftTotal + rightArea * rightTotal;
+			const float toLeftCost	= leftMerged.getSurfaceArea() * leftTotal + rightArea * (rightTotal - 1.0f);
+			const float toRightCost = leftArea * (leftTotal - 1.0f) + rightMerged.getSurfaceArea() * rightTotal;
+			if(toLeftCost < splitCost && toLeftCost <= toRightCost) {
+				lefts.push_back(ref);
+			} else if(toRightCost < splitCost) {
+				rights.push_back(ref);
+			} else {
+				lefts.push_back(leftRef);
+				rights.push_back(rightRef);
+			}
+		}
+		leftCount  = lefts.size();
+		rightCount = rights.size();
+		// Rounding can make the actual split differ from the binned estimate.
+		if(leftCount != 0 && rightCount != 0 && leftCount + rightCount - count <= room) {
+			const size_t rightBegin = begin + leftCount + (room - (leftCount + rightCount - count)) * leftCount / (leftCount + rightCount);
+			std::copy(lefts.begin(), lefts.end(), refs.begin() + begin);
+			std::copy(rights.begin(), rights.end(), refs.begin() + rightBegin);
+			children[0] = {set.build, 0, begin, leftCount, rightBegin, set.depth + 1};
+			children[1] = {set.build, 0, rightBegin, rightCount, set.end, set.depth + 1};
+			return true;
+		}
+	}
+
+	// Object split, or two halves if all centroids are identical.
+	if(objectSplit.axis < 0) {
+		if(count <= _settings.maxLeafSize) {
+			return false;
+		}
+		leftCount = count / 2;
+	} else {
+		leftCount = partition(refs, begin, count, objectSplit);
+	}
+	rightCount = count - leftCount;
+	// Share the remaining room between both children.
+	const size_t rightBegin = begin + leftCount + room * leftCount / count;
+	std::copy_backward(refs.begin() + begin + leftCount, refs.begin() + begin + count, refs.begin() + rightBegin + rightCount);
+	children[0] = {set.build, 0, begin, leftCount, rightBegin, set.depth + 1};
+	children[1] = {set.build, 0, rightBegin, rightCount, set.end, set.depth + 1};
+	return true;
+}
+
+void Raycaster::buildLBVH(Build & build) const {
+	std::vector<Reference> & refs = build.refs;
+	const size_t count			  = refs.size();
+	if(count == 0) {
+		build.nodes.assign(1, Node());
+		build.nodeCount = 1;
+		return;
+	}
+
+	// Morton codes of the primitives centroids, in the centroids bounding box.
+	const BoundingBox centroids = reduceRange(0, count, BoundingBox(), true, [&refs](BoundingBox & bounds, size_t rid) {
+		bounds.merge(refs[rid].box.getCentroid());
+	}, [](BoundingBox & bounds, const BoundingBox & other) {
+		bounds.merge(other);
+	});
+	const glm::vec3 invSize = 1.0f / glm::max(centroids.getSize(), glm::vec3(1e-20f));
+	const uint axisBits		= _settings.mortonBits > 30 ? 21 : 10;
+	std::vector<uint64_t> codes(count);
+	std::vector<uint32_t> ids(count);
+	forChunks(count, [&refs, &codes, &ids, &centroids, &invSize, axisBits](size_t, size_t begin, size_t end) {
+		for(size_t rid = begin; rid < end; ++rid) {
+			codes[rid] = mortonCode((refs[rid].box.getCentroid() - centroids.minis) * invSize, axisBits);
+			ids[rid]   = uint32_t(rid);
+		}
+	});
+	radixSort(codes, ids, 3 * axisBits);
+
+	// Each internal node covers a range of sorted primitives, split where the highest bit of their codes differs (Karras 2012).
+	// Primitives with identical codes are separated using their position in the sorted list.
+	LinearTree tree;
+	tree.internalCount = count - 1;
+	const size_t nodeCount = tree.internalCount + count;
+	tree.children.resize(2 * tree.internalCount);
+	tree.counts.assign(nodeCount, 1);
+	const int64_t signedCount = int64_t(count);
+	auto prefix = [&codes, signedCount](int64_t i, int64_t j) {
+		if(j < 0 || j >= signedCount) {
+			return -1;
+		}
+		const uint64_t diff = codes[size_t(i)] ^ codes[size_t(j)];
+		return diff != 0 ? leadingZeros(diff) : 64 + leadingZeros(uint64_t(i ^ j));
+	};
+	forChunks(tree.internalCount, [&tree, &prefix](size_t, size_t begin, size_t end) {
+		for(size_t nid = begin; nid < end; ++nid) {
+			const int64_t i = int64_t(nid);
+			// Direction of the range, and upper bound on its length.
+			const int64_t d		 = prefix(i, i + 1) > prefix(i, i - 1) ? 1 : -1;
+			const int minPrefix	 = prefix(i, i - d);
+			int64_t maxLength	 = 2;
+			while(prefix(i, i + maxLength * d) > minPrefix) {
+				maxLength *= 2;
+			}
+			// Find the other end of the range with a binary search.
+			int64_t length = 0;
+			for(int64_t step = maxLength / 2; step >= 1; step /= 2) {
+				if(prefix(i, i + (length + step) * d) > minPrefix) {
+					length += step;
+				}
+			}
+			const int64_t j		 = i + length * d;
+			const int nodePrefix = prefix(i, j);
+			tree.counts[nid]	 = uint32_t(length + 1);
+			// Find the split position with a binary search.
+			int64_t split = 0;
+			int64_t step  = length;
+			do {
+				step = (step + 1) / 2;
+				if(prefix(i, i + (split + step) * d) > nodePrefix) {
+					split += step;
+				}
+			} while(step > 1);
+			const int64_t gamma	  = i + split * d + std::min<int64_t>(d, 0);
+			// Children covering a single primitive are leaves.
+			const size_t leaves		   = tree.internalCount;
+			tree.children[2 * nid]	   = uint32_t(std::min(i, j) == gamma ? leaves + size_t(gamma) : size_t(gamma));
+			tree.children[2 * nid + 1] = uint32_t(std::max(i, j) == gamma + 1 ? leaves + size_t(gamma) + 1 : size_t(gamma) + 1);
+		}
+	});
+
+	// Leaves data, with the references reordered along the curve so that leaves of a subtree are close in memory.
+	std::vector<Reference> sortedRefs(count);
+	tree.boxes.resize(nodeCount);
+	tree.costs.resize(nodeCount);
+	tree.collapsed.assign(nodeCount, 1);
+	forChunks(count, [this, &tree, &refs, &sortedRefs, &ids](size_t, size_t begin, size_t end) {
+		for(size_t pid = begin; pid < end; ++pid) {
+			const size_t nid = tree.internalCount + pid;
+			sortedRefs[pid]	 = refs[ids[pid]];
+			tree.boxes[nid]	 = sortedRefs[pid].box;
+			tree.costs[nid]	 = _settings.leafCost * tree.boxes[nid].getSurfaceArea();
+		}
+	});
+
+	// Large subtrees are processed by multiple threads, then the nodes above them by the current thread.
+	const size_t threadCount = System::threadCount();
+	const size_t subtreeSize = std::max(reductionChunkSize, count / (4 * threadCount));
+	std::vector<uint32_t> topNodes;
+	std::vector<uint32_t> subtrees;
+	auto splitTop = [&tree, &topNodes, &subtrees, subtreeSize]() {
+		topNodes.clear();
+		subtrees.clear();
+		std::vector<uint32_t> toVisit = {0};
+		while(!toVisit.empty()) {
+			const uint32_t nid = toVisit.back();
+			toVisit.pop_back();
+			if(nid >= tree.internalCount || tree.counts[nid] <= subtreeSize) {
+				subtrees.push_back(nid);
+				continue;
+			}
+			// Parents are listed before their children.
+			topNodes.push_back(nid);
+			toVisit.push_back(tree.children[2 * nid]);
+			toVisit.push_back(tree.children[2 * nid + 1]);
+		}
+	};
+
+	// Update internal nodes from the leaves to the root, restructuring treelets in additional passes.
+	for(uint pass = 0; pass <= _settings.treeletPasses && tree.internalCount != 0; ++pass) {
+		const bool optimize = pass != 0;
+		auto updateNode = [this, &tree, optimize](uint32_t nid) {
+			updateLinearNode(tree, nid);
+			// Subtrees that will be collapsed don't need to be restructured.
+			if(optimize && !tree.collapsed[nid]) {
+				optimizeTreelet(tree, nid);
+			}
+		};
+		splitTop();
+		forTasks(subtrees.size(), [&tree, &subtrees, &updateNode](size_t sid) {
+			// Parents are listed before their children.
+			std::vector<uint32_t> order;
+			if(subtrees[sid] < tree.internalCount) {
+				order.push_back(subtrees[sid]);
+			}
+			for(size_t oid = 0; oid < order.size(); ++oid) {
+				for(int c = 0; c < 2; ++c) {
+					const uint32_t child = tree.children[2 * order[oid] + c];
+					if(child < tree.internalCount) {
+						order.push_back(child);
+					}
+				}
+			}
+			for(auto nid = order.rbegin(); nid != order.rend(); ++nid) {
+				updateNode(*nid);
+			}
+		});
+		for(auto nid = topNodes.rbegin(); nid != topNodes.rend(); ++nid) {
+			updateNode(*nid);
+		}
+	}
+
+	// Emit the nodes from the root, placing the primitives of each leaf together, after those of the previous leaves.
+	struct Emit {
+		uint32_t node; ///< Node in the linear hierarchy.
+		size_t id;	   ///< Index of the emitted node.
+		size_t depth;  ///< Depth of the emitted node.
+		size_t first;  ///< Index of the first primitive reference of the emitted node.
+	};
+	build.nodes.resize(2 * count - 1);
+	build.nodeCount = 1;
+	auto emit = [&tree, &build, &refs, &sortedRefs](const Emit & root, bool stopAtSubtrees, size_t subtreeSize, std::vector<Emit> & subtrees) {
+		std::vector<Emit> toEmit = {root};
+		std::vector<uint32_t> subtree;
+		while(!toEmit.empty()) {
+			const Emit current = toEmit.back();
+			toEmit.pop_back();
+			if(stopAtSubtrees && tree.counts[current.node] <= subtreeSize) {
+				subtrees.push_back(current);
+				continue;
+			}
+			Node & node = build.nodes[current.id];
+			node.box	= tree.boxes[current.node];
+			// Past the maximum depth, all remaining primitives are placed in a leaf, to bound the traversal stack size.
+			if(tree.collapsed[current.node] || current.depth + 1 >= maxDepth) {
+				node.leaf  = true;
+				node.left  = current.first;
+				node.right = tree.counts[current.node];
+				size_t rid = current.first;
+				subtree.assign(1, current.node);
+				while(!subtree.empty()) {
+					const uint32_t nid = subtree.back();
+					subtree.pop_back();
+					if(nid >= tree.internalCount) {
+						refs[rid++] = sortedRefs[nid - tree.internalCount];
+						continue;
+					}
+					subtree.push_back(tree.children[2 * nid + 1]);
+					subtree.push_back(tree.children[2 * nid]);
+				}
+				continue;
+			}
+			const size_t leftPos = build.nodeCount.fetch_add(2);
+			const uint32_t left	 = tree.children[2 * current.node];
+			node.leaf			 = false;
+			node.left			 = leftPos;
+			node.right			 = leftPos + 1;
+			toEmit.push_back({tree.children[2 * current.node + 1], leftPos + 1, current.depth + 1, current.first + tree.counts[left]});
+			toEmit.push_back({left, leftPos, current.depth + 1, current.first});
+		}
+	};
+	std::vector<Emit> emitSubtrees;
+	emit({0, 0, 0, 0}, true, subtreeSize, emitSubtrees);
+	forTasks(emitSubtrees.size(), [&emit, &emitSubtrees](size_t sid) {
+		std::vector<Emit> unused;
+		emit(emitSubtrees[sid], false, 0, unused);
+	});
+	build.nodes.resize(build.nodeCount);
+	build.nodes.shrink_to_fit();
+}
+
+void Raycaster::updateLinearNode(LinearTree & tree, uint32_t node) const {
+	const uint32_t left	 = tree.children[2 * node];
+	const uint32_t right = tree.children[2 * node + 1];
+	BoundingBox & box	 = tree.boxes[node];
+	box = tree.boxes[left];
+	box.merge(tree.boxes[right]);
+	tree.counts[node] = tree.counts[left] + tree.counts[right];
+	// Compare the cost of splitting and of collapsing the node into a leaf, primitive pairs are never split.
+	const float area	  = box.getSurfaceArea();
+	const float splitCost = _settings.traversalCost * area + tree.costs[left] + tree.costs[right];
+	const float leafCost  = _settings.leafCost * area * float(tree.counts[node]);
+	tree.collapsed[node]  = tree.counts[node] < 3 || (tree.counts[node] <= _settings.maxLeafSize && leafCost <= splitCost);
+	tree.costs[node]	  = tree.collapsed[node] ? leafCost : splitCost;
+}
+
+void Raycaster::optimizeTreelet(LinearTree & tree, uint32_t root) const {
+	// Form the treelet by repeatedly expanding its internal leaf with the largest area (Karras and Aila 2013).
+	static const size_t treeletSize = 5;
+	uint32_t leaves[treeletSize];
+	uint32_t internals[treeletSize - 1];
+	size_t leafCount	 = 2;
+	size_t internalCount = 1;
+	leaves[0]	 = tree.children[2 * root];
+	leaves[1]	 = tree.children[2 * root + 1];
+	internals[0] = root;
+	while(leafCount < treeletSize) {
+		size_t expanded = treeletSize;
+		float maxArea	= -1.0f;
+		for(size_t lid = 0; lid < leafCount; ++lid) {
+			if(leaves[lid] < tree.internalCount && tree.boxes[leaves[lid]].getSurfaceArea() > maxArea) {
+				maxArea	 = tree.boxes[leaves[lid]].getSurfaceArea();
+				expanded = lid;
+			}
+		}
+		if(expanded == treeletSize) {
+			break;
+		}
+		const uint32_t node			 = leaves[expanded];
+		internals[internalCount++] = node;
+		leaves[expanded]			 = tree.children[2 * node];
+		leaves[leafCount++]			 = tree.children[2 * node + 1];
+	}
+	// Two leaves can only be arranged in one way.
+	if(leafCount < 3) {
+		return;
+	}
+
+	// Optimal cost of each subset of the treelet leaves, built from smaller subsets.
+	const uint32_t subsetCount = 1u << leafCount;
+	BoundingBox boxes[1 << treeletSize];
+	float costs[1 << treeletSize];
+	uint32_t counts[1 << treeletSize];
+	uint8_t partitions[1 << treeletSize];
+	for(uint32_t set = 1; set < subsetCount; ++set) {
+		const uint32_t lowest = set & (~set + 1);
+		if(set == lowest) {
+			size_t lid = 0;
+			while((1u << lid) != set) {
+				++lid;
+			}
+			boxes[set]	= tree.boxes[leaves[lid]];
+			costs[set]	= tree.costs[leaves[lid]];
+			counts[set] = tree.counts[leaves[lid]];
+			continue;
+		}
+		boxes[set] = boxes[set ^ lowest];
+		boxes[set].merge(boxes[lowest]);
+		counts[set] = counts[set ^ lowest] + counts[lowest];
+		// Each partition is considered once, with its first part containing the lowest leaf.
+		float bestCost		= std::numeric_limits<float>::max();
+		uint32_t bestPart	= lowest;
+		for(uint32_t part = (set - 1) & set; part != 0; part = (part - 1) & set) {
+			if((part & lowest) && costs[part] + costs[set ^ part] < bestCost) {
+				bestCost = costs[part] + costs[set ^ part];
+				bestPart = part;
+			}
+		}
+		const float area = boxes[set].getSurfaceArea();
+		costs[set]		 = _settings.traversalCost * area + bestCost;
+		partitions[set]	 = uint8_t(bestPart);
+		if(counts[set] <= _settings.maxLeafSize) {
+			costs[set] = std::min(costs[set], _settings.leafCost * area * float(counts[set]));
+		}
+	}
+	const uint32_t all = subsetCount - 1;
+	if(costs[all] >= tree.costs[root] * 0.9999f) {
+		return;
+	}
+
+	// Rebuild the treelet with the same internal nodes, then update them from the bottom.
+	uint32_t sets[treeletSize - 1];
+	size_t usedCount = 1;
+	sets[0] = all;
+	for(size_t iid = 0; iid < usedCount; ++iid) {
+		const uint32_t node = internals[iid];
+		const uint32_t set	= sets[iid];
+		const uint32_t parts[2] = {partitions[set], set ^ partitions[set]};
+		for(int c = 0; c < 2; ++c) {
+			const uint32_t part = parts[c];
+			if((part & (part - 1)) == 0) {
+				size_t lid = 0;
+				while((1u << lid) != part) {
+					++lid;
+				}
+				tree.children[2 * node + c] = leaves[lid];
+			} else {
+				sets[usedCount]				= part;
+				tree.children[2 * node + c] = internals[usedCount];
+				++usedCount;
+			}
+		}
+	}
+	for(size_t iid = usedCount; iid > 0; --iid) {
+		updateLinearNode(tree, internals[iid - 1]);
+	}
+}
+
+template<typename LeafCost>
+float Raycaster::cost(const std::vector<Node> & nodes, LeafCost leafCost) const {
+	if(nodes.empty()) {
+		return 0.0f;
+	}
+	const float invArea = 1.0f / std::max(nodes[0].box.getSurfaceArea(), std::numeric_limits<float>::min());
+	float total = 0.0f;
+	for(const Node & node : nodes) {
+		const float nodeCost = node.leaf ? leafCost(node) : _settings.traversalCost;
+		total += node.box.getSurfaceArea() * invArea * nodeCost;
+	}
+	return total;
+}
+
+float Raycaster::cost() const {
+	// A top-level leaf costs the sum of its instances costs, weighted by the probability of hitting each of them.
+	return cost(_topLevel, [this](const Node & leaf) {
+		const float invArea = 1.0f / std::max(leaf.box.getSurfaceArea(), std::numeric_limits<float>::min());
+		float leafCost = 0.0f;
+		for(size_t iid = 0; iid < leaf.right; ++iid) {
+			const Instance & instance = _instances[_instanceIds[leaf.left + iid]];
+			leafCost += _settings.traversalCost + instance.box.getSurfaceArea() * invArea * _geometries[instance.geometry].cost;
+		}
+		return leafCost;
+	});
+}
+
+Raycaster::Hit Raycaster::intersects(const glm::vec3 & origin, const glm::vec3 & direction, float mini, float maxi, const Filter & filter) const {
+	const Ray ray(origin, direction);
+	RAYCASTER_COUNT(rays, 1);
+
+	Hit bestHit;
+	traverse(_topLevelWide, ray, mini, maxi, [this, &ray, &bestHit, &filter, mini](size_t first, size_t count, float & maxDist) {
+		// Test all instances in the leaf.
+		for(size_t iid = first; iid < first + count; ++iid) {
+			const size_t instanceId = _instanceIds[iid];
+			RAYCASTER_COUNT(boxes, 1);
+			if(!Intersection::box(ray, _instances[instanceId].box, mini, maxDist)) {
+				continue;
+			}
+			const Hit hit = intersectsInstance(ray, instanceId, mini, maxDist, filter);
+			// We found a valid hit.
+			if(hit.hit && hit.dist < bestHit.dist) {
+				bestHit = hit;
+				maxDist = bestHit.dist;
+			}
+		}
+		return false;
+	});
+	if(bestHit.hit) {
+		completeHit(ray.pos + bestHit.dist * ray.dir, bestHit);
+	}
+	return bestHit;
+}
+
+bool Raycaster::intersectsAny(const glm::vec3 & origin, const glm::vec3 & direction, float mini, float maxi, const Filter & filter) const {
+	const Ray ray(origin, direction);
+	RAYCASTER_COUNT(rays, 1);
+
+	// Stop at the first intersection found.
+	return traverse(_topLevelWide, ray, mini, maxi, [this, &ray, &filter, mini](size_t first, size_t count, float & maxDist) {
+		for(size_t iid = first; iid < first + count; ++iid) {
+			const size_t instanceId = _instanceIds[iid];
+			RAYCASTER_COUNT(boxes, 1);
+			if(Intersection::box(ray, _instances[instanceId].box, mini, maxDist) && intersectsAnyInstance(ray, instanceId, mini, maxDist, filter)) {
+				return true;
+			}
+		}
+		return false;
+	});
+}
+
+/** \brief Wrapper without SIMD instructions, processing one ray at a time. */
+struct LanesScalar {
+	typedef float Floats; ///< One value.
+	typedef bool Mask;	  ///< One comparison result.
+
+	static const size_t width = 1; ///< Number of rays processed at once.
+
+	static Floats load(const float * src){ return *src; }
+	static void store(float * dst, Floats a){ *dst = a; }
+	static Floats set(float a){ return a; }
+	static Floats add(Floats a, Floats b){ return a + b; }
+	static Floats sub(Floats a, Floats b){ return a - b; }
+	static Floats mul(Floats a, Floats b){ return a * b; }
+	static Floats div(Floats a, Floats b){ return a / b; }
+	static Floats min(Floats a, Floats b){ return std::min(a, b); }
+	static Floats max(Floats a, Floats b){ return std::max(a, b); }
+	static Floats abs(Floats a){ return std::abs(a); }
+	static Floats sqrt(Floats a){ return std::sqrt(a); }
+	static Mask lessThan(Floats a, Floats b){ return a < b; }
+	static Mask lessEqual(Floats a, Floats b){ return a <= b; }
+	static Mask bitAnd(Mask a, Mask b){ return a && b; }
+	static Floats select(Mask m, Floats a, Floats b){ return m ? a : b; }
+	static int bits(Mask m){ return m ? 1 : 0; }
+};
+
+void Raycaster::intersectsPacketScalar(const PacketScene & scene, Packet & packet) {
+	intersectsPacket<LanesScalar>(scene, packet);
+}
+
+Raycaster::PacketKernel Raycaster::packetKernel() {
+	// Check if the CPU and the OS support AVX.
+#if defined(_MSC_VER) && defined(_M_X64)
+	int infos[4];
+	__cpuid(infos, 1);
+	const bool hasXSave = (infos[2] & (1 << 27)) != 0;
+	const bool hasAVX	= hasXSave && (infos[2] & (1 << 28)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+#elif defined(__GNUC__) && defined(__x86_64__)
+	const bool hasAVX = __builtin_cpu_supports("avx");
+#else
+	const bool hasAVX = false;
+#endif
+	if(hasAVX) {
+		Log::Verbose() << "[Raycaster] Using AVX packet traversal." << std::endl;
+		return &intersectsPacketAVX;
+	}
+#if defined(__x86_64__) || defined(_M_X64)
+	Log::Verbose() << "[Raycaster] Using SSE packet traversal." << std::endl;
+	return &intersectsPacketSSE;
+#else
+	Log::Verbose() << "[Raycaster] Using scalar packet traversal." << std::endl;
+	return &intersectsPacketScalar;
+#endif
+}
+
+void Raycaster::intersects(const std::vector<glm::vec3> & origins, const std::vector<glm::vec3> & directions, std::vector<Hit> & hits, float mini, float maxi, const Filter & filter, std::vector<Stats> * stats) const {
+	const size_t rayCount = std::min(origins.size(), directions.size());
+	hits.assign(rayCount, Hit());
+	if(stats) {
+		stats->assign(rayCount, Stats());
+	}
+	if(_topLevel.empty() || rayCount == 0) {
+		return;
+	}
+	static const PacketKernel kernel = packetKernel();
+	std::vector<size_t> stack;
+	const PacketScene scene = packetScene(stack);
+
+	Packet packet;
+	packet.mini	  = mini;
+	packet.anyHit = false;
+	for(size_t first = 0; first < rayCount; first += packetSize) {
+		const size_t count = std::min(packetSize, rayCount - first);
+		// Unused rays have a negative maximum distance and will never hit.
+		for(size_t lid = 0; lid < packetSize; ++lid) {
+			const size_t rid = first + std::min(lid, count - 1);
+			setPacketRay(packet, lid, Ray(origins[rid], directions[rid]), lid < count ? maxi : -1.0f);
+		}
+
+		packet.stats = Stats();
+		kernel(scene, packet);
+		recordPacketStats(packet, count, stats == nullptr ? nullptr : stats->data() + first);
+
+		for(size_t lid = 0; lid < count; ++lid) {
+			if(packet.instance[lid] == packetMiss) {
+				continue;
+			}
+			const Ray ray(origins[first + lid], directions[first + lid]);
+			Hit & hit = hits[first + lid];
+			hit		  = packetHit(packet, lid, ray, packet.dist[lid]);
+			// Packet kernels only read plain data and can't call the filter, complete rejected rays individually.
+			if(filter && !filter(hit)) {
+				const Stats before = threadStats();
+				hit = intersects(ray.pos, ray.dir, mini, maxi, filter);
+				if(statsEnabled && stats) {
+					(*stats)[first + lid] += threadStats() - before;
+				}
+			}
+		}
+	}
+}
+
+void Raycaster::intersectsAny(const std::vector<glm::vec3> & origins, const std::vector<glm::vec3> & directions, const std::vector<float> & maxis, std::vector<bool> & occluded, float mini, const Filter & filter, std::vector<Stats> * stats) const {
+	const size_t rayCount = std::min(std::min(origins.size(), directions.size()), maxis.size());
+	occluded.assign(rayCount, false);
+	if(stats) {
+		stats->assign(rayCount, Stats());
+	}
+	if(_topLevel.empty() || rayCount == 0) {
+		return;
+	}
+	static const PacketKernel kernel = packetKernel();
+	std::vector<size_t> stack;
+	const PacketScene scene = packetScene(stack);
+
+	// Sort the rays by direction octant first, then by origin along a Morton curve over the scene bounds.
+	const BoundingBox & bounds = _topLevel[0].box;
+	const glm::vec3 invSize	   = 1.0f / glm::max(bounds.getSize(), glm::vec3(1e-8f));
+	std::vector<std::pair<uint32_t, uint32_t>> order(rayCount);
+	for(size_t rid = 0; rid < rayCount; ++rid) {
+		const glm::vec3 & dir = directions[rid];
+		const uint32_t octant = (dir.x < 0.0f ? 4 : 0) | (dir.y < 0.0f ? 2 : 0) | (dir.z < 0.0f ? 1 : 0);
+		order[rid]			  = {(octant << 29) | uint32_t(mortonCode((origins[rid] - bounds.minis) * invSize, 10) >> 1), uint32_t(rid)};
+	}
+	std::sort(order.begin(), order.end());
+
+	Packet packet;
+	packet.mini	  = mini;
+	packet.anyHit = true;
+	for(size_t first = 0; first < rayCount; first += packetSize) {
+		const size_t count = std::min(packetSize, rayCount - first);
+		for(size_t lid = 0; lid < packetSize; ++lid) {
+			const size_t rid = order[first + std::min(lid, count - 1)].second;
+			setPacketRay(packet, lid, Ray(origins[rid], directions[rid]), lid < count ? maxis[rid] : -1.0f);
+		}
+
+		packet.stats = Stats();
+		kernel(scene, packet);
+		Stats packetStats[packetSize];
+		recordPacketStats(packet, count, stats == nullptr ? nullptr : packetStats);
+
+		for(size_t lid = 0; lid < count; ++lid) {
+			const size_t rid = order[first + lid].second;
+			if(packet.instance[lid] != packetMiss) {
+				// Packet kernels can't call the filter, search for another hit only if the first one found is rejected.
+				occluded[rid] = !filter || filter(packetHit(packet, lid, Ray(origins[rid], directions[rid]), packet.anyDist[lid]));
+				if(!occluded[rid]) {
+					const Stats before = threadStats();
+					occluded[rid] = intersectsAny(origins[rid], directions[rid], mini, maxis[rid], filter);
+					if(statsEnabled && stats) {
+						packetStats[lid] += threadStats() - before;
+					}
+				}
+			}
+			if(statsEnabled && stats) {
+				(*stats)[rid] = packetStats[lid];
+			}
+		}
+	}
+}
+
+void Raycaster::updatePackets() {
+	_packetGeometries.resize(_geometries.size());
+	_packetDepth = 0;
+	for(size_t gid = 0; gid < _geometries.size(); ++gid) {
+		const Geometry & geometry  = _geometries[gid];
+		_packetGeometries[gid]	   = {geometry.hierarchy.data(), geometry.triangles.data(), int(geometry.shape)};
+		_packetDepth			   = std::max(_packetDepth, geometry.depth);
+	}
+	_packetInstances.resize(_instances.size());
+	for(size_t iid = 0; iid < _instances.size(); ++iid) {
+		updatePacketInstance(iid);
+	}
+}
+
+void Raycaster::updatePacketInstance(size_t instanceId) {
+	// Instances added since the last hierarchy update are not traversed yet.
+	if(instanceId >= _packetInstances.size()) {
+		return;
+	}
+	const Instance & instance = _instances[instanceId];
+	PacketInstance & infos	  = _packetInstances[instanceId];
+	for(int r = 0; r < 3; ++r) {
+		for(int c = 0; c < 4; ++c) {
+			infos.toLocal[r][c] = instance.invModel[c][r];
+		}
+	}
+	infos.geometry = instance.geometry;
+	infos.identity = instance.identity;
+}
+
+Raycaster::PacketScene Raycaster::packetScene(std::vector<size_t> & stack) const {
+	// Each visited node pushes its two children, the stack never contains more elements than the depth of the hierarchy plus one.
+	stack.resize(_topLevelDepth + _packetDepth + 2);
+	return {_topLevel.data(), _instanceIds.data(), _packetInstances.data(), _packetGeometries.data(), stack.data()};
+}
+
+Raycaster::Hit Raycaster::packetHit(const Packet & packet, size_t lid, const Ray & ray, float dist) const {
+	const Geometry & geometry = _geometries[_instances[packet.instance[lid]].geometry];
+	const bool isShape		  = geometry.shape != Shape::Mesh;
+	const uint32_t localId	  = isShape ? 0 : geometry.localIds[packet.triangle[lid]];
+	Hit hit(dist, packet.u[lid], packet.v[lid], localId, packet.instance[lid]);
+	hit.internalId = packet.triangle[lid];
+	// Parametric coordinates of analytic shapes are only computed for the returned hits.
+	completeHit(ray.pos + hit.dist * ray.dir, hit);
+	return hit;
+}
+
+void Raycaster::recordPacketStats(const Packet & packet, size_t count, Stats * stats) {
+#ifdef RAYCASTER_STATS
+	// Each ray is charged the work of the whole packet.
+	for(size_t lid = 0; lid < count; ++lid) {
+		Stats rayStats		= packet.stats;
+		rayStats.rays		= 1;
+		rayStats.hits		= packet.hitCounts[lid];
+		threadCounters += rayStats;
+		if(stats) {
+			stats[lid] = rayStats;
+		}
+	}
+#else
+	(void)packet;
+	(void)count;
+	(void)stats;
+#endif
+}
+
+void Raycaster::setPacketRay(Packet & packet, size_t lid, const Ray & ray, float maxi) {
+	for(int c = 0; c < 3; ++c) {
+		packet.world.pos[c][lid]	= ray.pos[c];
+		packet.world.dir[c][lid]	= ray.dir[c];
+		packet.world.invdir[c][lid] = ray.invdir[c];
+	}
+	packet.dist[lid]	 = maxi;
+	packet.anyDist[lid]	 = maxi;
+	packet.u[lid]		 = 0.0f;
+	packet.v[lid]		 = 0.0f;
+	packet.triangle[lid]  = 0;
+	packet.instance[lid]  = packetMiss;
+	packet.hitCounts[lid] = 0;
+}
+
+bool Raycaster::visible(const glm::vec3 & p0, const glm::vec3 & p1) const {
+	const glm::vec3 direction = p1 - p0;
+	const float maxi		  = glm::length(direction);
+	return !intersectsAny(p0, direction, 0.0001f, maxi);
+}
+
+Raycaster::Hit Raycaster::closestPoint(const glm::vec3 & point, float maxi) const {
+	ClosestPoint closest;
+	closest.hit.dist = maxi;
+	traverseClosest(_topLevelWide, point, maxi, [this, &point, &closest](size_t first, size_t count, float & maxDist) {
+		// Test all instances in the leaf.
+		for(size_t iid = first; iid < first + count; ++iid) {
+			const size_t instanceId = _instanceIds[iid];
+			const BoundingBox & box = _instances[instanceId].box;
+			const glm::vec3 delta	= glm::max(glm::max(box.minis - point, point - box.maxis), glm::vec3(0.0f));
+			RAYCASTER_COUNT(boxes, 1);
+			if(glm::length(delta) > maxDist) {
+				continue;
+			}
+			closestPointInstance(point, instanceId, closest);
+			maxDist = closest.hit.dist;
+		}
+	});
+	if(!closest.hit.hit) {
+		return Hit();
+	}
+	completeHit(closest.position, closest.hit);
+	return closest.hit;
+}
+
+void Raycaster::closestPoints(const std::vector<glm::vec3> & points, std::vector<Hit> & hits, float maxi) const {
+	hits.resize(points.size());
+	System::forParallel(0, points.size(), [this, &points, &hits, maxi](size_t pid) {
+		hits[pid] = closestPoint(points[pid], maxi);
+	});
+}
+
+void Raycaster::closestPointInstance(const glm::vec3 & point, size_t instanceId, ClosestPoint & closest) const {
+	const Instance & instance = _instances[instanceId];
+	const Geometry & geometry = _geometries[instance.geometry];
+	// Keep the candidate if it is closer, or as close but facing the query location more.
+	auto consider = [&point, &closest, instanceId](const glm::vec3 & position, const glm::vec3 & normal, size_t tid, unsigned long localId, float u, float v) {
+		// Relative tolerance under which two points are considered at the same distance.
+		const float tieEpsilon = 1e-4f;
+		const glm::vec3 offset = point - position;
+		const float dist	   = glm::length(offset);
+		if(dist > closest.hit.dist * (1.0f + tieEpsilon) || (!closest.hit.hit && dist > closest.hit.dist)) {
+			return;
+		}
+		const float normalLength = glm::length(normal);
+		// Degenerate triangles are never preferred.
+		const float alignment = normalLength == 0.0f ? 0.0f : (dist > 0.0f ? std::abs(glm::dot(offset, normal)) / (dist * normalLength) : 1.0f);
+		if(closest.hit.hit && dist >= closest.hit.dist * (1.0f - tieEpsilon) && alignment <= closest.alignment) {
+			return;
+		}
+		closest.hit			   = Hit(std::min(dist, closest.hit.dist), u, v, localId, static_cast<unsigned long>(instanceId));
+		closest.hit.internalId = static_cast<unsigned long>(tid);
+		closest.position	   = position;
+		closest.alignment	   = alignment;
+	};
+
+	if(geometry.shape != Shape::Mesh) {
+		RAYCASTER_COUNT(primitives, 1);
+		const glm::vec3 local	 = glm::vec3(instance.invModel * glm::vec4(point, 1.0f));
+		const glm::vec3 position = closestOnShape(local, geometry.shape);
+		glm::vec2 uv;
+		glm::vec3 normal, tangent;
+		shapeFrame(geometry.shape, position, uv, normal, tangent);
+		// Normals are transformed by the inverse transpose of the model matrix.
+		consider(glm::vec3(instance.model * glm::vec4(position, 1.0f)), glm::transpose(glm::mat3(instance.invModel)) * normal, 0, 0, uv.x, uv.y);
+		return;
+	}
+
+	// Traverse the mesh hierarchy in mesh space, bounding world space distances from below.
+	const glm::vec3 local = instance.identity ? point : glm::vec3(instance.invModel * glm::vec4(point, 1.0f));
+	traverseClosest(geometry.wide, local, closest.hit.dist / instance.minScale, [&geometry, &instance, &closest, &consider, &point](size_t first, size_t count, float & maxDist) {
+		RAYCASTER_COUNT(primitives, count);
+		for(size_t tid = first; tid < first + count; ++tid) {
+			glm::vec3 v0, v1, v2;
+			getTriangle(geometry, tid, v0, v1, v2);
+			if(!instance.identity) {
+				v0 = glm::vec3(instance.model * glm::vec4(v0, 1.0f));
+				v1 = glm::vec3(instance.model * glm::vec4(v1, 1.0f));
+				v2 = glm::vec3(instance.model * glm::vec4(v2, 1.0f));
+			}
+			float u, v;
+			const glm::vec3 position = closestOnTriangle(point, v0, v1, v2, u, v);
+			// The normal of slivers is unreliable, treat them as degenerate.
+			const glm::vec3 e1 = v1 - v0;
+			const glm::vec3 e2 = v2 - v0;
+			const glm::vec3 normal = glm::cross(e1, e2);
+			const bool sliver	   = glm::length(normal) <= 1e-5f * (glm::dot(e1, e1) + glm::dot(e2, e2));
+			consider(position, sliver ? glm::vec3(0.0f) : normal, tid, geometry.localIds[tid], u, v);
+		}
+		maxDist = closest.hit.dist / instance.minScale;
+	});
+}
+
+glm::vec3 Raycaster::position(const Hit & hit) const {
+	const Instance & instance = _instances[hit.meshId];
+	const Geometry & geometry = _geometries[instance.geometry];
+	glm::vec3 local;
+	if(geometry.shape == Shape::Sphere) {
+		// Invert the longitude and latitude parametrization.
+		const float phi	  = (hit.u - 0.5f) * glm::two_pi<float>();
+		const float theta = hit.v * glm::pi<float>();
+		local = glm::vec3(std::sin(theta) * std::sin(phi), std::cos(theta), std::sin(theta) * std::cos(phi));
+	} else if(geometry.shape != Shape::Mesh) {
+		local = glm::vec3(2.0f * hit.u - 1.0f, 2.0f * hit.v - 1.0f, 0.0f);
+	} else {
+		glm::vec3 v0, v1, v2;
+		getTriangle(geometry, hit.internalId, v0, v1, v2);
+		local = hit.w * v0 + hit.u * v1 + hit.v * v2;
+	}
+	return instance.identity ? local : glm::vec3(instance.model * glm::vec4(local, 1.0f));
+}
+
+void Raycaster::bakeDistanceField(const BoundingBox & bounds, const glm::uvec3 & resolution, Texture & field, float maxi) const {
+	field.clearImages();
+	field.shape	 = TextureShape::D3;
+	field.width	 = resolution.x;
+	field.height = resolution.y;
+	field.depth	 = resolution.z;
+	field.levels = 1;
+
+	const glm::vec3 voxelSize = bounds.getSize() / glm::vec3(resolution);
+	std::vector<glm::vec3> points(size_t(resolution.x) * resolution.y);
+	std::vector<Hit> hits;
+	for(uint z = 0; z < resolution.z; ++z) {
+		// Query the voxels centers of each slice together.
+		for(uint y = 0; y < resolution.y; ++y) {
+			for(uint x = 0; x < resolution.x; ++x) {
+				points[y * resolution.x + x] = bounds.minis + (glm::vec3(x, y, z) + 0.5f) * voxelSize;
+			}
+		}
+		closestPoints(points, hits, maxi);
+
+		field.images.emplace_back(resolution.x, resolution.y, 1, maxi);
+		Image & slice = field.images.back();
+		for(uint y = 0; y < resolution.y; ++y) {
+			for(uint x = 0; x < resolution.x; ++x) {
+				const size_t pid = y * resolution.x + x;
+				const Hit & hit	 = hits[pid];
+				if(!hit.hit) {
+					continue;
+				}
+				// Locations behind the closest surface are inside.
+				const bool inside		= glm::dot(points[pid] - position(hit), hit.normal) < 0.0f;
+				slice.r(int(x), int(y)) = inside ? -hit.dist : hit.dist;
+			}
+		}
+	}
+	Log::Info() << "[Raycaster] Distance field baked, " << resolution.x << "x" << resolution.y << "x" << resolution.z << " voxels." << std::endl;
+}
+
+Raycaster::Hit Raycaster::sphereCast(const glm::vec3 & origin, const glm::vec3 & direction, float radius, float maxi) const {
+	return capsuleCast(origin, origin, direction, radius, maxi);
+}
+
+Raycaster::Hit Raycaster::capsuleCast(const glm::vec3 & p0, const glm::vec3 & p1, const glm::vec3 & direction, float radius, float maxi) const {
+	const Ray ray(p0, direction);
+	const glm::vec3 axis = p1 - p0;
+	RAYCASTER_COUNT(rays, 1);
+
+	// Grow the boxes so that the first end enters them whenever the capsule overlaps them.
+	Inflation inflation;
+	inflation.lower = glm::max(axis, 0.0f) + radius;
+	inflation.upper = glm::max(-axis, 0.0f) + radius;
+
+	Hit bestHit;
+	bestHit.dist = maxi;
+	glm::vec3 contact(0.0f);
+	traverse(_topLevelWide, ray, 0.0f, maxi, [this, &ray, &axis, &inflation, &bestHit, &contact, radius](size_t first, size_t count, float & maxDist) {
+		// Test all instances in the leaf.
+		for(size_t iid = first; iid < first + count; ++iid) {
+			const size_t instanceId = _instanceIds[iid];
+			const BoundingBox & box = _instances[instanceId].box;
+			RAYCASTER_COUNT(boxes, 1);
+			if(!Intersection::box(ray, BoundingBox(box.minis - inflation.lower, box.maxis + inflation.upper), 0.0f, maxDist)) {
+				continue;
+			}
+			sweepInstance(ray, axis, radius, instanceId, bestHit, contact);
+			maxDist = bestHit.dist;
+		}
+		return false;
+	}, &inflation);
+	if(!bestHit.hit) {
+		return Hit();
+	}
+	completeHit(contact, bestHit);
+	// The contact normal points from the contact to the closest point on the capsule axis.
+	const glm::vec3 start	= ray.pos + bestHit.dist * ray.dir;
+	const float axisLength2 = glm::dot(axis, axis);
+	const float along		= axisLength2 > 0.0f ? glm::clamp(glm::dot(contact - start, axis) / axisLength2, 0.0f, 1.0f) : 0.0f;
+	const glm::vec3 normal	= start + along * axis - contact;
+	const float normalLength = glm::length(normal);
+	if(normalLength > 1e-6f * radius) {
+		bestHit.normal = normal / normalLength;
+	} else if(glm::dot(bestHit.normal, ray.dir) > 0.0f) {
+		// Overlapping the surface, use its normal facing the motion.
+		bestHit.normal = -bestHit.normal;
+	}
+	return bestHit;
+}
+
+/** Check if a linear transformation is a similarity, scaling all directions by the same amount.
+ \param frame the transformation
+ \return true if angles are preserved
+ */
+static bool preservesAngles(const glm::mat3 & frame) {
+	const float scale2	  = glm::dot(frame[0], frame[0]);
+	const float tolerance = 1e-4f * scale2;
+	return std::abs(glm::dot(frame[1], frame[1]) - scale2) <= tolerance && std::abs(glm::dot(frame[2], frame[2]) - scale2) <= tolerance && std::abs(glm::dot(frame[0], frame[1])) <= tolerance && std::abs(glm::dot(frame[0], frame[2])) <= tolerance && std::abs(glm::dot(frame[1], frame[2])) <= tolerance;
+}
+
+void Raycaster::sweepInstance(const Ray & ray, const glm::vec3 & axis, float radius, size_t instanceId, Hit & hit, glm::vec3 & contact) const {
+	const Instance & instance = _instances[instanceId];
+	const Geometry & geometry = _geometries[instance.geometry];
+	const unsigned long meshId = static_cast<unsigned long>(instanceId);
+	float dist;
+	glm::vec3 point;
+
+	if(geometry.shape == Shape::Sphere && preservesAngles(glm::mat3(instance.model))) {
+		RAYCASTER_COUNT(primitives, 1);
+		// The capsule touches the sphere when its axis comes closer to the center than the sum of the radii.
+		const glm::vec3 center	= glm::vec3(instance.model[3]);
+		const float shapeRadius = glm::length(glm::vec3(instance.model[0]));
+		if(!sweep(ray, axis, radius + shapeRadius, center, center, center, hit.dist, dist, point)) {
+			return;
+		}
+		const glm::vec3 start	= ray.pos + dist * ray.dir;
+		const float axisLength2 = glm::dot(axis, axis);
+		const float along		= axisLength2 > 0.0f ? glm::clamp(glm::dot(center - start, axis) / axisLength2, 0.0f, 1.0f) : 0.0f;
+		const glm::vec3 offset	= start + along * axis - center;
+		const float offsetLength = glm::length(offset);
+		hit		= Hit(dist, 0.0f, 0.0f, 0, meshId);
+		contact = center + shapeRadius * (offsetLength > 0.0f ? offset / offsetLength : -ray.dir);
+		return;
+	}
+
+	if(geometry.shape == Shape::Sphere) {
+		// Ellipsoids are approximated by a latitude-longitude polyhedron.
+		const uint sides = 32;
+		const uint rings = 16;
+		auto vertex = [&instance](uint ring, uint side) {
+			const float theta = glm::pi<float>() * float(ring) / float(rings);
+			const float phi	  = glm::two_pi<float>() * float(side) / float(sides);
+			const glm::vec3 local(std::sin(theta) * std::sin(phi), std::cos(theta), std::sin(theta) * std::cos(phi));
+			return glm::vec3(instance.model * glm::vec4(local, 1.0f));
+		};
+		RAYCASTER_COUNT(primitives, 2 * sides * (rings - 1));
+		for(uint ring = 0; ring < rings; ++ring) {
+			for(uint side = 0; side < sides; ++side) {
+				const glm::vec3 v00 = vertex(ring, side);
+				const glm::vec3 v01 = vertex(ring, side + 1);
+				const glm::vec3 v10 = vertex(ring + 1, side);
+				const glm::vec3 v11 = vertex(ring + 1, side + 1);
+				// Skip the degenerate triangles at the poles.
+				if(ring != 0 && sweep(ray, axis, radius, v00, v10, v01, hit.dist, dist, point)) {
+					hit		= Hit(dist, 0.0f, 0.0f, 0, meshId);
+					contact = point;
+				}
+				if(ring + 1 != rings && sweep(ray, axis, radius, v01, v10, v11, hit.dist, dist, point)) {
+					hit		= Hit(dist, 0.0f, 0.0f, 0, meshId);
+					contact = point;
+				}
+			}
+		}
+		return;
+	}
+
+	if(geometry.shape != Shape::Mesh) {
+		// Sweep against the shape outline, disks are approximated by a polygon.
+		const uint sides = geometry.shape == Shape::Quad ? 4 : 32;
+		glm::vec3 corners[32];
+		for(uint sid = 0; sid < sides; ++sid) {
+			const float angle	   = glm::two_pi<float>() * float(sid) / float(sides);
+			const glm::vec2 corner = geometry.shape == Shape::Quad ? glm::vec2(sid == 1 || sid == 2 ? 1.0f : -1.0f, sid >= 2 ? 1.0f : -1.0f) : glm::vec2(std::cos(angle), std::sin(angle));
+			corners[sid] = glm::vec3(instance.model * glm::vec4(corner, 0.0f, 1.0f));
+		}
+		RAYCASTER_COUNT(primitives, sides - 2);
+		for(uint sid = 1; sid + 1 < sides; ++sid) {
+			if(sweep(ray, axis, radius, corners[0], corners[sid], corners[sid + 1], hit.dist, dist, point)) {
+				hit		= Hit(dist, 0.0f, 0.0f, 0, meshId);
+				contact = point;
+			}
+		}
+		return;
+	}
+
+	// Traverse the mesh hierarchy in mesh space, where the world space radius is at most scaled by the inverse of the instance minimal scale.
+	float scale		= 1.0f;
+	const Ray local = instance.identity ? ray : localRay(ray, instance, scale);
+	const glm::vec3 localAxis = instance.identity ? axis : glm::mat3(instance.invModel) * axis;
+	const float localRadius	  = radius / instance.minScale;
+	Inflation inflation;
+	inflation.lower = glm::max(localAxis, 0.0f) + localRadius;
+	inflation.upper = glm::max(-localAxis, 0.0f) + localRadius;
+
+	traverse(geometry.wide, local, 0.0f, hit.dist * scale, [&geometry, &instance, &ray, &axis, &hit, &contact, radius, meshId, scale](size_t first, size_t count, float & maxDist) {
+		RAYCASTER_COUNT(primitives, count);
+		for(size_t tid = first; tid < first + count; ++tid) {
+			glm::vec3 v0, v1, v2;
+			getTriangle(geometry, tid, v0, v1, v2);
+			if(!instance.identity) {
+				v0 = glm::vec3(instance.model * glm::vec4(v0, 1.0f));
+				v1 = glm::vec3(instance.model * glm::vec4(v1, 1.0f));
+				v2 = glm::vec3(instance.model * glm::vec4(v2, 1.0f));
+			}
+			float dist;
+			glm::vec3 point;
+			if(!sweep(ray, axis, radius, v0, v1, v2, hit.dist, dist, point)) {
+				continue;
+			}
+			float u, v;
+			closestOnTriangle(point, v0, v1, v2, u, v);
+			hit			   = Hit(dist, u, v, geometry.localIds[tid], meshId);
+			hit.internalId = static_cast<unsigned long>(tid);
+			contact		   = point;
+		}
+		maxDist = hit.dist * scale;
+		return false;
+	}, &inflation);
+}
+
+Ray Raycaster::localRay(const Ray & ray, const Instance & instance, float & scale) {
+	const glm::vec3 localPos = glm::vec3(instance.invModel * glm::vec4(ray.pos, 1.0f));
+	const glm::vec3 localDir = glm::vec3(instance.invModel * glm::vec4(ray.dir, 0.0f));
+	// The world space direction is normalized, the length of the local one gives the scaling of distances.
+	scale = glm::length(localDir);
+	return Ray(localPos, localDir);
+}
+
+Raycaster::Hit Raycaster::intersectsInstance(const Ray & ray, size_t instanceId, float mini, float maxi, const Filter & filter) const {
+	const Instance & instance = _instances[instanceId];
+	const Geometry & geometry = _geometries[instance.geometry];
+
+	// Move to mesh space if needed.
+	float scale		= 1.0f;
+	const Ray local = instance.identity ? ray : localRay(ray, instance, scale);
+
+	Hit bestHit;
+	bestHit.meshId = static_cast<unsigned long>(instanceId);
+	if(geometry.shape != Shape::Mesh) {
+		intersects(local, geometry.shape, mini * scale, maxi * scale, filter, scale, bestHit);
+		bestHit.dist /= scale;
+		return bestHit;
+	}
+	traverse(geometry.wide, local, mini * scale, maxi * scale, [&geometry, &local, &bestHit, &filter, mini, scale](size_t first, size_t count, float & maxDist) {
+		// Test all triangles in the leaf.
+		if(intersects(local, geometry, first, count, mini * scale, maxDist, filter, scale, bestHit)) {
+			maxDist = bestHit.dist;
+		}
+		return false;
+	});
+	// Back to world space.
+	bestHit.dist /= scale;
+	return bestHit;
+}
+
+bool Raycaster::intersectsAnyInstance(const Ray & ray, size_t instanceId, float mini, float maxi, const Filter & filter) const {
+	const Instance & instance = _instances[instanceId];
+	const Geometry & geometry = _geometries[instance.geometry];
+
+	// Move to mesh space if needed.
+	float scale		= 1.0f;
+	const Ray local = instance.identity ? ray : localRay(ray, instance, scale);
+
+	if(geometry.shape != Shape::Mesh) {
+		Hit hit;
+		hit.meshId = static_cast<unsigned long>(instanceId);
+		return intersects(local, geometry.shape, mini * scale, maxi * scale, filter, scale, hit);
+	}
+	// Stop at the first intersection found.
+	return traverse(geometry.wide, local, mini * scale, maxi * scale, [&geometry, &local, &filter, instanceId, mini, scale](size_t first, size_t count, float & maxDist) {
+		Hit hit;
+		hit.meshId = static_cast<unsigned long>(instanceId);
+		return intersects(local, geometry, first, count, mini * scale, maxDist, filter, scale, hit);
+	});
+}
+
+void Raycaster::getTriangle(const Geometry & geometry, size_t tid, glm::vec3 & v0, glm::vec3 & v1, glm::vec3 & v2) {
+	const TriangleBlock & block = geometry.triangles[tid / blockSize];
+	const size_t bid			= tid % blockSize;
+	v0 = glm::vec3(block.v0[0][bid], block.v0[1][bid], block.v0[2][bid]);
+	v1 = v0 + glm::vec3(block.e1[0][bid], block.e1[1][bid], block.e1[2][bid]);
+	v2 = v0 + glm::vec3(block.e2[0][bid], block.e2[1][bid], block.e2[2][bid]);
+}
+
+bool Raycaster::intersects(const Ray & ray, const Geometry & geometry, size_t first, size_t count, float mini, float maxi, const Filter & filter, float scale, Hit & hit) {
+	// Implement Moller-Trumbore intersection test.
+	size_t bestId = noTriangle;
+	float bestU = 0.0f, bestV = 0.0f;
+	float ts[blockSize], us[blockSize], vs[blockSize];
+	const size_t end = first + count;
+	for(size_t begin = first - first % blockSize; begin < end; begin += blockSize) {
+		const TriangleBlock & block = geometry.triangles[begin / blockSize];
+		// Only test the triangles of the block in the range.
+		const size_t blockFirst = first > begin ? first - begin : 0;
+		const size_t blockCount = std::min(blockSize, end - begin);
+		int mask = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+		// Test the whole block at once.
+		const __m128 dir[3] = {_mm_set1_ps(ray.dir[0]), _mm_set1_ps(ray.dir[1]), _mm_set1_ps(ray.dir[2])};
+		const __m128 e1[3]	= {_mm_load_ps(block.e1[0]), _mm_load_ps(block.e1[1]), _mm_load_ps(block.e1[2])};
+		const __m128 e2[3]	= {_mm_load_ps(block.e2[0]), _mm_load_ps(block.e2[1]), _mm_load_ps(block.e2[2])};
+		// p = dir x e2
+		const __m128 p[3] = {
+			_mm_sub_ps(_mm_mul_ps(dir[1], e2[2]), _mm_mul_ps(dir[2], e2[1])),
+			_mm_sub_ps(_mm_mul_ps(dir[2], e2[0]), _mm_mul_ps(dir[0], e2[2])),
+			_mm_sub_ps(_mm_mul_ps(dir[0], e2[1]), _mm_mul_ps(dir[1], e2[0]))};
+		const __m128 det	= _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1[0], p[0]), _mm_mul_ps(e1[1], p[1])), _mm_mul_ps(e1[2], p[2]));
+		const __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+		// q = pos - v0
+		const __m128 q[3] = {
+			_mm_sub_ps(_mm_set1_ps(ray.pos[0]), _mm_load_ps(block.v0[0])),
+			_mm_sub_ps(_mm_set1_ps(ray.pos[1]), _mm_load_ps(block.v0[1])),
+			_mm_sub_ps(_mm_set1_ps(ray.pos[2]), _mm_load_ps(block.v0[2]))};
+		const __m128 u = _mm_mul_ps(invDet, _mm_add_ps(_mm_add_ps(_mm_mul_ps(q[0], p[0]), _mm_mul_ps(q[1], p[1])), _mm_mul_ps(q[2], p[2])));
+		// r = q x e1
+		const __m128 r[3] = {
+			_mm_sub_ps(_mm_mul_ps(q[1], e1[2]), _mm_mul_ps(q[2], e1[1])),
+			_mm_sub_ps(_mm_mul_ps(q[2], e1[0]), _mm_mul_ps(q[0], e1[2])),
+			_mm_sub_ps(_mm_mul_ps(q[0], e1[1]), _mm_mul_ps(q[1], e1[0]))};
+		const __m128 v = _mm_mul_ps(invDet, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dir[0], r[0]), _mm_mul_ps(dir[1], r[1])), _mm_mul_ps(dir[2], r[2])));
+		const __m128 t = _mm_mul_ps(invDet, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2[0], r[0]), _mm_mul_ps(e2[1], r[1])), _mm_mul_ps(e2[2], r[2])));
+
+		const __m128 zero	= _mm_setzero_ps();
+		const __m128 one	= _mm_set1_ps(1.0f);
+		const __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+		__m128 valid = _mm_cmpge_ps(absDet, _mm_set1_ps(std::numeric_limits<float>::epsilon()));
+		valid		 = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+		valid		 = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+		valid		 = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, _mm_set1_ps(mini)), _mm_cmplt_ps(t, _mm_set1_ps(maxi))));
+		mask = _mm_movemask_ps(valid) & ((1 << blockCount) - (1 << blockFirst));
+		_mm_storeu_ps(ts, t);
+		_mm_storeu_ps(us, u);
+		_mm_storeu_ps(vs, v);
+#else
+		for(size_t bid = blockFirst; bid < blockCount; ++bid) {
+			const glm::vec3 v01(block.e1[0][bid], block.e1[1][bid], block.e1[2][bid]);
+			const glm::vec3 v02(block.e2[0][bid], block.e2[1][bid], block.e2[2][bid]);
+			const glm::vec3 p  = glm::cross(ray.dir, v02);
+			const float det	   = glm::dot(v01, p);
+			if(std::abs(det) < std::numeric_limits<float>::epsilon()) {
+				continue;
+			}
+			const float invDet = 1.0f / det;
+			const glm::vec3 q  = ray.pos - glm::vec3(block.v0[0][bid], block.v0[1][bid], block.v0[2][bid]);
+			const glm::vec3 r  = glm::cross(q, v01);
+			us[bid] = invDet * glm::dot(q, p);
+			vs[bid] = invDet * glm::dot(ray.dir, r);
+			ts[bid] = invDet * glm::dot(v02, r);
+			if(us[bid] >= 0.0f && us[bid] <= 1.0f && vs[bid] >= 0.0f && (us[bid] + vs[bid]) <= 1.0f && ts[bid] > mini && ts[bid] < maxi) {
+				mask |= 1 << bid;
+			}
+		}
+#endif
+		RAYCASTER_COUNT(primitives, blockCount - blockFirst);
+#ifdef RAYCASTER_STATS
+		for(int bits = mask; bits != 0; bits &= bits - 1) {
+			RAYCASTER_COUNT(hits, 1);
+		}
+#endif
+		if(filter) {
+			// Submit candidates from near to far, the first accepted one is the closest hit of the block.
+			while(mask != 0) {
+				size_t nearest = blockSize;
+				for(size_t bid = blockFirst; bid < blockCount; ++bid) {
+					if((mask & (1 << bid)) && (nearest == blockSize || ts[bid] < ts[nearest])) {
+						nearest = bid;
+					}
+				}
+				mask &= ~(1 << nearest);
+				if(ts[nearest] >= maxi) {
+					break;
+				}
+				Hit candidate(ts[nearest] / scale, us[nearest], vs[nearest], geometry.localIds[begin + nearest], hit.meshId);
+				candidate.internalId = static_cast<unsigned long>(begin + nearest);
+				if(filter(candidate)) {
+					maxi   = ts[nearest];
+					bestU  = us[nearest];
+					bestV  = vs[nearest];
+					bestId = begin + nearest;
+					break;
+				}
+			}
+			continue;
+		}
+		// Keep the closest hit.
+		for(size_t bid = blockFirst; bid < blockCount; ++bid) {
+			if((mask & (1 << bid)) && ts[bid] < maxi) {
+				maxi   = ts[bid];
+				bestU  = us[bid];
+				bestV  = vs[bid];
+				bestId = begin + bid;
+			}
+		}
+	}
+	if(bestId == noTriangle) {
+		return false;
+	}
+	hit			   = Hit(maxi, bestU, bestV, geometry.localIds[bestId], hit.meshId);
+	hit.internalId = static_cast<unsigned long>(bestId);
+	return true;
+}
+
+bool Raycaster::intersects(const Ray & ray, Shape shape, float mini, float maxi, const Filter & filter, float scale, Hit & hit) {
+	RAYCASTER_COUNT(primitives, 1);
+	// Candidate distances, from near to far.
+	float ts[2];
+	int count = 0;
+	if(shape == Shape::Sphere) {
+		glm::vec2 roots;
+		if(!Intersection::sphere(ray.pos, ray.dir, 1.0f, roots)) {
+			return false;
+		}
+		ts[count++] = roots[0];
+		ts[count++] = roots[1];
+	} else {
+		// Quads and disks lie in the XY plane.
+		if(std::abs(ray.dir.z) < std::numeric_limits<float>::epsilon()) {
+			return false;
+		}
+		const float t	  = -ray.pos.z / ray.dir.z;
+		const glm::vec2 p = glm::vec2(ray.pos) + t * glm::vec2(ray.dir);
+		const bool inside = shape == Shape::Quad ? (std::abs(p.x) <= 1.0f && std::abs(p.y) <= 1.0f) : glm::dot(p, p) <= 1.0f;
+		if(!inside) {
+			return false;
+		}
+		ts[count++] = t;
+	}
+	for(int i = 0; i < count; ++i) {
+		if(ts[i] <= mini || ts[i] >= maxi) {
+			continue;
+		}
+		RAYCASTER_COUNT(hits, 1);
+		glm::vec2 uv;
+		glm::vec3 normal, tangent;
+		shapeFrame(shape, ray.pos + ts[i] * ray.dir, uv, normal, tangent);
+		Hit candidate(ts[i] / scale, uv.x, uv.y, 0, hit.meshId);
+		candidate.w = 0.0f;
+		if(filter && !filter(candidate)) {
+			continue;
+		}
+		hit		 = candidate;
+		hit.dist = ts[i];
+		return true;
+	}
+	return false;
+}
+
+void Raycaster::shapeFrame(Shape shape, const glm::vec3 & point, glm::vec2 & uv, glm::vec3 & normal, glm::vec3 & tangent) {
+	if(shape != Shape::Sphere) {
+		uv		= 0.5f * glm::vec2(point) + 0.5f;
+		normal	= glm::vec3(0.0f, 0.0f, 1.0f);
+		tangent = glm::vec3(1.0f, 0.0f, 0.0f);
+		return;
+	}
+	// Longitude around the Y axis, latitude from the north pole.
+	normal	= glm::normalize(point);
+	uv.x	= std::atan2(normal.x, normal.z) / glm::two_pi<float>() + 0.5f;
+	uv.y	= std::acos(glm::clamp(normal.y, -1.0f, 1.0f)) / glm::pi<float>();
+	tangent = glm::vec3(normal.z, 0.0f, -normal.x);
+	const float tangentLength = glm::length(tangent);
+	// The longitude is undefined at the poles.
+	tangent = tangentLength > 1e-6f ? tangent / tangentLength : glm::vec3(1.0f, 0.0f, 0.0f);
+}
+
+/** Find when a moving point first comes within a distance of a fixed point.
+ \param origin the moving point initial position
+ \param dir the normalized motion direction
+ \param center the fixed point
+ \param radius the distance
+ \param dist will contain the distance travelled, zero if initially close enough
+ \return true if the moving point comes close enough
+ */
+static bool sweepPoint(const glm::vec3 & origin, const glm::vec3 & dir, const glm::vec3 & center, float radius, float & dist) {
+	const glm::vec3 offset = origin - center;
+	const float radius2	   = radius * radius;
+	if(glm::dot(offset, offset) <= radius2) {
+		dist = 0.0f;
+		return true;
+	}
+	const float b = glm::dot(offset, dir);
+	if(b >= 0.0f) {
+		return false;
+	}
+	// Compute the discriminant from the closest approach vector, a difference of squared distances loses too much precision far from the center.
+	const glm::vec3 closest = offset - b * dir;
+	const float delta		= radius2 - glm::dot(closest, closest);
+	if(delta < 0.0f) {
+		return false;
+	}
+	dist = -b - std::sqrt(delta);
+	return true;
+}
+
+/** Find when a moving point first comes within a distance of a fixed segment, closer to its interior than to its ends.
+ \param origin the moving point initial position
+ \param dir the normalized motion direction
+ \param a the segment first end
+ \param b the segment second end
+ \param radius the distance
+ \param dist will contain the distance travelled, zero if initially close enough
+ \return true if the moving point comes close enough to the segment interior
+ */
+static bool sweepSegment(const glm::vec3 & origin, const glm::vec3 & dir, const glm::vec3 & a, const glm::vec3 & b, float radius, float & dist) {
+	const glm::vec3 segment = b - a;
+	const float length2		= glm::dot(segment, segment);
+	if(length2 == 0.0f) {
+		return false;
+	}
+	// Work with the components orthogonal to the segment.
+	const glm::vec3 offset	 = origin - a;
+	const glm::vec3 offsetT	 = offset - (glm::dot(offset, segment) / length2) * segment;
+	const glm::vec3 dirT	 = dir - (glm::dot(dir, segment) / length2) * segment;
+	const float radius2 = radius * radius;
+	if(glm::dot(offsetT, offsetT) <= radius2) {
+		dist = 0.0f;
+	} else {
+		const float qa	  = glm::dot(dirT, dirT);
+		const float qb	  = glm::dot(offsetT, dirT);
+		if(qb >= 0.0f || qa == 0.0f) {
+			return false;
+		}
+		// As for points, compute the discriminant from the closest approach vector for precision.
+		const glm::vec3 closest = offsetT - (qb / qa) * dirT;
+		const float delta		= qa * (radius2 - glm::dot(closest, closest));
+		if(delta < 0.0f) {
+			return false;
+		}
+		dist = (-qb - std::sqrt(delta)) / qa;
+	}
+	const float along = glm::dot(offset + dist * dir, segment) / length2;
+	return along >= 0.0f && along <= 1.0f;
+}
+
+/** Find the closest point to a location on a segment.
+ \param point the location
+ \param a the segment first end
+ \param b the segment second end
+ \return the closest point
+ */
+static glm::vec3 closestOnSegment(const glm::vec3 & point, const glm::vec3 & a, const glm::vec3 & b) {
+	const glm::vec3 segment = b - a;
+	const float length2		= glm::dot(segment, segment);
+	return length2 > 0.0f ? a + glm::clamp(glm::dot(point - a, segment) / length2, 0.0f, 1.0f) * segment : a;
+}
+
+/** Test if a point of a triangle plane is inside the triangle.
+ \param point the point
+ \param v0 the triangle first vertex
+ \param v1 the triangle second vertex
+ \param v2 the triangle third vertex
+ \param normal the triangle normal
+ \return true if the point is inside
+ */
+static bool insideTriangle(const glm::vec3 & point, const glm::vec3 & v0, const glm::vec3 & v1, const glm::vec3 & v2, const glm::vec3 & normal) {
+	return glm::dot(glm::cross(v1 - v0, point - v0), normal) >= 0.0f && glm::dot(glm::cross(v2 - v1, point - v1), normal) >= 0.0f && glm::dot(glm::cross(v0 - v2, point - v2), normal) >= 0.0f;
+}
+
+/** Find when a point moving towards a plane first comes within a distance of it.
+ \param offset the initial signed distance to the plane
+ \param speed the signed distance variation per unit of motion
+ \param radius the distance
+ \return the distance travelled, zero if initially close enough, negative if never close enough
+ */
+static float sweepPlane(float offset, float speed, float radius) {
+	if(std::abs(offset) <= radius) {
+		return 0.0f;
+	}
+	return offset * speed < 0.0f ? (std::abs(offset) - radius) / std::abs(speed) : -1.0f;
+}
+
+bool Raycaster::sweep(const Ray & ray, const glm::vec3 & axis, float radius, const glm::vec3 & v0, const glm::vec3 & v1, const glm::vec3 & v2, float maxi, float & dist, glm::vec3 & contact) {
+	const glm::vec3 vertices[3] = {v0, v1, v2};
+	const glm::vec3 normal		= glm::cross(v1 - v0, v2 - v0);
+	const float normalLength	= glm::length(normal);
+	const bool capsule			= axis != glm::vec3(0.0f);
+	bool found = false;
+	dist	   = maxi;
+	auto keep = [&dist, &contact, &found](float t, const glm::vec3 & point) {
+		if(t >= 0.0f && t < dist) {
+			dist	= t;
+			contact = point;
+			found	= true;
+		}
+	};
+
+	float t;
+	// Capsule ends against the triangle face, edges and vertices.
+	for(int end = 0; end < (capsule ? 2 : 1); ++end) {
+		const glm::vec3 origin = ray.pos + float(end) * axis;
+		if(normalLength > 0.0f) {
+			const glm::vec3 n = normal / normalLength;
+			t = sweepPlane(glm::dot(origin - v0, n), glm::dot(ray.dir, n), radius);
+			if(t >= 0.0f && t < dist) {
+				const glm::vec3 center	  = origin + t * ray.dir;
+				const glm::vec3 projected = center - glm::dot(center - v0, n) * n;
+				if(insideTriangle(projected, v0, v1, v2, n)) {
+					keep(t, projected);
+				}
+			}
+		}
+		for(int i = 0; i < 3; ++i) {
+			const glm::vec3 & a = vertices[i];
+			const glm::vec3 & b = vertices[(i + 1) % 3];
+			if(sweepSegment(origin, ray.dir, a, b, radius, t)) {
+				keep(t, closestOnSegment(origin + t * ray.dir, a, b));
+			}
+			if(sweepPoint(origin, ray.dir, a, radius, t)) {
+				keep(t, a);
+			}
+		}
+	}
+	if(!capsule) {
+		return found;
+	}
+
+	for(int i = 0; i < 3; ++i) {
+		const glm::vec3 & a = vertices[i];
+		const glm::vec3 & b = vertices[(i + 1) % 3];
+		// Triangle vertices against the capsule side, they move backwards relative to the capsule.
+		if(sweepSegment(a, -ray.dir, ray.pos, ray.pos + axis, radius, t)) {
+			keep(t, a);
+		}
+		// Triangle edges against the capsule axis, the distance between their lines varies linearly.
+		const glm::vec3 edge = b - a;
+		const glm::vec3 perp = glm::cross(axis, edge);
+		const float perpLength = glm::length(perp);
+		if(perpLength <= 1e-6f * glm::length(axis) * glm::length(edge)) {
+			continue;
+		}
+		t = sweepPlane(glm::dot(ray.pos - a, perp) / perpLength, glm::dot(ray.dir, perp) / perpLength, radius);
+		if(t < 0.0f || t >= dist) {
+			continue;
+		}
+		// The closest points of the lines have to be inside both segments.
+		const glm::vec3 offset = ray.pos + t * ray.dir - a;
+		const float aa = glm::dot(axis, axis);
+		const float ee = glm::dot(edge, edge);
+		const float ae = glm::dot(axis, edge);
+		const float ao = glm::dot(axis, offset);
+		const float eo = glm::dot(edge, offset);
+		const float denom = aa * ee - ae * ae;
+		const float s	  = (ae * eo - ao * ee) / denom;
+		const float w	  = (aa * eo - ae * ao) / denom;
+		if(s >= 0.0f && s <= 1.0f && w >= 0.0f && w <= 1.0f) {
+			keep(t, a + w * edge);
+		}
+	}
+	// Capsule axis crossing the triangle face at the initial position.
+	if(normalLength > 0.0f && dist > 0.0f) {
+		const float d0 = glm::dot(ray.pos - v0, normal);
+		const float d1 = glm::dot(ray.pos + axis - v0, normal);
+		if(d0 * d1 <= 0.0f && d0 != d1) {
+			const glm::vec3 crossing = ray.pos + (d0 / (d0 - d1)) * axis;
+			if(insideTriangle(crossing, v0, v1, v2, normal)) {
+				keep(0.0f, crossing);
+			}
+		}
+	}
+	return found;
+}
+
+glm::vec3 Raycaster::closestOnTriangle(const glm::vec3 & point, const glm::vec3 & v0, const glm::vec3 & v1, const glm::vec3 & v2, float & u, float & v) {
+	// Find the Voronoi region of the triangle containing the point (Ericson, Real-Time Collision Detection, 5.1.5).
+	const glm::vec3 e1 = v1 - v0;
+	const glm::vec3 e2 = v2 - v0;
+	const glm::vec3 p0 = point - v0;
+	const float d1	   = glm::dot(e1, p0);
+	const float d2	   = glm::dot(e2, p0);
+	if(d1 <= 0.0f && d2 <= 0.0f) {
+		u = v = 0.0f;
+		return v0;
+	}
+	const glm::vec3 p1 = point - v1;
+	const float d3	   = glm::dot(e1, p1);
+	const float d4	   = glm::dot(e2, p1);
+	if(d3 >= 0.0f && d4 <= d3) {
+		u = 1.0f;
+		v = 0.0f;
+		return v1;
+	}
+	const float vc = d1 * d4 - d3 * d2;
+	// Degenerate edges fall back to their first vertex.
+	if(vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+		u = d1 > d3 ? d1 / (d1 - d3) : 0.0f;
+		v = 0.0f;
+		return v0 + u * e1;
+	}
+	const glm::vec3 p2 = point - v2;
+	const float d5	   = glm::dot(e1, p2);
+	const float d6	   = glm::dot(e2, p2);
+	if(d6 >= 0.0f && d5 <= d6) {
+		u = 0.0f;
+		v = 1.0f;
+		return v2;
+	}
+	const float vb = d5 * d2 - d1 * d6;
+	if(vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+		u = 0.0f;
+		v = d2 > d6 ? d2 / (d2 - d6) : 0.0f;
+		return v0 + v * e2;
+	}
+	const float va = d3 * d6 - d5 * d4;
+	if(va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+		v = (d4 - d3) + (d5 - d6) > 0.0f ? (d4 - d3) / ((d4 - d3) + (d5 - d6)) : 0.0f;
+		u = 1.0f - v;
+		return v1 + v * (v2 - v1);
+	}
+	// Inside the face.
+	if(va + vb + vc <= 0.0f) {
+		u = v = 0.0f;
+		return v0;
+	}
+	const float denom = 1.0f / (va + vb + vc);
+	u = vb * denom;
+	v = vc * denom;
+	return v0 + u * e1 + v * e2;
+}
+
+glm::vec3 Raycaster::closestOnShape(const glm::vec3 & point, Shape shape) {
+	if(shape == Shape::Sphere) {
+		const float length = glm::length(point);
+		return length > 0.0f ? point / length : glm::vec3(0.0f, 1.0f, 0.0f);
+	}
+	// Quads and disks lie in the XY plane.
+	glm::vec2 p(point);
+	if(shape == Shape::Quad) {
+		p = glm::clamp(p, -1.0f, 1.0f);
+	} else if(glm::dot(p, p) > 1.0f) {
+		p = glm::normalize(p);
+	}
+	return glm::vec3(p, 0.0f);
+}
+
+void Raycaster::completeHit(const glm::vec3 & point, Hit & hit) const {
+	const Instance & instance = _instances[hit.meshId];
+	const Geometry & geometry = _geometries[instance.geometry];
+	glm::vec3 normal, tangent;
+	if(geometry.shape != Shape::Mesh) {
+		const glm::vec3 local = glm::vec3(instance.invModel * glm::vec4(point, 1.0f));
+		glm::vec2 uv;
+		shapeFrame(geometry.shape, local, uv, normal, tangent);
+		hit.u = uv.x;
+		hit.v = uv.y;
+		hit.w = 0.0f;
+	} else {
+		glm::vec3 v0, v1, v2;
+		getTriangle(geometry, hit.internalId, v0, v1, v2);
+		tangent = v1 - v0;
+		normal	= glm::cross(tangent, v2 - v0);
+	}
+	// Normals are transformed by the inverse transpose of the model matrix.
+	if(!instance.identity) {
+		normal	= glm::transpose(glm::mat3(instance.invModel)) * normal;
+		tangent = glm::mat3(instance.model) * tangent;
 	}
-	return {};
+	hit.normal	= glm::normalize(normal);
+	hit.tangent = glm::normalize(tangent);
 }
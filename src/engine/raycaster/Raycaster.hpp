@@ -3,8 +3,15 @@
 #include "Common.hpp"
 #include "raycaster/Intersection.hpp"
 
+#include <atomic>
+#include <functional>
+#include <map>
+
+class Texture;
+
 /**
  \brief Allows to cast rays against a polygonal mesh, on the CPU. Relies on an internal acceleration structure to speed up intersection queries.
+ \details The acceleration structure has two levels: each mesh geometry is stored once with its own hierarchy, in mesh space, and is referenced by one or more instances placed in the scene. A top-level hierarchy is built over these instances, and rays are transformed to mesh space when visiting an instance.
  \ingroup Raycaster
  */
 class Raycaster {
@@ -15,15 +22,18 @@ public:
 	/** Represent a hit event between a ray and the geometry. */
 	struct Hit {
 
+		friend class Raycaster;				 ///< For internal hit records.
 		friend class RaycasterVisualisation; ///< For debug visualisation.
 
 		bool hit;			   ///< Denote if there has been a hit.
 		float dist;			   ///< Distance from the ray origin to the hit location.
-		float u;			   ///< First barycentric coordinate.
-		float v;			   ///< Second barycentric coordinate.
-		float w;			   ///< Third barycentric coordinate.
-		unsigned long localId; ///< Position of the hit triangle first vertex in the mesh index buffer.
-		unsigned long meshId;  ///< Index of the mesh hit by the ray.
+		float u;			   ///< First barycentric coordinate, or first parametric coordinate on analytic shapes.
+		float v;			   ///< Second barycentric coordinate, or second parametric coordinate on analytic shapes.
+		float w;			   ///< Third barycentric coordinate, zero on analytic shapes.
+		unsigned long localId; ///< Position of the hit triangle first vertex in the mesh index buffer, zero on analytic shapes.
+		unsigned long meshId;  ///< Index of the mesh instance hit by the ray, in order of addition.
+		glm::vec3 normal;	   ///< Geometric normal at the hit location in world space, facing outwards for analytic shapes.
+		glm::vec3 tangent;	   ///< Tangent at the hit location in world space, along the first parametric coordinate for analytic shapes.
 
 		/** Default constructor ('no hit' case). */
 		Hit();
@@ -38,40 +48,235 @@ public:
 		Hit(float distance, float uu, float vv, unsigned long lid, unsigned long mid);
 
 	private:
-		unsigned long internalId; ///< Index of the triangle in the raycaster internal primitive list.
+		unsigned long internalId; ///< Index of the triangle in the instanced geometry primitive list.
+	};
+
+	/** Test run on each candidate hit found during traversal, before it is accepted. Returning false rejects the hit and the ray continues as if the triangle had been missed, for instance to alpha-test masked geometry. The candidate distance is expressed in world space and its mesh index is set, so that attributes can be interpolated. Parametric coordinates are set on analytic shapes.
+	 \note The filter can be called on hits that are not the closest ones, and from multiple threads at once. Normals and tangents are only computed for the hits returned by queries.
+	 */
+	typedef std::function<bool(const Hit & hit)> Filter;
+
+	/** Strategy used to split a set of primitives in two when building the hierarchy. */
+	enum class Split {
+		Midpoint, ///< Split at the mean of the primitive centroids along the largest axis, fallback to a median split.
+		SAH,	  ///< Pick the split minimizing the surface area heuristic, evaluated on a fixed number of bins along each axis.
+		SBVH,	  ///< Same as SAH, but mesh triangles can also be split across a plane, duplicating their references, when this lowers the cost.
+		LBVH	  ///< Sort the primitives along a Morton curve and emit the hierarchy from the common prefixes of their codes, trading quality for construction speed.
+	};
+
+	/** \brief Traversal counters, to understand the cost of ray queries. They are only updated when compiled with RAYCASTER_STATS defined.
+	 \note Rays traversing the hierarchy in packets are each charged the nodes, boxes and primitives tested by their packet.
+	 */
+	struct Stats {
+		uint64_t rays		= 0; ///< Number of rays cast.
+		uint64_t nodes		= 0; ///< Number of hierarchy nodes visited.
+		uint64_t boxes		= 0; ///< Number of ray-box tests, including instance boxes.
+		uint64_t primitives = 0; ///< Number of ray-triangle and ray-shape tests.
+		uint64_t hits		= 0; ///< Number of primitives intersected, including hits that were not the closest or were rejected by a filter.
+
+		/** Accumulate counters.
+		 \param other the counters to add
+		 \return a reference to the updated counters
+		 */
+		Stats & operator+=(const Stats & other);
+
+		/** Difference of counters.
+		 \param other the counters to subtract
+		 \return the counters difference
+		 */
+		Stats operator-(const Stats & other) const;
+	};
+
+#ifdef RAYCASTER_STATS
+	static const bool statsEnabled = true; ///< Are traversal counters updated.
+#else
+	static const bool statsEnabled = false; ///< Are traversal counters updated.
+#endif
+
+	/** Analytic shapes that can be intersected instead of triangle meshes, defined in their local frame. */
+	enum class Shape : int {
+		Mesh = 0, ///< Triangle mesh.
+		Sphere,	  ///< Unit sphere centered on the origin, parametrized by longitude around the Y axis and latitude from the +Y pole.
+		Quad,	  ///< Square from -1 to 1 along the X and Y axes, facing +Z, parametrized from 0 to 1 along X and Y.
+		Disk	  ///< Unit disk in the XY plane, facing +Z, parametrized from 0 to 1 along X and Y.
+	};
+
+	/** \brief Hierarchy construction settings. */
+	struct Settings {
+		Split split			= Split::Midpoint; ///< The splitting strategy.
+		uint bins			= 16;			   ///< Number of bins along each axis for the SAH split.
+		uint maxLeafSize	= 8;			   ///< Maximum number of primitives in a SAH leaf.
+		float traversalCost = 1.0f;			   ///< Estimated cost of traversing an internal node.
+		float leafCost		= 1.0f;			   ///< Estimated cost of intersecting a primitive in a leaf, relative to the traversal cost.
+		float rebuildRatio	= 1.5f;			   ///< Rebuild the top level when refitting increases its cost above this ratio of the cost after construction, disabled if zero.
+		uint width			= 4;			   ///< Maximum number of children of each node used for single ray queries (2, 4 or 8).
+		float splitBudget	= 0.3f;			   ///< Maximum number of references added by SBVH spatial splits, relative to the triangles count of each mesh.
+		float splitOverlap	= 1e-5f;		   ///< SBVH spatial splits are only evaluated when the children boxes of the best SAH split overlap over more than this fraction of the mesh area.
+		uint mortonBits		= 30;			   ///< Length of the Morton codes used by the LBVH builder (30 or 63), longer codes separate primitives better in large or unevenly distributed meshes.
+		uint treeletPasses	= 1;			   ///< Number of treelet restructuring passes applied to LBVH hierarchies to recover quality, disabled if zero.
+		uint quantization	= 0;			   ///< Number of bits used to store the children boxes of wide nodes relative to their parent (8 or 16), full precision floats if zero.
 	};
 
 	/** Default constructor. */
 	Raycaster() = default;
 
+	/** Constructor.
+	 \param settings the hierarchy construction settings
+	 */
+	explicit Raycaster(const Settings & settings);
+
 	/** Adds a mesh to the internal geometry.
 	 \param mesh the mesh to add
 	 \param model the transformation matrix to apply to the vertices
+	 \note If the same mesh has already been added, its geometry will be shared and only a new instance will be created.
 	 */
 	void addMesh(const Mesh & mesh, const glm::mat4 & model);
 
+	/** Adds an analytic shape, tested directly instead of being tessellated. It is placed in the same hierarchy as meshes and shares their indices.
+	 \param shape the shape to add
+	 \param model the transformation matrix to apply to the shape
+	 */
+	void addShape(Shape shape, const glm::mat4 & model);
+
+	/** Remove a mesh instance. The indices of the other meshes are preserved. The hierarchy will only reflect the change after a call to updateHierarchy().
+	 \param meshId the index of the mesh, in order of addition
+	 \note The mesh geometry is released at the next hierarchy update once no instance uses it anymore. Adding the mesh again will then create a new geometry, this can be used to take modifications of the mesh into account.
+	 */
+	void removeMesh(size_t meshId);
+
 	/** Update the internal bounding volume hierarchy.
-	 \note This operation can be costful in time.
+	 \note This operation can be costful in time. Large meshes are processed using multiple threads. Each mesh hierarchy is kept until its geometry is released or the construction settings change, so only meshes added since the last update are built, along with the top level.
 	 */
 	void updateHierarchy();
 
+	/** Update the internal bounding volume hierarchy, reusing the one stored in a cache file if it was built from the same meshes, transformations and settings. Otherwise, or if the file is invalid, the hierarchy is built and saved to the file.
+	 \param cachePath the path to the cache file
+	 \return true if the hierarchy was loaded from the cache file
+	 */
+	bool updateHierarchy(const std::string & cachePath);
+
+	/** Update the transformation of a mesh instance. The hierarchy will only reflect the change after a call to refit() or updateHierarchy().
+	 \param meshId the index of the mesh, in order of addition
+	 \param model the new transformation matrix to apply to the vertices
+	 */
+	void updateInstance(size_t meshId, const glm::mat4 & model);
+
+	/** Update the bounding boxes of the hierarchy following instance transformation changes, from the leaves to the root. If the hierarchy quality has degraded too much, the top level is rebuilt.
+	 \return true if the top level has been rebuilt
+	 \note Mesh hierarchies are expressed in mesh space and are not modified, making this much cheaper than a full update.
+	 */
+	bool refit();
+
+	/** Estimate the cost of the current hierarchy using the surface area heuristic. The probability of visiting each node is given by its area relative to the area of the whole geometry bounding box, and weighted by the settings traversal and leaf costs.
+	 \return the expected cost of a ray query
+	 \note This can be used to compare hierarchies built with different settings on the same geometry.
+	 */
+	float cost() const;
+
+	/** Get the hierarchy construction settings.
+	 \return a reference to the settings.
+	 \note Changes will only be taken into account at the next hierarchy update.
+	 */
+	Settings & settings(){ return _settings; }
+
 	/** Find the closest intersection of a ray with the geometry.
 	 \param origin ray origin
 	 \param direction ray direction (not necessarily normalized)
 	 \param mini the minimum distance allowed for the intersection
 	 \param maxi the maximum distance allowed for the intersection
+	 \param filter optional test rejecting candidate hits
 	 \return a hit object containg the potential hit informations
 	 */
-	Hit intersects(const glm::vec3 & origin, const glm::vec3 & direction, float mini = 0.0001f, float maxi = 1e8f) const;
+	Hit intersects(const glm::vec3 & origin, const glm::vec3 & direction, float mini = 0.0001f, float maxi = 1e8f, const Filter & filter = nullptr) const;
 
 	/** Intersect a ray with the geometry.
 	 \param origin ray origin
 	 \param direction ray direction (not necessarily normalized)
 	 \param mini the minimum distance allowed for the intersection
 	 \param maxi the maximum distance allowed for the intersection
+	 \param filter optional test rejecting candidate hits
 	 \return true if the ray intersected geometry
 	 */
-	bool intersectsAny(const glm::vec3 & origin, const glm::vec3 & direction, float mini = 0.0001f, float maxi = 1e8f) const;
+	bool intersectsAny(const glm::vec3 & origin, const glm::vec3 & direction, float mini = 0.0001f, float maxi = 1e8f, const Filter & filter = nullptr) const;
+
+	/** Find the closest intersections of a set of rays with the geometry. Consecutive rays are grouped in packets that traverse the hierarchy together, using SIMD instructions when supported by the CPU.
+	 \param origins rays origins
+	 \param directions rays directions (not necessarily normalized)
+	 \param hits will contain a hit object for each ray
+	 \param mini the minimum distance allowed for the intersections
+	 \param maxi the maximum distance allowed for the intersections
+	 \param filter optional test rejecting candidate hits
+	 \param stats optional, will contain the traversal counters of each ray if they are enabled
+	 \note Packets are efficient when their rays are coherent, for instance primary rays of neighbouring pixels. Rays whose closest hit is rejected by the filter are completed individually.
+	 */
+	void intersects(const std::vector<glm::vec3> & origins, const std::vector<glm::vec3> & directions, std::vector<Hit> & hits, float mini = 0.0001f, float maxi = 1e8f, const Filter & filter = nullptr, std::vector<Stats> * stats = nullptr) const;
+
+	/** Test a set of segments for occlusion. Segments are reordered by direction octant and origin location, and grouped in packets that stop each ray at its first hit.
+	 \param origins segments origins
+	 \param directions segments directions (not necessarily normalized)
+	 \param maxis the length of each segment along its direction
+	 \param occluded will contain one bit for each segment, set if it intersected geometry
+	 \param mini the minimum distance allowed for the intersections
+	 \param filter optional test rejecting candidate hits
+	 \param stats optional, will contain the traversal counters of each segment if they are enabled
+	 \note This is intended for shadow rays, that are often incoherent and gain from being sorted before traversal.
+	 */
+	void intersectsAny(const std::vector<glm::vec3> & origins, const std::vector<glm::vec3> & directions, const std::vector<float> & maxis, std::vector<bool> & occluded, float mini = 0.0001f, const Filter & filter = nullptr, std::vector<Stats> * stats = nullptr) const;
+
+	/** Find the first contact of a sphere moving along a direction with the geometry. The hierarchy is traversed by the sphere center, against bounding boxes inflated by the radius.
+	 \param origin the sphere initial center
+	 \param direction the motion direction (not necessarily normalized)
+	 \param radius the sphere radius
+	 \param maxi the maximum distance allowed for the motion
+	 \return a hit object containing the distance travelled before the contact, the triangle and barycentric coordinates of the contact point (parametric coordinates on analytic shapes), and the contact normal, pointing from the surface to the sphere
+	 \note A sphere overlapping the geometry at its initial position is in contact at distance zero. Spheres scaled non-uniformly are approximated by polyhedra, and disks by polygons.
+	 */
+	Hit sphereCast(const glm::vec3 & origin, const glm::vec3 & direction, float radius, float maxi = 1e8f) const;
+
+	/** Find the first contact of a capsule moving along a direction with the geometry. The hierarchy is traversed by the first capsule end, against bounding boxes extended by the capsule axis and inflated by the radius.
+	 \param p0 the capsule first end initial position
+	 \param p1 the capsule second end initial position
+	 \param direction the motion direction (not necessarily normalized)
+	 \param radius the capsule radius
+	 \param maxi the maximum distance allowed for the motion
+	 \return a hit object containing the distance travelled before the contact, the triangle and barycentric coordinates of the contact point (parametric coordinates on analytic shapes), and the contact normal, pointing from the surface to the capsule
+	 \note A capsule overlapping the geometry at its initial position is in contact at distance zero. Spheres scaled non-uniformly are approximated by polyhedra, and disks by polygons.
+	 */
+	Hit capsuleCast(const glm::vec3 & p0, const glm::vec3 & p1, const glm::vec3 & direction, float radius, float maxi = 1e8f) const;
+
+	/** Query the traversal counters accumulated by the queries run on the calling thread. The counters of a query are the difference between the values before and after it.
+	 \return the thread counters, always zero if not compiled with RAYCASTER_STATS defined
+	 */
+	static Stats threadStats();
+
+	/** Find the closest point to a location on the geometry surface. Hierarchy nodes further than the closest point found so far are skipped.
+	 \param point the query location
+	 \param maxi the maximum distance allowed for the closest point
+	 \return a hit object containing the distance to the closest point, its triangle and barycentric coordinates (parametric coordinates on analytic shapes), and the geometric normal and tangent there
+	 \note When points on multiple triangles are at the same distance, for instance on an edge, the triangle facing the location the most is returned. On analytic shapes, the closest point is only exact for transformations preserving angles.
+	 */
+	Hit closestPoint(const glm::vec3 & point, float maxi = 1e8f) const;
+
+	/** Find the closest points to a set of locations on the geometry surface, using multiple threads.
+	 \param points the query locations
+	 \param hits will contain a hit object for each location
+	 \param maxi the maximum distance allowed for the closest points
+	 */
+	void closestPoints(const std::vector<glm::vec3> & points, std::vector<Hit> & hits, float maxi = 1e8f) const;
+
+	/** Compute the position of the closest point or intersection described by a hit.
+	 \param hit the hit, returned by a query
+	 \return the world space position
+	 */
+	glm::vec3 position(const Hit & hit) const;
+
+	/** Compute a signed distance field of the geometry on a regular grid. The distance is negative at locations behind the closest surface, so meshes are expected to be closed and consistently oriented.
+	 \param bounds the region covered by the grid
+	 \param resolution the number of voxels along each axis
+	 \param field will contain the distances at the voxels centers, as a 3D texture with one single channel image per slice
+	 \param maxi the maximum distance, stored in voxels further from the geometry
+	 */
+	void bakeDistanceField(const BoundingBox & bounds, const glm::uvec3 & resolution, Texture & field, float maxi = 1e8f) const;
 
 	/** Test visibility between two points.
 	 \param p0 first point
@@ -96,6 +301,8 @@ public:
 		return hit.w * attribute[i0] + hit.u * attribute[i1] + hit.v * attribute[i2];
 	}
 
+	static const size_t packetSize = 16; ///< Number of rays in a packet.
+
 	/** Copy constructor.*/
 	Raycaster(const Raycaster &) = delete;
 	
@@ -113,32 +320,204 @@ public:
 	Raycaster & operator=(Raycaster &&) = delete;
 	
 private:
-	/** Internal triangle representation. */
-	struct TriangleInfos {
-		BoundingBox box;		   ///< The triangle axis-aligned bounding box.
-		unsigned long v0	  = 0; ///< First vertex index.
-		unsigned long v1	  = 0; ///< Second vertex index.
-		unsigned long v2	  = 0; ///< Third vertex index.
-		unsigned long localId = 0; ///< Position of the triangle first vertex in the mesh initial index buffer.
-		unsigned int meshId   = 0; ///< Index of the mesh this triangle belongs to.
+	static const size_t blockSize	  = 4;			///< Number of triangles in a block.
+	static const uint32_t noTriangle = 0xFFFFFFFF; ///< Local index of unused triangles in a block.
+	static const size_t maxDepth	  = 64;			///< Maximum depth of a hierarchy, bounding the traversal stack size.
+
+	/** \brief Block of triangles, stored as a structure of arrays with precomputed edges so that they can be tested together. */
+	struct alignas(16) TriangleBlock {
+		float v0[3][blockSize]; ///< First vertex of each triangle, per axis.
+		float e1[3][blockSize]; ///< First edge of each triangle (from the first to the second vertex), per axis.
+		float e2[3][blockSize]; ///< Second edge of each triangle (from the first to the third vertex), per axis.
 	};
 
 	/** Base element of the acceleration structure. */
 	struct Node {
 		BoundingBox box;	 ///< Bounding box of the contained geometry.
-		size_t left  = 0;	///< Index of the left child element, or first triangle index if this is a leaf.
-		size_t right = 0;	///< Index of the right child element, or number of triangles if this is a leaf.
+		size_t left  = 0;	///< Index of the left child element, or first primitive index if this is a leaf.
+		size_t right = 0;	///< Index of the right child element, or number of primitives if this is a leaf.
 		bool leaf	= true; ///< Is this a leaf in the hierarchy.
 	};
 
-	/** Test a ray and triangle intersection using the Muller-Trumbore test.
+	/** \brief Node of a wide hierarchy, storing the bounding boxes of its children as a structure of arrays so that they can be tested together.
+	 \tparam W the maximum number of children
+	 */
+	template<size_t W>
+	struct alignas(16) WideNode {
+		float minis[3][W];	  ///< Lower corner of each child box, per axis.
+		float maxis[3][W];	  ///< Upper corner of each child box, per axis.
+		uint32_t children[W]; ///< Index of each child node, or of its first primitive if it is a leaf.
+		uint32_t counts[W];	  ///< Number of primitives in each child if it is a leaf, 0 otherwise.
+		uint32_t count;		  ///< Number of children.
+
+		static const size_t width = W; ///< Maximum number of children.
+	};
+
+	/** \brief Compressed node of a wide hierarchy, storing the bounding boxes of its children on a grid covering the node box.
+	 Internal children are stored consecutively, as are the primitives of the leaf children, so that only the first index of each has to be stored.
+	 \tparam W the maximum number of children
+	 \tparam T the unsigned integer type storing grid coordinates
+	 */
+	template<size_t W, typename T>
+	struct QuantizedNode {
+		float origin[3];	 ///< Lower corner of the node box, origin of the grid.
+		int8_t exponents[3]; ///< Size of a grid cell along each axis, as a power of two.
+		uint8_t count;		 ///< Number of children.
+		uint32_t children;	 ///< Index of the first internal child node.
+		uint32_t primitives; ///< Index of the first primitive of the first leaf child.
+		T minis[3][W];		 ///< Lower corner of each child box in grid cells, rounded down.
+		T maxis[3][W];		 ///< Upper corner of each child box in grid cells, rounded up.
+		uint8_t counts[W];	 ///< Number of primitives in each child if it is a leaf, 0 otherwise.
+
+		static const size_t width = W; ///< Maximum number of children.
+	};
+
+	/** \brief A binary hierarchy collapsed into wide nodes. Only the nodes matching the width and quantization used at construction are filled. */
+	struct WideHierarchy {
+		std::vector<WideNode<2>> nodes2;					///< Binary nodes.
+		std::vector<WideNode<4>> nodes4;					///< Four-wide nodes.
+		std::vector<WideNode<8>> nodes8;					///< Eight-wide nodes.
+		std::vector<QuantizedNode<2, uint8_t>> nodes2q8;	///< Binary nodes, 8 bits boxes.
+		std::vector<QuantizedNode<4, uint8_t>> nodes4q8;	///< Four-wide nodes, 8 bits boxes.
+		std::vector<QuantizedNode<8, uint8_t>> nodes8q8;	///< Eight-wide nodes, 8 bits boxes.
+		std::vector<QuantizedNode<2, uint16_t>> nodes2q16; ///< Binary nodes, 16 bits boxes.
+		std::vector<QuantizedNode<4, uint16_t>> nodes4q16; ///< Four-wide nodes, 16 bits boxes.
+		std::vector<QuantizedNode<8, uint16_t>> nodes8q16; ///< Eight-wide nodes, 16 bits boxes.
+
+		/** \return the memory used by the nodes, in bytes */
+		size_t size() const;
+	};
+
+	/** Geometry of a mesh, in mesh space, shared by all instances of this mesh. */
+	struct Geometry {
+		std::vector<TriangleBlock> triangles; ///< Mesh space triangles, in leaf order once the hierarchy is built.
+		std::vector<uint32_t> localIds;		  ///< Position of each triangle first vertex in the mesh index buffer, or noTriangle if unused.
+		std::vector<Node> hierarchy;		  ///< Bottom-level acceleration structure.
+		WideHierarchy wide;					  ///< Bottom-level acceleration structure used for single ray queries.
+		float cost = 0.0f;					  ///< Expected cost of a ray query hitting the hierarchy root.
+		size_t depth = 0;					  ///< Depth of the deepest leaf in the hierarchy.
+		uint64_t hash = 0;					  ///< Hash of the mesh data, computed when it is added.
+		Shape shape = Shape::Mesh;			  ///< Analytic shape replacing the triangles, if any.
+		uint64_t builtHash = 0;				  ///< Hash of the mesh data and settings the hierarchy was built from, zero if not built.
+		size_t instanceCount = 0;			  ///< Number of instances using the geometry, it is released when none is left.
+	};
+
+	/** Placement of a mesh geometry in the scene. */
+	struct Instance {
+		glm::mat4 model		  = glm::mat4(1.0f); ///< Mesh to world transformation.
+		glm::mat4 invModel	  = glm::mat4(1.0f); ///< World to mesh transformation.
+		BoundingBox box;						 ///< World space bounding box.
+		unsigned int geometry = 0;				 ///< Index of the instanced geometry.
+		float minScale		  = 1.0f;			 ///< Lower bound of the ratio between world space and mesh space distances.
+		bool identity		  = true;			 ///< Is the transformation the identity.
+		bool removed		  = false;			 ///< Has the instance been removed.
+	};
+
+	/** Set the transformation of an instance.
+	 \param instance the instance to update
+	 \param model the mesh to world transformation
+	 */
+	static void setTransform(Instance & instance, const glm::mat4 & model);
+
+	/** Retrieve the vertices of a triangle.
+	 \param geometry the geometry the triangle belongs to
+	 \param tid the index of the triangle
+	 \param v0 will contain the first vertex
+	 \param v1 will contain the second vertex
+	 \param v2 will contain the third vertex
+	 */
+	static void getTriangle(const Geometry & geometry, size_t tid, glm::vec3 & v0, glm::vec3 & v1, glm::vec3 & v2);
+
+	/** Find the closest intersection of a ray with consecutive triangles, using the Muller-Trumbore test on each block.
 	 \param ray the ray
-	 \param tri the triangle infos
+	 \param geometry the geometry the triangles belong to
+	 \param first the index of the first triangle
+	 \param count the number of triangles
 	 \param mini the minimum allowed distance along the ray
 	 \param maxi the maximum allowed distance along the ray
-	 \return a hit object containg the potential hit informations
+	 \param filter the test rejecting candidate hits, can be empty
+	 \param scale the ratio between the ray and world space distances, to express candidate hits in world space
+	 \param hit will be updated if a triangle is hit closer than the maximum distance, its mesh index is preserved
+	 \return true if a triangle was hit
+	 \note Candidate hits of a block are submitted to the filter from near to far, until one is accepted.
 	 */
-	Hit intersects(const Ray & ray, const TriangleInfos & tri, float mini, float maxi) const;
+	static bool intersects(const Ray & ray, const Geometry & geometry, size_t first, size_t count, float mini, float maxi, const Filter & filter, float scale, Hit & hit);
+
+	/** Find the closest intersection of a ray with an analytic shape.
+	 \param ray the ray, in the shape frame
+	 \param shape the shape
+	 \param mini the minimum allowed distance along the ray
+	 \param maxi the maximum allowed distance along the ray
+	 \param filter the test rejecting candidate hits, can be empty
+	 \param scale the ratio between the ray and world space distances, to express candidate hits in world space
+	 \param hit will be updated if the shape is hit closer than the maximum distance, its mesh index is preserved
+	 \return true if the shape was hit
+	 */
+	static bool intersects(const Ray & ray, Shape shape, float mini, float maxi, const Filter & filter, float scale, Hit & hit);
+
+	/** Compute the parametric coordinates and local frame of a point on an analytic shape.
+	 \param shape the shape
+	 \param point the point, in the shape frame
+	 \param uv will contain the parametric coordinates
+	 \param normal will contain the outward normal, in the shape frame
+	 \param tangent will contain the direction of increasing first coordinate, in the shape frame
+	 */
+	static void shapeFrame(Shape shape, const glm::vec3 & point, glm::vec2 & uv, glm::vec3 & normal, glm::vec3 & tangent);
+
+	/** Fill the normal and tangent of a hit returned by a query, and the parametric coordinates of analytic shapes.
+	 \param point the world space hit location
+	 \param hit the hit to complete
+	 */
+	void completeHit(const glm::vec3 & point, Hit & hit) const;
+
+	/** Find the closest point to a location on a triangle.
+	 \param point the query location
+	 \param v0 the first vertex
+	 \param v1 the second vertex
+	 \param v2 the third vertex
+	 \param u will contain the barycentric coordinate of the second vertex
+	 \param v will contain the barycentric coordinate of the third vertex
+	 \return the closest point
+	 */
+	static glm::vec3 closestOnTriangle(const glm::vec3 & point, const glm::vec3 & v0, const glm::vec3 & v1, const glm::vec3 & v2, float & u, float & v);
+
+	/** Find the closest point to a location on an analytic shape.
+	 \param point the query location, in the shape frame
+	 \param shape the shape
+	 \return the closest point, in the shape frame
+	 */
+	static glm::vec3 closestOnShape(const glm::vec3 & point, Shape shape);
+
+	/** Find the first contact of a capsule moving along a direction with a triangle.
+	 \param ray the motion of the capsule first end, with a normalized direction
+	 \param axis the vector from the capsule first end to its second end, null for a sphere
+	 \param radius the capsule radius
+	 \param v0 the triangle first vertex
+	 \param v1 the triangle second vertex
+	 \param v2 the triangle third vertex
+	 \param maxi the maximum distance allowed for the motion
+	 \param dist will contain the distance travelled before the contact, if smaller than the maximum distance
+	 \param contact will contain the contact point on the triangle
+	 \return true if the capsule touches the triangle before the maximum distance
+	 \note Each pair of features that can come into contact is tested: the capsule ends against the triangle face, edges and vertices, the capsule axis against the edges and vertices, and the axis crossing the face at the initial position.
+	 */
+	static bool sweep(const Ray & ray, const glm::vec3 & axis, float radius, const glm::vec3 & v0, const glm::vec3 & v1, const glm::vec3 & v2, float maxi, float & dist, glm::vec3 & contact);
+
+	/** Find the first contact of a capsule moving along a direction with an instance geometry, if it is closer than the current one.
+	 \param ray the motion of the capsule first end, with a normalized direction
+	 \param axis the vector from the capsule first end to its second end, null for a sphere
+	 \param radius the capsule radius
+	 \param instanceId the index of the instance
+	 \param hit the closest contact found so far, its distance bounds the motion, will be updated
+	 \param contact the contact point of the closest contact, will be updated
+	 */
+	void sweepInstance(const Ray & ray, const glm::vec3 & axis, float radius, size_t instanceId, Hit & hit, glm::vec3 & contact) const;
+
+	/** \brief Growth of bounding boxes, to traverse the hierarchy with a swept volume instead of a ray. */
+	struct Inflation {
+		glm::vec3 lower; ///< Distance to move the lower corner of boxes by, towards negative coordinates.
+		glm::vec3 upper; ///< Distance to move the upper corner of boxes by, towards positive coordinates.
+	};
 
 	/** Test a ray and bounding box intersection.
 	 \param ray the ray
@@ -149,9 +528,568 @@ private:
 	 */
 	static bool intersects(const Ray & ray, const BoundingBox & box, float mini, float maxi);
 
-	std::vector<TriangleInfos> _triangles; ///< Merged triangles informations.
-	std::vector<glm::vec3> _vertices;	   ///< Merged vertices.
-	std::vector<Node> _hierarchy;		   ///< Acceleration structure.
+	/** Collapse a binary hierarchy into a wide hierarchy, by repeatedly replacing the child with the largest area by its own children.
+	 \param nodes the binary hierarchy
+	 \param wide will contain the wide hierarchy
+	 \tparam W the maximum number of children of each wide node
+	 */
+	template<size_t W>
+	static void collapse(const std::vector<Node> & nodes, std::vector<WideNode<W>> & wide);
+
+	/** Quantize the children boxes of a wide hierarchy, conservatively. Leaf primitives are reordered so that those of the leaf children of each node are consecutive, and leaves too large to be stored are split.
+	 \param wide the wide hierarchy
+	 \param quantized will contain the quantized hierarchy
+	 \param order will contain the previous index of each primitive, in the new order
+	 \tparam W the maximum number of children of each wide node
+	 \tparam T the unsigned integer type storing grid coordinates
+	 */
+	template<size_t W, typename T>
+	static void quantize(const std::vector<WideNode<W>> & wide, std::vector<QuantizedNode<W, T>> & quantized, std::vector<uint32_t> & order);
+
+	/** Quantize the children boxes of a wide hierarchy, using the current width and quantization.
+	 \param wide the wide hierarchy
+	 \param quantized will contain the quantized hierarchy
+	 \param order will contain the previous index of each primitive, in the new order
+	 */
+	void quantize(const WideHierarchy & wide, WideHierarchy & quantized, std::vector<uint32_t> & order) const;
+
+	/** Collapse a binary hierarchy into a wide hierarchy, using the current width and quantization.
+	 \param nodes the binary hierarchy, its leaves will be updated if primitives are reordered
+	 \param wide will contain the wide hierarchy
+	 \param order will contain the previous index of each primitive in the new order, or be empty if they were not reordered
+	 */
+	void collapse(std::vector<Node> & nodes, WideHierarchy & wide, std::vector<uint32_t> & order) const;
+
+	/** Collapse the top-level hierarchy, reordering the instance indices if needed. */
+	void collapseTopLevel();
+
+	/** Test a ray against a set of bounding boxes.
+	 \param ray the ray
+	 \param minis the lower corner of each box, per axis
+	 \param maxis the upper corner of each box, per axis
+	 \param count the number of boxes to test
+	 \param mini the minimum allowed distance along the ray
+	 \param maxi the maximum allowed distance along the ray
+	 \param nears will contain the entry distance of the ray in each box
+	 \return a mask with one bit set for each box intersected
+	 \tparam W the size of the arrays, aligned on 16 bytes
+	 */
+	template<size_t W>
+	static int intersectsBoxes(const Ray & ray, const float minis[3][W], const float maxis[3][W], uint32_t count, float mini, float maxi, float nears[W]);
+
+	/** Test a ray against all the children bounding boxes of a wide node.
+	 \param ray the ray
+	 \param node the wide node
+	 \param mini the minimum allowed distance along the ray
+	 \param maxi the maximum allowed distance along the ray
+	 \param nears will contain the entry distance of the ray in each child box
+	 \param inflation optional growth applied to the boxes
+	 \return a mask with one bit set for each child intersected
+	 */
+	template<size_t W>
+	static int intersectsChildren(const Ray & ray, const WideNode<W> & node, float mini, float maxi, float nears[W], const Inflation * inflation);
+
+	/** Test a ray against all the children bounding boxes of a quantized node, decoded conservatively.
+	 \param ray the ray
+	 \param node the quantized node
+	 \param mini the minimum allowed distance along the ray
+	 \param maxi the maximum allowed distance along the ray
+	 \param nears will contain the entry distance of the ray in each child box
+	 \param inflation optional growth applied to the boxes
+	 \return a mask with one bit set for each child intersected
+	 */
+	template<size_t W, typename T>
+	static int intersectsChildren(const Ray & ray, const QuantizedNode<W, T> & node, float mini, float maxi, float nears[W], const Inflation * inflation);
+
+	/** Decode the children bounding boxes of a quantized node, conservatively.
+	 \param node the quantized node
+	 \param minis will contain the lower corner of each child box, per axis
+	 \param maxis will contain the upper corner of each child box, per axis
+	 */
+	template<size_t W, typename T>
+	static void decodeChildren(const QuantizedNode<W, T> & node, float minis[3][W], float maxis[3][W]);
+
+	/** Compute the squared distances from a point to a set of bounding boxes.
+	 \param point the point
+	 \param minis the lower corner of each box, per axis
+	 \param maxis the upper corner of each box, per axis
+	 \param count the number of boxes to test
+	 \param maxi the maximum allowed distance
+	 \param dists will contain the squared distance to each box, zero if the point is inside
+	 \return a mask with one bit set for each box closer than the maximum distance
+	 \tparam W the size of the arrays, aligned on 16 bytes
+	 */
+	template<size_t W>
+	static int distanceBoxes(const glm::vec3 & point, const float minis[3][W], const float maxis[3][W], uint32_t count, float maxi, float dists[W]);
+
+	/** Compute the squared distances from a point to all the children bounding boxes of a wide node.
+	 \param point the point
+	 \param node the wide node
+	 \param maxi the maximum allowed distance
+	 \param dists will contain the squared distance to each child box
+	 \return a mask with one bit set for each child closer than the maximum distance
+	 */
+	template<size_t W>
+	static int distanceChildren(const glm::vec3 & point, const WideNode<W> & node, float maxi, float dists[W]);
+
+	/** Compute the squared distances from a point to all the children bounding boxes of a quantized node, decoded conservatively.
+	 \param point the point
+	 \param node the quantized node
+	 \param maxi the maximum allowed distance
+	 \param dists will contain the squared distance to each child box
+	 \return a mask with one bit set for each child closer than the maximum distance
+	 */
+	template<size_t W, typename T>
+	static int distanceChildren(const glm::vec3 & point, const QuantizedNode<W, T> & node, float maxi, float dists[W]);
+
+	/** Retrieve the index of a wide node child.
+	 \param node the wide node
+	 \param cid the child position in the node
+	 \return the index of the child node, or of its first primitive if it is a leaf
+	 */
+	template<size_t W>
+	static uint32_t childIndex(const WideNode<W> & node, uint32_t cid);
+
+	/** Retrieve the index of a quantized node child, from the children stored before it.
+	 \param node the quantized node
+	 \param cid the child position in the node
+	 \return the index of the child node, or of its first primitive if it is a leaf
+	 */
+	template<size_t W, typename T>
+	static uint32_t childIndex(const QuantizedNode<W, T> & node, uint32_t cid);
+
+	/** Traverse a wide hierarchy along a ray, visiting intersected children from near to far and skipping those entered after the closest hit found so far. No memory is allocated.
+	 \param nodes the wide hierarchy
+	 \param ray the ray
+	 \param mini the minimum allowed distance along the ray
+	 \param maxi the maximum allowed distance along the ray
+	 \param visitLeaf the function testing the primitives of a leaf, it can reduce the maximum distance and stop the traversal by returning true, signature: bool(size_t first, size_t count, float & maxi)
+	 \param inflation optional growth applied to the boxes, to traverse with a swept volume
+	 \return true if the traversal was stopped
+	 \tparam N the wide node type, full precision or quantized
+	 */
+	template<typename N, typename VisitLeaf>
+	static bool traverse(const std::vector<N> & nodes, const Ray & ray, float mini, float maxi, VisitLeaf visitLeaf, const Inflation * inflation = nullptr);
+
+	/** Traverse a wide hierarchy along a ray, using the current width and quantization.
+	 \param hierarchy the wide hierarchy
+	 \param ray the ray
+	 \param mini the minimum allowed distance along the ray
+	 \param maxi the maximum allowed distance along the ray
+	 \param visitLeaf the function testing the primitives of a leaf, see the templated version
+	 \param inflation optional growth applied to the boxes, to traverse with a swept volume
+	 \return true if the traversal was stopped
+	 */
+	template<typename VisitLeaf>
+	bool traverse(const WideHierarchy & hierarchy, const Ray & ray, float mini, float maxi, VisitLeaf visitLeaf, const Inflation * inflation = nullptr) const;
+
+	/** Traverse a wide hierarchy around a point, visiting children from near to far and skipping those further than the closest point found so far. No memory is allocated.
+	 \param nodes the wide hierarchy
+	 \param point the query location
+	 \param maxi the maximum allowed distance
+	 \param visitLeaf the function testing the primitives of a leaf, it can reduce the maximum distance, signature: void(size_t first, size_t count, float & maxi)
+	 \tparam N the wide node type, full precision or quantized
+	 */
+	template<typename N, typename VisitLeaf>
+	static void traverseClosest(const std::vector<N> & nodes, const glm::vec3 & point, float maxi, VisitLeaf visitLeaf);
+
+	/** Traverse a wide hierarchy around a point, using the current width and quantization.
+	 \param hierarchy the wide hierarchy
+	 \param point the query location
+	 \param maxi the maximum allowed distance
+	 \param visitLeaf the function testing the primitives of a leaf, see the templated version
+	 */
+	template<typename VisitLeaf>
+	void traverseClosest(const WideHierarchy & hierarchy, const glm::vec3 & point, float maxi, VisitLeaf visitLeaf) const;
+
+	/** \brief Closest point found so far by a query. */
+	struct ClosestPoint {
+		Hit hit;				 ///< The closest point informations, its distance bounds the search.
+		glm::vec3 position;		 ///< World space position of the closest point.
+		float alignment = -1.0f; ///< Cosine between the closest point normal and the direction to the query location, to choose between points at the same distance.
+	};
+
+	/** Find the closest point to a location on an instance geometry, if it is closer than the current one.
+	 \param point the world space query location
+	 \param instanceId the index of the instance
+	 \param closest the closest point found so far, will be updated
+	 */
+	void closestPointInstance(const glm::vec3 & point, size_t instanceId, ClosestPoint & closest) const;
+
+	/** Find the closest intersection of a ray with an instance geometry.
+	 \param ray the world space ray
+	 \param instanceId the index of the instance
+	 \param mini the minimum allowed distance along the ray
+	 \param maxi the maximum allowed distance along the ray
+	 \param filter the test rejecting candidate hits, can be empty
+	 \return a hit object containg the potential hit informations, expressed in world space
+	 */
+	Hit intersectsInstance(const Ray & ray, size_t instanceId, float mini, float maxi, const Filter & filter) const;
+
+	/** Intersect a ray with an instance geometry.
+	 \param ray the world space ray
+	 \param instanceId the index of the instance
+	 \param mini the minimum allowed distance along the ray
+	 \param maxi the maximum allowed distance along the ray
+	 \param filter the test rejecting candidate hits, can be empty
+	 \return true if the ray intersected the instance geometry
+	 */
+	bool intersectsAnyInstance(const Ray & ray, size_t instanceId, float mini, float maxi, const Filter & filter) const;
+
+	/** Express a ray in the local frame of an instance.
+	 \param ray the world space ray
+	 \param instance the instance
+	 \param scale will contain the ratio between mesh space and world space distances along the ray
+	 \return the mesh space ray
+	 */
+	static Ray localRay(const Ray & ray, const Instance & instance, float & scale);
+
+	/** \brief Rays of a packet, stored as a structure of arrays. */
+	struct alignas(32) PacketRays {
+		float pos[3][packetSize];	 ///< Origins.
+		float dir[3][packetSize];	 ///< Directions.
+		float invdir[3][packetSize]; ///< Inverse of the directions.
+	};
+
+	/** \brief Packet of rays traversing the hierarchy together. */
+	struct alignas(32) Packet {
+		PacketRays world;				 ///< World space rays, with normalized directions.
+		PacketRays local;				 ///< Rays in the space of the instance being visited.
+		float dist[packetSize];			 ///< Distance to the closest hit found, negative for unused rays.
+		float anyDist[packetSize];		 ///< Distance to the first hit found, for occlusion rays.
+		float u[packetSize];			 ///< First barycentric coordinate of the closest hit.
+		float v[packetSize];			 ///< Second barycentric coordinate of the closest hit.
+		uint32_t triangle[packetSize];	 ///< Index of the closest hit triangle in its geometry.
+		uint32_t instance[packetSize];	 ///< Index of the closest hit instance, or packetMiss.
+		uint32_t hitCounts[packetSize];	 ///< Number of primitives intersected by each ray, if traversal counters are enabled.
+		Stats stats;					 ///< Nodes, boxes and primitives tested by the whole packet, if traversal counters are enabled.
+		float mini;						 ///< Minimum distance allowed for intersections.
+		bool anyHit;					 ///< Stop each ray at its first hit, setting its distance to a negative value.
+	};
+
+	/** \brief Instance data used by packet traversal. */
+	struct PacketInstance {
+		float toLocal[3][4];   ///< Rows of the world to mesh transformation.
+		unsigned int geometry; ///< Index of the instanced geometry.
+		bool identity;		   ///< Is the transformation the identity.
+	};
+
+	/** \brief Geometry data used by packet traversal. */
+	struct PacketGeometry {
+		const Node * nodes;				///< Hierarchy nodes.
+		const TriangleBlock * triangles; ///< Mesh space triangles, in leaf order.
+		int shape;						///< Analytic shape replacing the triangles, as an integer (see Shape).
+	};
+
+	/** \brief Flat view of the hierarchies used by packet traversal.
+	 \details Packet traversal kernels are compiled in separate files, with different instruction sets enabled. They should only read plain data and not call any inline function, to avoid instruction set specific versions of these functions being shared with the rest of the program.
+	 */
+	struct PacketScene {
+		const Node * topLevel;				///< Top-level hierarchy nodes.
+		const size_t * instanceIds;			///< Instance indices, in top-level leaf order.
+		const PacketInstance * instances;	///< Instances.
+		const PacketGeometry * geometries;	///< Geometries.
+		size_t * stack;						///< Traversal stack, large enough for the deepest hierarchies.
+	};
+
+	/** Signature of packet traversal kernels. */
+	typedef void (*PacketKernel)(const PacketScene & scene, Packet & packet);
+
+	static const uint32_t packetMiss = 0xFFFFFFFF; ///< Instance index of rays that didn't hit anything.
+
+	/** Find the closest intersections of a packet of rays with the geometry, using a given SIMD instruction set.
+	 \param scene the hierarchies to traverse
+	 \param packet the rays, will be updated with the closest hits
+	 \tparam Lanes wrapper around the SIMD instruction set, processing Lanes::width rays at once
+	 \note Defined in RaycasterPacket.hpp, to be instantiated by each kernel.
+	 */
+	template<typename Lanes>
+	static void intersectsPacket(const PacketScene & scene, Packet & packet);
+
+	/** Packet traversal kernel without SIMD instructions.
+	 \param scene the hierarchies to traverse
+	 \param packet the rays, will be updated with the closest hits
+	 */
+	static void intersectsPacketScalar(const PacketScene & scene, Packet & packet);
+
+	/** Packet traversal kernel using SSE instructions, falling back to the scalar kernel if unavailable at compilation.
+	 \param scene the hierarchies to traverse
+	 \param packet the rays, will be updated with the closest hits
+	 */
+	static void intersectsPacketSSE(const PacketScene & scene, Packet & packet);
+
+	/** Packet traversal kernel using AVX instructions, falling back to the SSE kernel if unavailable at compilation.
+	 \param scene the hierarchies to traverse
+	 \param packet the rays, will be updated with the closest hits
+	 */
+	static void intersectsPacketAVX(const PacketScene & scene, Packet & packet);
+
+	/** Select the fastest packet traversal kernel supported by the CPU.
+	 \return the kernel to use
+	 */
+	static PacketKernel packetKernel();
+
+	/** Update the flat view of the hierarchies used by packet traversal, after they have been built or loaded. */
+	void updatePackets();
+
+	/** Update the flat view of an instance used by packet traversal, after its transformation has changed.
+	 \param instanceId the index of the instance
+	 */
+	void updatePacketInstance(size_t instanceId);
+
+	/** Get the flat view of the hierarchies used by packet traversal.
+	 \param stack will be allocated as the traversal stack, large enough for the deepest hierarchies
+	 \return the flat view
+	 */
+	PacketScene packetScene(std::vector<size_t> & stack) const;
+
+	/** Build the intersection record of a ray of a packet, after traversal.
+	 \param packet the packet
+	 \param lid the index of the ray in the packet, it should have hit something
+	 \param ray the world space ray
+	 \param dist the distance to the hit along the ray
+	 \return the complete intersection record
+	 */
+	Hit packetHit(const Packet & packet, size_t lid, const Ray & ray, float dist) const;
+
+	/** Add the traversal counters of a packet to the thread counters, if they are enabled.
+	 \param packet the packet, after traversal
+	 \param count the number of used rays in the packet
+	 \param stats optional, will contain the counters of each ray
+	 */
+	static void recordPacketStats(const Packet & packet, size_t count, Stats * stats);
+
+	/** Place a ray in a packet.
+	 \param packet the packet to update
+	 \param lid the index of the ray in the packet
+	 \param ray the ray
+	 \param maxi the maximum distance allowed for the intersection, negative for unused rays
+	 */
+	static void setPacketRay(Packet & packet, size_t lid, const Ray & ray, float maxi);
+
+	/** Compute the depth of a hierarchy.
+	 \param nodes the hierarchy
+	 \return the depth of the deepest leaf
+	 */
+	static size_t depth(const std::vector<Node> & nodes);
+
+	/** Reference to a primitive (triangle or instance) used during construction. */
+	struct Reference {
+		BoundingBox box; ///< Bounding box of the primitive.
+		size_t id;		 ///< Index of the primitive.
+	};
+
+	/** \brief A hierarchy under construction. */
+	struct Build {
+		std::vector<Reference> refs;		 ///< Primitive references, reordered in leaf order.
+		std::vector<Node> nodes;			 ///< The hierarchy nodes, the first one is the root.
+		std::atomic<size_t> nodeCount { 0 }; ///< Number of nodes already claimed.
+		const Geometry * geometry = nullptr; ///< Triangles that can be clipped by spatial splits, or null if they are disabled.
+	};
+
+	/** Subset of the primitives associated to a node during construction. */
+	struct SetInfos {
+		Build * build; ///< The hierarchy the node belongs to.
+		size_t id;	   ///< Index of the node.
+		size_t begin;  ///< Index of the first primitive reference.
+		size_t count;  ///< Number of primitive references.
+		size_t end;	   ///< End of the references range reserved for the node, leaving room for references duplicated by spatial splits.
+		size_t depth;  ///< Depth of the node in the hierarchy.
+	};
+
+	/** \brief Split of a set of primitives along an axis, based on their centroids. */
+	struct ObjectSplit {
+		float cost	   = std::numeric_limits<float>::max(); ///< Expected cost of the split.
+		int axis	   = -1;								///< Split axis, or -1 if no split was found.
+		uint bin	   = 0;									///< Last bin on the left side.
+		float minCoord = 0.0f;								///< Lower bound of the bins along the axis.
+		float scale	   = 0.0f;								///< Number of bins per unit along the axis.
+		BoundingBox left;									///< Bounding box of the left side.
+		BoundingBox right;									///< Bounding box of the right side.
+	};
+
+	/** \brief Split of a set of triangles by an axis-aligned plane, clipping the triangles crossing it. */
+	struct SpatialSplit {
+		float cost		  = std::numeric_limits<float>::max(); ///< Expected cost of the split.
+		int axis		  = -1;								   ///< Split axis, or -1 if no split was found.
+		float position	  = 0.0f;							   ///< Position of the plane along the axis.
+		size_t leftCount  = 0;								   ///< Number of references on the left side.
+		size_t rightCount = 0;								   ///< Number of references on the right side.
+		BoundingBox left;									   ///< Bounding box of the left side.
+		BoundingBox right;									   ///< Bounding box of the right side.
+	};
+
+	/** \brief Construction timings and statistics. */
+	struct BuildStats {
+		uint64_t topLevels = 0;	  ///< Time spent splitting large sets, in nanoseconds.
+		uint64_t subtrees  = 0;	  ///< Time spent building subtrees, in nanoseconds.
+		size_t topNodes	   = 0;	  ///< Number of large sets split.
+		size_t subtreeCount = 0;  ///< Number of subtrees built.
+		size_t threads	   = 1;	  ///< Number of threads used for subtrees.
+	};
+
+	/** Compute a hash identifying the hierarchy that would be built from the current geometries, instances and settings.
+	 \return the hash
+	 */
+	uint64_t contentHash() const;
+
+	/** Compute a hash identifying a mesh hierarchy, from its data and the current construction settings.
+	 \param geometry the mesh geometry
+	 \return the hash
+	 */
+	uint64_t geometryHash(const Geometry & geometry) const;
+
+	/** Release the geometries that are not used by any instance anymore, compacting the others. */
+	void releaseGeometries();
+
+	/** Load the whole hierarchy from a cache file.
+	 \param path the path to the cache file
+	 \param hash the expected content hash
+	 \return true if the file was valid and built from the same content
+	 */
+	bool loadHierarchy(const std::string & path, uint64_t hash);
+
+	/** Save the whole hierarchy to a cache file.
+	 \param path the path to the cache file
+	 \param hash the content hash the hierarchy was built from
+	 */
+	void saveHierarchy(const std::string & path, uint64_t hash) const;
+
+	/** Compute the world space bounding box of each instance from its geometry hierarchy and transformation. */
+	void updateInstanceBoxes();
+
+	/** Build the top-level hierarchy over all instances, using their current bounding boxes. */
+	void buildTopLevel();
+
+	/** Build multiple hierarchies, each over its own set of primitives references.
+	 \param builds the hierarchies to build
+	 \param stats will be updated with construction timings
+	 */
+	void buildHierarchies(std::vector<Build> & builds, BuildStats & stats);
+
+	/** Compute the bounding box of a node and split its primitives in two subsets if needed.
+	 \param set the node and its primitives
+	 \param parallel should the reductions over the primitives use multiple threads
+	 \param children will contain the two child nodes sets, if the node was split
+	 \return true if the node was split, false if it is a leaf
+	 */
+	bool splitNode(const SetInfos & set, bool parallel, SetInfos children[2]);
+
+	/** Partition a set of primitives at the mean of their centroids along the largest axis of their bounding box, or at their median if this fails.
+	 \param refs the primitives references
+	 \param begin the index of the first primitive
+	 \param count the number of primitives
+	 \param box the bounding box of the primitives
+	 \param parallel should the reductions over the primitives use multiple threads
+	 \return the number of primitives in the first subset
+	 */
+	size_t splitMidpoint(std::vector<Reference> & refs, size_t begin, size_t count, const BoundingBox & box, bool parallel);
+
+	/** Find the split of a set of primitives minimizing the surface area heuristic, evaluated on a set of bins along each axis.
+	 \param refs the primitives references
+	 \param begin the index of the first primitive
+	 \param count the number of primitives
+	 \param box the bounding box of the primitives
+	 \param parallel should the reductions over the primitives use multiple threads
+	 \param split will contain the best split found
+	 */
+	void findObjectSplit(const std::vector<Reference> & refs, size_t begin, size_t count, const BoundingBox & box, bool parallel, ObjectSplit & split) const;
+
+	/** Partition a set of primitives on each side of an object split.
+	 \param refs the primitives references
+	 \param begin the index of the first primitive
+	 \param count the number of primitives
+	 \param split the split to apply
+	 \return the number of primitives in the first subset
+	 */
+	static size_t partition(std::vector<Reference> & refs, size_t begin, size_t count, const ObjectSplit & split);
+
+	/** Find the plane splitting a set of triangles minimizing the surface area heuristic, evaluated on a set of bins along each axis. Triangles crossing the plane are clipped and counted on both sides.
+	 \param build the hierarchy under construction, referencing the triangles
+	 \param begin the index of the first triangle reference
+	 \param count the number of triangle references
+	 \param box the bounding box of the triangle references
+	 \param parallel should the reductions over the triangles use multiple threads
+	 \param split will contain the best split found
+	 */
+	void findSpatialSplit(const Build & build, size_t begin, size_t count, const BoundingBox & box, bool parallel, SpatialSplit & split) const;
+
+	/** Compute the bounding box of the part of a triangle between two planes, restricted to its reference bounding box.
+	 \param geometry the geometry the triangle belongs to
+	 \param ref the triangle reference
+	 \param axis the axis the planes are orthogonal to
+	 \param mini the lower plane position
+	 \param maxi the upper plane position
+	 \return the bounding box of the clipped triangle, empty if it is outside of the planes
+	 */
+	static BoundingBox clip(const Geometry & geometry, const Reference & ref, int axis, float mini, float maxi);
+
+	/** Split a set of triangles using either an object split or a spatial split, depending on the one minimizing the surface area heuristic and on the remaining room for duplicated references.
+	 \param set the node and its triangles
+	 \param box the bounding box of the triangle references
+	 \param parallel should the reductions over the triangles use multiple threads
+	 \param children will contain the two child nodes sets (except for their node indices), if the node was split
+	 \return true if the node was split, false if it should be a leaf
+	 */
+	bool splitSBVH(const SetInfos & set, const BoundingBox & box, bool parallel, SetInfos children[2]);
+
+	/** \brief Binary hierarchy emitted by the LBVH builder, before its conversion to nodes. Internal nodes come first, the root being the first one, followed by one leaf for each primitive in Morton order. */
+	struct LinearTree {
+		std::vector<uint32_t> children; ///< Left and right children of each internal node.
+		std::vector<BoundingBox> boxes; ///< Bounding box of each node.
+		std::vector<uint32_t> counts;	///< Number of primitives below each node.
+		std::vector<float> costs;		///< Surface area heuristic cost of the subtree below each node, not normalized.
+		std::vector<uint8_t> collapsed;	///< Should each node be turned into a leaf, because this is cheaper than splitting it.
+		size_t internalCount = 0;		///< Number of internal nodes.
+	};
+
+	/** Build a hierarchy by sorting its primitives along a Morton curve, using multiple threads. The hierarchy is emitted from the common prefixes of the sorted codes, optionally restructured by treelets, and small subtrees are collapsed into leaves when this lowers the cost.
+	 \param build the hierarchy to build
+	 */
+	void buildLBVH(Build & build) const;
+
+	/** Update the bounding box, primitives count and cost of an internal node of a linear hierarchy from its children.
+	 \param tree the linear hierarchy
+	 \param node the internal node to update
+	 */
+	void updateLinearNode(LinearTree & tree, uint32_t node) const;
+
+	/** Find the binary tree minimizing the surface area heuristic over the treelet formed by a node and its largest descendants, and restructure it if this lowers the cost.
+	 \param tree the linear hierarchy, whose nodes below the treelet root must be up to date
+	 \param root the treelet root, an internal node
+	 */
+	void optimizeTreelet(LinearTree & tree, uint32_t root) const;
+
+	/** Partition a set of primitives in the way minimizing the surface area heuristic, evaluated on a set of bins along each axis.
+	 \param refs the primitives references
+	 \param begin the index of the first primitive
+	 \param count the number of primitives
+	 \param box the bounding box of the primitives
+	 \param parallel should the reductions over the primitives use multiple threads
+	 \return the number of primitives in the first subset, or 0 if creating a leaf is cheaper
+	 */
+	size_t splitSAH(std::vector<Reference> & refs, size_t begin, size_t count, const BoundingBox & box, bool parallel);
+
+	/** Estimate the cost of a hierarchy using the surface area heuristic, relative to its root area.
+	 \param nodes the hierarchy
+	 \param leafCost the function returning the cost of a leaf, signature: float(const Node & leaf)
+	 \return the expected cost of a ray query hitting the root
+	 */
+	template<typename LeafCost>
+	float cost(const std::vector<Node> & nodes, LeafCost leafCost) const;
 
-	unsigned int _meshCount = 0; ///< Number of meshes stored in the raycaster.
+	std::vector<Geometry> _geometries;				  ///< Mesh geometries.
+	std::vector<Instance> _instances;				  ///< Mesh instances, in order of addition.
+	std::vector<Node> _topLevel;					  ///< Top-level acceleration structure, over the instances.
+	WideHierarchy _topLevelWide;					  ///< Top-level acceleration structure used for single ray queries.
+	std::vector<size_t> _instanceIds;				  ///< Instance indices, in top-level leaf order.
+	std::map<const Mesh *, unsigned int> _geometryIds; ///< Geometry associated to each added mesh.
+	Settings _settings;								  ///< Hierarchy construction settings.
+	float _builtCost = 0.0f;						  ///< Cost of the hierarchy after the last top-level construction.
+	size_t _topLevelDepth = 0;						  ///< Depth of the top-level hierarchy.
+	std::vector<PacketGeometry> _packetGeometries;	  ///< Geometries, as seen by packet traversal.
+	std::vector<PacketInstance> _packetInstances;	  ///< Instances, as seen by packet traversal.
+	size_t _packetDepth = 0;						  ///< Depth of the deepest geometry hierarchy.
+	uint _width = 4;								  ///< Width of the wide hierarchies.
+	uint _quantization = 0;							  ///< Number of bits of the wide hierarchies children boxes, or zero if stored as floats.
 };
@@ -0,0 +1,43 @@
+#include "raycaster/RaycasterPacket.hpp"
+
+// This file should be compiled with AVX enabled, the kernel will only be used if the CPU supports it.
+#if defined(__AVX__)
+
+#include <immintrin.h>
+
+/** \brief AVX wrapper, processing eight rays at once. */
+struct LanesAVX {
+	typedef __m256 Floats; ///< Eight values.
+	typedef __m256 Mask;   ///< Eight comparison results.
+
+	static const size_t width = 8; ///< Number of rays processed at once.
+
+	static Floats load(const float * src){ return _mm256_load_ps(src); }
+	static void store(float * dst, Floats a){ _mm256_store_ps(dst, a); }
+	static Floats set(float a){ return _mm256_set1_ps(a); }
+	static Floats add(Floats a, Floats b){ return _mm256_add_ps(a, b); }
+	static Floats sub(Floats a, Floats b){ return _mm256_sub_ps(a, b); }
+	static Floats mul(Floats a, Floats b){ return _mm256_mul_ps(a, b); }
+	static Floats div(Floats a, Floats b){ return _mm256_div_ps(a, b); }
+	static Floats min(Floats a, Floats b){ return _mm256_min_ps(a, b); }
+	static Floats max(Floats a, Floats b){ return _mm256_max_ps(a, b); }
+	static Floats abs(Floats a){ return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+	static Floats sqrt(Floats a){ return _mm256_sqrt_ps(a); }
+	static Mask lessThan(Floats a, Floats b){ return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	static Mask lessEqual(Floats a, Floats b){ return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	static Mask bitAnd(Mask a, Mask b){ return _mm256_and_ps(a, b); }
+	static Floats select(Mask m, Floats a, Floats b){ return _mm256_blendv_ps(b, a, m); }
+	static int bits(Mask m){ return _mm256_movemask_ps(m); }
+};
+
+void Raycaster::intersectsPacketAVX(const PacketScene & scene, Packet & packet) {
+	intersectsPacket<LanesAVX>(scene, packet);
+}
+
+#else
+
+void Raycaster::intersectsPacketAVX(const PacketScene & scene, Packet & packet) {
+	intersectsPacketSSE(scene, packet);
+}
+
+#endif
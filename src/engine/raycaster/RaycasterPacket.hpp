@@ -0,0 +1,247 @@
+#pragma once
+#include "raycaster/Raycaster.hpp"
+
+#include <cfloat>
+
+#ifdef RAYCASTER_STATS
+#define RAYCASTER_PACKET_COUNT(counter, value) (packet.stats.counter += (value))
+#define RAYCASTER_PACKET_HIT(lid) (++packet.hitCounts[lid])
+#else
+#define RAYCASTER_PACKET_COUNT(counter, value)
+#define RAYCASTER_PACKET_HIT(lid)
+#endif
+
+/**
+ \file RaycasterPacket.hpp
+ \brief Packet traversal shared by all instruction sets. Each kernel provides a Lanes wrapper exposing the following static members:
+ - Floats and Mask, the vector types for values and comparison results,
+ - width, the number of rays processed at once,
+ - load, store, set, add, sub, mul, div, min, max, abs, sqrt for values,
+ - lessThan, lessEqual, bitAnd, select, bits for masks.
+ \warning Only plain data should be read here, and no inline function from other headers should be called (see Raycaster::PacketScene).
+ \ingroup Raycaster
+ */
+
+template<typename Lanes>
+void Raycaster::intersectsPacket(const PacketScene & scene, Packet & packet) {
+	typedef typename Lanes::Floats Floats;
+	typedef typename Lanes::Mask Mask;
+
+	const Floats mini = Lanes::set(packet.mini);
+	// Occlusion rays are disabled after their first hit by setting a negative distance.
+	const Floats done = Lanes::set(-1.0f);
+
+	// Slab test of all the rays of the packet against a box, stopping as soon as one ray hits.
+	auto intersectsBox = [&packet, &mini](const PacketRays & rays, const BoundingBox & box) {
+		RAYCASTER_PACKET_COUNT(boxes, 1);
+		const Floats bMin[3] = {Lanes::set(box.minis.x), Lanes::set(box.minis.y), Lanes::set(box.minis.z)};
+		const Floats bMax[3] = {Lanes::set(box.maxis.x), Lanes::set(box.maxis.y), Lanes::set(box.maxis.z)};
+		for(size_t lid = 0; lid < packetSize; lid += Lanes::width) {
+			Floats closest	= mini;
+			Floats furthest = Lanes::load(packet.dist + lid);
+			for(int i = 0; i < 3; ++i) {
+				const Floats pos	= Lanes::load(rays.pos[i] + lid);
+				const Floats invdir = Lanes::load(rays.invdir[i] + lid);
+				const Floats minRatio = Lanes::mul(Lanes::sub(bMin[i], pos), invdir);
+				const Floats maxRatio = Lanes::mul(Lanes::sub(bMax[i], pos), invdir);
+				closest	 = Lanes::max(closest, Lanes::min(minRatio, maxRatio));
+				furthest = Lanes::min(furthest, Lanes::max(minRatio, maxRatio));
+			}
+			if(Lanes::bits(Lanes::lessEqual(closest, furthest)) != 0) {
+				return true;
+			}
+		}
+		return false;
+	};
+
+	// Moller-Trumbore test of all the rays of the packet against a triangle, updating the closest hits.
+	auto intersectsTriangle = [&packet, &mini, &done](const PacketRays & rays, const TriangleBlock & block, size_t bid, uint32_t triangle, uint32_t instance) {
+		const Floats e1[3] = {Lanes::set(block.e1[0][bid]), Lanes::set(block.e1[1][bid]), Lanes::set(block.e1[2][bid])};
+		const Floats e2[3] = {Lanes::set(block.e2[0][bid]), Lanes::set(block.e2[1][bid]), Lanes::set(block.e2[2][bid])};
+		const Floats p0[3] = {Lanes::set(block.v0[0][bid]), Lanes::set(block.v0[1][bid]), Lanes::set(block.v0[2][bid])};
+		const Floats zero  = Lanes::set(0.0f);
+		const Floats one   = Lanes::set(1.0f);
+		const Floats eps   = Lanes::set(FLT_EPSILON);
+		RAYCASTER_PACKET_COUNT(primitives, 1);
+
+		for(size_t lid = 0; lid < packetSize; lid += Lanes::width) {
+			const Floats d[3] = {Lanes::load(rays.dir[0] + lid), Lanes::load(rays.dir[1] + lid), Lanes::load(rays.dir[2] + lid)};
+			// p = d x e2
+			const Floats p[3] = {
+				Lanes::sub(Lanes::mul(d[1], e2[2]), Lanes::mul(d[2], e2[1])),
+				Lanes::sub(Lanes::mul(d[2], e2[0]), Lanes::mul(d[0], e2[2])),
+				Lanes::sub(Lanes::mul(d[0], e2[1]), Lanes::mul(d[1], e2[0]))};
+			const Floats det	= Lanes::add(Lanes::add(Lanes::mul(e1[0], p[0]), Lanes::mul(e1[1], p[1])), Lanes::mul(e1[2], p[2]));
+			const Floats invDet = Lanes::div(one, det);
+			// q = o - v0
+			const Floats q[3] = {
+				Lanes::sub(Lanes::load(rays.pos[0] + lid), p0[0]),
+				Lanes::sub(Lanes::load(rays.pos[1] + lid), p0[1]),
+				Lanes::sub(Lanes::load(rays.pos[2] + lid), p0[2])};
+			const Floats u = Lanes::mul(invDet, Lanes::add(Lanes::add(Lanes::mul(q[0], p[0]), Lanes::mul(q[1], p[1])), Lanes::mul(q[2], p[2])));
+			// r = q x e1
+			const Floats r[3] = {
+				Lanes::sub(Lanes::mul(q[1], e1[2]), Lanes::mul(q[2], e1[1])),
+				Lanes::sub(Lanes::mul(q[2], e1[0]), Lanes::mul(q[0], e1[2])),
+				Lanes::sub(Lanes::mul(q[0], e1[1]), Lanes::mul(q[1], e1[0]))};
+			const Floats v = Lanes::mul(invDet, Lanes::add(Lanes::add(Lanes::mul(d[0], r[0]), Lanes::mul(d[1], r[1])), Lanes::mul(d[2], r[2])));
+			const Floats t = Lanes::mul(invDet, Lanes::add(Lanes::add(Lanes::mul(e2[0], r[0]), Lanes::mul(e2[1], r[1])), Lanes::mul(e2[2], r[2])));
+
+			const Floats dist = Lanes::load(packet.dist + lid);
+			Mask valid = Lanes::lessEqual(eps, Lanes::abs(det));
+			valid	   = Lanes::bitAnd(valid, Lanes::bitAnd(Lanes::lessEqual(zero, u), Lanes::lessEqual(u, one)));
+			valid	   = Lanes::bitAnd(valid, Lanes::bitAnd(Lanes::lessEqual(zero, v), Lanes::lessEqual(Lanes::add(u, v), one)));
+			valid	   = Lanes::bitAnd(valid, Lanes::bitAnd(Lanes::lessThan(mini, t), Lanes::lessThan(t, dist)));
+			const int hits = Lanes::bits(valid);
+			if(hits == 0) {
+				continue;
+			}
+			Lanes::store(packet.dist + lid, Lanes::select(valid, packet.anyHit ? done : t, dist));
+			if(packet.anyHit) {
+				Lanes::store(packet.anyDist + lid, Lanes::select(valid, t, Lanes::load(packet.anyDist + lid)));
+			}
+			Lanes::store(packet.u + lid, Lanes::select(valid, u, Lanes::load(packet.u + lid)));
+			Lanes::store(packet.v + lid, Lanes::select(valid, v, Lanes::load(packet.v + lid)));
+			for(size_t i = 0; i < Lanes::width; ++i) {
+				if(hits & (1 << i)) {
+					packet.triangle[lid + i] = triangle;
+					packet.instance[lid + i] = instance;
+					RAYCASTER_PACKET_HIT(lid + i);
+				}
+			}
+		}
+	};
+
+	// Test of all the rays of the packet against an analytic shape in its local frame, updating the closest hits. Parametric coordinates are computed afterwards.
+	auto intersectsShape = [&packet, &mini, &done](const PacketRays & rays, int shape, uint32_t instance) {
+		const Floats zero = Lanes::set(0.0f);
+		const Floats one  = Lanes::set(1.0f);
+		RAYCASTER_PACKET_COUNT(primitives, 1);
+
+		for(size_t lid = 0; lid < packetSize; lid += Lanes::width) {
+			const Floats o[3] = {Lanes::load(rays.pos[0] + lid), Lanes::load(rays.pos[1] + lid), Lanes::load(rays.pos[2] + lid)};
+			const Floats d[3] = {Lanes::load(rays.dir[0] + lid), Lanes::load(rays.dir[1] + lid), Lanes::load(rays.dir[2] + lid)};
+			const Floats dist = Lanes::load(packet.dist + lid);
+			Floats t;
+			Mask valid;
+			if(shape == int(Shape::Sphere)) {
+				// Directions are not normalized, keep the quadratic term. Use the far root if the near one is behind.
+				const Floats a = Lanes::add(Lanes::add(Lanes::mul(d[0], d[0]), Lanes::mul(d[1], d[1])), Lanes::mul(d[2], d[2]));
+				const Floats b = Lanes::add(Lanes::add(Lanes::mul(o[0], d[0]), Lanes::mul(o[1], d[1])), Lanes::mul(o[2], d[2]));
+				const Floats c = Lanes::sub(Lanes::add(Lanes::add(Lanes::mul(o[0], o[0]), Lanes::mul(o[1], o[1])), Lanes::mul(o[2], o[2])), one);
+				const Floats delta = Lanes::sub(Lanes::mul(b, b), Lanes::mul(a, c));
+				const Floats root  = Lanes::sqrt(Lanes::max(delta, zero));
+				const Floats near  = Lanes::div(Lanes::sub(Lanes::sub(zero, b), root), a);
+				const Floats far   = Lanes::div(Lanes::add(Lanes::sub(zero, b), root), a);
+				t	  = Lanes::select(Lanes::lessThan(mini, near), near, far);
+				valid = Lanes::lessEqual(zero, delta);
+			} else {
+				// Quads and disks lie in the XY plane.
+				t = Lanes::div(Lanes::sub(zero, o[2]), d[2]);
+				const Floats x = Lanes::add(o[0], Lanes::mul(t, d[0]));
+				const Floats y = Lanes::add(o[1], Lanes::mul(t, d[1]));
+				if(shape == int(Shape::Quad)) {
+					valid = Lanes::bitAnd(Lanes::lessEqual(Lanes::abs(x), one), Lanes::lessEqual(Lanes::abs(y), one));
+				} else {
+					valid = Lanes::lessEqual(Lanes::add(Lanes::mul(x, x), Lanes::mul(y, y)), one);
+				}
+			}
+			valid = Lanes::bitAnd(valid, Lanes::bitAnd(Lanes::lessThan(mini, t), Lanes::lessThan(t, dist)));
+			const int hits = Lanes::bits(valid);
+			if(hits == 0) {
+				continue;
+			}
+			Lanes::store(packet.dist + lid, Lanes::select(valid, packet.anyHit ? done : t, dist));
+			if(packet.anyHit) {
+				Lanes::store(packet.anyDist + lid, Lanes::select(valid, t, Lanes::load(packet.anyDist + lid)));
+			}
+			for(size_t i = 0; i < Lanes::width; ++i) {
+				if(hits & (1 << i)) {
+					packet.triangle[lid + i] = 0;
+					packet.instance[lid + i] = instance;
+					RAYCASTER_PACKET_HIT(lid + i);
+				}
+			}
+		}
+	};
+
+	// Check if all rays of an occlusion packet have hit something.
+	auto allDone = [&packet]() {
+		for(size_t lid = 0; lid < packetSize; ++lid) {
+			if(packet.dist[lid] >= 0.0f) {
+				return false;
+			}
+		}
+		return true;
+	};
+
+	size_t * stack	 = scene.stack;
+	size_t stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while(stackSize > 0) {
+		const Node & node = scene.topLevel[stack[--stackSize]];
+		RAYCASTER_PACKET_COUNT(nodes, 1);
+		if(!intersectsBox(packet.world, node.box)) {
+			continue;
+		}
+		if(!node.leaf) {
+			stack[stackSize++] = node.left;
+			stack[stackSize++] = node.right;
+			continue;
+		}
+
+		// Visit each instance in the leaf, using the remaining part of the stack.
+		for(size_t i = 0; i < node.right; ++i) {
+			const size_t instanceId			= scene.instanceIds[node.left + i];
+			const PacketInstance & instance = scene.instances[instanceId];
+			const PacketGeometry & geometry = scene.geometries[instance.geometry];
+
+			// Express the rays in mesh space. Directions are not normalized, so that distances along the rays are preserved.
+			const PacketRays * rays = &packet.world;
+			if(!instance.identity) {
+				const PacketRays & world = packet.world;
+				PacketRays & local		 = packet.local;
+				for(size_t lid = 0; lid < packetSize; ++lid) {
+					for(int c = 0; c < 3; ++c) {
+						const float * row = instance.toLocal[c];
+						local.pos[c][lid] = row[0] * world.pos[0][lid] + row[1] * world.pos[1][lid] + row[2] * world.pos[2][lid] + row[3];
+						local.dir[c][lid] = row[0] * world.dir[0][lid] + row[1] * world.dir[1][lid] + row[2] * world.dir[2][lid];
+					}
+					for(int c = 0; c < 3; ++c) {
+						local.invdir[c][lid] = 1.0f / local.dir[c][lid];
+					}
+				}
+				rays = &local;
+			}
+
+			size_t * localStack	  = stack + stackSize;
+			size_t localStackSize = 0;
+			localStack[localStackSize++] = 0;
+			while(localStackSize > 0) {
+				const Node & localNode = geometry.nodes[localStack[--localStackSize]];
+				RAYCASTER_PACKET_COUNT(nodes, 1);
+				if(!intersectsBox(*rays, localNode.box)) {
+					continue;
+				}
+				if(!localNode.leaf) {
+					localStack[localStackSize++] = localNode.left;
+					localStack[localStackSize++] = localNode.right;
+					continue;
+				}
+				if(geometry.shape != int(Shape::Mesh)) {
+					intersectsShape(*rays, geometry.shape, uint32_t(instanceId));
+				}
+				for(size_t tid = localNode.left; tid < localNode.left + localNode.right; ++tid) {
+					intersectsTriangle(*rays, geometry.triangles[tid / blockSize], tid % blockSize, uint32_t(tid), uint32_t(instanceId));
+				}
+				if(packet.anyHit && allDone()) {
+					return;
+				}
+			}
+		}
+	}
+}
+
+#undef RAYCASTER_PACKET_COUNT
+#undef RAYCASTER_PACKET_HIT
@@ -0,0 +1,43 @@
+#include "raycaster/RaycasterPacket.hpp"
+
+// SSE2 is always available on x64.
+#if defined(__SSE2__) || defined(_M_X64)
+
+#include <emmintrin.h>
+
+/** \brief SSE wrapper, processing four rays at once. */
+struct LanesSSE {
+	typedef __m128 Floats; ///< Four values.
+	typedef __m128 Mask;   ///< Four comparison results.
+
+	static const size_t width = 4; ///< Number of rays processed at once.
+
+	static Floats load(const float * src){ return _mm_load_ps(src); }
+	static void store(float * dst, Floats a){ _mm_store_ps(dst, a); }
+	static Floats set(float a){ return _mm_set1_ps(a); }
+	static Floats add(Floats a, Floats b){ return _mm_add_ps(a, b); }
+	static Floats sub(Floats a, Floats b){ return _mm_sub_ps(a, b); }
+	static Floats mul(Floats a, Floats b){ return _mm_mul_ps(a, b); }
+	static Floats div(Floats a, Floats b){ return _mm_div_ps(a, b); }
+	static Floats min(Floats a, Floats b){ return _mm_min_ps(a, b); }
+	static Floats max(Floats a, Floats b){ return _mm_max_ps(a, b); }
+	static Floats abs(Floats a){ return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+	static Floats sqrt(Floats a){ return _mm_sqrt_ps(a); }
+	static Mask lessThan(Floats a, Floats b){ return _mm_cmplt_ps(a, b); }
+	static Mask lessEqual(Floats a, Floats b){ return _mm_cmple_ps(a, b); }
+	static Mask bitAnd(Mask a, Mask b){ return _mm_and_ps(a, b); }
+	static Floats select(Mask m, Floats a, Floats b){ return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+	static int bits(Mask m){ return _mm_movemask_ps(m); }
+};
+
+void Raycaster::intersectsPacketSSE(const PacketScene & scene, Packet & packet) {
+	intersectsPacket<LanesSSE>(scene, packet);
+}
+
+#else
+
+void Raycaster::intersectsPacketSSE(const PacketScene & scene, Packet & packet) {
+	intersectsPacketScalar(scene, packet);
+}
+
+#endif
@@ -1,153 +1,220 @@
-#include "raycaster/RaycasterVisualisation.hpp"
-#include <queue>
-#include <stack>
-
-RaycasterVisualisation::RaycasterVisualisation(const Raycaster & raycaster) :
-	_raycaster(raycaster) {
-}
-
-void RaycasterVisualisation::getAllLevels(std::vector<Mesh> & meshes) const {
-	std::vector<DisplayNode> selectedNodes;
-
-	// Breadth-first tree exploration.
-	std::queue<DisplayNode> nodesToVisit;
-	// Start by visiting each object.
-	for(size_t nid = 0; nid < _raycaster._meshCount; ++nid) {
-		nodesToVisit.push({nid, 0});
-	}
-
-	while(!nodesToVisit.empty()) {
-		const DisplayNode location = nodesToVisit.front();
-		selectedNodes.push_back(location);
-		// Remove the current node from the visit queue.
-		nodesToVisit.pop();
-		// If this is not a leaf, enqueue the two children nodes.
-		const Raycaster::Node & node = _raycaster._hierarchy[location.node];
-		if(!node.leaf) {
-			nodesToVisit.push({node.left, location.depth + 1});
-			nodesToVisit.push({node.right, location.depth + 1});
-		}
-	}
-
-	createBVHMeshes(selectedNodes, meshes);
-}
-
-Raycaster::Hit RaycasterVisualisation::getRayLevels(const glm::vec3 & origin, const glm::vec3 & direction, std::vector<Mesh> & meshes, float mini, float maxi) const {
-
-	const Ray ray(origin, direction);
-	std::vector<DisplayNode> selectedNodes;
-	std::stack<DisplayNode> nodesToTest;
-	// Start by testing each object.
-	for(size_t nid = 0; nid < _raycaster._meshCount; ++nid) {
-		// If the ray doesn't intersect the bounding box, move to the next node.
-		if(!Intersection::box(ray, _raycaster._hierarchy[nid].box, mini, maxi)) {
-			continue;
-		}
-		nodesToTest.push({nid, 0});
-	}
-	Raycaster::Hit bestHit;
-	while(!nodesToTest.empty()) {
-		const DisplayNode & infos	= nodesToTest.top();
-		const Raycaster::Node & node = _raycaster._hierarchy[infos.node];
-		const size_t depth			 = infos.depth;
-		selectedNodes.push_back(infos);
-		nodesToTest.pop();
-
-		// If the node is a leaf, test all included triangles.
-		if(node.leaf) {
-			for(size_t tid = 0; tid < node.right; ++tid) {
-				const auto & tri			= _raycaster._triangles[node.left + tid];
-				const Raycaster::Hit hit = _raycaster.intersects(ray, tri, mini, maxi);
-				// We found a valid hit.
-				if(hit.hit && hit.dist < bestHit.dist) {
-					bestHit			   = hit;
-					maxi			   = bestHit.dist;
-					bestHit.internalId = ulong(node.left) + ulong(tid);
-				}
-			}
-			// Move to the next node.
-			continue;
-		}
-		// Else, intersect both child nodes.
-		if(Intersection::box(ray, _raycaster._hierarchy[node.left].box, mini, maxi)) {
-			nodesToTest.push({node.left, depth + 1});
-		}
-		if(Intersection::box(ray, _raycaster._hierarchy[node.right].box, mini, maxi)) {
-			nodesToTest.push({node.right, depth + 1});
-		}
-	}
-	createBVHMeshes(selectedNodes, meshes);
-	return bestHit;
-}
-
-void RaycasterVisualisation::getRayMesh(const glm::vec3 & rayPos, const glm::vec3 & rayDir, const Raycaster::Hit & hit, Mesh & mesh, float defaultLength) const {
-	const float length	 = hit.hit ? hit.dist : defaultLength;
-	const glm::vec3 hitPos = rayPos + length * glm::normalize(rayDir);
-	// Ray color: green if hit, red otherwise.
-	const glm::vec3 rayColor(hit.hit ? 0.0f : 1.0f, hit.hit ? 1.0f : 0.0f, 0.0f);
-	// Create the geometry.
-	mesh.clean();
-	mesh.positions = {rayPos, hitPos};
-	mesh.colors	= {rayColor, rayColor};
-	mesh.indices   = {0, 1, 0};
-	// If there was a hit, add the intersected triangle to the visualisation.
-	if(hit.hit) {
-		const Raycaster::TriangleInfos & tri = _raycaster._triangles[hit.internalId];
-		const glm::vec3 & v0				 = _raycaster._vertices[tri.v0];
-		const glm::vec3 & v1				 = _raycaster._vertices[tri.v1];
-		const glm::vec3 & v2				 = _raycaster._vertices[tri.v2];
-		mesh.positions.push_back(v0);
-		mesh.positions.push_back(v1);
-		mesh.positions.push_back(v2);
-		mesh.colors.push_back(rayColor);
-		mesh.colors.push_back(rayColor);
-		mesh.colors.push_back(rayColor);
-		mesh.indices.push_back(2);
-		mesh.indices.push_back(3);
-		mesh.indices.push_back(4);
-	}
-}
-
-void RaycasterVisualisation::createBVHMeshes(const std::vector<DisplayNode> & nodes, std::vector<Mesh> & meshes) const {
-	// Compute the max depth.
-	size_t maxDepth = 0;
-	for(const auto & displayNode : nodes) {
-		maxDepth = std::max(maxDepth, displayNode.depth);
-	}
-	meshes.clear();
-	for(size_t did = 0; did < maxDepth + 1; ++did) {
-		meshes.emplace_back("Level " + std::to_string(did));
-	}
-	// Setup degenerate triangles for each line of a cube.
-	const std::vector<unsigned int> indices = {
-		0, 1, 0, 0, 2, 0, 1, 3, 1, 2, 3, 2, 4, 5, 4, 4, 6, 4, 5, 7, 5, 6, 7, 6, 1, 5, 1, 0, 4, 0, 2, 6, 2, 3, 7, 3};
-
-	// Generate the geometry for all nodes.
-	for(const auto & displayNode : nodes) {
-		const Raycaster::Node & node = _raycaster._hierarchy[displayNode.node];
-		// Setup vertices.
-		Mesh & mesh					  = meshes[displayNode.depth];
-		const unsigned int firstIndex = uint(mesh.positions.size());
-		const auto corners			  = node.box.getCorners();
-		for(const auto & corner : corners) {
-			mesh.positions.push_back(corner);
-		}
-		for(const unsigned int iid : indices) {
-			mesh.indices.push_back(firstIndex + iid);
-		}
-	}
-
-	// Associate a color to all the nodes at a given depth.
-	for(size_t did = 0; did < maxDepth + 1; ++did) {
-		// Compute relative depth for colorisation.
-		float depth = float(did) / float(maxDepth);
-		// We have fewer boxes at low depth, skew the hue scale.
-		depth *= depth;
-		// Decrease value as we go deeper.
-		const float val		  = 0.5f * (1.0f - depth) + 0.25f;
-		const glm::vec3 color = glm::rgbColor(glm::vec3(300.0f * depth, 1.0f, val));
-		Mesh & mesh			  = meshes[did];
-		const size_t vCount   = mesh.positions.size();
-		mesh.colors			  = std::vector<glm::vec3>(vCount, color);
-	}
-}
+#include "raycaster/RaycasterVisualisation.hpp"
+#include <queue>
+#include <stack>
+
+RaycasterVisualisation::RaycasterVisualisation(const Raycaster & raycaster) :
+	_raycaster(raycaster) {
+}
+
+void RaycasterVisualisation::getAllLevels(std::vector<Mesh> & meshes) const {
+	std::vector<DisplayNode> selectedNodes;
+	if(_raycaster._topLevel.empty()) {
+		createBVHMeshes(selectedNodes, meshes);
+		return;
+	}
+
+	// Breadth-first tree exploration.
+	std::queue<std::pair<size_t, size_t>> nodesToVisit;
+	// Start by visiting the top-level hierarchy root.
+	nodesToVisit.push({0, 0});
+
+	while(!nodesToVisit.empty()) {
+		const size_t nodeId = nodesToVisit.front().first;
+		const size_t depth	= nodesToVisit.front().second;
+		// Remove the current node from the visit queue.
+		nodesToVisit.pop();
+		const Raycaster::Node & node = _raycaster._topLevel[nodeId];
+		selectedNodes.push_back({&node, nullptr, depth});
+		// If this is not a leaf, enqueue the two children nodes.
+		if(!node.leaf) {
+			nodesToVisit.push({node.left, depth + 1});
+			nodesToVisit.push({node.right, depth + 1});
+			continue;
+		}
+		// Else, add the hierarchies of all instances in the leaf.
+		for(size_t iid = 0; iid < node.right; ++iid) {
+			addInstanceNodes(_raycaster._instanceIds[node.left + iid], depth + 1, selectedNodes);
+		}
+	}
+
+	createBVHMeshes(selectedNodes, meshes);
+}
+
+void RaycasterVisualisation::addInstanceNodes(size_t instanceId, size_t depth, std::vector<DisplayNode> & nodes) const {
+	const Raycaster::Instance & instance = _raycaster._instances[instanceId];
+	const std::vector<Raycaster::Node> & hierarchy = _raycaster._geometries[instance.geometry].hierarchy;
+
+	std::queue<std::pair<size_t, size_t>> nodesToVisit;
+	nodesToVisit.push({0, depth});
+	while(!nodesToVisit.empty()) {
+		const size_t nodeId	   = nodesToVisit.front().first;
+		const size_t nodeDepth = nodesToVisit.front().second;
+		nodesToVisit.pop();
+		const Raycaster::Node & node = hierarchy[nodeId];
+		nodes.push_back({&node, &instance.model, nodeDepth});
+		if(!node.leaf) {
+			nodesToVisit.push({node.left, nodeDepth + 1});
+			nodesToVisit.push({node.right, nodeDepth + 1});
+		}
+	}
+}
+
+Raycaster::Hit RaycasterVisualisation::getRayLevels(const glm::vec3 & origin, const glm::vec3 & direction, std::vector<Mesh> & meshes, float mini, float maxi) const {
+
+	const Ray ray(origin, direction);
+	std::vector<DisplayNode> selectedNodes;
+	Raycaster::Hit bestHit;
+	const std::vector<Raycaster::Node> & topLevel = _raycaster._topLevel;
+	if(topLevel.empty() || !Intersection::box(ray, topLevel[0].box, mini, maxi)) {
+		createBVHMeshes(selectedNodes, meshes);
+		return bestHit;
+	}
+
+	std::stack<std::pair<size_t, size_t>> nodesToTest;
+	nodesToTest.push({0, 0});
+	while(!nodesToTest.empty()) {
+		const Raycaster::Node & node = topLevel[nodesToTest.top().first];
+		const size_t depth			 = nodesToTest.top().second;
+		selectedNodes.push_back({&node, nullptr, depth});
+		nodesToTest.pop();
+
+		// If the node is a leaf, visit all included instances.
+		if(node.leaf) {
+			for(size_t iid = 0; iid < node.right; ++iid) {
+				const size_t instanceId				 = _raycaster._instanceIds[node.left + iid];
+				const Raycaster::Instance & instance = _raycaster._instances[instanceId];
+				if(!Intersection::box(ray, instance.box, mini, maxi)) {
+					continue;
+				}
+				const Raycaster::Geometry & geometry = _raycaster._geometries[instance.geometry];
+				// Move to mesh space.
+				float scale		= 1.0f;
+				const Ray local = instance.identity ? ray : Raycaster::localRay(ray, instance, scale);
+				float localMaxi = maxi * scale;
+				const float localMini = mini * scale;
+
+				std::stack<std::pair<size_t, size_t>> localNodesToTest;
+				localNodesToTest.push({0, depth + 1});
+				while(!localNodesToTest.empty()) {
+					const Raycaster::Node & localNode = geometry.hierarchy[localNodesToTest.top().first];
+					const size_t localDepth			  = localNodesToTest.top().second;
+					localNodesToTest.pop();
+					// Skip nodes that are now further than the closest hit.
+					if(!Intersection::box(local, localNode.box, localMini, localMaxi)) {
+						continue;
+					}
+					selectedNodes.push_back({&localNode, &instance.model, localDepth});
+
+					// If the node is a leaf, test all included triangles.
+					if(localNode.leaf) {
+						Raycaster::Hit hit;
+						// We found a valid hit.
+						if(Raycaster::intersects(local, geometry, localNode.left, localNode.right, localMini, localMaxi, nullptr, scale, hit)) {
+							bestHit		   = hit;
+							bestHit.dist   = hit.dist / scale;
+							bestHit.meshId = ulong(instanceId);
+							localMaxi	   = hit.dist;
+							maxi		   = bestHit.dist;
+						}
+						continue;
+					}
+					localNodesToTest.push({localNode.left, localDepth + 1});
+					localNodesToTest.push({localNode.right, localDepth + 1});
+				}
+			}
+			// Move to the next node.
+			continue;
+		}
+		// Else, intersect both child nodes.
+		if(Intersection::box(ray, topLevel[node.left].box, mini, maxi)) {
+			nodesToTest.push({node.left, depth + 1});
+		}
+		if(Intersection::box(ray, topLevel[node.right].box, mini, maxi)) {
+			nodesToTest.push({node.right, depth + 1});
+		}
+	}
+	createBVHMeshes(selectedNodes, meshes);
+	return bestHit;
+}
+
+void RaycasterVisualisation::getRayMesh(const glm::vec3 & rayPos, const glm::vec3 & rayDir, const Raycaster::Hit & hit, Mesh & mesh, float defaultLength) const {
+	const float length	 = hit.hit ? hit.dist : defaultLength;
+	const glm::vec3 hitPos = rayPos + length * glm::normalize(rayDir);
+	// Ray color: green if hit, red otherwise.
+	const glm::vec3 rayColor(hit.hit ? 0.0f : 1.0f, hit.hit ? 1.0f : 0.0f, 0.0f);
+	// Create the geometry.
+	mesh.clean();
+	mesh.positions = {rayPos, hitPos};
+	mesh.colors	= {rayColor, rayColor};
+	mesh.indices   = {0, 1, 0};
+	if(!hit.hit) {
+		return;
+	}
+	const Raycaster::Instance & instance = _raycaster._instances[hit.meshId];
+	const Raycaster::Geometry & geometry = _raycaster._geometries[instance.geometry];
+	// Analytic shapes have no triangle, show the normal at the hit instead.
+	if(geometry.shape != Raycaster::Shape::Mesh) {
+		mesh.positions.push_back(hitPos + 0.1f * length * hit.normal);
+		mesh.colors.push_back(rayColor);
+		mesh.indices.push_back(1);
+		mesh.indices.push_back(2);
+		mesh.indices.push_back(1);
+		return;
+	}
+	// Add the intersected triangle to the visualisation.
+	glm::vec3 v0, v1, v2;
+	Raycaster::getTriangle(geometry, hit.internalId, v0, v1, v2);
+	mesh.positions.push_back(glm::vec3(instance.model * glm::vec4(v0, 1.0f)));
+	mesh.positions.push_back(glm::vec3(instance.model * glm::vec4(v1, 1.0f)));
+	mesh.positions.push_back(glm::vec3(instance.model * glm::vec4(v2, 1.0f)));
+	mesh.colors.push_back(rayColor);
+	mesh.colors.push_back(rayColor);
+	mesh.colors.push_back(rayColor);
+	mesh.indices.push_back(2);
+	mesh.indices.push_back(3);
+	mesh.indices.push_back(4);
+}
+
+void RaycasterVisualisation::createBVHMeshes(const std::vector<DisplayNode> & nodes, std::vector<Mesh> & meshes) const {
+	// Compute the max depth.
+	size_t maxDepth = 0;
+	for(const auto & displayNode : nodes) {
+		maxDepth = std::max(maxDepth, displayNode.depth);
+	}
+	meshes.clear();
+	for(size_t did = 0; did < maxDepth + 1; ++did) {
+		meshes.emplace_back("Level " + std::to_string(did));
+	}
+	// Setup degenerate triangles for each line of a cube.
+	const std::vector<unsigned int> indices = {
+		0, 1, 0, 0, 2, 0, 1, 3, 1, 2, 3, 2, 4, 5, 4, 4, 6, 4, 5, 7, 5, 6, 7, 6, 1, 5, 1, 0, 4, 0, 2, 6, 2, 3, 7, 3};
+
+	// Generate the geometry for all nodes.
+	for(const auto & displayNode : nodes) {
+		// Setup vertices.
+		Mesh & mesh					  = meshes[displayNode.depth];
+		const unsigned int firstIndex = uint(mesh.positions.size());
+		const auto corners			  = displayNode.node->box.getCorners();
+		for(const auto & corner : corners) {
+			// Mesh space boxes are displayed as transformed by their instance.
+			mesh.positions.push_back(displayNode.model ? glm::vec3((*displayNode.model) * glm::vec4(corner, 1.0f)) : corner);
+		}
+		for(const unsigned int iid : indices) {
+			mesh.indices.push_back(firstIndex + iid);
+		}
+	}
+
+	// Associate a color to all the nodes at a given depth.
+	for(size_t did = 0; did < maxDepth + 1; ++did) {
+		// Compute relative depth for colorisation.
+		float depth = float(did) / float(maxDepth);
+		// We have fewer boxes at low depth, skew the hue scale.
+		depth *= depth;
+		// Decrease value as we go deeper.
+		const float val		  = 0.5f * (1.0f - depth) + 0.25f;
+		const glm::vec3 color = glm::rgbColor(glm::vec3(300.0f * depth, 1.0f, val));
+		Mesh & mesh			  = meshes[did];
+		const size_t vCount   = mesh.positions.size();
+		mesh.colors			  = std::vector<glm::vec3>(vCount, color);
+	}
+}
@@ -15,6 +15,7 @@ public:
 	explicit RaycasterVisualisation(const Raycaster & raycaster);
 
 	/** Generate geometry to visualize each level of the bounding volume hierarchy as a series of bounding boxes.
+	 The top-level hierarchy over instances comes first, each instance geometry hierarchy then starts one level below the leaf containing the instance.
 	 \param meshes will be filled with the geometry of each depth level
 	 */
 	void getAllLevels(std::vector<Mesh> & meshes) const;
@@ -41,10 +42,18 @@ public:
 private:
 	/** Infos for displaying a given node. */
 	struct DisplayNode {
-		size_t node;  ///< The index of the node.
-		size_t depth; ///< Its depth.
+		const Raycaster::Node * node; ///< The node.
+		const glm::mat4 * model;	  ///< The node to world transformation.
+		size_t depth;				  ///< Its depth.
 	};
 
+	/** Add the nodes of a geometry hierarchy, as seen through an instance.
+	 \param instanceId the index of the instance
+	 \param depth the depth of the instance in the top-level hierarchy
+	 \param nodes will receive the geometry nodes
+	 */
+	void addInstanceNodes(size_t instanceId, size_t depth, std::vector<DisplayNode> & nodes) const;
+
 	/** Generate geometry for a subset of the bounding volume hierarchy as a series of bounding boxes.
 	 \param nodes the nodes to generate geometry for
 	 \param meshes will be filled with the geometry of each depth level
@@ -34,6 +34,14 @@ glm::vec3 BoundingBox::getSize() const {
 	return maxis - minis;
 }
 
+float BoundingBox::getSurfaceArea() const {
+	if(empty()) {
+		return 0.0f;
+	}
+	const glm::vec3 size = glm::max(getSize(), glm::vec3(0.0f));
+	return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
 std::vector<glm::vec3> BoundingBox::getCorners() const {
 	return {
 		glm::vec3(minis[0], minis[1], minis[2]),
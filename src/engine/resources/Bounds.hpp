@@ -63,6 +63,11 @@ public:
 	 */
 	glm::vec3 getSize() const;
 
+	/** Query the surface area of this box.
+	 \return the area of the six faces, or 0 if the box is empty
+	 */
+	float getSurfaceArea() const;
+
 	/** Query the positions of the eight corners of the box, in the following order (with \p m=mini, \p M=maxi):
 	 \p (m,m,m), \p (m,m,M), \p (m,M,m), \p (m,M,M), \p (M,m,m), \p (M,m,M), \p (M,M,m), \p (M,M,M)
 	 \return a vector containing the box corners
@@ -17,6 +17,8 @@
 #define TINYEXR_IMPLEMENTATION
 #include <tinyexr/tinyexr.h>
 
+#include <array>
+
 void write_stbi_to_disk(void * context, void * data, int size) {
 	const std::string * path = static_cast<std::string *>(context);
 	Resources::saveRawDataToExternalFile(*path, static_cast<char *>(data), size);
@@ -119,6 +121,21 @@ int Image::save(const std::string & path, bool flip, bool ignoreAlpha){
 	return saveAsLDR(path, flip, ignoreAlpha);
 }
 
+int Image::loadWithAttributes(const std::string & path, unsigned int channels, bool flip, bool externalFile, Attributes & attributes) {
+	attributes.clear();
+	if(!isFloat(path)) {
+		return 1;
+	}
+	return loadHDR(path, channels, flip, externalFile, &attributes);
+}
+
+int Image::saveWithAttributes(const std::string & path, bool flip, const Attributes & attributes) {
+	if(!isFloat(path)) {
+		return 1;
+	}
+	return saveAsHDR(path, flip, false, true, &attributes);
+}
+
 bool Image::isFloat(const std::string & path) {
 	return path.substr(path.size() - 4, 4) == ".exr";
 }
@@ -149,7 +166,7 @@ int Image::saveAsLDR(const std::string & path, bool flip, bool ignoreAlpha) {
 	return ret == 0;
 }
 
-int Image::saveAsHDR(const std::string & path, bool flip, bool ignoreAlpha) {
+int Image::saveAsHDR(const std::string & path, bool flip, bool ignoreAlpha, bool fullPrecision, const Attributes * attributes) {
 	
 	
 	// Assume at least 16x16 pixels.
@@ -254,7 +271,26 @@ int Image::saveAsHDR(const std::string & path, bool flip, bool ignoreAlpha) {
 	int ret = 0;
 	for(int i = 0; i < header.num_channels; i++) {
 		header.pixel_types[i]			= TINYEXR_PIXELTYPE_FLOAT; // pixel type of input image
-		header.requested_pixel_types[i] = TINYEXR_PIXELTYPE_HALF;  // pixel type of output image to be stored in .EXR
+		header.requested_pixel_types[i] = fullPrecision ? TINYEXR_PIXELTYPE_FLOAT : TINYEXR_PIXELTYPE_HALF;  // pixel type of output image to be stored in .EXR
+	}
+	// Custom attributes, stored as little-endian 32-bits integers whatever the host order.
+	std::vector<EXRAttribute> customAttributes;
+	std::vector<std::array<unsigned char, 4>> customValues;
+	if(attributes) {
+		customValues.reserve(attributes->size());
+		for(const auto & attribute : *attributes) {
+			const uint32_t value = uint32_t(attribute.second);
+			customValues.push_back({{(unsigned char)(value & 0xffu), (unsigned char)((value >> 8) & 0xffu), (unsigned char)((value >> 16) & 0xffu), (unsigned char)(value >> 24)}});
+			EXRAttribute exrAttribute;
+			std::memset(&exrAttribute, 0, sizeof(EXRAttribute));
+			attribute.first.copy(exrAttribute.name, sizeof(exrAttribute.name) - 1);
+			std::strcpy(exrAttribute.type, "int");
+			exrAttribute.value = customValues.back().data();
+			exrAttribute.size  = 4;
+			customAttributes.push_back(exrAttribute);
+		}
+		header.num_custom_attributes = int(customAttributes.size());
+		header.custom_attributes	 = customAttributes.empty() ? nullptr : &customAttributes[0];
 	}
 	// Here
 	if(header.compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
@@ -321,7 +357,7 @@ int Image::loadLDR(const std::string & path, unsigned int channels, bool flip, b
 	return 0;
 }
 
-int Image::loadHDR(const std::string & path, unsigned int channels, bool flip, bool externalFile) {
+int Image::loadHDR(const std::string & path, unsigned int channels, bool flip, bool externalFile, Attributes * attributes) {
 	const unsigned int finalChannels = channels > 0 ? channels : 3;
 	pixels.clear();
 	width = height = 0;
@@ -406,6 +442,18 @@ int Image::loadHDR(const std::string & path, unsigned int channels, bool flip, b
 		}
 	}
 
+	// Retrieve integer custom attributes.
+	if(attributes) {
+		for(int aid = 0; aid < exr_header.num_custom_attributes; ++aid) {
+			const EXRAttribute & attribute = exr_header.custom_attributes[aid];
+			if(strcmp(attribute.type, "int") == 0 && attribute.size == 4) {
+				// Little-endian in the file.
+				const uint32_t value = uint32_t(attribute.value[0]) | (uint32_t(attribute.value[1]) << 8) | (uint32_t(attribute.value[2]) << 16) | (uint32_t(attribute.value[3]) << 24);
+				(*attributes)[std::string(attribute.name)] = int(value);
+			}
+		}
+	}
+
 	FreeEXRHeader(&exr_header);
 	FreeEXRImage(&exr_image);
 	return 0;
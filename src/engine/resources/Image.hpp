@@ -1,6 +1,8 @@
 #pragma once
 #include "Common.hpp"
 
+#include <map>
+
 /**
  \brief Represents an image composed of pixels with values in [0,1]. Provide image loading/saving utilities, for both LDR and HDR images.
  \ingroup Resources
@@ -8,6 +10,9 @@
 class Image {
 
 public:
+
+	/** Named integer attributes stored in the header of HDR images. */
+	using Attributes = std::map<std::string, int>;
 	
 	/** Default constructor. */
 	Image() = default;
@@ -109,6 +114,25 @@ public:
 	 \return a success/error flag
 	 */
 	int save(const std::string & path, bool flip, bool ignoreAlpha = false);
+
+	/** Load a HDR image from disk, along with the integer attributes stored in its header.
+	 \param path the path to the image
+	 \param channels the number of channels to load from the image
+	 \param flip should the image be vertically flipped
+	 \param externalFile if true, skip the resources manager and load directly from disk
+	 \param attributes will be filled with the integer attributes found in the header
+	 \return a success/error flag
+	 */
+	int loadWithAttributes(const std::string & path, unsigned int channels, bool flip, bool externalFile, Attributes & attributes);
+
+	/** Save a HDR image to disk in full float precision, with integer attributes stored in its header.
+	 \param path the path to the image, should have the "exr" extension
+	 \param flip should the image be vertically flipped
+	 \param attributes the integer attributes to store
+	 \return a success/error flag
+	 \note Contrary to save, values are not converted to half floats, so that the image can be reloaded exactly.
+	 */
+	int saveWithAttributes(const std::string & path, bool flip, const Attributes & attributes);
 	
 	/** Query if a path points to an image loaded in floating point, based on the extension.
 	 \param path the path to the image
@@ -152,9 +176,11 @@ private:
 	 \param path the path to the image
 	 \param flip should the image be vertically flipped
 	 \param ignoreAlpha if true, the alpha channel will be ignored
+	 \param fullPrecision store values as floats instead of half floats
+	 \param attributes optional integer attributes to store in the header
 	 \return a success/error flag
 	 */
-	int saveAsHDR(const std::string & path,  bool flip, bool ignoreAlpha);
+	int saveAsHDR(const std::string & path,  bool flip, bool ignoreAlpha, bool fullPrecision = false, const Attributes * attributes = nullptr);
 	
 	/** Load a LDR image from disk using stb_image.
 	 \param path the path to the image
@@ -170,9 +196,10 @@ private:
 	 \param channels will contain the number of channels of the loaded image
 	 \param flip should the image be vertically flipped
 	 \param externalFile if true, skip the resources manager and load directly from disk
+	 \param attributes optional, will be filled with the integer attributes found in the header
 	 \return a success/error flag
 	 */
-	int loadHDR(const std::string & path, unsigned int channels, bool flip, bool externalFile);
+	int loadHDR(const std::string & path, unsigned int channels, bool flip, bool externalFile, Attributes * attributes = nullptr);
 	
 };
 
@@ -23,6 +23,20 @@ static const std::map<std::string, Object::Type> strToTypes = {
 	REGISTER_STRTYPE(Transparent),
 };
 
+static const std::map<Object::Shape, std::string> shapesToStr = {
+	{Object::Shape::Mesh, "Mesh"},
+	{Object::Shape::Sphere, "Sphere"},
+	{Object::Shape::Quad, "Quad"},
+	{Object::Shape::Disk, "Disk"},
+};
+
+static const std::map<std::string, Object::Shape> strToShapes = {
+	{"Mesh", Object::Shape::Mesh},
+	{"Sphere", Object::Shape::Sphere},
+	{"Quad", Object::Shape::Quad},
+	{"Disk", Object::Shape::Disk},
+};
+
 Object::Object(const Type type, const Mesh * mesh, bool castShadows) :
 	_mesh(mesh), _material(type), _castShadow(castShadows) {
 	// Skip UVs if not available.
@@ -45,6 +59,12 @@ void Object::decode(const KeyValues & params, Storage options) {
 			const std::string meshString = param.values[0];
 			_mesh						 = Resources::manager().getMesh(meshString, options);
 
+		} else if(param.key == "shape" && !param.values.empty()) {
+			const std::string shapeString = param.values[0];
+			if(strToShapes.count(shapeString) > 0) {
+				_shape = strToShapes.at(shapeString);
+			}
+
 		} else if(param.key == "shadows") {
 			_castShadow = Codable::decodeBool(param);
 
@@ -89,6 +109,10 @@ KeyValues Object::encode() const {
 		obj.elements.emplace_back("mesh");
 		obj.elements.back().values = {_mesh->name()};
 	}
+	if(_shape != Shape::Mesh){
+		obj.elements.emplace_back("shape");
+		obj.elements.back().values = {shapesToStr.at(_shape)};
+	}
 	
 	if(!_animations.empty()){
 		obj.elements.emplace_back("animations");
@@ -22,6 +22,14 @@ public:
 		Transparent, ///< Transparent object
 	};
 
+	/// \brief Analytic shape represented by the mesh, for renderers that can intersect it directly.
+	enum class Shape : int {
+		Mesh = 0, ///< Only the mesh triangles.
+		Sphere,	  ///< Unit sphere centered on the origin.
+		Quad,	  ///< Square from -1 to 1 along the X and Y axes, facing +Z.
+		Disk	  ///< Unit disk in the XY plane, facing +Z.
+	};
+
 	/** Constructor */
 	Object() = default;
 
@@ -80,6 +88,11 @@ public:
 	 */
 	const Type & type() const { return _material; }
 
+	/** Shape getter.
+	 \return the analytic shape represented by the object mesh, if any
+	 */
+	Shape shape() const { return _shape; }
+
 	/** Is the object casting a shadow.
 	 \return a boolean denoting if the object is a caster
 	 */
@@ -109,6 +122,7 @@ public:
 	 \verbatim
 	 type: objecttype
 	 mesh: meshname
+	 shape: Sphere|Quad|Disk
 	 translation: X,Y,Z
 	 scaling: scale
 	 orientation: axisX,axisY,axisZ angle
@@ -159,6 +173,7 @@ protected:
 	Animated<glm::mat4> _model { glm::mat4(1.0f) };		///< The transformation matrix of the 3D model, updated by the animations.
 	mutable BoundingBox _bbox;							///< The world space object bounding box.
 	Type _material   = Type::None;		 ///< The material type.
+	Shape _shape	 = Shape::Mesh;		 ///< The analytic shape approximated by the mesh.
 	bool _castShadow = true;			 ///< Can the object casts shadows.
 	bool _twoSided   = false;			 ///< Should faces of the object be visible from the two sides.
 	bool _masked	 = false;			 ///< The object RGB texture has a non-empty alpha channel.
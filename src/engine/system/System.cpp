@@ -6,6 +6,9 @@
 
 #ifndef _WIN32
 #	include <sys/stat.h>
+#	include <sys/mman.h>
+#	include <fcntl.h>
+#	include <unistd.h>
 #endif
 
 // On Windows, we can notify both AMD and Nvidia drivers that we prefer discrete GPUs.
@@ -58,12 +61,72 @@ bool System::createDirectory(const std::string & directory) {
 	return CreateDirectoryW(widen(directory), nullptr) != 0;
 }
 
+const char * System::mapFile(const std::string & path, size_t & size) {
+	size = 0;
+	HANDLE file = CreateFileW(widen(path), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(file == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+	LARGE_INTEGER fileSize;
+	// Empty files can't be mapped.
+	if(!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		CloseHandle(file);
+		return nullptr;
+	}
+	HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if(mapping == nullptr) {
+		return nullptr;
+	}
+	// The view keeps the mapping alive.
+	const char * data = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	CloseHandle(mapping);
+	if(data != nullptr) {
+		size = size_t(fileSize.QuadPart);
+	}
+	return data;
+}
+
+void System::unmapFile(const char * data, size_t) {
+	if(data != nullptr) {
+		UnmapViewOfFile(data);
+	}
+}
+
 #else
 
 bool System::createDirectory(const std::string & directory) {
 	return mkdir(directory.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) == 0;
 }
 
+const char * System::mapFile(const std::string & path, size_t & size) {
+	size = 0;
+	const int file = open(path.c_str(), O_RDONLY);
+	if(file < 0) {
+		return nullptr;
+	}
+	struct stat infos;
+	// Empty files can't be mapped.
+	if(fstat(file, &infos) != 0 || infos.st_size == 0) {
+		close(file);
+		return nullptr;
+	}
+	void * data = mmap(nullptr, size_t(infos.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+	// The mapping stays valid once the file is closed.
+	close(file);
+	if(data == MAP_FAILED) {
+		return nullptr;
+	}
+	size = size_t(infos.st_size);
+	return static_cast<const char *>(data);
+}
+
+void System::unmapFile(const char * data, size_t size) {
+	if(data != nullptr) {
+		munmap(const_cast<char *>(data), size);
+	}
+}
+
 #endif
 
 void System::ping() {
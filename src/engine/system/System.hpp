@@ -3,6 +3,7 @@
 #include "system/Config.hpp"
 #include "Common.hpp"
 
+#include <atomic>
 #include <thread>
 
 /**
@@ -35,6 +36,20 @@ public:
 		 */
 	static bool createDirectory(const std::string & directory);
 
+	/** Map the content of a file in memory, for reading only.
+	 \param path the path to the file
+	 \param size will contain the size of the file in bytes
+	 \return a pointer to the file content, or null if the file could not be mapped
+	 \note The mapping should be released with unmapFile.
+	 */
+	static const char * mapFile(const std::string & path, size_t & size);
+
+	/** Release a file content mapped in memory.
+	 \param data the pointer to the file content
+	 \param size the size of the file in bytes
+	 */
+	static void unmapFile(const char * data, size_t size);
+
 	/** Notify the user by sending a 'Bell' signal. */
 	static void ping();
 	
@@ -64,8 +79,7 @@ public:
 			high			  = temp;
 		}
 		// Prepare the threads pool.
-		// Always leave one thread free.
-		const size_t count = size_t(std::max(int(std::thread::hardware_concurrency())-1, 1));
+		const size_t count = threadCount();
 		std::vector<std::thread> threads;
 		threads.reserve(count);
 
@@ -80,14 +94,52 @@ public:
 
 		for(size_t tid = 0; tid < count; ++tid) {
 			// For each thread, call the same lambda with different bounds as arguments.
-			const size_t threadLow  = tid * span;
-			const size_t threadHigh = tid == (count-1) ? high : ((tid + 1) * span);
+			// Clamp to the interval, in case there are fewer iterations than threads.
+			const size_t threadLow  = std::min(low + tid * span, high);
+			const size_t threadHigh = tid == (count-1) ? high : std::min(low + (tid + 1) * span, high);
 			threads.emplace_back(launchThread, threadLow, threadHigh);
 		}
 		// Wait for all threads to finish.
 		std::for_each(threads.begin(), threads.end(), [](std::thread & x) { x.join(); });
 	}
 
+	/** Multi-threaded for-loop with dynamic scheduling: each thread claims the next iteration from a shared counter once done with the previous one. This balances the work when iterations have uneven costs.
+		 \param low lower (included) bound
+		 \param high higher (excluded) bound
+		 \param func the function to execute at each iteration, will receive the index of the
+		 element and the index of the thread executing it, in [0, threadCount()). Signature: void func(size_t i, size_t tid)
+		 \note Iterations are claimed in increasing order.
+		 */
+	template<typename ThreadFunc>
+	static void forParallelDynamic(size_t low, size_t high, ThreadFunc func) {
+		if(high < low) {
+			const size_t temp = low;
+			low				  = high;
+			high			  = temp;
+		}
+		const size_t count = std::min(threadCount(), std::max(high - low, size_t(1)));
+		std::vector<std::thread> threads;
+		threads.reserve(count);
+
+		std::atomic<size_t> next(low);
+		auto launchThread = [&func, &next, high](size_t tid) {
+			for(size_t i = next++; i < high; i = next++) {
+				func(i, tid);
+			}
+		};
+		for(size_t tid = 0; tid < count; ++tid) {
+			threads.emplace_back(launchThread, tid);
+		}
+		std::for_each(threads.begin(), threads.end(), [](std::thread & x) { x.join(); });
+	}
+
+	/** Number of threads used by parallel loops.
+		 \return the thread count, always leaving one hardware thread free
+		 */
+	static size_t threadCount() {
+		return size_t(std::max(int(std::thread::hardware_concurrency()) - 1, 1));
+	}
+
 	#ifdef _WIN32
 
 	/** Convert a string to the system representation.